@@ -628,6 +628,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_HID_DEMOD_FSK:
 			CmdHIDdemodFSK(0, 0, 0, 1);					// Demodulate HID tag
 			break;
+		case CMD_EM410X_DEMOD:
+			CmdEM410xdemod(c->arg[0], 1);				// Demodulate EM410x tag
+			break;
 		case CMD_HID_SIM_TAG:
 			CmdHIDsimTAG(c->arg[0], c->arg[1], 1);					// Simulate HID tag by ID
 			break;
@@ -738,6 +741,12 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_READER_ISO_14443a:
 			ReaderIso14443a(c, &ack);
 			break;
+		case CMD_READER_ISO_14443a_APDUS:
+			ReaderIso14443aApdus(c, &ack);
+			break;
+		case CMD_READER_ISO_14443a_INVENTORY:
+			ReaderIso14443aInventory(c, &ack);
+			break;
 		case CMD_SIMULATE_TAG_ISO_14443a:
 			SimulateIso14443aTag(c->arg[0], c->arg[1], c->arg[2]);  // ## Simulate iso14443a tag - pass tag type & UID
 			break;
@@ -747,6 +756,15 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_MIFARE_DES_READER:
 			ReaderMifareDES(c->arg[0], c->arg[1], c->d.asBytes, &ack);
 			break;
+		case CMD_MIFARE_DES_CHKKEYS:
+			MifareDESChkKeys(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
+		case CMD_MIFARE_DES_SIM_LOAD:
+			MifareDESSimLoad(c->arg[0], c->arg[1], c->d.asBytes);
+			break;
+		case CMD_SIMULATE_MIFARE_DES:
+			MifareDESSim(c->arg[0]);
+			break;
         case CMD_READER_MIFARE:
             ReaderMifare(c->arg[0]);
             break;
@@ -765,6 +783,12 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_MIFARE_CHKKEYS:
 			MifareChkKeys(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
+		case CMD_MIFARE_CHKKEYS_FAST:
+			MifareChkKeysFast(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
+		case CMD_MIFARE_DUMP:
+			MifareDump(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
 		case CMD_SIMULATE_MIFARE_CARD:
 			Mifare1ksim(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
@@ -782,6 +806,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_MIFARE_EML_MEMGET:
 			MifareEMemGet(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
+		case CMD_MIFARE_EML_MEMSET_BULK:
+			MifareEMemSetBulk(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
 		case CMD_MIFARE_EML_CARDLOAD:
 			MifareECardLoad(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
@@ -793,6 +820,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_MIFARE_EML_CGETBLOCK:
 			MifareCGetBlock(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
+		case CMD_MIFARE_CLONE_MAGIC:
+			MifareCClone(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
 			
 		// mifare sniffer
 		case CMD_MIFARE_SNIFFER:
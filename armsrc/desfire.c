@@ -8,8 +8,6 @@
 // Routines to support Mifare DESFire Cards
 //-----------------------------------------------------------------------------
 */
-#include <stdarg.h>
-
 #include "proxmark3.h"
 #include "apps.h"
 #include "util.h"
@@ -21,10 +19,20 @@
 #include "iso14443crc.h"
 
 #include "desfire.h"
+#include "desfiresim.h"
 
+struct desfire_data {
+   uint8_t iso_resp_buf[256];
+   uint8_t resp_buf[256];
+   uint8_t chain_buf[DESFIRE_CHAIN_LIMIT]; // responses for the host
+   des_ctx_t session_key;
+   uint8_t authenticated_key;
+};
 
+// the session outlives a command, nothing else may share its bytes
+typedef char desfire_data_fits[sizeof(struct desfire_data) <= sizeof(BigBuf) - DESFIRE_READER_DATA ? 1 : -1];
 
-struct desfire_data * desfire = (void *) (BigBuf + 1024); // BigBuf+4096 Bytes
+struct desfire_data * desfire = (void *) ((uint8_t *)BigBuf + DESFIRE_READER_DATA);
 
 void print_result(char * name, uint8_t * buf, size_t len) {
    uint8_t * p = buf;
@@ -32,125 +40,132 @@ void print_result(char * name, uint8_t * buf, size_t len) {
        Dbprintf("[%s:%02x/%02x] %x %x %x %x %x %x %x %x", name, p-buf, len, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
 }
 
-/* execute a desfire command
+/* execute a desfire command and follow its ADDITIONAL_FRAMEs
  * by sending it in an APDU on the established iso14443a channel
- * put return result into *data
- * return number of bytes received */
-int _desfire_command(uint8_t * cmd, size_t cmd_len, void * data) {
-   uint8_t* resp = desfire->iso_resp_buf;  // was 3560 - tied to other size changes
-   int len;
+ * the payload of all frames goes to buf, at most limit bytes, the status
+ * of the last frame to *status
+ * return payload length, DESFIRE_LINK_ERROR or DESFIRE_BUFFER_ERROR */
+int desfire_chain(uint8_t * cmd, size_t cmd_len, uint8_t * buf, size_t limit, uint8_t * status) {
+   static uint8_t cmd_more_data[] = {ADDITIONAL_FRAME};
+   uint8_t * bounce = desfire->iso_resp_buf;
+   size_t total = 0;
+   uint8_t saved[3];
+
+   for(;;) {
+       /* with room for a whole frame left it is received in place, its
+        * PCB, CID and status land on the tail of the previous payload */
+       int in_place = total >= 3 && limit - total >= sizeof(desfire->iso_resp_buf);
+       uint8_t * frame = in_place ? buf + total - 3 : bounce;
+       int len;
+
+       if(in_place) memcpy(saved, frame, 3);
+       len = iso14_apdu(cmd, cmd_len, frame);
+       if(len < 5) return DESFIRE_LINK_ERROR;
+       len -= 5; //2 bytes iso, 1 byte status, in the end: 2 bytes crc
+       *status = frame[2];
+
+       if(in_place) {
+           memcpy(frame, saved, 3);
+       } else {
+           if(total + len > limit) return DESFIRE_BUFFER_ERROR;
+           memcpy(buf + total, frame + 3, len);
+       }
+       total += len;
 
-   /* construct APDU and append CRC */
-   uint8_t real_cmd[cmd_len+4];
-   real_cmd[0] = 0x0a;
-   real_cmd[1] = 0x00;
-   memcpy(real_cmd+2, cmd, cmd_len);
-   AppendCrc14443a(real_cmd,cmd_len+2);
+       /* during authentication the next frame is ours to send */
+       if(*status != ADDITIONAL_FRAME || cmd[0] == AUTHENTICATE_A
+          || cmd[0] == AUTHENTICATE_ISO || cmd[0] == AUTHENTICATE_AES)
+           return total;
 
-   ReaderTransmit(real_cmd, cmd_len+4);
+       cmd = cmd_more_data;
+       cmd_len = sizeof(cmd_more_data);
+   }
+}
 
-   len = ReaderReceive(resp);
-   if(!len)
-       return -1; //DATA LINK ERROR
+/* execute a desfire command
+ * put return result into *data, at most a resp_buf full
+ * return number of bytes received */
+int _desfire_command(uint8_t * cmd, size_t cmd_len, void * data) {
+   uint8_t status;
+   int len = desfire_chain(cmd, cmd_len, data, sizeof(desfire->resp_buf), &status);
 
-   char name[6];
-   sprintf(name, "rx:%02x", cmd[0]);
-   print_result(name, resp, len);
-   
-   // cid = resp[1];
-   enum DESFIRE_STATUS status = resp[2];
-   resp += 3; len -= 5; //2 bytes iso, 1 byte status, in the end: 2 bytes crc
+   if(len < 0)
+       return len;
 
    /* HACK: during authentication (0x0a) the status is set to AF instead of SUCCESS */
    if(cmd[0] == AUTHENTICATE_A && status == ADDITIONAL_FRAME) status = OPERATION_OK;
 
-   switch(status) { // status code
-   case OPERATION_OK:
-       memcpy(data, resp, len);
-       return len;
-   case ADDITIONAL_FRAME: // Additional Frame
-       memcpy(data, resp, len);
-       uint8_t cmd_more_data[] = {0xaf};
-       int res = _desfire_command(cmd_more_data, sizeof(cmd_more_data), (uint8_t *) data+len);
-       if(res < 0) return res;
-       return res + len;
-   default:
+   if(status != OPERATION_OK) {
        Dbprintf("unexpected desfire response: %X (to %X)", status, cmd[0]);
        return -status;
    }
+   return len;
 }
 
-int desfire_command(void * resp, enum DESFIRE_CMD cmd, size_t arg_count, ...) {
-   va_list argptr;
-   uint8_t command[arg_count+1];
-   uint8_t *p = command;
-
-   va_start(argptr, arg_count);
-   while(p++ - command < arg_count)
-       *p = va_arg(argptr, int);
-
-   va_end( argptr );
-
-   command[0] = cmd;
-   int res = _desfire_command(command, arg_count+1, resp);
-   if(res >= 0) return res;
-   Dbprintf("desfire command %X failed: %X", cmd, -res);
-   print_result("cmd", command, arg_count+1);
+/* encode a command from the table and execute it, an answer shorter than
+ * the table expects is a link error */
+int desfire_command(void * resp, enum desfire_command_id id, const uint32_t * args) {
+   uint8_t command[DESFIRE_HEADER_MAX];
+   int len = desfire_encode(command, id, args);
+   int res = _desfire_command(command, len, resp);
+
+   if(res >= desfire_commands[id].resp) return res;
+   if(res >= 0) res = DESFIRE_LINK_ERROR;
+   Dbprintf("desfire command %X failed: %X", command[0], -res);
+   print_result("cmd", command, len);
    return res;
 }
 
-void memxor(uint8_t * dst, uint8_t * src, size_t len) {
-   for( ; len > 0; len--,dst++,src++)
-       *dst ^= *src;
-}
+/* DESFIRE_COMMAND(resp, READ_DATA, file_id, offset, length) */
+#define DESFIRE_COMMAND(resp, name, ...) \
+   desfire_command(resp, DESFIRE_ID_##name, (const uint32_t[]){__VA_ARGS__})
 
-void desfire_encrypt_cbc(DES3_KS k, void * data, int len) {
-   uint8_t *d  = data;
+/* DESFire native CBC on whole blocks, starting from a zero IV */
+void desfire_encrypt_cbc(const des_ctx_t * k, void * data, int len) {
    uint8_t iv[8] = {0,0,0,0,0,0,0,0};
-   if(((uint32_t) d & 0x3) != 0) Dbprintf("warn: DES not 32bit aligned");
-
-   for(;len>0;len-=8,d+=8) {
-       memxor(d, iv, 8);
-       des3(k, (void *)d);
-       memcpy(iv, d, 8);
-   }
+   des_cbc_send(k, data, len, iv);
 }
 
-int desfire_encrypt_packet(uint8_t * p, size_t length, DES3_KS session_key) {
+int desfire_encrypt_packet(uint8_t * p, size_t length, des_ctx_t * session_key) {
    int p_len = (length+7+2) & ~7;
    AppendCrc14443a(p, length);
-   memset(p+length+2, 0, p_len - length);
+   memset(p+length+2, 0, p_len - length - 2);
    desfire_encrypt_cbc(session_key, p, p_len);
    return p_len;
 }
 
-void setup_3des_ks(uint32_t *key, DES3_KS knd) {
-   uint32_t des_key[6] = {key[0], key[1], key[2], key[3], key[0], key[1]};
-   des3key(knd,(void *)des_key,1);
+/* a 2-key 3DES schedule, kept if the key did not change */
+void setup_3des_ks(uint32_t *key, des_ctx_t * ks) {
+   des_setkey(ks, (void *)key, 16);
 }
 
 int request_authentication(uint8_t key_slot, uint8_t * resp) {
    iso14a_set_trigger(1);
-   if(desfire_command(resp, AUTHENTICATE_A, 1, key_slot) < 0) return 0;
+   if(DESFIRE_COMMAND(resp, AUTHENTICATE_A, key_slot) < 0) return 0;
    iso14a_set_trigger(0);
    return 1;
 }
 
-/* perform the desfire authentication procedure */
-int desfire_auth(uint8_t key_slot, uint32_t * key, DES3_KS session_key) {
+/* the legacy authentication procedure, without any debug output
+ * return 0, -status of the card or DESFIRE_LINK_ERROR */
+int desfire_authenticate(uint8_t key_slot, uint32_t * key, des_ctx_t * session_key) {
 
-   DES3_KS knd;
-   int res;
+   static des_ctx_t knd;   // kept across calls, rebuilt when the key changes
    uint8_t* resp = desfire->resp_buf;
    uint8_t nonce_command[17];
+   uint8_t status;
+   int len;
 
    uint32_t sess_key[4];
 
-   setup_3des_ks(key, knd);
+   setup_3des_ks(key, &knd);
 
-   if(desfire_command(resp, AUTHENTICATE_A, 1, key_slot) < 0) return 0;
+   len = DESFIRE_ENCODE(nonce_command, AUTHENTICATE_A, key_slot);
+   len = desfire_chain(nonce_command, len, resp, sizeof(desfire->resp_buf), &status);
+   if(len < 0) return len;
+   if(status != ADDITIONAL_FRAME) return -status;
 
-   des3(knd, resp);            //decrypt the nonce
+   des_decrypt_block(&knd, resp); //decrypt the nonce
 
    sess_key[1] = *(uint32_t *)  resp;  //generate the session key
    sess_key[3] = *(uint32_t *) (resp+4);
@@ -159,18 +174,25 @@ int desfire_auth(uint8_t key_slot, uint32_t * key, DES3_KS session_key) {
    if(key[0] == key[2] && key[1] == key[3])
        sess_key[2] = sess_key[0],
        sess_key[3] = sess_key[1];
-   Dbprintf("0x%x,0x%x,0x%x,0x%x", sess_key[0], sess_key[1], sess_key[2], sess_key[3]);
-   setup_3des_ks(sess_key, session_key);
 
    memcpy(nonce_command+9, resp+1, 7); //shift the nonce
    nonce_command[16] = resp[0];
 
-   desfire_encrypt_cbc(knd, nonce_command+1, 16);
+   desfire_encrypt_cbc(&knd, nonce_command+1, 16);
    nonce_command[0] = AUTHENTICATION_FRAME;
-   res = _desfire_command(nonce_command, 17, resp);
-   if(res < 0) { Dbprintf("authentication failed: %X", -res); return 0; }
+   len = desfire_chain(nonce_command, 17, resp, sizeof(desfire->resp_buf), &status);
+   if(len < 0) return len;
+   if(status != OPERATION_OK) return -status;
+
+   setup_3des_ks(sess_key, session_key);
    desfire->authenticated_key = key_slot;
+   return 0;
+}
 
+/* perform the desfire authentication procedure */
+int desfire_auth(uint8_t key_slot, uint32_t * key, des_ctx_t * session_key) {
+   int res = desfire_authenticate(key_slot, key, session_key);
+   if(res < 0) { Dbprintf("authentication failed: %X", -res); return 0; }
    return 1;
 }
 
@@ -192,56 +214,52 @@ int desfire_key_settings(
 
 
 int desfire_create_app(uint32_t aid, uint8_t key_settings, uint8_t num_keys) {
-   return desfire_command(desfire->resp_buf, CREATE_APPLICATION, 5, aid, aid >> 8, aid >> 16, key_settings, num_keys);
+   return DESFIRE_COMMAND(desfire->resp_buf, CREATE_APPLICATION, aid, key_settings, num_keys);
 }
 int desfire_delete_app(uint32_t aid) {
-   return desfire_command(desfire->resp_buf, DELETE_APPLICATION, 3, aid, aid >> 8, aid >> 16);
+   return DESFIRE_COMMAND(desfire->resp_buf, DELETE_APPLICATION, aid);
 }
 int desfire_select_app(uint32_t aid) {
-   return desfire_command(desfire->resp_buf, SELECT_APPLICATION, 3, aid, aid >> 8, aid >> 16);
+   return DESFIRE_COMMAND(desfire->resp_buf, SELECT_APPLICATION, aid);
 }
 
 int desfire_create_file(int file_id, int security_level, int size) {
-   return desfire_command(desfire->resp_buf, CREATE_STD_DATA_FILE, 7, file_id, security_level, 0xee, 0xee, size, size >> 8, size >> 16);
+   return DESFIRE_COMMAND(desfire->resp_buf, CREATE_STD_DATA_FILE, file_id, security_level, 0xeeee, size);
 }
 
 int desfire_change_file_settings(int file_id, int security_level, int read_key, int write_key, int rw_key) {
-   return desfire_command(desfire->resp_buf, CHANGE_FILE_SETTINGS, 4, file_id, security_level, rw_key << 4 | 0xe, read_key << 4 | write_key);
+   return DESFIRE_COMMAND(desfire->resp_buf, CHANGE_FILE_SETTINGS, file_id, security_level, rw_key << 4 | 0xe | (read_key << 4 | write_key) << 8);
 }
 
 int desfire_read_data(int file_id, int offset, int length, void * buf) {
-   return desfire_command(buf, READ_DATA, 7, file_id, offset, offset >> 8, offset >> 16, length, length >> 8, length >> 16);
+   return DESFIRE_COMMAND(buf, READ_DATA, file_id, offset, length);
 }
 
-int desfire_write_data(int file_id, int offset, int length, void * buf, DES3_KS session_key) {
+int desfire_write_data(int file_id, int offset, int length, void * buf, des_ctx_t * session_key) {
    uint8_t cmd[length+8+10];
-   cmd[0] = WRITE_DATA;
-   cmd[1] = file_id;
-   cmd[2] = offset, cmd[3] = offset >> 8, cmd[4] = offset >> 16;
-   cmd[5] = length, cmd[6] = length >> 8, cmd[7] = length >> 16;
+   int header = DESFIRE_ENCODE(cmd, WRITE_DATA, file_id, offset, length);
 
-   memcpy(cmd+8, buf, length);
+   memcpy(cmd+header, buf, length);
    if(session_key)
-       length = desfire_encrypt_packet(cmd+8, length, session_key);
+       length = desfire_encrypt_packet(cmd+header, length, session_key);
 
-   return _desfire_command(cmd, length+8, desfire->resp_buf);
+   return _desfire_command(cmd, header+length, desfire->resp_buf);
 }
 
-int desfire_change_key(uint8_t key_slot, void * old_key, void * new_key, DES3_KS session_key) {
+int desfire_change_key(uint8_t key_slot, void * old_key, void * new_key, des_ctx_t * session_key) {
    uint8_t * cmd = desfire->resp_buf + 2; // +another 2 needs to be on a 32bit boundary
    uint8_t * data = cmd+2;
    uint32_t * old = old_key,
             * new = new_key;
    uint32_t * key = (uint32_t *) data;
 
-   cmd[0] = CHANGE_KEY;
-   cmd[1] = key_slot;
+   DESFIRE_ENCODE(cmd, CHANGE_KEY, key_slot);
 
    int i, res;
    int len = 18;
    uint8_t key_settings[2];
            
-   if((res = desfire_command(key_settings, GET_KEY_SETTINGS, 0)) < 0) return res;
+   if((res = desfire_command(key_settings, DESFIRE_ID_GET_KEY_SETTINGS, NULL)) < 0) return res;
 
    uint8_t change_key = key_settings[0] >> 4;
        
@@ -275,12 +293,16 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
    uint32_t default_key[] = {0,0,0,0};
    int res;
 
-    DbpString("desfire.c called ReaderMifare");
-
    if(param & CONNECT)
    {
        iso14443a_setup();
-       res = iso14443a_select_card(resp,NULL,&param);
+       desfire->session_key.valid = 0; // BigBuf may have been used since
+       // a card select with RATS, the card has to speak ISO14443-4 for us
+       res = iso14443a_select_card(ack->d.asBytes, (iso14a_card_select_t *) (ack->d.asBytes+12), NULL);
+       if(param & NO_DISCONNECT) { // the host opens a session, tell it who answered
+           ack->arg[0] = res;
+           UsbSendPacket((void *)ack, sizeof(UsbCommand));
+       }
        if(!res) {
            DbpString("iso14443a card select failed");
            goto err;
@@ -293,53 +315,59 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
    }
    if(param & EXECUTE_NATIVE_COMMAND)
    {
-       // param2 is cmd_len
+       // param2 is cmd_len, its second byte the offset of the data to encrypt
+       // the payload of all frames is collected for FETCH_RESPONSE
+       int cmd_len = param2 & 0xff;
+       uint8_t status = 0;
        if(param2 >> 8 & 0xff) { // stuff to encrypt?
            uint8_t offset = param2 >> 8;
-           desfire_encrypt_packet(cmd + offset, (param2 & 0xff) - offset, desfire->session_key);
+           cmd_len = offset + desfire_encrypt_packet(cmd + offset, cmd_len - offset, &desfire->session_key);
        }
-       ack->arg[0] = _desfire_command(cmd, param2 & 0xff, ack->d.asBytes);
-       /*if(param2 >> 16 & 0xff) { // stuff to decrypt?
-           uint8_t offset = param2 >> 16;
-           desfire_decrypt_packet(ack->d.asBytes + offset...
-       }*/
+       ack->arg[0] = desfire_chain(cmd, cmd_len, desfire->chain_buf, sizeof(desfire->chain_buf), &status);
+       ack->arg[1] = status;
+       memcpy(ack->d.asBytes, desfire->chain_buf, sizeof(ack->d.asBytes));
        UsbSendPacket((void *)ack, sizeof(UsbCommand));
-    }
-   
-///*
-   if(param & EXECUTE_SPECIAL_COMMAND)
+   }
+
+   if(param & FETCH_RESPONSE)
    {
-       ack->arg[0] = request_authentication(param2 & 0xf, ack->d.asBytes);
+       // the rest of a response longer than one packet, param2 is the offset
+       if(param2 < sizeof(desfire->chain_buf))
+           memcpy(ack->d.asBytes, desfire->chain_buf + param2, sizeof(ack->d.asBytes));
        UsbSendPacket((void *)ack, sizeof(UsbCommand));
-   }   
-//*/
-/*
+   }
+
    if(param & EXECUTE_SPECIAL_COMMAND)
    {   // special functionality to access in card
        // param2 is cmd
        switch(param2) {
-       case AUTH:
-           ack->arg[0] = desfire_auth(*cmd, cmd+4, desfire->session_key);
+       case SPECIAL_AUTH:
+           ack->arg[0] = desfire_auth(*cmd, (uint32_t *)(cmd+4), &desfire->session_key);
            break;
-       case CH_KEY:
-           ack->arg[0] = desfire_change_key(*cmd, cmd+4, cmd+20, desfire->session_key);
+       case SPECIAL_CHANGE_KEY:
+           ack->arg[0] = desfire_change_key(*cmd, cmd+4, cmd+20, &desfire->session_key) >= 0;
            break;
        default:
            Dbprintf("desfire command %x unimplemented", param2);
+           ack->arg[0] = 0;
        }
        UsbSendPacket((void *)ack, sizeof(UsbCommand));
    }
-*/
+
+   // the built-in test sequence is for a plain connect only
+   if(!(param & CONNECT) || (param & (EXECUTE_NATIVE_COMMAND | EXECUTE_SPECIAL_COMMAND | FETCH_RESPONSE | NO_DISCONNECT)))
+       goto done;
+
 ///*
-   res = desfire_command(resp, GET_VERSION, 0);
+   res = desfire_command(resp, DESFIRE_ID_GET_VERSION, NULL);
    print_result("ver", resp, res);
 
-   res = desfire_command(resp, GET_APPLICATION_IDS, 0);
+   res = desfire_command(resp, DESFIRE_ID_GET_APPLICATION_IDS, NULL);
    print_result("apps", resp, res);
 
         if(desfire_select_app(0) < 0) goto err;
 
-   if(!desfire_auth(0, default_key, desfire->session_key)) goto err; 
+   if(!desfire_auth(0, default_key, &desfire->session_key)) goto err; 
 //*/
 /*
    if(param & 4)
@@ -348,7 +376,7 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
    if(param & 1) {
        if(desfire_create_app(0xabcdef, desfire_key_settings(1, 0, 0, 1, 1, 0, 0), 4) < 0) goto err;
    
-           res = desfire_command(resp, GET_APPLICATION_IDS, 0);
+           res = desfire_command(resp, DESFIRE_ID_GET_APPLICATION_IDS, NULL);
        print_result("apps", resp, res);
    }
 */
@@ -357,9 +385,9 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
        DbpString("desfie_select_app");
        if(desfire_select_app(0xabcdef) < 0) goto err;
 
-       if(!desfire_auth(0, default_key, desfire->session_key)) goto err;
+       if(!desfire_auth(0, default_key, &desfire->session_key)) goto err;
 
-       res = desfire_command(resp, GET_FILE_IDS, 0);
+       res = desfire_command(resp, DESFIRE_ID_GET_FILE_IDS, NULL);
        if(res < 0) goto err;
        print_result("files", resp, res);
 
@@ -374,13 +402,13 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
            print_result("file", resp, res);
 
            uint8_t data[] = {0,2,4,6,8,9};
-           if((res = desfire_write_data(1, 0, 6, data, desfire->session_key)) < 0) goto err;
+           if((res = desfire_write_data(1, 0, 6, data, &desfire->session_key)) < 0) goto err;
 
            if((res = desfire_read_data(1, 0, 8, resp)) < 0) goto err;
            print_result("file", resp, res);
        }
 
-       if(desfire_command(resp, GET_KEY_VERSION, 1, 2) < 0) goto err;
+       if(DESFIRE_COMMAND(resp, GET_KEY_VERSION, 2) < 0) goto err;
        Dbprintf("key version: %x", resp[0]);
        uint8_t changekey = param >> 12 & 0xf;
    
@@ -388,16 +416,103 @@ void ReaderMifareDES(uint32_t param, uint32_t param2, uint8_t * cmd, UsbCommand
            uint32_t old[] = {0,0,0,0};
            uint32_t new[] = {2,4,6,8};
 
-           res = desfire_change_key(changekey, old, new, desfire->session_key);
+           res = desfire_change_key(changekey, old, new, &desfire->session_key);
            if(res < 0) Dbprintf("change key error: %x", -res);
 
-           if(!desfire_auth(changekey, new, desfire->session_key)) {
-               if(desfire_auth(changekey, old, desfire->session_key) < 0) goto err;
+           if(!desfire_auth(changekey, new, &desfire->session_key)) {
+               if(desfire_auth(changekey, old, &desfire->session_key) < 0) goto err;
                DbpString("still using the old key");
            }
        }
    }
-err:   
+done:
    if(param & NO_DISCONNECT) return;
+err:   
+   FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+}
+
+/* activation with RATS, after a field reset if asked, and application
+ * selection for MifareDESChkKeys
+ * return 0, -status of the card or DESFIRE_LINK_ERROR */
+static int chk_select(uint32_t aid, int reset) {
+   uint8_t uid[10];
+   iso14a_card_select_t card;
+   uint8_t cmd[DESFIRE_HEADER_MAX];
+   int len = DESFIRE_ENCODE(cmd, SELECT_APPLICATION, aid);
+   uint8_t status;
+   int res;
+
+   if(reset) { // a card in ISO14443-4 state ignores WUPA
+       FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+       SpinDelay(100);
+       FpgaWriteConfWord(FPGA_MAJOR_MODE_HF_ISO14443A | FPGA_HF_ISO14443A_READER_MOD);
+   }
+   if(iso14443a_select_card(uid, &card, NULL) != 1) return DESFIRE_LINK_ERROR;
+
+   res = desfire_chain(cmd, len, desfire->resp_buf, sizeof(desfire->resp_buf), &status);
+   if(res < 0) return res;
+   return status == OPERATION_OK ? 0 : -status;
+}
+
+/* try a list of 2K3DES keys on one key slot of an application
+ * arg2 holds the number of keys in this packet, the index of the first one
+ * << 8 and DESFIRE_CHK_RUN; the keys are collected in chain_buf and tried
+ * when DESFIRE_CHK_RUN comes.
+ * A wrong key leaves the application selected, so the next key is tried
+ * right away. Only if an authentication fails in another way the card is
+ * activated again and the key retried once. */
+void MifareDESChkKeys(uint32_t aid, uint32_t key_slot, uint32_t arg2, uint8_t * datain) {
+   UsbCommand ack = {CMD_ACK, {0, 0, 0}};
+   uint8_t * keys = desfire->chain_buf;
+   int count = arg2 & 0xff, first = arg2 >> 8 & 0xff;
+   int total = first + count, i = 0, retried = 0, res;
+   uint32_t start;
+
+   if(count > DESFIRE_CHK_KEYS_PER_PACKET || total > DESFIRE_CHK_MAX_KEYS) {
+       ack.arg[0] = DESFIRE_BUFFER_ERROR;
+       UsbSendPacket((void *)&ack, sizeof(UsbCommand));
+       return;
+   }
+   memcpy(keys + 16 * first, datain, 16 * count);
+   if(!(arg2 & DESFIRE_CHK_RUN)) {
+       ack.arg[0] = total;
+       UsbSendPacket((void *)&ack, sizeof(UsbCommand));
+       return;
+   }
+
+   iso14443a_setup();
+   LED_A_ON();
+   start = GetTickCount();
+
+   res = chk_select(aid, 0);
+   while(res == 0 && i < total) {
+       res = desfire_authenticate(key_slot, (uint32_t *)(keys + 16 * i), &desfire->session_key);
+       if(res == 0) {
+           memcpy(ack.d.asBytes, keys + 16 * i, 16);
+           ack.arg[0] = 1;
+           i++;
+           break;
+       }
+       if(res == -AUTHENTICATION_ERROR) {
+           res = 0;
+           retried = 0;
+           i++;
+       } else if(!retried) {
+           retried = 1;
+           res = chk_select(aid, 1);
+       }
+   }
+   if(res < 0) ack.arg[0] = res;
+   ack.arg[1] = i;
+   ack.arg[2] = GetTickCount() - start;
+
    FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+   LEDsoff();
+   UsbSendPacket((void *)&ack, sizeof(UsbCommand));
+}
+
+/* a piece of the card image for MifareDESSim(), at most 48 bytes */
+void MifareDESSimLoad(uint32_t offset, uint32_t len, uint8_t * datain) {
+   if(len > 48 || offset > DESFIRE_SIM_IMAGE_MAX - len) return;
+   memcpy((uint8_t *)BigBuf + DESFIRE_SIM_IMAGE + offset, datain, len);
 }
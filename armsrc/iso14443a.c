@@ -19,6 +19,7 @@
 #include "iso14443a.h"
 #include "crapto1.h"
 #include "mifareutil.h"
+#include "desfiresim.h"
 
 static uint32_t iso14a_timeout;
 uint8_t *trace = (uint8_t *) BigBuf+TRACE_OFFSET;
@@ -29,6 +30,19 @@ uint8_t trigger = 0;
 
 // the block number for the ISO14443-4 PCB
 static uint8_t iso14_pcb_blocknum = 0;
+// the frame size the card accepts, from FSCI in its ATS
+static int iso14_fsc = 32;
+// the most we send in a frame, CRC included: its modulation has to fit
+// ToSend[512] and its parity bits one uint32_t
+#define ISO14_TX_FRAME_MAX 32
+// the CID the blocks go to, and the block numbers and frame sizes of the
+// other cards iso14443a_inventory() activated alongside
+static int iso14_cid = 0;
+static uint8_t iso14_cid_blocknum[ISO14A_MAX_CID];
+static int iso14_cid_fsc[ISO14A_MAX_CID];
+// the SELECT frames of the last anticollision, for iso14443a_reselect_card()
+static uint8_t iso14_sel_uid[3][9];
+static int iso14_sel_levels = 0;
 
 // CARD TO READER - manchester
 // Sequence D: 11110000 modulation with subcarrier during first half
@@ -379,6 +393,13 @@ static RAMFUNC int MillerDecoding(int bit)
 //=============================================================================
 static tDemod Demod;
 
+// bit oriented anticollision (iso14443a_inventory()): the answer completes
+// the byte the reader split after iso14_anticol_split bits, and a bit two
+// cards answer differently is taken as a 1, the first one noted
+static int iso14_anticol = 0;
+static int iso14_anticol_split = 0;
+static int iso14_anticol_collision = -1;
+
 static RAMFUNC int ManchesterDecoding(int v)
 {
 	int bit;
@@ -427,7 +448,7 @@ static RAMFUNC int ManchesterDecoding(int v)
 			Demod.len = 0;
 			Demod.state = DEMOD_START_OF_COMMUNICATION;
 			Demod.sub = SUB_FIRST_HALF;
-			Demod.bitCount = 0;
+			Demod.bitCount = iso14_anticol ? iso14_anticol_split : 0;
 			Demod.shiftReg = 0;
 			Demod.parityBits = 0;
 			Demod.samples = 0;
@@ -460,7 +481,13 @@ static RAMFUNC int ManchesterDecoding(int v)
 		}
 		else {
 			Demod.posCount = 0;
-			if(modulation && (Demod.sub == SUB_FIRST_HALF)) {
+			if(modulation && (Demod.sub == SUB_FIRST_HALF) && iso14_anticol
+			   && Demod.state != DEMOD_START_OF_COMMUNICATION) {
+				// a collision, not a parity bit after one
+				if(iso14_anticol_collision < 0 && Demod.bitCount < 8)
+					iso14_anticol_collision = Demod.len * 8 + Demod.bitCount;
+			}
+			else if(modulation && (Demod.sub == SUB_FIRST_HALF)) {
 				if(Demod.state!=DEMOD_ERROR_WAIT) {
 					Demod.state = DEMOD_ERROR_WAIT;
 					Demod.output[Demod.len] = 0xaa;
@@ -1302,10 +1329,10 @@ void ShortFrameFromReader(const uint8_t bt)
 }
 
 //-----------------------------------------------------------------------------
-// Prepare reader command to send to FPGA
-//
+// Prepare reader command to send to FPGA, the first bits of cmd: a byte
+// split by the anticollision goes out without its parity bit
 //-----------------------------------------------------------------------------
-void CodeIso14443aAsReaderPar(const uint8_t * cmd, int len, uint32_t dwParity)
+void CodeIso14443aBitsAsReaderPar(const uint8_t * cmd, int bits, uint32_t dwParity)
 {
   int i, j;
   int last;
@@ -1318,11 +1345,11 @@ void CodeIso14443aAsReaderPar(const uint8_t * cmd, int len, uint32_t dwParity)
   last = 0;
 
   // Generate send structure for the data bits
-  for (i = 0; i < len; i++) {
+  for (i = 0; i * 8 < bits; i++) {
     // Get the current byte to send
     b = cmd[i];
 
-    for (j = 0; j < 8; j++) {
+    for (j = 0; j < 8 && i * 8 + j < bits; j++) {
       if (b & 1) {
         // Sequence X
     	  ToSend[++ToSendMax] = SEC_X;
@@ -1339,6 +1366,7 @@ void CodeIso14443aAsReaderPar(const uint8_t * cmd, int len, uint32_t dwParity)
       }
       b >>= 1;
     }
+    if (j < 8) break;
 
     // Get the parity bit
     if ((dwParity >> i) & 0x01) {
@@ -1378,12 +1406,19 @@ void CodeIso14443aAsReaderPar(const uint8_t * cmd, int len, uint32_t dwParity)
   ToSendMax++;
 }
 
+void CodeIso14443aAsReaderPar(const uint8_t * cmd, int len, uint32_t dwParity)
+{
+  CodeIso14443aBitsAsReaderPar(cmd, len * 8, dwParity);
+}
+
 //-----------------------------------------------------------------------------
 // Wait for commands from reader
 // Stop when button is pressed (return 1) or field was gone (return 2)
 // Or return 0 when command is captured
+// Unless ks is NULL, its keystream grows towards ksBits a bit at a time
+// whenever the SSC has no sample for us.
 //-----------------------------------------------------------------------------
-static int EmGetCmd(uint8_t *received, int *len, int maxLen)
+static int EmGetCmd(uint8_t *received, int *len, int maxLen, mf_keystream_t *ks, int ksBits)
 {
 	*len = 0;
 
@@ -1451,6 +1486,8 @@ static int EmGetCmd(uint8_t *received, int *len, int maxLen)
 				if (tracing) LogTrace(received, *len, GetDeltaCountUS(), Uart.parityBits, TRUE);
 				return 0;
 			}
+		} else if (ks && ks->made - ks->used < (uint32_t)ksBits) {
+			mf_ks_fill(ks, ks->made - ks->used + 1);
 		}
 	}
 }
@@ -1528,6 +1565,53 @@ int EmSendCmdPar(uint8_t *resp, int respLen, uint32_t par){
 	return EmSendCmdExPar(resp, respLen, 0, par);
 }
 
+//-----------------------------------------------------------------------------
+// Answers modulated in advance, there is no time to code them when the reader
+// asks. EmPrepareCmdPar() codes resp into the space left at *mod and moves
+// *mod on; an answer that does not fit is coded when it is sent.
+//-----------------------------------------------------------------------------
+typedef struct {
+	uint8_t *resp;
+	int respLen;
+	uint32_t par;
+	uint8_t *mod;
+	int modLen;
+} em_prepared_t;
+
+static int EmPrepareCmdPar(em_prepared_t *p, uint8_t *resp, int respLen, uint32_t par, uint8_t **mod, int *modLeft)
+{
+	p->resp = resp;
+	p->respLen = respLen;
+	p->par = par;
+	p->mod = NULL;
+
+	CodeIso14443aAsTagPar(resp, respLen, par);
+	if (ToSendMax > *modLeft)
+		return -1;
+	memcpy(*mod, ToSend, ToSendMax);
+	p->mod = *mod;
+	p->modLen = ToSendMax;
+	*mod += ToSendMax;
+	*modLeft -= ToSendMax;
+	return 0;
+}
+
+static int EmPrepareCmd(em_prepared_t *p, uint8_t *resp, int respLen, uint8_t **mod, int *modLeft)
+{
+	return EmPrepareCmdPar(p, resp, respLen, GetParity(resp, respLen), mod, modLeft);
+}
+
+static int EmSendPrepared(em_prepared_t *p, int correctionNeeded)
+{
+	int res;
+
+	if (!p->mod)
+		return EmSendCmdExPar(p->resp, p->respLen, correctionNeeded, p->par);
+	res = EmSendCmd14443aRaw(p->mod, p->modLen, correctionNeeded);
+	if (tracing) LogTrace(p->resp, p->respLen, GetDeltaCountUS(), p->par, FALSE);
+	return res;
+}
+
 //-----------------------------------------------------------------------------
 // Wait a certain time for tag response
 //  If a response is captured return TRUE
@@ -1591,14 +1675,14 @@ void ReaderTransmitShort(const uint8_t* bt)
   if (tracing) LogTrace(bt,1,0,GetParity(bt,1),TRUE);
 }
 
-void ReaderTransmitPar(uint8_t* frame, int len, uint32_t par)
+void ReaderTransmitBitsPar(uint8_t* frame, int bits, uint32_t par)
 {
   int wait = 0;
   int samples = 0;
 
   // This is tied to other size changes
   // 	uint8_t* frame_addr = ((uint8_t*)BigBuf) + 2024;
-  CodeIso14443aAsReaderPar(frame,len,par);
+  CodeIso14443aBitsAsReaderPar(frame,bits,par);
 
   // Select the card
   TransmitFor14443a(ToSend, ToSendMax, &samples, &wait);
@@ -1606,7 +1690,12 @@ void ReaderTransmitPar(uint8_t* frame, int len, uint32_t par)
   	LED_A_ON();
 
   // Store reader command in buffer
-  if (tracing) LogTrace(frame,len,0,par,TRUE);
+  if (tracing) LogTrace(frame,(bits+7)/8,0,par,TRUE);
+}
+
+void ReaderTransmitPar(uint8_t* frame, int len, uint32_t par)
+{
+  ReaderTransmitBitsPar(frame,len*8,par);
 }
 
 
@@ -1635,6 +1724,27 @@ int ReaderReceivePar(uint8_t* receivedAnswer, uint32_t * parptr)
   return Demod.len;
 }
 
+// the frame size from FSCI in T0 of an ATS, if there is one
+static void iso14_set_fsc(const uint8_t * ats, int len)
+{
+	static const uint16_t fsc[] = { 16, 24, 32, 40, 48, 64, 96, 128 };
+
+	iso14_fsc = 32;
+	if(len > 3 && ats[0] > 1)
+		iso14_fsc = (ats[1] & 0x0f) < 8 ? fsc[ats[1] & 0x0f] : 256;
+}
+
+// The ISO14443-4 blocks go to the card with CID cid from now on, each card
+// keeps its block number.
+void iso14_use_cid(int cid)
+{
+	iso14_cid_blocknum[iso14_cid] = iso14_pcb_blocknum;
+	iso14_cid_fsc[iso14_cid] = iso14_fsc;
+	iso14_cid = cid;
+	iso14_pcb_blocknum = iso14_cid_blocknum[cid];
+	iso14_fsc = iso14_cid_fsc[cid] ? iso14_cid_fsc[cid] : 32;
+}
+
 /* performs iso14443a anticolision procedure
  * fills the uid pointer unless NULL
  * fills resp_data unless NULL */
@@ -1653,6 +1763,8 @@ int iso14443a_select_card(uint8_t * uid_ptr, iso14a_card_select_t * resp_data, u
 	
 	// clear uid
 	memset(uid_ptr, 0, 8);
+	iso14_sel_levels = 0;
+	iso14_use_cid(0);
 
 	// Broadcast for a card, WUPA (0x52) will force response from all cards in the field
 	ReaderTransmitShort(wupa);
@@ -1682,11 +1794,13 @@ int iso14443a_select_card(uint8_t * uid_ptr, iso14a_card_select_t * resp_data, u
 		memcpy(sel_uid+2,resp,5);
 		AppendCrc14443a(sel_uid,7);
 		ReaderTransmit(sel_uid,sizeof(sel_uid));
+		if(cascade_level < 3) memcpy(iso14_sel_uid[cascade_level], sel_uid, sizeof(sel_uid));
 
 		// Receive the SAK
 		if (!ReaderReceive(resp)) return 0;
 		sak = resp[0];
 	}
+	if(cascade_level <= 3) iso14_sel_levels = cascade_level;
 	if(resp_data) {
 		resp_data->sak = sak;
 		resp_data->ats_len = 0;
@@ -1709,6 +1823,7 @@ int iso14443a_select_card(uint8_t * uid_ptr, iso14a_card_select_t * resp_data, u
 		
 		memcpy(resp_data->ats, resp, sizeof(resp_data->ats));
 		resp_data->ats_len = len;
+		iso14_set_fsc(resp, len);
 	}
 	
 	// reset the PCB block number
@@ -1717,6 +1832,167 @@ int iso14443a_select_card(uint8_t * uid_ptr, iso14a_card_select_t * resp_data, u
 	return 1;
 }
 
+/* wakes the card of the last iso14443a_select_card() with WUPA and selects
+ * it by its UID right away, without the anticollision loop
+ * returns 1 if it answered every cascade level, else 0 */
+int iso14443a_reselect_card(void) {
+	uint8_t wupa[] = { 0x52 };
+	uint8_t* resp = (((uint8_t *)BigBuf) + MIFARE_BUFF_OFFSET);
+	int i;
+
+	if(!iso14_sel_levels) return 0;
+
+	ReaderTransmitShort(wupa);
+	if(!ReaderReceive(resp)) return 0;
+	for(i = 0; i < iso14_sel_levels; i++) {
+		ReaderTransmit(iso14_sel_uid[i], sizeof(iso14_sel_uid[i]));
+		if(!ReaderReceive(resp)) return 0;
+	}
+	iso14_pcb_blocknum = 0;
+	return 1;
+}
+
+// an answer with the anticollision's split byte and collision check, the
+// first collision from the split byte on in collision or -1
+static int ReaderReceiveAnticol(uint8_t * resp, int split, int * collision)
+{
+	int len;
+
+	iso14_anticol = 1;
+	iso14_anticol_split = split;
+	iso14_anticol_collision = -1;
+	len = ReaderReceive(resp);
+	iso14_anticol = 0;
+	*collision = iso14_anticol_collision;
+	return len;
+}
+
+/* the UID CLn with its BCC of one card at cascade level level: where the
+ * cards answer different bits the walk goes on with those that have a 1,
+ * the UID one bit further fixed in the next SELECT, down to one card
+ * returns 1, or 0 if no card answered or the BCC is wrong */
+static int iso14_anticollision(int level, uint8_t * uid_cl)
+{
+	uint8_t frame[7];
+	uint8_t* resp = (((uint8_t *)BigBuf) + MIFARE_BUFF_OFFSET);
+	int known = 0, n, split, collision, len, i;
+
+	memset(uid_cl, 0, 5);
+	while(known < 40) {
+		n = known / 8;
+		split = known % 8;
+		frame[0] = 0x93 + level * 2;
+		frame[1] = 0x20 + (n << 4) + split; // NVB
+		memcpy(frame + 2, uid_cl, (known + 7) / 8);
+		ReaderTransmitBitsPar(frame, 16 + known, GetParity(frame, 2 + n));
+		if(!(len = ReaderReceiveAnticol(resp, split, &collision))) return 0;
+
+		// the bits the cards filled in
+		uid_cl[n] = (uid_cl[n] & ((1 << split) - 1)) | (resp[0] & (0xff << split));
+		for(i = 1; i < len && n + i < 5; i++)
+			uid_cl[n + i] = resp[i];
+		if(collision < 0)
+			return uid_cl[4] == (uid_cl[0] ^ uid_cl[1] ^ uid_cl[2] ^ uid_cl[3]);
+		known = n * 8 + collision + 1;
+	}
+	return 0;
+}
+
+/* lists the cards in the field: each round REQA, the anticollision down to
+ * one card, its SELECT and HLTA, so the next round finds the others, until
+ * no card answers
+ * returns the number of cards in cards, at most max */
+int iso14443a_inventory(iso14a_inventory_t * cards, int max) {
+	uint8_t reqa[] = { 0x26 };
+	uint8_t sel_uid[9];
+	uint8_t hlta[4] = { 0x50, 0x00 };
+	uint8_t uid_cl[5];
+	uint8_t* resp = (((uint8_t *)BigBuf) + MIFARE_BUFF_OFFSET);
+	iso14a_inventory_t * card;
+	int count = 0, errors = 0, level, collision, i;
+
+	AppendCrc14443a(hlta, 2);
+	while(count < max && errors < 3) {
+		WDT_HIT();
+		card = cards + count;
+		memset(card, 0, sizeof(iso14a_inventory_t));
+		card->cid = 0xff;
+
+		// the cards not halted yet, their ATQAs over each other
+		ReaderTransmitShort(reqa);
+		if(!ReaderReceiveAnticol(resp, 0, &collision)) break;
+		memcpy(card->atqa, resp, 2);
+
+		card->sak = 0x04;
+		for(level = 0; level < 3 && (card->sak & 0x04); level++) {
+			if(!iso14_anticollision(level, uid_cl)) break;
+			sel_uid[0] = 0x93 + level * 2;
+			sel_uid[1] = 0x70;
+			memcpy(sel_uid + 2, uid_cl, 5);
+			AppendCrc14443a(sel_uid, 7);
+			ReaderTransmit(sel_uid, sizeof(sel_uid));
+			if(!ReaderReceive(resp)) break;
+			card->sak = resp[0];
+			// the cascade tag is not part of the UID
+			i = (card->sak & 0x04) ? 1 : 0;
+			memcpy(card->uid + card->uid_len, uid_cl + i, 4 - i);
+			card->uid_len += 4 - i;
+		}
+		if(card->sak & 0x04) {
+			// lost on the way, the card went back to idle
+			errors++;
+			continue;
+		}
+		ReaderTransmit(hlta, sizeof(hlta));
+
+		// a card that does not halt would answer every round
+		for(i = 0; i < count; i++)
+			if(cards[i].uid_len == card->uid_len && !memcmp(cards[i].uid, card->uid, card->uid_len)) break;
+		if(i < count) break;
+		count++;
+		errors = 0;
+	}
+	return count;
+}
+
+/* wakes a card of iso14443a_inventory(), selects it by its UID and
+ * activates it with RATS for CID cid
+ * returns the length of its ATS or 0 */
+static int iso14443a_activate(const iso14a_inventory_t * card, int cid) {
+	uint8_t wupa[] = { 0x52 };
+	uint8_t sel_uid[9];
+	uint8_t rats[4] = { 0xE0, 0x80 | cid }; // FSD=256, FSDI=8
+	uint8_t* resp = (((uint8_t *)BigBuf) + MIFARE_BUFF_OFFSET);
+	int levels = card->uid_len == 4 ? 1 : (card->uid_len == 7 ? 2 : 3);
+	int level, pos = 0, len, collision;
+
+	ReaderTransmitShort(wupa);
+	if(!ReaderReceiveAnticol(resp, 0, &collision)) return 0;
+	for(level = 0; level < levels; level++) {
+		sel_uid[0] = 0x93 + level * 2;
+		sel_uid[1] = 0x70;
+		if(level < levels - 1) {
+			sel_uid[2] = 0x88;
+			memcpy(sel_uid + 3, card->uid + pos, 3);
+			pos += 3;
+		} else {
+			memcpy(sel_uid + 2, card->uid + pos, 4);
+		}
+		sel_uid[6] = sel_uid[2] ^ sel_uid[3] ^ sel_uid[4] ^ sel_uid[5];
+		AppendCrc14443a(sel_uid, 7);
+		ReaderTransmit(sel_uid, sizeof(sel_uid));
+		if(!ReaderReceive(resp)) return 0;
+	}
+
+	iso14_use_cid(cid);
+	AppendCrc14443a(rats, 2);
+	ReaderTransmit(rats, sizeof(rats));
+	if(!(len = ReaderReceive(resp))) return 0;
+	iso14_set_fsc(resp, len);
+	iso14_pcb_blocknum = 0;
+	return len;
+}
+
 void iso14443a_setup() {
 	// Setup SSC
 	FpgaSetupSsc();
@@ -1744,7 +2020,7 @@ int iso14_apdu(uint8_t * cmd, size_t cmd_len, void * data) {
 	real_cmd[0] = 0x0a; //I-Block
 	// put block number into the PCB
 	real_cmd[0] |= iso14_pcb_blocknum;
-	real_cmd[1] = 0x00; //CID: 0 //FIXME: allow multiple selected cards
+	real_cmd[1] = iso14_cid;
 	memcpy(real_cmd+2, cmd, cmd_len);
 	AppendCrc14443a(real_cmd,cmd_len+2);
  
@@ -1766,6 +2042,103 @@ int iso14_apdu(uint8_t * cmd, size_t cmd_len, void * data) {
 	return len;
 }
 
+// an I-block with the CID as iso14_apdu() sends it, the M-bit if more follow
+static int iso14_i_block(uint8_t * frame, const uint8_t * inf, int len, int chaining)
+{
+	frame[0] = 0x0a | (chaining ? 0x10 : 0) | iso14_pcb_blocknum;
+	frame[1] = iso14_cid;
+	memcpy(frame+2, inf, len);
+	AppendCrc14443a(frame, len+2);
+	return len+4;
+}
+
+// R(ACK) or R(NAK) with the CID and the current block number
+static void iso14_r_block(int nak)
+{
+	uint8_t frame[4] = { (nak ? 0xba : 0xaa) | iso14_pcb_blocknum, iso14_cid };
+
+	AppendCrc14443a(frame, 2);
+	ReaderTransmit(frame, sizeof(frame));
+}
+
+/* Exchange one APDU by the block protocol of ISO14443-4: it goes out in
+ * I-blocks of at most FSC bytes and ISO14_TX_FRAME_MAX, chained, the answer is collected over the
+ * card's chaining, S(WTX) is granted for the next frame, and a frame lost
+ * or broken is asked for again with R(NAK), R(ACK) while the card chains.
+ * Returns the length of the answer in answer or ISO14A_APDU_*_ERROR,
+ * ISO14A_APDU_OVERFLOW if it is longer than max. */
+int iso14_apdu_exchange(const uint8_t * apdu, int len, uint8_t * answer, int max)
+{
+	uint8_t * tx = ((uint8_t *)BigBuf) + ISO14A_APDU_FRAMES;
+	uint8_t * rx = tx + 260;
+	uint32_t timeout = iso14a_timeout;
+	int room = (iso14_fsc < ISO14_TX_FRAME_MAX ? iso14_fsc : ISO14_TX_FRAME_MAX) - 4;
+	int piece = len < room ? len : room;
+	int sent = 0, got = 0, errors = 0, chained = 0;
+	int tx_len, rx_len, inf, n;
+	uint8_t pcb;
+
+	tx_len = iso14_i_block(tx, apdu, piece, piece < len);
+	ReaderTransmit(tx, tx_len);
+
+	for(;;) {
+		rx_len = ReaderReceive(rx);
+		iso14a_timeout = timeout; // a WTX holds for one frame only
+
+		if(rx_len < 3 || !CheckCrc14443(CRC_14443_A, rx, rx_len)) {
+			if(++errors > 3) return ISO14A_APDU_LINK_ERROR;
+			iso14_r_block(!chained);
+			continue;
+		}
+		pcb = rx[0];
+		inf = 1 + (pcb & 0x08 ? 1 : 0) + (pcb & 0x04 ? 1 : 0);
+
+		if((pcb & 0xf7) == 0xf2) { // S(WTX), WTXM 1 to 59
+			if(rx_len < inf + 3 || (rx[inf] & 0x3f) == 0 || (rx[inf] & 0x3f) > 59)
+				return ISO14A_APDU_PROTOCOL_ERROR;
+			iso14a_timeout = timeout * (rx[inf] & 0x3f);
+			rx[inf] &= 0x3f;
+			AppendCrc14443a(rx, inf+1);
+			ReaderTransmit(rx, inf+3);
+			continue;
+		}
+
+		if((pcb & 0xe6) == 0xa2) { // R-block
+			if(pcb & 0x10) return ISO14A_APDU_PROTOCOL_ERROR;
+			if((pcb & 0x01) != iso14_pcb_blocknum) {
+				// the card never saw our last I-block
+				if(++errors > 3) return ISO14A_APDU_LINK_ERROR;
+				ReaderTransmit(tx, tx_len);
+				continue;
+			}
+			// acknowledges a chained I-block, on to the next one
+			if(sent + piece >= len) return ISO14A_APDU_PROTOCOL_ERROR;
+			iso14_pcb_blocknum ^= 1;
+			sent += piece;
+			piece = len - sent < room ? len - sent : room;
+			tx_len = iso14_i_block(tx, apdu + sent, piece, sent + piece < len);
+			ReaderTransmit(tx, tx_len);
+			errors = 0;
+			continue;
+		}
+
+		if((pcb & 0xe2) != 0x02 || (pcb & 0x01) != iso14_pcb_blocknum
+		   || sent + piece < len || rx_len < inf + 2)
+			return ISO14A_APDU_PROTOCOL_ERROR;
+
+		// an I-block of the answer
+		iso14_pcb_blocknum ^= 1;
+		n = rx_len - inf - 2;
+		if(got + n > max) return ISO14A_APDU_OVERFLOW;
+		memcpy(answer + got, rx + inf, n);
+		got += n;
+		errors = 0;
+		if(!(pcb & 0x10)) return got;
+		chained = 1;
+		iso14_r_block(0);
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Read an ISO 14443a tag. Send out commands and store answers.
 //
@@ -1816,6 +2189,102 @@ void ReaderIso14443a(UsbCommand * c, UsbCommand * ack)
 	LEDsoff();
 }
 
+//-----------------------------------------------------------------------------
+// Collect a queue of APDUs from the host and run it back to back, see
+// CMD_READER_ISO_14443a_APDUS for the layout.
+//-----------------------------------------------------------------------------
+void ReaderIso14443aApdus(UsbCommand * c, UsbCommand * ack)
+{
+	uint8_t * queue = ((uint8_t *)BigBuf) + ISO14A_APDU_QUEUE;
+	uint8_t * answers = ((uint8_t *)BigBuf) + ISO14A_APDU_ANSWERS;
+	uint32_t offset = c->arg[0], len = c->arg[1];
+	iso14a_command_t param = c->arg[2] >> 16;
+	int count = c->arg[2] & 0xfff;
+	int cid = c->arg[2] >> 12 & 0xf;
+	int pos = 0, out = 0, done = 0, res = 0, n;
+	uint8_t uid[10];
+	iso14a_card_select_t card;
+
+	if(len > sizeof(c->d.asBytes) || offset > ISO14A_APDU_QUEUE_SIZE - len) return;
+	memcpy(queue + offset, c->d.asBytes, len);
+	if(!(param & ISO14A_APDU)) return;
+
+	if(param & ISO14A_CONNECT) {
+		iso14443a_setup();
+		if(iso14443a_select_card(uid, &card, NULL) != 1) res = ISO14A_APDU_NO_CARD;
+	} else if(cid < ISO14A_MAX_CID) {
+		iso14_use_cid(cid);
+	} else {
+		res = ISO14A_APDU_NO_CARD;
+	}
+	LED_A_ON();
+
+	for(; res == 0 && done < count; done++) {
+		n = pos + 2 <= ISO14A_APDU_QUEUE_SIZE ? queue[pos] | queue[pos+1] << 8 : ISO14A_APDU_QUEUE_SIZE;
+		if(pos + 2 + n > ISO14A_APDU_QUEUE_SIZE || out + 2 > ISO14A_APDU_ANSWERS_SIZE) {
+			res = ISO14A_APDU_OVERFLOW;
+			break;
+		}
+		res = iso14_apdu_exchange(queue + pos + 2, n, answers + out + 2, ISO14A_APDU_ANSWERS_SIZE - out - 2);
+		if(res < 0) break;
+		answers[out] = res & 0xff;
+		answers[out+1] = res >> 8;
+		out += 2 + res;
+		pos += 2 + n;
+		res = 0;
+	}
+
+	ack->arg[0] = done;
+	ack->arg[1] = out;
+	ack->arg[2] = res;
+	memcpy(ack->d.asBytes, answers, sizeof(ack->d.asBytes));
+	UsbSendPacket((void *)ack, sizeof(UsbCommand));
+
+	LED_A_OFF();
+	if(param & ISO14A_NO_DISCONNECT)
+		return;
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+}
+
+//-----------------------------------------------------------------------------
+// List the cards in the field, see CMD_READER_ISO_14443a_INVENTORY.
+//-----------------------------------------------------------------------------
+void ReaderIso14443aInventory(UsbCommand * c, UsbCommand * ack)
+{
+	iso14a_command_t param = c->arg[0];
+	iso14a_inventory_t * cards = (iso14a_inventory_t *)(((uint8_t *)BigBuf) + ISO14A_INVENTORY);
+	int max = c->arg[1], count, cid = 0, i;
+	uint32_t start = GetTickCount();
+
+	if(max <= 0 || max > ISO14A_INVENTORY_MAX) max = ISO14A_INVENTORY_MAX;
+
+	iso14443a_setup();
+	LED_A_ON();
+	count = iso14443a_inventory(cards, max);
+
+	// the ISO14443-4 cards side by side, CID by CID
+	for(i = 0; (param & ISO14A_ACTIVATE) && i < count && cid < ISO14A_MAX_CID; i++) {
+		if(!(cards[i].sak & 0x20)) continue;
+		cards[i].ats_len = iso14443a_activate(cards + i, cid);
+		if(cards[i].ats_len) cards[i].cid = cid++;
+	}
+
+	ack->arg[0] = count;
+	ack->arg[1] = cid;
+	ack->arg[2] = GetTickCount() - start;
+	memcpy(ack->d.asBytes, cards, sizeof(ack->d.asBytes));
+	UsbSendPacket((void *)ack, sizeof(UsbCommand));
+
+	LED_A_OFF();
+	if(param & ISO14A_ACTIVATE)
+		return;
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+}
+
 //-----------------------------------------------------------------------------
 // Read an ISO 14443a tag. Send out commands and store answers.
 //
@@ -1943,9 +2412,19 @@ void ReaderMifare(uint32_t parameter)
 }
 
 
+// sector of a block, 4K cards have sectors of 16 blocks from block 128 on
+static uint8_t mf_sim_sector(uint8_t block)
+{
+	return block < 128 ? block / 4 : 32 + (block - 128) / 16;
+}
+
 //-----------------------------------------------------------------------------
 // MIFARE 1K simulate. 
-// 
+// arg0: the sectors of the card, 5, 16 (or 0), 32 or 40, the card memory
+// the emulator memory holds. The answers that do not depend on the reader
+// are modulated in advance, the keystream for encrypted ones is made while
+// the receiver waits for the command. Read answers are encrypted from that
+// keystream but modulated as they go out.
 //-----------------------------------------------------------------------------
 void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 {
@@ -1972,16 +2451,24 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 	struct Crypto1State mpcs = {0, 0};
 	struct Crypto1State *pcs;
 	pcs = &mpcs;
+	mf_keystream_t ks;
+	int sectors = arg0 ? arg0 : 16;
+	int blocks = sectors < 32 ? sectors * 4 : 128 + (sectors - 32) * 16;
+	// read answer times against the trace clock
+	uint32_t cmdTime = 0, ansTime, ansMax = 0, ansSum = 0, ansCnt = 0;
 	
 	uint8_t* receivedCmd = eml_get_bigbufptr_recbuf();
 	uint8_t *response = eml_get_bigbufptr_sendbuf();
+	uint8_t *mod = ((uint8_t *)BigBuf) + EML_RESPONSES;
+	int modLeft = CARD_MEMORY - EML_RESPONSES;
+	em_prepared_t pATQA, pUIDBCC1, pUIDBCC2, pSAK, pSAK1, pAUTH_NT;
 	
 	static uint8_t rATQA[] = {0x04, 0x00}; // Mifare classic 1k 4BUID
 
 	static uint8_t rUIDBCC1[] = {0xde, 0xad, 0xbe, 0xaf, 0x62}; 
 	static uint8_t rUIDBCC2[] = {0xde, 0xad, 0xbe, 0xaf, 0x62}; // !!!
 		
-	static uint8_t rSAK[] = {0x08, 0xb6, 0xdd};
+	static uint8_t rSAK[] = {0x08, 0x00, 0x00};
 	static uint8_t rSAK1[] = {0x04, 0xda, 0x17};
 
 	static uint8_t rAUTH_NT[] = {0x01, 0x02, 0x03, 0x04};
@@ -1991,6 +2478,14 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 	// clear trace
 	traceLen = 0;
 	tracing = true;
+	mf_ks_init(&ks, pcs);
+
+	if (sectors != 5 && sectors != 16 && sectors != 32 && sectors != 40) {
+		sectors = 16;
+		blocks = 64;
+	}
+	rSAK[0] = sectors == 40 ? 0x18 : sectors == 32 ? 0x19 : sectors == 5 ? 0x09 : 0x08;
+	AppendCrc14443a(rSAK, 1);
 
   // Authenticate response - nonce
 	uint32_t nonce = bytes_to_num(rAUTH_NT, 4);
@@ -1999,12 +2494,12 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 	emlGetMemBt(receivedCmd, 7, 1);
 	_7BUID = !(receivedCmd[0] == 0x00);
 	if (!_7BUID) {                     // ---------- 4BUID
-		rATQA[0] = 0x04;
+		rATQA[0] = sectors == 40 ? 0x02 : 0x04;
 
 		emlGetMemBt(rUIDBCC1, 0, 4);
 		rUIDBCC1[4] = rUIDBCC1[0] ^ rUIDBCC1[1] ^ rUIDBCC1[2] ^ rUIDBCC1[3];
 	} else {                           // ---------- 7BUID
-		rATQA[0] = 0x44;
+		rATQA[0] = sectors == 40 ? 0x42 : 0x44;
 
 		rUIDBCC1[0] = 0x88;
 		emlGetMemBt(&rUIDBCC1[1], 0, 3);
@@ -2013,9 +2508,13 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 		rUIDBCC2[4] = rUIDBCC2[0] ^ rUIDBCC2[1] ^ rUIDBCC2[2] ^ rUIDBCC2[3];
 	}
 
-// --------------------------------------	test area
+	EmPrepareCmd(&pATQA, rATQA, sizeof(rATQA), &mod, &modLeft);
+	EmPrepareCmd(&pUIDBCC1, rUIDBCC1, sizeof(rUIDBCC1), &mod, &modLeft);
+	EmPrepareCmd(&pUIDBCC2, rUIDBCC2, sizeof(rUIDBCC2), &mod, &modLeft);
+	EmPrepareCmd(&pSAK, rSAK, sizeof(rSAK), &mod, &modLeft);
+	EmPrepareCmd(&pSAK1, rSAK1, sizeof(rSAK1), &mod, &modLeft);
+	EmPrepareCmd(&pAUTH_NT, rAUTH_NT, sizeof(rAUTH_NT), &mod, &modLeft);
 
-// --------------------------------------	END test area
 	// start mkseconds counter
 	StartCountUS();
 
@@ -2026,7 +2525,7 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
   FpgaWriteConfWord(FPGA_MAJOR_MODE_HF_ISO14443A | FPGA_HF_ISO14443A_TAGSIM_LISTEN);
 	SpinDelay(200);
 
-	if (MF_DBGLEVEL >= 1)	Dbprintf("Started. 7buid=%d", _7BUID);
+	if (MF_DBGLEVEL >= 1)	Dbprintf("Started. 7buid=%d sectors=%d", _7BUID, sectors);
 	// calibrate mkseconds counter
 	GetDeltaCountUS();
 	while (true) {
@@ -2048,13 +2547,19 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 		} 
 
 		if (cardSTATE != MFEMUL_NOFIELD) {
-			res = EmGetCmd(receivedCmd, &len, RECV_CMD_SIZE); // (+ nextCycleTimeout)
+			// the keystream of the next command and its answer, made while
+			// the receiver waits
+			if (cardSTATE == MFEMUL_WORK && cardAUTHKEY != 0xff)
+				res = EmGetCmd(receivedCmd, &len, RECV_CMD_SIZE, &ks, MF_KS_READ);
+			else
+				res = EmGetCmd(receivedCmd, &len, RECV_CMD_SIZE, NULL, 0); // (+ nextCycleTimeout)
 			if (res == 2) {
 				cardSTATE = MFEMUL_NOFIELD;
 				LEDsoff();
 				continue;
 			}
 			if(res) break;
+			cmdTime = GetCountUS();
 		}
 		
 		//nextCycleTimeout = 0;
@@ -2065,7 +2570,7 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 			// REQ or WUP request in ANY state and WUP in HALTED state
 			if (len == 1 && ((receivedCmd[0] == 0x26 && cardSTATE != MFEMUL_HALTED) || receivedCmd[0] == 0x52)) {
 				selTimer = GetTickCount();
-				EmSendCmdEx(rATQA, sizeof(rATQA), (receivedCmd[0] == 0x52));
+				EmSendPrepared(&pATQA, (receivedCmd[0] == 0x52));
 				cardSTATE = MFEMUL_SELECT1;
 
 				// init crypto block
@@ -2089,7 +2594,7 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 			case MFEMUL_SELECT1:{
 				// select all
 				if (len == 2 && (receivedCmd[0] == 0x93 && receivedCmd[1] == 0x20)) {
-					EmSendCmd(rUIDBCC1, sizeof(rUIDBCC1));
+					EmSendPrepared(&pUIDBCC1, 0);
 					break;
 				}
 
@@ -2097,9 +2602,9 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 				if (len == 9 && 
 						(receivedCmd[0] == 0x93 && receivedCmd[1] == 0x70 && memcmp(&receivedCmd[2], rUIDBCC1, 4) == 0)) {
 					if (!_7BUID) 
-						EmSendCmd(rSAK, sizeof(rSAK));
+						EmSendPrepared(&pSAK, 0);
 					else
-						EmSendCmd(rSAK1, sizeof(rSAK1));
+						EmSendPrepared(&pSAK1, 0);
 
 					cuid = bytes_to_num(rUIDBCC1, 4);
 					if (!_7BUID) {
@@ -2119,14 +2624,14 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 				if (!len) break;
 			
 				if (len == 2 && (receivedCmd[0] == 0x95 && receivedCmd[1] == 0x20)) {
-					EmSendCmd(rUIDBCC2, sizeof(rUIDBCC2));
+					EmSendPrepared(&pUIDBCC2, 0);
 					break;
 				}
 
 				// select 2 card
 				if (len == 9 && 
 						(receivedCmd[0] == 0x95 && receivedCmd[1] == 0x70 && memcmp(&receivedCmd[2], rUIDBCC2, 4) == 0)) {
-					EmSendCmd(rSAK, sizeof(rSAK));
+					EmSendPrepared(&pSAK, 0);
 
 					cuid = bytes_to_num(rUIDBCC2, 4);
 					cardSTATE = MFEMUL_WORK;
@@ -2154,6 +2659,7 @@ void Mifare1ksim(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 					}
 					ans = prng_successor(nonce, 96) ^ crypto1_word(pcs, 0, 0);
 					num_to_bytes(ans, 4, rAUTH_AT);
+					mf_ks_init(&ks, pcs);
 					// --- crypto
 					EmSendCmd(rAUTH_AT, sizeof(rAUTH_AT));
 					cardSTATE = MFEMUL_AUTH2;
@@ -2176,14 +2682,14 @@ lbWORK:	if (len == 0) break;
 					if (len == 4 && (receivedCmd[0] == 0x60 || receivedCmd[0] == 0x61)) {
 						authTimer = GetTickCount();
 
-						cardAUTHSC = receivedCmd[1] / 4;  // received block num
+						cardAUTHSC = mf_sim_sector(receivedCmd[1]);  // received block num
 						cardAUTHKEY = receivedCmd[0] - 0x60;
 
+						// the nonce is the same every time, crypto1 after it
+						EmSendPrepared(&pAUTH_NT, 0);
 						// --- crypto
 						crypto1_create(pcs, emlGetKey(cardAUTHSC, cardAUTHKEY));
 						ans = nonce ^ crypto1_word(pcs, cuid ^ nonce, 0); 
-						num_to_bytes(nonce, 4, rAUTH_AT);
-						EmSendCmd(rAUTH_AT, sizeof(rAUTH_AT));
 						// --- crypto
 						
 //   last working revision 
@@ -2196,13 +2702,13 @@ lbWORK:	if (len == 0) break;
 					}
 				} else {
 					// decrypt seqence
-					mf_crypto1_decrypt(pcs, receivedCmd, len);
+					mf_ks_decrypt(&ks, receivedCmd, len);
 					
 					// nested authentication
 					if (len == 4 && (receivedCmd[0] == 0x60 || receivedCmd[0] == 0x61)) {
 						authTimer = GetTickCount();
 
-						cardAUTHSC = receivedCmd[1] / 4;  // received block num
+						cardAUTHSC = mf_sim_sector(receivedCmd[1]);  // received block num
 						cardAUTHKEY = receivedCmd[0] - 0x60;
 
 						// --- crypto
@@ -2221,36 +2727,40 @@ lbWORK:	if (len == 0) break;
 				// rule 13 of 7.5.3. in ISO 14443-4. chaining shall be continued
 				// BUT... ACK --> NACK
 				if (len == 1 && receivedCmd[0] == CARD_ACK) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					break;
 				}
 				
 				// rule 12 of 7.5.3. in ISO 14443-4. R(NAK) --> R(ACK)
 				if (len == 1 && receivedCmd[0] == CARD_NACK_NA) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_ACK));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_ACK));
 					break;
 				}
 				
 				// read block
 				if (len == 4 && receivedCmd[0] == 0x30) {
-					if (receivedCmd[1] >= 16 * 4 || receivedCmd[1] / 4 != cardAUTHSC) {
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					if (receivedCmd[1] >= blocks || mf_sim_sector(receivedCmd[1]) != cardAUTHSC) {
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 						break;
 					}
 					emlGetMem(response, receivedCmd[1], 1);
 					AppendCrc14443a(response, 16);
-					mf_crypto1_encrypt(pcs, response, 18, &par);
+					mf_ks_encrypt(&ks, response, 18, &par);
+					ansTime = GetCountUS() - cmdTime;
 					EmSendCmdPar(response, 18, par);
+					if (ansTime > ansMax) ansMax = ansTime;
+					ansSum += ansTime;
+					ansCnt++;
 					break;
 				}
 				
 				// write block
 				if (len == 4 && receivedCmd[0] == 0xA0) {
-					if (receivedCmd[1] >= 16 * 4 || receivedCmd[1] / 4 != cardAUTHSC) {
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					if (receivedCmd[1] >= blocks || mf_sim_sector(receivedCmd[1]) != cardAUTHSC) {
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 						break;
 					}
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_ACK));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_ACK));
 					//nextCycleTimeout = 50;
 					cardSTATE = MFEMUL_WRITEBL2;
 					cardWRBL = receivedCmd[1];
@@ -2261,13 +2771,13 @@ lbWORK:	if (len == 0) break;
 				
 				// increment, decrement, restore
 				if (len == 4 && (receivedCmd[0] == 0xC0 || receivedCmd[0] == 0xC1 || receivedCmd[0] == 0xC2)) {
-					if (receivedCmd[1] >= 16 * 4 || 
-							receivedCmd[1] / 4 != cardAUTHSC || 
+					if (receivedCmd[1] >= blocks || 
+							mf_sim_sector(receivedCmd[1]) != cardAUTHSC || 
 							emlCheckValBl(receivedCmd[1])) {
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 						break;
 					}
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_ACK));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_ACK));
 					if (receivedCmd[0] == 0xC1)
 						cardSTATE = MFEMUL_INTREG_INC;
 					if (receivedCmd[0] == 0xC0)
@@ -2282,15 +2792,15 @@ lbWORK:	if (len == 0) break;
 
 				// transfer
 				if (len == 4 && receivedCmd[0] == 0xB0) {
-					if (receivedCmd[1] >= 16 * 4 || receivedCmd[1] / 4 != cardAUTHSC) {
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					if (receivedCmd[1] >= blocks || mf_sim_sector(receivedCmd[1]) != cardAUTHSC) {
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 						break;
 					}
 					
 					if (emlSetValBl(cardINTREG, cardINTBLOCK, receivedCmd[1]))
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					else
-						EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_ACK));
+						EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_ACK));
 						
 					break;
 				}
@@ -2306,7 +2816,7 @@ lbWORK:	if (len == 0) break;
 				
 				// command not allowed
 				if (len == 4) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					break;
 				}
 
@@ -2315,9 +2825,9 @@ lbWORK:	if (len == 0) break;
 			}
 			case MFEMUL_WRITEBL2:{
 				if (len == 18){
-					mf_crypto1_decrypt(pcs, receivedCmd, len);
+					mf_ks_decrypt(&ks, receivedCmd, len);
 					emlSetMem(receivedCmd, cardWRBL, 1);
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_ACK));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_ACK));
 					cardSTATE = MFEMUL_WORK;
 					break;
 				} else {
@@ -2328,10 +2838,10 @@ lbWORK:	if (len == 0) break;
 			}
 			
 			case MFEMUL_INTREG_INC:{
-				mf_crypto1_decrypt(pcs, receivedCmd, len);
+				mf_ks_decrypt(&ks, receivedCmd, len);
 				memcpy(&ans, receivedCmd, 4);
 				if (emlGetValBl(&cardINTREG, &cardINTBLOCK, cardWRBL)) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					cardSTATE_TO_IDLE();
 					break;
 				}
@@ -2340,10 +2850,10 @@ lbWORK:	if (len == 0) break;
 				break;
 			}
 			case MFEMUL_INTREG_DEC:{
-				mf_crypto1_decrypt(pcs, receivedCmd, len);
+				mf_ks_decrypt(&ks, receivedCmd, len);
 				memcpy(&ans, receivedCmd, 4);
 				if (emlGetValBl(&cardINTREG, &cardINTBLOCK, cardWRBL)) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					cardSTATE_TO_IDLE();
 					break;
 				}
@@ -2352,10 +2862,10 @@ lbWORK:	if (len == 0) break;
 				break;
 			}
 			case MFEMUL_INTREG_REST:{
-				mf_crypto1_decrypt(pcs, receivedCmd, len);
+				mf_ks_decrypt(&ks, receivedCmd, len);
 				memcpy(&ans, receivedCmd, 4);
 				if (emlGetValBl(&cardINTREG, &cardINTBLOCK, cardWRBL)) {
-					EmSend4bit(mf_crypto1_encrypt4bit(pcs, CARD_NACK_NA));
+					EmSend4bit(mf_ks_encrypt4bit(&ks, CARD_NACK_NA));
 					cardSTATE_TO_IDLE();
 					break;
 				}
@@ -2373,6 +2883,162 @@ lbWORK:	if (len == 0) break;
 	LogTrace(rAUTH_NT, 4, 0, 0, TRUE);
 
 	if (MF_DBGLEVEL >= 1)	Dbprintf("Emulator stopped. Tracing: %d  trace length: %d ",	tracing, traceLen);
+	if (MF_DBGLEVEL >= 1 && ansCnt)	Dbprintf("Read answers: %d, ready %d us after the command on average, %d us at most", ansCnt, ansSum / ansCnt, ansMax);
+}
+
+//-----------------------------------------------------------------------------
+// MIFARE DESFire card simulation from the image at DESFIRE_SIM_IMAGE
+// (desfiresim.c). Anticollision as a 7 byte UID card with SAK 0x20, then
+// every frame goes to the card; answers that depend on the image only are
+// modulated before the field comes up, the others as they are known.
+//-----------------------------------------------------------------------------
+void MifareDESSim(uint32_t length)
+{
+	desfire_sim_t *sim = (desfire_sim_t *)((uint8_t *)BigBuf + DESFIRE_SIM_STATE);
+	uint8_t *image = (uint8_t *)BigBuf + DESFIRE_SIM_IMAGE;
+	uint8_t *receivedCmd = (uint8_t *)BigBuf + RECV_CMD_OFFSET;
+	uint8_t *response = (uint8_t *)BigBuf + RECV_RES_OFFSET;
+	uint8_t *modulation = (uint8_t *)BigBuf + DESFIRE_SIM_MODULATION;
+	int cardSTATE = MFEMUL_NOFIELD;
+	int vHf, res, len = 0, respLen, i, n, nstatic;
+	int modLeft = DESFIRE_SIM_MODULATION_SIZE;
+
+	static uint8_t rATQA[] = {0x44, 0x03};
+	static uint8_t rUIDBCC1[5];
+	static uint8_t rUIDBCC2[5];
+	static uint8_t rSAK1[] = {0x04, 0x00, 0x00};   // UID not complete
+	static uint8_t rSAK2[] = {0x20, 0x00, 0x00};
+
+	static uint8_t frames[10][24];
+	em_prepared_t statics[10];
+
+	traceLen = 0;
+	tracing = true;
+
+	if (length > DESFIRE_SIM_IMAGE_MAX || desfire_sim_init(sim, image, length, GetTickCount())) {
+		Dbprintf("No DESFire image loaded");
+		return;
+	}
+	rUIDBCC1[0] = 0x88;
+	memcpy(&rUIDBCC1[1], ((desfire_sim_header_t *)image)->uid, 3);
+	memcpy(rUIDBCC2, ((desfire_sim_header_t *)image)->uid + 3, 4);
+	rUIDBCC1[4] = rUIDBCC1[0] ^ rUIDBCC1[1] ^ rUIDBCC1[2] ^ rUIDBCC1[3];
+	rUIDBCC2[4] = rUIDBCC2[0] ^ rUIDBCC2[1] ^ rUIDBCC2[2] ^ rUIDBCC2[3];
+	AppendCrc14443a(rSAK1, 1);
+	AppendCrc14443a(rSAK2, 1);
+
+	// there is no time for the modulation of these once the reader asks
+	for (nstatic = 0; nstatic < (int)(sizeof(statics) / sizeof(statics[0])); nstatic++) {
+		n = desfire_sim_static(sim, nstatic, frames[nstatic]);
+		if (n == 0 || n > (int)sizeof(frames[nstatic]))
+			break;
+		if (EmPrepareCmd(&statics[nstatic], frames[nstatic], n, &modulation, &modLeft))
+			break;
+	}
+
+	StartCountUS();
+
+	// We need to listen to the high-frequency, peak-detected path.
+	SetAdcMuxFor(GPIO_MUXSEL_HIPKD);
+	FpgaSetupSsc();
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_HF_ISO14443A | FPGA_HF_ISO14443A_TAGSIM_LISTEN);
+	SpinDelay(200);
+
+	Dbprintf("DESFire simulation: %d byte image, %d answers prepared", length, nstatic);
+	GetDeltaCountUS();
+	while (true) {
+		WDT_HIT();
+
+		if(BUTTON_PRESS()) {
+			break;
+		}
+
+		// find reader field
+		if (cardSTATE == MFEMUL_NOFIELD) {
+			vHf = (33000 * AvgAdc(ADC_CHAN_HF)) >> 10;
+			if (vHf > MF_MINFIELDV) {
+				cardSTATE_TO_IDLE();
+				LED_A_ON();
+			}
+			continue;
+		}
+
+		res = EmGetCmd(receivedCmd, &len, RECV_CMD_SIZE, NULL, 0);
+		if (res == 2) {
+			cardSTATE = MFEMUL_NOFIELD;
+			desfire_sim_halt(sim);
+			LEDsoff();
+			continue;
+		}
+		if(res) break;
+
+		// REQ or WUP request in any state but HALTED, where only WUP wakes
+		if (len == 1 && ((receivedCmd[0] == 0x26 && cardSTATE != MFEMUL_HALTED) || receivedCmd[0] == 0x52)) {
+			EmSendCmdEx(rATQA, sizeof(rATQA), (receivedCmd[0] == 0x52));
+			desfire_sim_halt(sim);
+			cardSTATE = MFEMUL_SELECT1;
+			LED_B_OFF();
+			continue;
+		}
+
+		switch (cardSTATE) {
+			case MFEMUL_SELECT1:
+				if (len == 2 && receivedCmd[0] == 0x93 && receivedCmd[1] == 0x20)
+					EmSendCmd(rUIDBCC1, sizeof(rUIDBCC1));
+				else if (len == 9 && receivedCmd[0] == 0x93 && receivedCmd[1] == 0x70 && memcmp(&receivedCmd[2], rUIDBCC1, 4) == 0) {
+					EmSendCmd(rSAK1, sizeof(rSAK1));
+					cardSTATE = MFEMUL_SELECT2;
+				} else
+					cardSTATE_TO_IDLE();
+				break;
+
+			case MFEMUL_SELECT2:
+				if (len == 2 && receivedCmd[0] == 0x95 && receivedCmd[1] == 0x20)
+					EmSendCmd(rUIDBCC2, sizeof(rUIDBCC2));
+				else if (len == 9 && receivedCmd[0] == 0x95 && receivedCmd[1] == 0x70 && memcmp(&receivedCmd[2], rUIDBCC2, 4) == 0) {
+					EmSendCmd(rSAK2, sizeof(rSAK2));
+					cardSTATE = MFEMUL_WORK;
+					LED_B_ON();
+				} else
+					cardSTATE_TO_IDLE();
+				break;
+
+			case MFEMUL_WORK:
+				// HLTA before RATS
+				if (len == 4 && receivedCmd[0] == 0x50 && receivedCmd[1] == 0x00 && !sim->active) {
+					cardSTATE = MFEMUL_HALTED;
+					LED_B_OFF();
+					break;
+				}
+				respLen = desfire_sim_frame(sim, receivedCmd, len, response);
+				if (respLen == 0)
+					break;
+
+				for (i = 0; i < nstatic; i++)
+					if (statics[i].respLen == respLen && memcmp(statics[i].resp, response, respLen) == 0)
+						break;
+				if (i < nstatic)
+					EmSendPrepared(&statics[i], 0);
+				else
+					EmSendCmd(response, respLen);
+
+				// S(DESELECT) ends the ISO14443-4 session
+				if (!sim->active) {
+					cardSTATE = MFEMUL_HALTED;
+					LED_B_OFF();
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+
+	Dbprintf("DESFire simulation stopped: %d native commands, trace length %d", sim->commands, traceLen);
 }
 
 //-----------------------------------------------------------------------------
@@ -2441,13 +3107,6 @@ void RAMFUNC SniffMifare(uint8_t param) {
 		LED_A_ON();
 		WDT_HIT();
 		
-		if (++sniffCounter > 65) {
-			if (MfSniffSend(2000)) {
-				FpgaEnableSscDma();
-			}
-			sniffCounter = 0;
-		}
-
 		int register readBufDataP = data - dmaBuf;
 		int register dmaBufDataP = DMA_BUFFER_SIZE - AT91C_BASE_PDC_SSC->PDC_RCR;
 		if (readBufDataP <= dmaBufDataP){
@@ -2455,6 +3114,14 @@ void RAMFUNC SniffMifare(uint8_t param) {
 		} else {
 			dataLen = DMA_BUFFER_SIZE - readBufDataP + dmaBufDataP + 1;
 		}
+
+		// the trace goes out while the DMA keeps sampling, a packet at a
+		// time and only with the samples read up
+		if (++sniffCounter > 65 && dataLen < 100) {
+			MfSniffSend();
+			sniffCounter = 0;
+			continue;
+		}
 		// test for length of buffer
 		if(dataLen > maxDataLen) {
 			maxDataLen = dataLen;
@@ -17,10 +17,22 @@
 
 // mifare reader                      over DMA buffer (SnoopIso14443a())!!!
 #define MIFARE_BUFF_OFFSET 3560  //              \/   \/   \/
-// card emulator memory
+// card emulator memory, CARD_MEMORY in common.h
 #define EML_RESPONSES      4000
-#define CARD_MEMORY        6000
-#define CARD_MEMORY_LEN    4096
+// DESFire simulator: answers modulated in advance over the DMA buffer up to
+// the card emulator memory, the card's state and its image
+// (DESFIRE_SIM_IMAGE_MAX) behind the card emulator memory
+#define DESFIRE_SIM_MODULATION      DMA_BUFFER_OFFSET
+#define DESFIRE_SIM_MODULATION_SIZE (CARD_MEMORY - DESFIRE_SIM_MODULATION)
+#define DESFIRE_SIM_STATE      10240
+#define DESFIRE_SIM_IMAGE      12288
+// batched APDUs: the frames sent and received over the DMA buffer, clear of
+// a trace running over its end by a frame, the queue and the answers
+// (ISO14A_APDU_QUEUE, ISO14A_APDU_ANSWERS) over the DESFire simulator's image
+#define ISO14A_APDU_FRAMES     (DMA_BUFFER_OFFSET + 1024)
+// DESFire reader: the session and the chained answers for the host behind
+// the batched APDUs' answers and the end of the simulator's image
+#define DESFIRE_READER_DATA    (ISO14A_APDU_ANSWERS + ISO14A_APDU_ANSWERS_SIZE)
 
 typedef struct nestedVector { uint32_t nt, ks1; } nestedVector;
 
@@ -85,12 +97,17 @@ extern void AppendCrc14443a(uint8_t* data, int len);
 extern void ReaderTransmitShort(const uint8_t* bt);
 extern void ReaderTransmit(uint8_t* frame, int len);
 extern void ReaderTransmitPar(uint8_t* frame, int len, uint32_t par);
+extern void ReaderTransmitBitsPar(uint8_t* frame, int bits, uint32_t par);
 extern int ReaderReceive(uint8_t* receivedAnswer);
 extern int ReaderReceivePar(uint8_t* receivedAnswer, uint32_t * parptr);
 
 extern void iso14443a_setup();
 extern int iso14_apdu(uint8_t * cmd, size_t cmd_len, void * data);
+extern int iso14_apdu_exchange(const uint8_t * apdu, int len, uint8_t * answer, int max);
 extern int iso14443a_select_card(uint8_t * uid_ptr, iso14a_card_select_t * resp_data, uint32_t * cuid_ptr);
+extern int iso14443a_reselect_card(void);
+extern int iso14443a_inventory(iso14a_inventory_t * cards, int max);
+extern void iso14_use_cid(int cid);
 extern void iso14a_set_trigger(int enable);
 extern void iso14a_set_timeout(uint32_t timeout);
 
@@ -4,7 +4,7 @@
 // the license.
 //-----------------------------------------------------------------------------
 // Miscellaneous routines for low frequency tag operations.
-// Tags supported here so far are Texas Instruments (TI), HID
+// Tags supported here so far are Texas Instruments (TI), HID, EM410x
 // Also routines for raw mode reading/simulating of LF waveform
 //-----------------------------------------------------------------------------
 
@@ -788,6 +788,224 @@ void CmdHIDdemodFSK(int findone, int *high, int *low, int ledcontrol)
 	}
 }
 
+/*------------------------------
+ * EM410x on-device demodulator
+ *------------------------------
+ */
+
+// three frames of 64 bits at RF/64, so one full frame is always in view
+#define EM410X_CAPTURE_LEN	(3*64*64)
+#define EM410X_INVALID		2
+
+static void EM410xCapture(uint8_t *dest, int n, int ledcontrol)
+{
+	int i = 0;
+
+	for(;;) {
+		if(AT91C_BASE_SSC->SSC_SR & (AT91C_SSC_TXRDY)) {
+			AT91C_BASE_SSC->SSC_THR = 0x43;
+			if (ledcontrol)
+				LED_D_ON();
+		}
+		if(AT91C_BASE_SSC->SSC_SR & (AT91C_SSC_RXRDY)) {
+			dest[i++] = (uint8_t)AT91C_BASE_SSC->SSC_RHR;
+			if (ledcontrol)
+				LED_D_OFF();
+			if(i >= n)
+				break;
+		}
+	}
+}
+
+// slice the samples to 0/1 in place, with hysteresis between a quarter and
+// three quarters of the captured swing. Returns 0 if there's no signal.
+static int EM410xSlice(uint8_t *samples, int n)
+{
+	int i, low = 255, high = 0, upper, lower, state;
+
+	for (i = 0; i < n; i++) {
+		if (samples[i] < low) low = samples[i];
+		if (samples[i] > high) high = samples[i];
+	}
+	if (high - low < 16)
+		return 0;
+
+	upper = low + 3 * (high - low) / 4;
+	lower = low + (high - low) / 4;
+	state = samples[0] >= upper;
+	for (i = 0; i < n; i++) {
+		if (state && samples[i] <= lower)
+			state = 0;
+		else if (!state && samples[i] >= upper)
+			state = 1;
+		samples[i] = state;
+	}
+	return 1;
+}
+
+// Manchester decode a sliced capture at the given clock. Every run between
+// two transitions must last one or two half bits, anything else (and the
+// truncated first run) is marked invalid. Returns the number of bits.
+static int EM410xManchester(const uint8_t *sliced, int n, int clock, uint8_t *halfbits, int max_halfbits, uint8_t *bits)
+{
+	int half = clock / 2;
+	int i, k, run = 1, count = 0, units, phase, best = 0;
+
+	for (i = 1; i <= n && count < max_halfbits - 1; i++) {
+		if (i < n && sliced[i] == sliced[i-1]) {
+			run++;
+			continue;
+		}
+		units = (run + half / 2) / half;
+		if (count == 0 || units < 1 || units > 2) {
+			halfbits[count++] = EM410X_INVALID;
+		} else {
+			while (units--)
+				halfbits[count++] = sliced[i-1];
+		}
+		run = 1;
+	}
+
+	// bit boundaries are where the half bit pairs differ
+	for (phase = 0, k = 0; k < 2; k++) {
+		int good = 0;
+		for (i = k; i + 1 < count; i += 2)
+			if (halfbits[i] != EM410X_INVALID && halfbits[i+1] != EM410X_INVALID && halfbits[i] != halfbits[i+1])
+				good++;
+		if (good > best) {
+			best = good;
+			phase = k;
+		}
+	}
+
+	for (k = 0, i = phase; i + 1 < count; i += 2, k++) {
+		if (halfbits[i] == EM410X_INVALID || halfbits[i] == halfbits[i+1])
+			bits[k] = EM410X_INVALID;
+		else
+			bits[k] = halfbits[i];
+	}
+	return k;
+}
+
+// look for 9 header ones, 10 rows of 4 data bits plus even parity, 4 column
+// parity bits and a stop bit. Returns 1 and the 40 bit ID if found.
+static int EM410xFindFrame(const uint8_t *bits, int n, int invert, uint32_t *hi, uint32_t *lo)
+{
+	int start, i, row, col, bit, parity, column_parity[4];
+	uint32_t id_hi, id_lo;
+
+	#define EM410X_BIT(x) (bits[x] == EM410X_INVALID ? EM410X_INVALID : bits[x] ^ invert)
+
+	for (start = 0; start + 64 <= n; start++) {
+		for (i = 0; i < 9; i++)
+			if (EM410X_BIT(start + i) != 1)
+				break;
+		if (i < 9)
+			continue;
+
+		id_hi = id_lo = 0;
+		column_parity[0] = column_parity[1] = column_parity[2] = column_parity[3] = 0;
+		for (row = 0; row < 10; row++) {
+			i = start + 9 + row * 5;
+			parity = 0;
+			for (col = 0; col < 4; col++) {
+				bit = EM410X_BIT(i + col);
+				if (bit == EM410X_INVALID)
+					break;
+				parity ^= bit;
+				column_parity[col] ^= bit;
+				id_hi = (id_hi << 1) | (id_lo >> 31);
+				id_lo = (id_lo << 1) | bit;
+			}
+			if (col < 4 || EM410X_BIT(i + 4) != parity)
+				break;
+		}
+		if (row < 10)
+			continue;
+
+		i = start + 59;
+		for (col = 0; col < 4; col++)
+			if (EM410X_BIT(i + col) != column_parity[col])
+				break;
+		if (col < 4 || EM410X_BIT(i + 4) != 0)
+			continue;
+
+		*hi = id_hi;
+		*lo = id_lo;
+		return 1;
+	}
+
+	#undef EM410X_BIT
+	return 0;
+}
+
+// loop to capture raw EM410x waveform, Manchester demodulate it on the device
+// and send only the decoded tag IDs to the host
+void CmdEM410xdemod(int findone, int ledcontrol)
+{
+	static const int clocks[] = {64, 32};
+	uint8_t *dest = (uint8_t *)BigBuf;
+	uint8_t *halfbits = dest + EM410X_CAPTURE_LEN;
+	uint8_t *bits = halfbits + EM410X_CAPTURE_LEN / 4;
+	uint32_t hi = 0, lo = 0, reads = 0;
+	int i, m, found;
+	UsbCommand c;
+
+	FpgaSendCommand(FPGA_CMD_SET_DIVISOR, 95); //125Khz
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_LF_READER);
+
+	// Connect the A/D to the peak-detected low-frequency path.
+	SetAdcMuxFor(GPIO_MUXSEL_LOPKD);
+
+	// Give it a bit of time for the resonant antenna to settle.
+	SpinDelay(50);
+
+	// Now set up the SSC to get the ADC samples that are now streaming at us.
+	FpgaSetupSsc();
+
+	StartTickCount();
+
+	for(;;) {
+		WDT_HIT();
+		if (ledcontrol)
+			LED_A_ON();
+		if(BUTTON_PRESS()) {
+			Dbprintf("Stopped after %d reads", reads);
+			if (ledcontrol)
+				LED_A_OFF();
+			return;
+		}
+
+		EM410xCapture(dest, EM410X_CAPTURE_LEN, ledcontrol);
+		if (!EM410xSlice(dest, EM410X_CAPTURE_LEN))
+			continue;
+
+		found = 0;
+		for (i = 0; i < sizeof(clocks) / sizeof(clocks[0]) && !found; i++) {
+			m = EM410xManchester(dest, EM410X_CAPTURE_LEN, clocks[i], halfbits, EM410X_CAPTURE_LEN / 4, bits);
+			found = EM410xFindFrame(bits, m, 0, &hi, &lo) || EM410xFindFrame(bits, m, 1, &hi, &lo);
+		}
+		WDT_HIT();
+		if (!found)
+			continue;
+
+		reads++;
+		c.cmd = CMD_EM410X_DEMODED_ID;
+		c.arg[0] = hi;
+		c.arg[1] = lo;
+		c.arg[2] = reads;
+		c.d.asDwords[0] = GetTickCount();
+		c.d.asDwords[1] = clocks[i-1];
+		UsbSendPacket((uint8_t *)&c, sizeof(c));
+
+		if (findone) {
+			if (ledcontrol)
+				LED_A_OFF();
+			return;
+		}
+	}
+}
+
 /*------------------------------
  * T5555/T5557/T5567 routines
  *------------------------------
@@ -590,6 +590,294 @@ void MifareChkKeys(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
 }
 
+// first block of a sector, Mini to 4K
+static uint8_t chk_first_block(int sector)
+{
+	return sector < 32 ? sector * 4 : 128 + (sector - 32) * 16;
+}
+
+// select the card again after a failed authentication or a HALT, and if it
+// does not answer its WUPA once more after a field reset
+static int chk_reselect(uint32_t *cuid)
+{
+	uint8_t uid[8];
+
+	if (iso14443a_reselect_card()) return 1;
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	SpinDelay(100);
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_HF_ISO14443A | FPGA_HF_ISO14443A_READER_MOD);
+	return iso14443a_select_card(uid, NULL, cuid) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// MIFARE check keys, fast: a dictionary from BigBuf on all sectors in one go,
+// see CMD_MIFARE_CHKKEYS_FAST. A wrong key leaves the card idle, so it is
+// woken by WUPA and selected by its UID again instead of a field reset, and
+// a card answers in far less than the default timeout. Keys found on the
+// card are tried first on the sectors that follow.
+//-----------------------------------------------------------------------------
+void MifareChkKeysFast(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain)
+{
+	uint8_t *keys = ((uint8_t *)BigBuf) + MF_CHK_KEYS;
+	mf_chk_key_t *table = (mf_chk_key_t *)(((uint8_t *)BigBuf) + MF_CHK_TABLE);
+	int keyCount = arg2 & 0xffff;
+	int sectors = arg2 >> 16 & 0xff;
+	UsbCommand ack = {CMD_ACK, {MF_CHK_OK, 0, 0}};
+
+	// variables
+	int s, t, i, j, k, res;
+	uint8_t uid[8];
+	uint32_t cuid, start, tried = 0;
+	uint8_t *key;
+	struct Crypto1State mpcs = {0, 0};
+	struct Crypto1State *pcs;
+	pcs = &mpcs;
+
+	if (arg1 > 8 || arg0 > MF_CHK_MAX_KEYS - arg1) return;
+	memcpy(keys + arg0 * 6, datain, arg1 * 6);
+	if (!(arg2 & MF_CHK_RUN)) return;
+
+	if (keyCount > MF_CHK_MAX_KEYS) keyCount = MF_CHK_MAX_KEYS;
+	if (sectors > MF_CHK_MAX_SECTORS) sectors = MF_CHK_MAX_SECTORS;
+	if (arg2 & MF_CHK_CLEAR) memset(table, 0, MF_CHK_MAX_SECTORS * 2 * sizeof(mf_chk_key_t));
+
+	// clear debug level
+	int OLD_MF_DBGLEVEL = MF_DBGLEVEL;	
+	MF_DBGLEVEL = MF_DBG_NONE;
+
+	iso14a_clear_trace();
+	iso14a_set_tracing(TRUE);
+
+	iso14443a_setup();
+
+	LED_A_ON();
+	LED_B_OFF();
+	LED_C_OFF();
+	start = GetTickCount();
+
+	if (!iso14443a_select_card(uid, NULL, &cuid)) {
+		ack.arg[0] = MF_CHK_NO_CARD;
+		goto done;
+	}
+	// about 2 ms, twenty times what a card takes to answer
+	iso14a_set_timeout(212);
+
+	for (s = 0; s < sectors; s++) {
+		for (t = 0; t < 2; t++) {
+			if (!(arg2 & (t ? MF_CHK_KEY_B : MF_CHK_KEY_A)) || table[s * 2 + t].found)
+				continue;
+
+			// the keys found on the card, once each, then the dictionary
+			for (i = 0; i < sectors * 2 + keyCount && !table[s * 2 + t].found; i++) {
+				if (i < sectors * 2) {
+					if (!table[i].found) continue;
+					for (j = 0; j < i; j++)
+						if (table[j].found && !memcmp(table[j].key, table[i].key, 6)) break;
+					if (j < i) continue;
+					key = table[i].key;
+				} else {
+					key = keys + (i - sectors * 2) * 6;
+				}
+
+				if (BUTTON_PRESS()) {
+					ack.arg[0] = MF_CHK_ABORTED;
+					goto done;
+				}
+				// a card not answering at all gets another chance
+				for (k = 0; k < 2; k++) {
+					res = mifare_classic_auth(pcs, cuid, chk_first_block(s), t, bytes_to_num(key, 6), AUTH_FIRST);
+					tried++;
+					if (res == 0) {
+						table[s * 2 + t].found = 1;
+						memcpy(table[s * 2 + t].key, key, 6);
+						mifare_classic_halt(pcs, cuid);
+					}
+					if (!chk_reselect(&cuid)) {
+						ack.arg[0] = MF_CHK_NO_CARD;
+						goto done;
+					}
+					if (res != 1) break;
+				}
+			}
+		}
+	}
+
+done:
+	ack.arg[1] = tried;
+	ack.arg[2] = GetTickCount() - start;
+
+	//  ----------------------------- crypto1 destroy
+	crypto1_destroy(pcs);
+
+	LED_B_ON();
+	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	LED_B_OFF();
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+
+	// restore debug level
+	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
+}
+
+// the card in MifareDump()
+#define DUMP_IDLE    0  // after a failed command, to be woken
+#define DUMP_ACTIVE  1  // selected
+#define DUMP_AUTH    2  // in an authenticated session
+
+// authenticate for a block, nested if there is a session, returns 0 if done,
+// 1 if the key is wrong, -1 if the card is gone
+static int dump_auth(struct Crypto1State *pcs, uint32_t *cuid, int *state, uint8_t blockNo, int keyType, mf_chk_key_t *key)
+{
+	if (*state == DUMP_AUTH) {
+		if (!mifare_classic_auth(pcs, *cuid, blockNo, keyType, bytes_to_num(key->key, 6), AUTH_NESTED))
+			return 0;
+		*state = DUMP_IDLE;
+	}
+	if (*state == DUMP_IDLE) {
+		if (!chk_reselect(cuid)) return -1;
+		*state = DUMP_ACTIVE;
+	}
+	if (mifare_classic_auth(pcs, *cuid, blockNo, keyType, bytes_to_num(key->key, 6), AUTH_FIRST)) {
+		*state = DUMP_IDLE;
+		return 1;
+	}
+	*state = DUMP_AUTH;
+	return 0;
+}
+
+// the access conditions C1 C2 C3 of a block of the sector as 0 to 7
+static int dump_access(uint8_t *trailer, int block, int blocks)
+{
+	int group = blocks == 4 ? block : (block == 15 ? 3 : block / 5);
+
+	return (trailer[7] >> (4 + group) & 1) | (trailer[8] >> group & 1) << 1 | (trailer[8] >> (4 + group) & 1) << 2;
+}
+
+//-----------------------------------------------------------------------------
+// MIFARE dump: every sector read in one authenticated session, the next one
+// authenticated nested in it, see CMD_MIFARE_DUMP. The trailer comes first
+// and tells which blocks need key B; blocks no key may read stay zero.
+//-----------------------------------------------------------------------------
+void MifareDump(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain)
+{
+	mf_chk_key_t *table = (mf_chk_key_t *)(((uint8_t *)BigBuf) + MF_CHK_TABLE);
+	uint8_t *data = ((uint8_t *)BigBuf) + MF_DUMP_DATA;
+	int sectors = arg2 & 0xff;
+	UsbCommand ack = {CMD_ACK, {MF_CHK_OK, 0, 0}};
+
+	// variables
+	int s, b, blocks, first, keyType, state, res, access, read;
+	uint8_t uid[8], trailer[16];
+	uint32_t cuid, start;
+	struct Crypto1State mpcs = {0, 0};
+	struct Crypto1State *pcs;
+	pcs = &mpcs;
+
+	if (arg1 > 48 || arg0 > MF_CHK_MAX_SECTORS * 2 * sizeof(mf_chk_key_t) - arg1) return;
+	memcpy((uint8_t *)table + arg0, datain, arg1);
+	if (!(arg2 & MF_DUMP_RUN)) return;
+	if (sectors > MF_CHK_MAX_SECTORS) sectors = MF_CHK_MAX_SECTORS;
+
+	// clear debug level
+	int OLD_MF_DBGLEVEL = MF_DBGLEVEL;	
+	MF_DBGLEVEL = MF_DBG_NONE;
+
+	iso14a_clear_trace();
+	iso14a_set_tracing(TRUE);
+
+	iso14443a_setup();
+
+	LED_A_ON();
+	LED_B_OFF();
+	LED_C_OFF();
+	start = GetTickCount();
+
+	memset(data, 0, 4096);
+	if (!iso14443a_select_card(uid, NULL, &cuid)) {
+		ack.arg[0] = MF_CHK_NO_CARD;
+		goto done;
+	}
+	state = DUMP_ACTIVE;
+
+	for (s = 0; s < sectors; s++) {
+		if (BUTTON_PRESS()) {
+			ack.arg[0] = MF_CHK_ABORTED;
+			goto done;
+		}
+		first = chk_first_block(s);
+		blocks = s < 32 ? 4 : 16;
+		ack.d.asBytes[s] = MF_DUMP_SECTOR_NONE;
+		ack.arg[1] = s + 1;
+
+		// key A if there is one, else key B
+		res = 1;
+		for (keyType = 0; keyType < 2 && res; keyType++) {
+			if (!table[s * 2 + keyType].found) continue;
+			res = dump_auth(pcs, &cuid, &state, first, keyType, &table[s * 2 + keyType]);
+			if (res < 0) {
+				ack.arg[0] = MF_CHK_NO_CARD;
+				goto done;
+			}
+		}
+		if (res) continue;
+		keyType--;
+		ack.d.asBytes[s] = MF_DUMP_SECTOR_PARTIAL;
+
+		// without the trailer all blocks are tried with the key
+		read = 0;
+		if (mifare_classic_readblock(pcs, cuid, first + blocks - 1, trailer)) {
+			state = DUMP_IDLE;
+			memset(trailer, 0, sizeof(trailer));
+			if (dump_auth(pcs, &cuid, &state, first, keyType, &table[s * 2 + keyType])) continue;
+		} else {
+			memcpy(data + (first + blocks - 1) * 16, trailer, 16);
+			read++;
+		}
+
+		for (b = 0; b < blocks - 1; b++) {
+			access = dump_access(trailer, b, blocks);
+			if (access == 7) continue;
+			// C1 C2 C3 011 and 101 read with key B only
+			if ((access == 6 || access == 5) && keyType == 0) {
+				if (!table[s * 2 + 1].found) continue;
+				keyType = 1;
+				res = dump_auth(pcs, &cuid, &state, first, keyType, &table[s * 2 + 1]);
+				if (res < 0) {
+					ack.arg[0] = MF_CHK_NO_CARD;
+					goto done;
+				}
+				if (res) break;
+			}
+			if (mifare_classic_readblock(pcs, cuid, first + b, data + (first + b) * 16)) {
+				// the card stops answering after a refused read
+				state = DUMP_IDLE;
+				if (dump_auth(pcs, &cuid, &state, first, keyType, &table[s * 2 + keyType])) break;
+				continue;
+			}
+			read++;
+		}
+		if (read == blocks) ack.d.asBytes[s] = MF_DUMP_SECTOR_ALL;
+	}
+	if (state == DUMP_AUTH) mifare_classic_halt(pcs, cuid);
+
+done:
+	ack.arg[2] = GetTickCount() - start;
+
+	//  ----------------------------- crypto1 destroy
+	crypto1_destroy(pcs);
+
+	LED_B_ON();
+	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	LED_B_OFF();
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+
+	// restore debug level
+	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
+}
+
 //-----------------------------------------------------------------------------
 // MIFARE commands set debug level
 // 
@@ -621,14 +909,36 @@ void MifareEMemGet(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain)
 	LED_B_OFF();
 }
 
+void MifareEMemSetBulk(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain){
+	uint8_t* emCARD = ((uint8_t *)BigBuf) + CARD_MEMORY;
+	uint16_t crc = 0xffff;
+	uint32_t i, len = arg2 & 0xffff;
+
+	if (arg1 <= 48 && arg0 + arg1 <= CARD_MEMORY_LEN)
+		memcpy(emCARD + arg0, datain, arg1);
+	if (!(arg2 & MF_EML_CRC)) return;
+
+	if (len > CARD_MEMORY_LEN) len = CARD_MEMORY_LEN;
+	for (i = 0; i < len; i++)
+		crc = update_crc16(crc, emCARD[i]);
+
+	UsbCommand ack = {CMD_ACK, {crc, len, 0}};
+
+	LED_B_ON();
+	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	LED_B_OFF();
+}
+
 //-----------------------------------------------------------------------------
 // Load a card into the emulator memory
 // 
 //-----------------------------------------------------------------------------
 void MifareECardLoad(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain){
-	int i;
+	int i = 0, j;
 	uint8_t sectorNo = 0;
+	uint8_t sectorsCnt = arg0 ? arg0 : 16;
 	uint8_t keyType = arg1;
+	uint8_t firstBlock, blocks;
 	uint64_t ui64Key = 0;
 	uint32_t cuid;
 	struct Crypto1State mpcs = {0, 0};
@@ -640,6 +950,8 @@ void MifareECardLoad(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datai
 	byte_t dataoutbuf2[16];
 	uint8_t uid[8];
 
+	if (sectorsCnt > MF_CHK_MAX_SECTORS) sectorsCnt = MF_CHK_MAX_SECTORS;
+
 	// clear trace
 	iso14a_clear_trace();
 	iso14a_set_tracing(false);
@@ -656,48 +968,34 @@ void MifareECardLoad(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datai
 			break;
 		};
 		
-		for (i = 0; i < 16; i++) {
+		for (i = 0; i < sectorsCnt; i++) {
 			sectorNo = i;
+			firstBlock = chk_first_block(sectorNo);
+			blocks = sectorNo < 32 ? 4 : 16;
 			ui64Key = emlGetKey(sectorNo, keyType);
 	
-			if (!i){
-				if(mifare_classic_auth(pcs, cuid, sectorNo * 4, keyType, ui64Key, AUTH_FIRST)) {
-					if (MF_DBGLEVEL >= 1)	Dbprintf("Sector[%d]. Auth error", i);
-					break;
-				}
-			} else {
-				if(mifare_classic_auth(pcs, cuid, sectorNo * 4, keyType, ui64Key, AUTH_NESTED)) {
-					if (MF_DBGLEVEL >= 1)	Dbprintf("Sector[%d]. Auth nested error", i);
-					break;
-				}
+			if(mifare_classic_auth(pcs, cuid, firstBlock, keyType, ui64Key, i ? AUTH_NESTED : AUTH_FIRST)) {
+				if (MF_DBGLEVEL >= 1)	Dbprintf("Sector[%d]. Auth error", i);
+				break;
 			}
 		
-			if(mifare_classic_readblock(pcs, cuid, sectorNo * 4 + 0, dataoutbuf)) {
-				if (MF_DBGLEVEL >= 1)	Dbprintf("Read block 0 error");
-				break;
-			};
-			emlSetMem(dataoutbuf, sectorNo * 4 + 0, 1);
-			
-			if(mifare_classic_readblock(pcs, cuid, sectorNo * 4 + 1, dataoutbuf)) {
-				if (MF_DBGLEVEL >= 1)	Dbprintf("Read block 1 error");
-				break;
-			};
-			emlSetMem(dataoutbuf, sectorNo * 4 + 1, 1);
-
-			if(mifare_classic_readblock(pcs, cuid, sectorNo * 4 + 2, dataoutbuf)) {
-				if (MF_DBGLEVEL >= 1)	Dbprintf("Read block 2 error");
-				break;
-			};
-			emlSetMem(dataoutbuf, sectorNo * 4 + 2, 1);
+			for (j = 0; j < blocks - 1; j++) {
+				if(mifare_classic_readblock(pcs, cuid, firstBlock + j, dataoutbuf)) {
+					if (MF_DBGLEVEL >= 1)	Dbprintf("Read block %d error", j);
+					break;
+				};
+				emlSetMem(dataoutbuf, firstBlock + j, 1);
+			}
+			if (j < blocks - 1) break;
 
-			// get block 3 bytes 6-9
-			if(mifare_classic_readblock(pcs, cuid, sectorNo * 4 + 3, dataoutbuf)) {
-				if (MF_DBGLEVEL >= 1)	Dbprintf("Read block 3 error");
+			// get trailer bytes 6-9
+			if(mifare_classic_readblock(pcs, cuid, firstBlock + j, dataoutbuf)) {
+				if (MF_DBGLEVEL >= 1)	Dbprintf("Read trailer error");
 				break;
 			};
-			emlGetMem(dataoutbuf2, sectorNo * 4 + 3, 1);
+			emlGetMem(dataoutbuf2, firstBlock + j, 1);
 			memcpy(&dataoutbuf2[6], &dataoutbuf[6], 4);
-			emlSetMem(dataoutbuf2,  sectorNo * 4 + 3, 1);
+			emlSetMem(dataoutbuf2, firstBlock + j, 1);
 		}
 
 		if(mifare_classic_halt(pcs, cuid)) {
@@ -716,6 +1014,12 @@ void MifareECardLoad(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datai
 	
 	if (MF_DBGLEVEL >= 2) DbpString("EMUL FILL SECTORS FINISHED");
 
+	// the sectors filled
+	UsbCommand ack = {CMD_ACK, {i, 0, 0}};
+	LED_B_ON();
+	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	LED_B_OFF();
+
 	// add trace trailer
 	memset(uid, 0x44, 4);
 	LogTrace(uid, 4, 0, 0, TRUE);
@@ -956,3 +1260,134 @@ void MifareCGetBlock(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datai
 	}
 }
 
+// the backdoor of a magic card, 0 if it opened
+static int magic_wakeup(uint8_t *receivedAnswer) {
+	uint8_t wupC1[]       = { 0x40 }; 
+	uint8_t wupC2[]       = { 0x43 }; 
+
+	ReaderTransmitShort(wupC1);
+	if(!ReaderReceive(receivedAnswer) || (receivedAnswer[0] != 0x0a)) return 1;
+
+	ReaderTransmit(wupC2, sizeof(wupC2));
+	if(!ReaderReceive(receivedAnswer) || (receivedAnswer[0] != 0x0a)) return 1;
+	return 0;
+}
+
+// a block written in the backdoor session, 0 if the card took it
+static int magic_write(uint8_t blockNo, uint8_t *data, uint8_t *receivedAnswer) {
+	uint8_t d_block[18];
+
+	if ((mifare_sendcmd_short(NULL, 0, 0xA0, blockNo, receivedAnswer) != 1) || (receivedAnswer[0] != 0x0a)) return 1;
+
+	memcpy(d_block, data, 16);
+	AppendCrc14443a(d_block, 16);
+	ReaderTransmit(d_block, sizeof(d_block));
+	if ((ReaderReceive(receivedAnswer) != 1) || (receivedAnswer[0] != 0x0a)) return 1;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Write the emulator memory to a "magic Chinese" card and read it back, all
+// in one backdoor session, see CMD_MIFARE_CLONE_MAGIC.
+//-----------------------------------------------------------------------------
+void MifareCClone(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint8_t *datain){
+	int blocks = arg0 ? arg0 : 64;
+	UsbCommand ack = {CMD_ACK, {MF_CHK_OK, 0, 0}};
+
+	// card commands
+	uint8_t wupC1[]       = { 0x40 }; 
+	uint8_t wipeC[]       = { 0x41 }; 
+
+	// variables
+	int b;
+	uint8_t data[16];
+	uint32_t start, msWrite = 0;
+	uint8_t* receivedAnswer = mifare_get_bigbufptr();
+
+	if (blocks > 256) blocks = 256;
+
+	// clear debug level
+	int OLD_MF_DBGLEVEL = MF_DBGLEVEL;	
+	MF_DBGLEVEL = MF_DBG_NONE;
+
+	iso14a_clear_trace();
+	iso14a_set_tracing(TRUE);
+
+	iso14443a_setup();
+
+	LED_A_ON();
+	LED_B_OFF();
+	LED_C_OFF();
+	start = GetTickCount();
+
+	if (arg1 & MF_CLONE_WIPE) {
+		ReaderTransmitShort(wupC1);
+		if(!ReaderReceive(receivedAnswer) || (receivedAnswer[0] != 0x0a)) {
+			ack.arg[0] = MF_CHK_NO_CARD;
+			goto done;
+		}
+		ReaderTransmit(wipeC, sizeof(wipeC));
+		if(!ReaderReceive(receivedAnswer) || (receivedAnswer[0] != 0x0a)) {
+			ack.arg[0] = MF_CLONE_WRITE_ERROR;
+			goto done;
+		}
+		mifare_classic_halt(NULL, 0);
+	}
+
+	if (magic_wakeup(receivedAnswer)) {
+		ack.arg[0] = MF_CHK_NO_CARD;
+		goto done;
+	}
+
+	for (b = 0; b < blocks; b++) {
+		if (BUTTON_PRESS()) {
+			ack.arg[0] = MF_CHK_ABORTED;
+			ack.arg[1] = b;
+			goto done;
+		}
+		WDT_HIT();
+
+		emlGetMem(data, b, 1);
+		if (magic_write(b, data, receivedAnswer)) {
+			// the card leaves the session on a refused block, once more in a new one
+			mifare_classic_halt(NULL, 0);
+			if (magic_wakeup(receivedAnswer) || magic_write(b, data, receivedAnswer)) {
+				ack.arg[0] = MF_CLONE_WRITE_ERROR;
+				ack.arg[1] = b;
+				goto done;
+			}
+		}
+	}
+	msWrite = GetTickCount() - start;
+	LED_C_ON();
+
+	// read back, the backdoor session still open
+	for (b = 0; b < blocks; b++) {
+		WDT_HIT();
+		emlGetMem(data, b, 1);
+		if ((mifare_sendcmd_short(NULL, 0, 0x30, b, receivedAnswer) != 18) || memcmp(receivedAnswer, data, 16)) {
+			ack.arg[0] = MF_CLONE_MISMATCH;
+			memcpy(ack.d.asBytes, receivedAnswer, 16);
+			break;
+		}
+	}
+	ack.arg[1] = b;
+	mifare_classic_halt(NULL, 0);
+
+done:
+	if (msWrite)
+		ack.arg[2] = (msWrite & 0xffff) | ((GetTickCount() - start - msWrite) & 0xffff) << 16;
+	else
+		ack.arg[2] = (GetTickCount() - start) & 0xffff;
+
+	LED_B_ON();
+	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	LED_B_OFF();
+
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+
+	// restore debug level
+	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
+}
+
@@ -19,6 +19,7 @@
 #include "string.h"
 
 #include "iso14443crc.h"
+#include "crc16.h"
 #include "iso14443a.h"
 #include "crapto1.h"
 #include "mifareutil.h"
@@ -19,6 +19,14 @@ static uint8_t sniffSAK;
 static uint8_t sniffBuf[16];
 static int timerData = 0;
 
+// the trace ring
+static uint8_t *sniffRing;
+static int sniffHalf;				// the half frames go to
+static int sniffLen[2];			// bytes in each half
+static int sniffSendHalf;		// the half being sent, -1 if none
+static int sniffSendPos;
+static uint32_t sniffPckNum;
+static uint32_t sniffLost;		// frames with both halves full
 
 int MfSniffInit(void){
 	rsamples = 0;
@@ -27,11 +35,23 @@ int MfSniffInit(void){
 	sniffSAK = 0;
 	sniffUIDType = SNF_UID_4;
 
+	sniffRing = ((uint8_t *)BigBuf) + SNF_RING_OFFSET;
+	sniffHalf = 0;
+	sniffLen[0] = sniffLen[1] = 0;
+	sniffSendHalf = -1;
+	sniffSendPos = 0;
+	sniffPckNum = 0;
+	sniffLost = 0;
+
 	return 0;
 }
 
 int MfSniffEnd(void){
-	UsbCommand ack = {CMD_ACK, {0, 0, 0}};
+	// what is left in both halves
+	while (sniffSendHalf >= 0 || sniffLen[sniffHalf])
+		intMfSniffSend();
+
+	UsbCommand ack = {CMD_MIFARE_SNIFF_DATA, {0, sniffLost, sniffPckNum}};
 
 	LED_B_ON();
 	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
@@ -40,6 +60,36 @@ int MfSniffEnd(void){
 	return 0;
 }
 
+// a frame into the ring, laid out like LogTrace() does
+static int RAMFUNC MfSniffTrace(const uint8_t * data, int len, uint32_t parity, int reader) {
+	uint8_t *rec;
+
+	if (sniffLen[sniffHalf] + 9 + len > SNF_RING_HALF) {
+		// the other half is still on its way
+		if (sniffSendHalf >= 0 || sniffLen[sniffHalf ^ 1]) {
+			sniffLost++;
+			return FALSE;
+		}
+		sniffSendHalf = sniffHalf;
+		sniffSendPos = 0;
+		sniffHalf ^= 1;
+	}
+
+	rec = sniffRing + sniffHalf * SNF_RING_HALF + sniffLen[sniffHalf];
+	rec[0] = (rsamples >> 0) & 0xff;
+	rec[1] = (rsamples >> 8) & 0xff;
+	rec[2] = (rsamples >> 16) & 0xff;
+	rec[3] = ((rsamples >> 24) & 0xff) | (reader ? 0 : 0x80);
+	rec[4] = (parity >> 0) & 0xff;
+	rec[5] = (parity >> 8) & 0xff;
+	rec[6] = (parity >> 16) & 0xff;
+	rec[7] = (parity >> 24) & 0xff;
+	rec[8] = len;
+	memcpy(rec + 9, data, len);
+	sniffLen[sniffHalf] += 9 + len;
+	return TRUE;
+}
+
 int RAMFUNC MfSniffLogic(const uint8_t * data, int len, uint32_t parity, int bitCnt, int reader) {
 
 	if ((len == 1) && (bitCnt = 9) && (data[0] > 0x0F)) { 
@@ -121,18 +171,18 @@ int RAMFUNC MfSniffLogic(const uint8_t * data, int len, uint32_t parity, int bit
 			sniffBuf[11] = sniffSAK;
 			sniffBuf[12] = 0xFF;
 			sniffBuf[13] = 0xFF;
-			LogTrace(sniffBuf, 14, 0, parity, true);
+			MfSniffTrace(sniffBuf, 14, parity, true);
 			timerData = GetTickCount();
 		}
 		case SNF_CARD_CMD:{
-			LogTrace(data, len, 0, parity, true);
+			MfSniffTrace(data, len, parity, true);
 
 			sniffState = SNF_CARD_RESP;
 			timerData = GetTickCount();
 			break;
 		}
 		case SNF_CARD_RESP:{
-			LogTrace(data, len, 0, parity, false);
+			MfSniffTrace(data, len, parity, false);
 
 			sniffState = SNF_CARD_CMD;
 			timerData = GetTickCount();
@@ -147,46 +197,43 @@ int RAMFUNC MfSniffLogic(const uint8_t * data, int len, uint32_t parity, int bit
 	return 0;
 }
 
-int RAMFUNC MfSniffSend(int maxTimeoutMs) {
-	if (traceLen && (timerData + maxTimeoutMs < GetTickCount())) {
-		return intMfSniffSend();
-	}
-	return 0;
+// One packet to the client, a half is sent once it has frames and the other
+// one is free. The caller makes sure the DMA buffer has room for the time.
+int RAMFUNC MfSniffSend(void) {
+	if (sniffSendHalf < 0 && !sniffLen[sniffHalf]) return 0;
+	return intMfSniffSend();
 }
 
 // internal seding function. not a RAMFUNC.
 int intMfSniffSend() {
-	
-	int pckSize = 0;
-	int pckLen = traceLen;
-	int pckNum = 0;
-	
-	if (!traceLen) return 0;
+	int pckSize;
 
-	FpgaDisableSscDma();
+	if (sniffSendHalf < 0) {
+		sniffSendHalf = sniffHalf;
+		sniffSendPos = 0;
+		sniffHalf ^= 1;
+	}
+
+	if (sniffSendPos < sniffLen[sniffSendHalf]) {
+		pckSize = min(SNF_PACKET_SIZE, sniffLen[sniffSendHalf] - sniffSendPos);
+		UsbCommand pck = {CMD_MIFARE_SNIFF_DATA, {1, pckSize, sniffPckNum++}};
+		memcpy(pck.d.asBytes, sniffRing + sniffSendHalf * SNF_RING_HALF + sniffSendPos, pckSize);
+		sniffSendPos += pckSize;
 
-	while (pckLen > 0) {
-		pckSize = min(32, pckLen);
-		UsbCommand ack = {CMD_ACK, {1, pckSize, pckNum}};
-		memcpy(ack.d.asBytes, trace + traceLen - pckLen, pckSize);
-	
 		LED_B_ON();
-		UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
-		SpinDelay(20);
+		UsbSendPacket((uint8_t *)&pck, sizeof(UsbCommand));
 		LED_B_OFF();
-
-		pckLen -= pckSize;
-		pckNum++;
+		return 1;
 	}
 
-	UsbCommand ack = {CMD_ACK, {2, 0, 0}};
+	// the half is through
+	UsbCommand pck = {CMD_MIFARE_SNIFF_DATA, {2, sniffLost, sniffPckNum++}};
 
 	LED_B_ON();
-	UsbSendPacket((uint8_t *)&ack, sizeof(UsbCommand));
+	UsbSendPacket((uint8_t *)&pck, sizeof(UsbCommand));
 	LED_B_OFF();
 
-	traceLen = 0;
-	memset(trace, 0x44, TRACE_SIZE);
-	
+	sniffLen[sniffSendHalf] = 0;
+	sniffSendHalf = -1;
 	return 1;
 }
@@ -38,9 +38,17 @@
 #define SNF_UID_4				0
 #define SNF_UID_7				0
 
+// The trace ring in BigBuf: frames go to one half while the other one is on
+// its way to the client in CMD_MIFARE_SNIFF_DATA packets, arg[0] 1 with
+// arg[1] bytes of records laid out like the trace, 2 when the half is done
+// with the frames lost so far, 0 at the end. arg[2] counts the packets.
+#define SNF_RING_OFFSET		12288
+#define SNF_RING_HALF			8192
+#define SNF_PACKET_SIZE		48
+
 int MfSniffInit(void);
 int RAMFUNC MfSniffLogic(const uint8_t * data, int len, uint32_t parity, int bitCnt, int reader);
-int RAMFUNC MfSniffSend(int maxTimeoutMs);
+int RAMFUNC MfSniffSend(void);
 int intMfSniffSend();
 int MfSniffEnd(void);
 
@@ -17,6 +17,7 @@
 #include "iso14443crc.h"
 #include "iso14443a.h"
 #include "crapto1.h"
+#include "crypto1ks.h"
 #include "mifareutil.h"
 
 int MF_DBGLEVEL = MF_DBG_ALL;
@@ -37,42 +38,78 @@ uint8_t* eml_get_bigbufptr_cardmem(void) {
 
 // crypto1 helpers
 void mf_crypto1_decrypt(struct Crypto1State *pcs, uint8_t *data, int len){
-	uint8_t	bt = 0;
-	int i;
-	
-	if (len != 1) {
-		for (i = 0; i < len; i++)
-			data[i] = crypto1_byte(pcs, 0x00, 0) ^ data[i];
-	} else {
-		bt = 0;
-		for (i = 0; i < 4; i++)
-			bt |= (crypto1_bit(pcs, 0, 0) ^ BIT(data[0], i)) << i;
-				
-		data[0] = bt;
-	}
-	return;
+	if (len == 1)
+		data[0] = mf_crypto1_encrypt4bit(pcs, data[0]);
+	else
+		crypto1_ks_crypt(pcs, data, len, NULL);
 }
 
 void mf_crypto1_encrypt(struct Crypto1State *pcs, uint8_t *data, int len, uint32_t *par) {
-	uint8_t bt = 0;
-	int i;
-	uint32_t mltpl = 1 << (len - 1); // for len=18 it=0x20000
+	crypto1_ks_crypt(pcs, data, len, par);
+}
+
+uint8_t mf_crypto1_encrypt4bit(struct Crypto1State *pcs, uint8_t data) {
+	return (crypto1_ks(pcs, 4) ^ data) & 0x0f;
+}
+
+// keystream made ahead of the frames
+void mf_ks_init(mf_keystream_t *ks, struct Crypto1State *pcs) {
+	ks->pcs = pcs;
+	ks->used = ks->made = 0;
+}
+
+void mf_ks_fill(mf_keystream_t *ks, int bits) {
+	uint32_t word;
+	int n;
+
+	if (bits > MF_KS_AHEAD) bits = MF_KS_AHEAD;
+	while (ks->made - ks->used < (uint32_t)bits) {
+		n = bits - (ks->made - ks->used);
+		if (n > 32) n = 32;
+		for (word = crypto1_ks(ks->pcs, n); n > 0; n--, word >>= 1)
+			ks->ks[ks->made++ & (MF_KS_AHEAD - 1)] = word & 0x01;
+	}
+}
+
+static inline uint8_t mf_ks_bit(mf_keystream_t *ks) {
+	if (ks->made == ks->used) mf_ks_fill(ks, 1);
+	return ks->ks[ks->used++ & (MF_KS_AHEAD - 1)];
+}
+
+void mf_ks_decrypt(mf_keystream_t *ks, uint8_t *data, int len) {
+	int i, j;
+
+	// 4 bit frames
+	if (len == 1) {
+		data[0] = mf_ks_encrypt4bit(ks, data[0]);
+		return;
+	}
+	for (i = 0; i < len; i++)
+		for (j = 0; j < 8; j++)
+			data[i] ^= mf_ks_bit(ks) << j;
+}
+
+void mf_ks_encrypt(mf_keystream_t *ks, uint8_t *data, int len, uint32_t *par) {
+	uint8_t bt;
+	int i, j;
+
 	*par = 0;
 	for (i = 0; i < len; i++) {
 		bt = data[i];
-		data[i] = crypto1_byte(pcs, 0x00, 0) ^ data[i];
-		*par = (*par >> 1) | ( ((filter(pcs->odd) ^ oddparity(bt)) & 0x01) * mltpl );
-	}	
-	return;
+		for (j = 0; j < 8; j++)
+			data[i] ^= mf_ks_bit(ks) << j;
+		// the parity bit takes the next bit of the stream without using it up
+		if (ks->made == ks->used) mf_ks_fill(ks, 1);
+		*par |= (uint32_t)((ks->ks[ks->used & (MF_KS_AHEAD - 1)] ^ oddparity(bt)) & 0x01) << i;
+	}
 }
 
-uint8_t mf_crypto1_encrypt4bit(struct Crypto1State *pcs, uint8_t data) {
+uint8_t mf_ks_encrypt4bit(mf_keystream_t *ks, uint8_t data) {
 	uint8_t bt = 0;
 	int i;
 
 	for (i = 0; i < 4; i++)
-		bt |= (crypto1_bit(pcs, 0, 0) ^ BIT(data, i)) << i;
-		
+		bt |= (mf_ks_bit(ks) ^ BIT(data, i)) << i;
 	return bt;
 }
 
@@ -85,7 +122,7 @@ int mifare_sendcmd_short(struct Crypto1State *pcs, uint8_t crypted, uint8_t cmd,
 int mifare_sendcmd_shortex(struct Crypto1State *pcs, uint8_t crypted, uint8_t cmd, uint8_t data, uint8_t* answer, uint32_t * parptr)
 {
 	uint8_t dcmd[4], ecmd[4];
-	uint32_t pos, par, res;
+	uint32_t par;
 
 	dcmd[0] = cmd;
 	dcmd[1] = data;
@@ -94,12 +131,7 @@ int mifare_sendcmd_shortex(struct Crypto1State *pcs, uint8_t crypted, uint8_t cm
 	memcpy(ecmd, dcmd, sizeof(dcmd));
 	
 	if (crypted) {
-		par = 0;
-		for (pos = 0; pos < 4; pos++)
-		{
-			ecmd[pos] = crypto1_byte(pcs, 0x00, 0) ^ dcmd[pos];
-			par = (par >> 1) | ( ((filter(pcs->odd) ^ oddparity(dcmd[pos])) & 0x01) * 0x08 );
-		}	
+		mf_crypto1_encrypt(pcs, ecmd, sizeof(ecmd), &par);
 
 		ReaderTransmitPar(ecmd, sizeof(ecmd), par);
 
@@ -111,21 +143,8 @@ int mifare_sendcmd_shortex(struct Crypto1State *pcs, uint8_t crypted, uint8_t cm
 	
 	if (parptr) *parptr = par;
 
-	if (crypted == CRYPT_ALL) {
-		if (len == 1) {
-			res = 0;
-			for (pos = 0; pos < 4; pos++)
-				res |= (crypto1_bit(pcs, 0, 0) ^ BIT(answer[0], pos)) << pos;
-				
-			answer[0] = res;
-			
-		} else {
-			for (pos = 0; pos < len; pos++)
-			{
-				answer[pos] = crypto1_byte(pcs, 0x00, 0) ^ answer[pos];
-			}
-		}
-	}
+	if (crypted == CRYPT_ALL)
+		mf_crypto1_decrypt(pcs, answer, len);
 	
 	return len;
 }
@@ -259,8 +278,7 @@ int mifare_classic_readblock(struct Crypto1State *pcs, uint32_t uid, uint8_t blo
 int mifare_classic_writeblock(struct Crypto1State *pcs, uint32_t uid, uint8_t blockNo, uint8_t *blockData) 
 {
 	// variables
-	int len, i;	
-	uint32_t pos;
+	int len;	
 	uint32_t par = 0;
 	byte_t res;
 	
@@ -279,21 +297,15 @@ int mifare_classic_writeblock(struct Crypto1State *pcs, uint32_t uid, uint8_t bl
 	AppendCrc14443a(d_block, 16);
 	
 	// crypto
-	par = 0;
-	for (pos = 0; pos < 18; pos++)
-	{
-		d_block_enc[pos] = crypto1_byte(pcs, 0x00, 0) ^ d_block[pos];
-		par = (par >> 1) | ( ((filter(pcs->odd) ^ oddparity(d_block[pos])) & 0x01) * 0x20000 );
-	}	
+	memcpy(d_block_enc, d_block, sizeof(d_block));
+	mf_crypto1_encrypt(pcs, d_block_enc, sizeof(d_block_enc), &par);
 
 	ReaderTransmitPar(d_block_enc, sizeof(d_block_enc), par);
 
 	// Receive the response
 	len = ReaderReceive(receivedAnswer);	
 
-	res = 0;
-	for (i = 0; i < 4; i++)
-		res |= (crypto1_bit(pcs, 0, 0) ^ BIT(receivedAnswer[0], i)) << i;
+	res = mf_crypto1_encrypt4bit(pcs, receivedAnswer[0]);
 
 	if ((len != 1) || (res != 0x0A)) {
 		if (MF_DBGLEVEL >= 1)	Dbprintf("Cmd send data2 Error: %02x", res);  
@@ -389,7 +401,11 @@ uint64_t emlGetKey(int sectorNum, int keyType) {
 	uint8_t key[6];
 	uint8_t* emCARD = eml_get_bigbufptr_cardmem();
 	
-	memcpy(key, emCARD + 3 * 16 + sectorNum * 4 * 16 + keyType * 10, 6);
+	// the trailer, 4K cards have sectors of 16 blocks from sector 32 on
+	if (sectorNum < 32)
+		memcpy(key, emCARD + (sectorNum * 4 + 3) * 16 + keyType * 10, 6);
+	else
+		memcpy(key, emCARD + (128 + (sectorNum - 32) * 16 + 15) * 16 + keyType * 10, 6);
 	return bytes_to_num(key, 6);
 }
 
@@ -77,6 +77,24 @@ void mf_crypto1_decrypt(struct Crypto1State *pcs, uint8_t *receivedCmd, int len)
 void mf_crypto1_encrypt(struct Crypto1State *pcs, uint8_t *data, int len, uint32_t *par);
 uint8_t mf_crypto1_encrypt4bit(struct Crypto1State *pcs, uint8_t data);
 
+// The keystream of pcs made ahead of the frames it encrypts, one bit per
+// byte, so the simulator can answer at once. Fill it while the reader is
+// busy; the functions make what is missing. After mf_ks_init() pcs runs
+// ahead of the stream and must not be used directly.
+#define MF_KS_AHEAD   256                  // bits, a power of 2
+#define MF_KS_READ    (4 * 8 + 18 * 8 + 1) // a READ, its answer and the last parity
+typedef struct {
+	struct Crypto1State *pcs;
+	uint8_t ks[MF_KS_AHEAD];
+	uint32_t used, made;
+} mf_keystream_t;
+
+void mf_ks_init(mf_keystream_t *ks, struct Crypto1State *pcs);
+void mf_ks_fill(mf_keystream_t *ks, int bits);
+void mf_ks_decrypt(mf_keystream_t *ks, uint8_t *data, int len);
+void mf_ks_encrypt(mf_keystream_t *ks, uint8_t *data, int len, uint32_t *par);
+uint8_t mf_ks_encrypt4bit(mf_keystream_t *ks, uint8_t data);
+
 // memory management
 uint8_t* mifare_get_bigbufptr(void);
 uint8_t* eml_get_bigbufptr_sendbuf(void);
@@ -0,0 +1,280 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Clock recovery: bit period estimation by edge autocorrelation
+//
+// The samples are sliced with hysteresis into a train of rising edges, the
+// autocorrelation of that train is computed through an FFT (O(N log N)) and
+// the shortest autocorrelation peak on whose grid the edges fall is taken as
+// the bit period. Isolated noisy samples only add a few uncorrelated edges,
+// so unlike a search for the global peak value they don't disturb the
+// estimate.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "clockrec.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define CLOCK_MIN_PERIOD  2
+#define CLOCK_MAX_PERIOD  8192
+#define CLOCK_MAX_CANDIDATES  16
+#define CLOCK_PEAK_RATIO  8        // candidates reach 1/8 of the strongest peak
+#define CLOCK_FIT_MARGIN  0.05
+
+typedef struct {
+	int valid;
+	const int *samples;
+	int len;
+	int peak;
+	uint32_t fingerprint;
+	int result;
+	clock_estimate_t est;
+} clock_cache_t;
+
+static clock_cache_t cache;
+
+// Callers modify sample buffers in place, so a cheap content hash is what
+// tells one buffer generation from the next.
+static uint32_t fingerprint(const int *samples, int len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (uint32_t)samples[i]) * 16777619u;
+	return hash;
+}
+
+// In-place iterative radix-2 FFT, n must be a power of two
+static void fft(double *re, double *im, int n, int inverse)
+{
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double tmp;
+			tmp = re[i]; re[i] = re[j]; re[j] = tmp;
+			tmp = im[i]; im[i] = im[j]; im[j] = tmp;
+		}
+	}
+
+	for (int span = 2; span <= n; span <<= 1) {
+		double angle = (inverse ? 2 : -2) * M_PI / span;
+		double step_re = cos(angle), step_im = sin(angle);
+		int half = span / 2;
+
+		for (int base = 0; base < n; base += span) {
+			double w_re = 1.0, w_im = 0.0;
+			for (int k = 0; k < half; k++) {
+				double *a_re = &re[base + k], *a_im = &im[base + k];
+				double *b_re = &re[base + k + half], *b_im = &im[base + k + half];
+				double t_re = *b_re * w_re - *b_im * w_im;
+				double t_im = *b_re * w_im + *b_im * w_re;
+				double next_re = w_re * step_re - w_im * step_im;
+
+				*b_re = *a_re - t_re;
+				*b_im = *a_im - t_im;
+				*a_re += t_re;
+				*a_im += t_im;
+				w_im = w_re * step_im + w_im * step_re;
+				w_re = next_re;
+			}
+		}
+	}
+
+	if (inverse) {
+		for (int i = 0; i < n; i++) {
+			re[i] /= n;
+			im[i] /= n;
+		}
+	}
+}
+
+// Slice the samples with hysteresis and record the rising edges
+static int find_edges(const int *samples, int len, int peak, double *train, int *edges)
+{
+	int low = samples[0], high = samples[0];
+	int count = 0;
+
+	for (int i = 1; i < len; i++) {
+		if (samples[i] < low)
+			low = samples[i];
+		if (samples[i] > high)
+			high = samples[i];
+	}
+	if (peak && peak > low)
+		high = peak;
+	if (high <= low)
+		return 0;
+
+	double upper = low + 0.75 * (high - low);
+	double lower = low + 0.25 * (high - low);
+	int state = samples[0] >= upper;
+
+	for (int i = 1; i < len; i++) {
+		if (!state && samples[i] >= upper) {
+			state = 1;
+			train[i] = 1.0;
+			edges[count++] = i;
+		} else if (state && samples[i] <= lower) {
+			state = 0;
+		}
+	}
+	return count;
+}
+
+// Share of edge intervals lying on a multiple of half the period
+static double fit_confidence(const int *edges, int count, double period)
+{
+	double half = period / 2;
+	int fits = 0;
+
+	if (count < 2)
+		return 0.0;
+
+	for (int i = 1; i < count; i++) {
+		int interval = edges[i] - edges[i - 1];
+		double multiple = floor(interval / half + 0.5);
+		if (multiple >= 2 && fabs(interval - multiple * half) <= period / 8)
+			fits++;
+	}
+	return (double)fits / (count - 1);
+}
+
+// Collect the autocorrelation peaks worth considering as bit period, in
+// ascending lag order. Returns the number of candidates found.
+static int find_candidates(const double *corr, int len, int *lags, int max_count)
+{
+	int max_lag = len / 2;
+	double strongest = 0.0;
+	int count = 0;
+
+	if (max_lag > CLOCK_MAX_PERIOD)
+		max_lag = CLOCK_MAX_PERIOD;
+
+	// three-tap sums absorb one sample of edge jitter, and the
+	// len / (len - k) factor undoes the bias towards short lags
+	#define CLOCK_SCORE(k) ((corr[(k) - 1] + corr[k] + corr[(k) + 1]) * len / (len - (k)))
+
+	for (int k = CLOCK_MIN_PERIOD; k < max_lag; k++)
+		if (CLOCK_SCORE(k) > strongest)
+			strongest = CLOCK_SCORE(k);
+	if (strongest <= 0.0)
+		return 0;
+
+	for (int k = CLOCK_MIN_PERIOD + 1; k < max_lag - 1 && count < max_count; k++) {
+		double score = CLOCK_SCORE(k);
+		if (score >= strongest / CLOCK_PEAK_RATIO
+		    && score >= CLOCK_SCORE(k - 1) && score > CLOCK_SCORE(k + 1))
+		{
+			lags[count++] = k;
+		}
+	}
+
+	#undef CLOCK_SCORE
+	return count;
+}
+
+// Centroid of an autocorrelation peak, gives the sub-sample period
+static double peak_centroid(const double *corr, int lag)
+{
+	double weight = 0.0, moment = 0.0;
+
+	for (int k = lag - 1; k <= lag + 1; k++) {
+		double value = corr[k] > 0.0 ? corr[k] : 0.0;
+		weight += value;
+		moment += value * k;
+	}
+	return weight > 0.0 ? moment / weight : lag;
+}
+
+static int recover_clock(const int *samples, int len, int peak, clock_estimate_t *est)
+{
+	int size = 1, count, result = -1;
+	int lags[CLOCK_MAX_CANDIDATES], candidates;
+	double best = -1.0;
+	double *re, *im;
+	int *edges;
+
+	while (size < 2 * len)
+		size <<= 1;
+
+	re = calloc(size, sizeof(double));
+	im = calloc(size, sizeof(double));
+	edges = malloc(len * sizeof(int));
+	if (!re || !im || !edges)
+		goto out;
+
+	count = find_edges(samples, len, peak, re, edges);
+	if (count < 3)
+		goto out;
+
+	// autocorrelation = IFFT(|FFT(x)|^2), zero padding to 2N keeps it linear
+	fft(re, im, size, 0);
+	for (int i = 0; i < size; i++) {
+		re[i] = re[i] * re[i] + im[i] * im[i];
+		im[i] = 0.0;
+	}
+	fft(re, im, size, 1);
+
+	candidates = find_candidates(re, len, lags, CLOCK_MAX_CANDIDATES);
+
+	// Longer lags are mostly multiples of the bit period and fit the edges
+	// just as well, so settle for the shortest one that fits about as well
+	// as the best.
+	for (int i = 0; i < candidates; i++) {
+		double period = peak_centroid(re, lags[i]);
+		double confidence = fit_confidence(edges, count, period);
+		if (confidence > best + CLOCK_FIT_MARGIN) {
+			est->period = period;
+			est->clock = (int)(period + 0.5);
+			est->confidence = confidence;
+			best = confidence;
+			result = 0;
+		}
+	}
+
+out:
+	free(re);
+	free(im);
+	free(edges);
+	return result;
+}
+
+/*
+ * Estimate the bit period of a sample buffer. peak is the signal's high
+ * level or 0 to derive it from the samples. Results are cached, asking
+ * again about an unchanged buffer costs only a hash over the samples.
+ * Returns 0 on success, -1 if no periodic structure was found.
+ */
+int estimate_clock(const int *samples, int len, int peak, clock_estimate_t *est)
+{
+	uint32_t hash;
+
+	if (len < 4)
+		return -1;
+
+	hash = fingerprint(samples, len);
+	if (!cache.valid || cache.samples != samples || cache.len != len
+	    || cache.peak != peak || cache.fingerprint != hash)
+	{
+		cache.samples = samples;
+		cache.len = len;
+		cache.peak = peak;
+		cache.fingerprint = hash;
+		cache.result = recover_clock(samples, len, peak, &cache.est);
+		cache.valid = 1;
+	}
+
+	if (cache.result == 0)
+		*est = cache.est;
+	return cache.result;
+}
@@ -0,0 +1,20 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Clock recovery: bit period estimation by edge autocorrelation
+//-----------------------------------------------------------------------------
+
+#ifndef CLOCKREC_H__
+#define CLOCKREC_H__
+
+typedef struct {
+	double period;      // estimated bit period in samples, sub-sample accurate
+	int clock;          // period rounded to whole samples
+	double confidence;  // 0.0 .. 1.0, share of edge intervals that fit the period
+} clock_estimate_t;
+
+int estimate_clock(const int *samples, int len, int peak, clock_estimate_t *est);
+
+#endif
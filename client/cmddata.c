@@ -16,6 +16,7 @@
 #include "data.h"
 #include "ui.h"
 #include "graph.h"
+#include "clockrec.h"
 #include "cmdparser.h"
 #include "cmdmain.h"
 #include "cmddata.h"
@@ -53,6 +54,7 @@ int CmdAmp(const char *Cmd)
       }
     }
   }
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -114,6 +116,7 @@ int Cmdaskdemod(const char *Cmd)
       GraphBuffer[i] = GraphBuffer[i - 1];
     }
   }
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -146,6 +149,7 @@ int CmdAutoCorr(const char *Cmd)
   GraphTraceLen = GraphTraceLen - window;
   memcpy(GraphBuffer, CorrelBuffer, GraphTraceLen * sizeof (int));
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -171,6 +175,7 @@ int CmdBitsamples(const char *Cmd)
     }
   }
   GraphTraceLen = cnt;
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -254,6 +259,7 @@ int CmdDec(const char *Cmd)
     GraphBuffer[i] = GraphBuffer[i * 2];
   GraphTraceLen /= 2;
   PrintAndLog("decimated by 2");
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -261,6 +267,14 @@ int CmdDec(const char *Cmd)
 /* Print our clock rate */
 int CmdDetectClockRate(const char *Cmd)
 {
+  clock_estimate_t est;
+
+  if (estimate_clock(GraphBuffer, GraphTraceLen, 0, &est) == 0) {
+    PrintAndLog("Auto-detected clock rate: %d (period %.2f samples, confidence %d%%)",
+      est.clock, est.period, (int)(est.confidence * 100));
+    return 0;
+  }
+
   int clock = DetectClock(0);
   PrintAndLog("Auto-detected clock rate: %d", clock);
   return 0;
@@ -321,6 +335,7 @@ int CmdFSKdemod(const char *Cmd)
   }
 
   GraphTraceLen -= (convLen + 16);
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
 
   // Find bit-sync (3 lo followed by 3 high)
@@ -342,12 +357,14 @@ int CmdFSKdemod(const char *Cmd)
   // place start of bit sync marker in graph
   GraphBuffer[maxPos] = maxMark;
   GraphBuffer[maxPos + 1] = minMark;
+  GraphChanged(maxPos, maxPos + 2);
 
   maxPos += j;
 
   // place end of bit sync marker in graph
   GraphBuffer[maxPos] = maxMark;
   GraphBuffer[maxPos+1] = minMark;
+  GraphChanged(maxPos, maxPos + 2);
 
   PrintAndLog("actual data bits start at sample %d", maxPos);
   PrintAndLog("length %d/%d", highLen, lowLen);
@@ -368,6 +385,7 @@ int CmdFSKdemod(const char *Cmd)
     // place inter bit marker in graph
     GraphBuffer[maxPos] = maxMark;
     GraphBuffer[maxPos + 1] = minMark;
+    GraphChanged(maxPos, maxPos + 2);
 
     // hi and lo form a 64 bit pair
     hi = (hi << 1) | (lo >> 31);
@@ -458,6 +476,7 @@ int CmdHpf(const char *Cmd)
   for (i = 0; i < GraphTraceLen; ++i)
     GraphBuffer[i] -= accum;
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -482,6 +501,7 @@ int CmdSamples(const char *Cmd)
   }
   PrintAndLog("Done!\n");
   GraphTraceLen = n*4;
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -502,6 +522,7 @@ int CmdLoad(const char *Cmd)
   }
   fclose(f);
   PrintAndLog("loaded %d samples", GraphTraceLen);
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -514,6 +535,7 @@ int CmdLtrim(const char *Cmd)
     GraphBuffer[i-ds] = GraphBuffer[i];
   GraphTraceLen -= ds;
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -753,6 +775,7 @@ int CmdManchesterMod(const char *Cmd)
     lastbit = bit;
   }
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -775,6 +798,7 @@ int CmdNorm(const char *Cmd)
         (max - min);
     }
   }
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -822,6 +846,7 @@ int CmdThreshold(const char *Cmd)
     else
       GraphBuffer[i] =- 1;
   }
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -851,6 +876,7 @@ int CmdZerocrossings(const char *Cmd)
     }
   }
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <sys/time.h>
 #include "util.h"
 #include "iso14443crc.h"
 #include "data.h"
@@ -461,12 +463,235 @@ int CmdHF14ASnoop(const char *Cmd) {
   return 0;
 }
 
+int iso14a_inventory(int flags, iso14a_inventory_t *cards, int max, int *activated, uint32_t *ms)
+{
+	UsbCommand c = {CMD_READER_ISO_14443a_INVENTORY, {flags, max, 0}};
+	UsbCommand *resp;
+	int count, pos, len;
+
+	SendCommand(&c);
+	resp = WaitForResponseTimeout(CMD_ACK, 10000);
+	if (resp == NULL)
+		return -1;
+	count = resp->arg[0];
+	*activated = resp->arg[1];
+	*ms = resp->arg[2];
+	if (count > max)
+		count = max;
+	len = count * sizeof(iso14a_inventory_t);
+	memcpy(cards, resp->d.asBytes, len < 48 ? len : 48);
+
+	// the rest of the list out of BigBuf
+	for (pos = 48; pos < len; pos += 48) {
+		UsbCommand d = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {(ISO14A_INVENTORY + pos) / 4, 0, 0}};
+		SendCommand(&d);
+		resp = WaitForResponse(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K);
+		memcpy((uint8_t *)cards + pos, resp->d.asBytes, len - pos < 48 ? len - pos : 48);
+	}
+	return count;
+}
+
+int CmdHF14AInventory(const char *Cmd)
+{
+	iso14a_inventory_t cards[ISO14A_INVENTORY_MAX];
+	int flags = 0, count, activated, i;
+	uint32_t ms;
+	char cid[8];
+
+	if (param_getchar(Cmd, 0) == 'h') {
+		PrintAndLog("List every ISO14443 Type A card in the field, by bitwise anticollision.");
+		PrintAndLog("Usage:  hf 14a inventory [a]");
+		PrintAndLog("        a - activate the ISO14443-4 cards with a CID each and keep the");
+		PrintAndLog("            field on, for hf 14a apdu n c <CID> ...");
+		return 0;
+	}
+	if (tolower((unsigned char)param_getchar(Cmd, 0)) == 'a')
+		flags |= ISO14A_ACTIVATE;
+
+	count = iso14a_inventory(flags, cards, ISO14A_INVENTORY_MAX, &activated, &ms);
+	if (count < 0) {
+		PrintAndLog("no answer from the device");
+		return 1;
+	}
+
+	PrintAndLog(" # | UID                  | ATQA  | SAK | CID");
+	PrintAndLog("---+----------------------+-------+-----+----");
+	for (i = 0; i < count; i++) {
+		if (cards[i].cid == 0xff)
+			strcpy(cid, "-");
+		else
+			sprintf(cid, "%d", cards[i].cid);
+		PrintAndLog("%2d | %-20s | %02x %02x | %02x  | %s", i + 1,
+			sprint_hex(cards[i].uid, cards[i].uid_len < 10 ? cards[i].uid_len : 10),
+			cards[i].atqa[0], cards[i].atqa[1], cards[i].sak, cid);
+	}
+	PrintAndLog("%d cards, %d activated, in %d ms", count, activated, ms);
+	return 0;
+}
+
+int iso14a_apdus(const uint8_t *queue, int queue_len, int count, int flags, int cid,
+                 uint8_t *answers, int *answered, int *answers_len)
+{
+	UsbCommand c = {CMD_READER_ISO_14443a_APDUS, {0, 0, 0}};
+	UsbCommand *resp;
+	int pos, n;
+
+	// the last packet starts the run, an empty one if the queue is
+	for (pos = 0; ; pos += n) {
+		n = queue_len - pos < 48 ? queue_len - pos : 48;
+		c.arg[0] = pos;
+		c.arg[1] = n;
+		memcpy(c.d.asBytes, queue + pos, n);
+		if (pos + n >= queue_len) {
+			c.arg[2] = (count & 0xfff) | (cid & 0xf) << 12 | (flags | ISO14A_APDU) << 16;
+			SendCommand(&c);
+			break;
+		}
+		SendCommand(&c);
+	}
+	resp = WaitForResponse(CMD_ACK);
+	*answered = resp->arg[0];
+	*answers_len = resp->arg[1];
+	n = (int)resp->arg[2];
+	if (*answers_len > ISO14A_APDU_ANSWERS_SIZE)
+		return ISO14A_APDU_OVERFLOW;
+	memcpy(answers, resp->d.asBytes, 48);
+
+	// the rest of the answers out of BigBuf
+	for (pos = 48; pos < *answers_len; pos += 48) {
+		UsbCommand d = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {(ISO14A_APDU_ANSWERS + pos) / 4, 0, 0}};
+		SendCommand(&d);
+		resp = WaitForResponse(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K);
+		memcpy(answers + pos, resp->d.asBytes, *answers_len - pos < 48 ? *answers_len - pos : 48);
+	}
+	return n;
+}
+
+// hex digits with blanks between them, returns the number of bytes or -1
+static int apdu_fromhex(const char *s, int len, uint8_t *apdu, int max)
+{
+	int n = 0, nibbles = 0, i;
+
+	for (i = 0; i < len; i++) {
+		if (isspace((unsigned char)s[i]))
+			continue;
+		if (!isxdigit((unsigned char)s[i]) || n >= max)
+			return -1;
+		apdu[n] = apdu[n] << 4 | (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+		if (++nibbles % 2 == 0)
+			n++;
+	}
+	return nibbles % 2 ? -1 : n;
+}
+
+static int apdu_queue(uint8_t *queue, int *queue_len, const char *s, int len)
+{
+	int n = apdu_fromhex(s, len, queue + *queue_len + 2, ISO14A_APDU_QUEUE_SIZE - *queue_len - 2);
+
+	if (n <= 0)
+		return -1;
+	queue[*queue_len] = n & 0xff;
+	queue[*queue_len + 1] = n >> 8;
+	*queue_len += 2 + n;
+	return 0;
+}
+
+int CmdHF14AApdu(const char *Cmd)
+{
+	static uint8_t queue[ISO14A_APDU_QUEUE_SIZE], answers[ISO14A_APDU_ANSWERS_SIZE];
+	int flags = ISO14A_CONNECT, queue_len = 0, count = 0, cid = 0;
+	int answered, answers_len, res, i, bg, en, qpos, apos, n;
+	char filename[256], line[1024];
+	struct timeval start, end;
+	FILE *f;
+
+	if (param_getchar(Cmd, 0) == 0 || param_getchar(Cmd, 0) == 'h') {
+		PrintAndLog("Send APDUs to a card in one go, chained, WTX and retransmission");
+		PrintAndLog("done by the device, and list the answers.");
+		PrintAndLog("Usage:  hf 14a apdu [k] [n [c <CID>]] <APDU | file> ...");
+		PrintAndLog("        k - keep the field on and the card selected afterwards");
+		PrintAndLog("        n - no select, go on with the card kept by k before");
+		PrintAndLog("        c - the card with that CID of hf 14a inventory a");
+		PrintAndLog("        APDUs in hex, or files of one APDU per line, # starts a comment");
+		PrintAndLog("sample: hf 14a apdu 00a4040007d2760000850101 00b0000000");
+		return 0;
+	}
+
+	for (i = 0; !param_getptr(Cmd, &bg, &en, i); i++) {
+		if (en == bg && tolower((unsigned char)Cmd[bg]) == 'k') {
+			flags |= ISO14A_NO_DISCONNECT;
+			continue;
+		}
+		if (en == bg && tolower((unsigned char)Cmd[bg]) == 'n') {
+			flags &= ~ISO14A_CONNECT;
+			continue;
+		}
+		if (en == bg && tolower((unsigned char)Cmd[bg]) == 'c') {
+			cid = param_get8ex(Cmd, ++i, ISO14A_MAX_CID, 10);
+			if (cid >= ISO14A_MAX_CID) {
+				PrintAndLog("CID 0 to %d", ISO14A_MAX_CID - 1);
+				return 0;
+			}
+			continue;
+		}
+		if (!apdu_queue(queue, &queue_len, Cmd + bg, en - bg + 1)) {
+			count++;
+			continue;
+		}
+		if (en - bg + 1 >= (int)sizeof(filename) || !param_getstr(Cmd, i, filename) || (f = fopen(filename, "r")) == NULL) {
+			PrintAndLog("not an APDU or a readable file: %.*s", en - bg + 1, Cmd + bg);
+			return 0;
+		}
+		while (fgets(line, sizeof(line), f)) {
+			if (line[0] == '#' || param_getchar(line, 0) == 0)
+				continue;
+			if (apdu_queue(queue, &queue_len, line, strlen(line))) {
+				PrintAndLog("not an APDU or no more room: %s", strtok(line, "\r\n"));
+				fclose(f);
+				return 0;
+			}
+			count++;
+		}
+		fclose(f);
+	}
+	if (count == 0 || count > 0xfff) {
+		PrintAndLog("no APDUs or too many of them");
+		return 0;
+	}
+
+	gettimeofday(&start, NULL);
+	res = iso14a_apdus(queue, queue_len, count, flags, cid, answers, &answered, &answers_len);
+	gettimeofday(&end, NULL);
+
+	for (i = 0, qpos = 0, apos = 0; i < answered && apos + 2 <= answers_len; i++) {
+		n = queue[qpos] | queue[qpos + 1] << 8;
+		PrintAndLog(">> %s", sprint_hex(queue + qpos + 2, n));
+		qpos += 2 + n;
+		n = answers[apos] | answers[apos + 1] << 8;
+		PrintAndLog("<< %s", sprint_hex(answers + apos + 2, n));
+		apos += 2 + n;
+	}
+	PrintAndLog("%d of %d APDUs in %ld ms", answered, count,
+		(end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
+	switch (res) {
+		case 0: break;
+		case ISO14A_APDU_LINK_ERROR: PrintAndLog("the card stopped answering"); break;
+		case ISO14A_APDU_PROTOCOL_ERROR: PrintAndLog("the card broke the block protocol"); break;
+		case ISO14A_APDU_OVERFLOW: PrintAndLog("no room for the answers"); break;
+		case ISO14A_APDU_NO_CARD: PrintAndLog("no ISO14443-4 card selected"); break;
+		default: PrintAndLog("error %d", res);
+	}
+	return 0;
+}
+
 static command_t CommandTable[] = 
 {
   {"help",   CmdHelp,              1, "This help"},
   {"list",   CmdHF14AList,         0, "List ISO 14443a history"},
   {"reader", CmdHF14AReader,       0, "Act like an ISO14443 Type A reader"},
+  {"apdu",   CmdHF14AApdu,         0, "<APDU | file> ... Send APDUs to an ISO14443-4 card in one go"},
   {"cuids",  CmdHF14ACUIDs,        0, "<n> Collect n>0 ISO14443 Type A UIDs in one go"},
+  {"inventory", CmdHF14AInventory, 0, "[a] List every card in the field, a: activate them by CID"},
   {"sim",    CmdHF14ASim,          0, "<UID> -- Fake ISO 14443a tag"},
   {"snoop",  CmdHF14ASnoop,        0, "Eavesdrop ISO 14443 Type A"},
   {NULL, NULL, 0, NULL}
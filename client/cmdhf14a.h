@@ -12,8 +12,26 @@
 #ifndef CMDHF14A_H__
 #define CMDHF14A_H__
 
+#include <stdint.h>
+#include "common.h"
+
 int CmdHF14A(const char *Cmd);
 
+// Run count APDUs on the device in one go, queue and answers laid out as for
+// CMD_READER_ISO_14443a_APDUS, flags ISO14A_CONNECT and ISO14A_NO_DISCONNECT,
+// without ISO14A_CONNECT on the card with CID cid. answers takes
+// ISO14A_APDU_ANSWERS_SIZE bytes. Returns 0 or an ISO14A_APDU_* error after
+// the answered APDUs.
+int iso14a_apdus(const uint8_t *queue, int queue_len, int count, int flags, int cid,
+                 uint8_t *answers, int *answered, int *answers_len);
+
+// List the cards in the field, at most max, with ISO14A_ACTIVATE in flags
+// activate the ISO14443-4 ones by CID. Returns the number of cards or -1.
+int iso14a_inventory(int flags, iso14a_inventory_t *cards, int max, int *activated, uint32_t *ms);
+
+
+int CmdHF14AApdu(const char *Cmd);
+int CmdHF14AInventory(const char *Cmd);
 int CmdHF14AList(const char *Cmd);
 int CmdHF14AMifare(const char *Cmd);
 int CmdHF14AReader(const char *Cmd);
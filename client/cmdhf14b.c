@@ -71,6 +71,7 @@ int CmdHF14BDemod(const char *Cmd)
     j += 2;
   }
   GraphTraceLen = i;
+  GraphChanged(0, GraphTraceLen);
 
   i = outOfWeakAt / 2;
   while (GraphBuffer[i] > 0 && i < GraphTraceLen)
@@ -33,13 +33,9 @@
 #include "cmdparser.h"
 #include "cmdhf15.h"
 #include "iso15693tools.h"
+#include "hf15demod.h"
 #include "cmdmain.h"
 
-#define FrameSOF              Iso15693FrameSOF
-#define Logic0						Iso15693Logic0
-#define Logic1						Iso15693Logic1
-#define FrameEOF					Iso15693FrameEOF
-
 #define Crc(data,datalen)     Iso15693Crc(data,datalen)
 #define AddCrc(data,datalen)  Iso15693AddCrc(data,datalen)
 #define sprintUID(target,uid)	Iso15693sprintUID(target,uid)
@@ -171,80 +167,35 @@ static char* TagErrorStr(uint8_t error) {
 
 
 // Mode 3
-int CmdHF15Demod(const char *Cmd)
+static void PrintHF15Frame(const hf15_frame_t *frame, void *ctx)
 {
-	// The sampling rate is 106.353 ksps/s, for T = 18.8 us
-	
-	int i, j;
-	int max = 0, maxPos = 0;
+	char hex[3 * HF15_MAX_FRAME_LEN + 1];
+	int n = 0;
 
-	int skip = 4;
+	for (int i = 0; i < frame->len; i++)
+		n += sprintf(hex + n, i ? " %02x" : "%02x", frame->data[i]);
+	hex[n] = '\0';
+
+	PrintAndLog("%9u  %-6s  %-6s  %-4s  %s", hf15_sample_to_us(frame->start),
+		frame->coding >= HF15_READER_1OF4 ? "reader" : "tag",
+		hf15_coding_name(frame->coding), frame->crc_ok ? "ok" : "!crc", hex);
+}
+
+// Decodes all frames of a hf 15 record/read capture in the GraphBuffer
+int CmdHF15Demod(const char *Cmd)
+{
+	// The sampling rate is 106.353 ksps/s, for T = 9.4 us
+	int frames;
 
 	if (GraphTraceLen < 1000) return 0;
 
-	// First, correlate for SOF
-	for (i = 0; i < 100; i++) {
-		int corr = 0;
-		for (j = 0; j < arraylen(FrameSOF); j += skip) {
-			corr += FrameSOF[j] * GraphBuffer[i + (j / skip)];
-		}
-		if (corr > max) {
-			max = corr;
-			maxPos = i;
-		}
-	}
-	PrintAndLog("SOF at %d, correlation %d", maxPos,
-		max / (arraylen(FrameSOF) / skip));
-	
-	i = maxPos + arraylen(FrameSOF) / skip;
-	int k = 0;
-	uint8_t outBuf[20];
-	memset(outBuf, 0, sizeof(outBuf));
-	uint8_t mask = 0x01;
-	for (;;) {
-		int corr0 = 0, corr1 = 0, corrEOF = 0;
-		for (j = 0; j < arraylen(Logic0); j += skip) {
-			corr0 += Logic0[j] * GraphBuffer[i + (j / skip)];
-		}
-		for (j = 0; j < arraylen(Logic1); j += skip) {
-			corr1 += Logic1[j] * GraphBuffer[i + (j / skip)];
-		}
-		for (j = 0; j < arraylen(FrameEOF); j += skip) {
-			corrEOF += FrameEOF[j] * GraphBuffer[i + (j / skip)];
-		}
-		// Even things out by the length of the target waveform.
-		corr0 *= 4;
-		corr1 *= 4;
-		
-		if (corrEOF > corr1 && corrEOF > corr0) {
-			PrintAndLog("EOF at %d", i);
-			break;
-		} else if (corr1 > corr0) {
-			i += arraylen(Logic1) / skip;
-			outBuf[k] |= mask;
-		} else {
-			i += arraylen(Logic0) / skip;
-		}
-		mask <<= 1;
-		if (mask == 0) {
-			k++;
-			mask = 0x01;
-		}
-		if ((i + (int)arraylen(FrameEOF)) >= GraphTraceLen) {
-			PrintAndLog("ran off end!");
-			break;
-		}
-	}
-	if (mask != 0x01) {
-		PrintAndLog("error, uneven octet! (discard extra bits!)");
-		PrintAndLog("   mask=%02x", mask);
-	}
-	PrintAndLog("%d octets", k);
-	
-	for (i = 0; i < k; i++) {
-		PrintAndLog("# %2d: %02x ", i, outBuf[i]);
+	PrintAndLog("%9s  %-6s  %-6s  %-4s  %s", "time/us", "src", "coding", "crc", "data");
+	frames = hf15_demod_stream(GraphBuffer, GraphTraceLen, PrintHF15Frame, NULL);
+	if (frames < 0) {
+		PrintAndLog("out of memory");
+		return 0;
 	}
-	PrintAndLog("CRC=%04x", Iso15693Crc(outBuf, k - 2));
+	PrintAndLog("%d frames", frames);
 	return 0;
 }
 
@@ -363,7 +314,7 @@ int CmdHF15DumpMem(const char*Cmd) {
 static command_t CommandTable15[] = 
 {
 	{"help",    CmdHF15Help,    1, "This help"},
-	{"demod",   CmdHF15Demod,   1, "Demodulate ISO15693 from tag"},
+	{"demod",   CmdHF15Demod,   1, "Demodulate all ISO15693 frames in the trace"},
 	{"read",    CmdHF15Read,    0, "Read HF tag (ISO 15693)"},
 	{"record",  CmdHF15Record,  0, "Record Samples (ISO 15693)"}, // atrox
 	{"reader",  CmdHF15Reader,  0, "Act like an ISO15693 reader"},
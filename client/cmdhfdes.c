@@ -8,8 +8,12 @@
 // High frequency MIFARE DESfire commands
 //-----------------------------------------------------------------------------
 
+#include <sys/time.h>
 #include "cmdhfdes.h"
 #include "proxmark3.h"
+#include "cmdmain.h"
+#include "desfirehost.h"
+#include "desfireemu.h"
 
 static int CmdHelp(const char *Cmd);
 
@@ -26,7 +30,7 @@ int CmdHFDESReader(const char *Cmd)
     uint64_t par_list = 0, ks_list = 0, r_key = 0;
     uint8_t isOK = 0;
     uint8_t keyBlock[8] = {0};
-    UsbCommand c  ={CMD_MIFARE_DES_READER, {3, 0x60, 0}};
+    UsbCommand c  ={CMD_MIFARE_DES_READER, {CONNECT, 0, 0}};
     SendCommand(&c);
 
     UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 2000);
@@ -64,13 +68,827 @@ int CmdHFDESDbg(const char *Cmd)
   return 0;
 }
 
+static double now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// string parameter that must fit in size bytes, returns its length or -1
+static int param_getstr_max(const char *Cmd, int paramnum, char *str, size_t size)
+{
+    int bg, en;
+
+    str[0] = '\0';
+    if (param_getptr(Cmd, &bg, &en, paramnum))
+        return 0;
+    if (en - bg + 1 >= (int)size)
+        return -1;
+    return param_getstr(Cmd, paramnum, str);
+}
+
+// variable length hex parameter, returns the number of bytes or -1
+static int param_gethex_var(const char *Cmd, int paramnum, uint8_t *data, int max)
+{
+    const char *str;
+    int bg, en, len, i;
+    unsigned int temp;
+
+    if (param_getptr(Cmd, &bg, &en, paramnum))
+        return -1;
+    str = Cmd + bg;
+    len = en - bg + 1;
+    if (len % 2 || len / 2 > max)
+        return -1;
+
+    for (i = 0; i < len; i += 2) {
+        if (!isxdigit(str[i]) || !isxdigit(str[i + 1]))
+            return -1;
+        sscanf((char[]){str[i], str[i + 1], 0}, "%X", &temp);
+        data[i / 2] = temp;
+    }
+    return len / 2;
+}
+
+static int report(int res)
+{
+    if (res < 0)
+        PrintAndLog("failed: %s (%d)", desfire_error(res), res);
+    return res < 0;
+}
+
+int CmdHFDESInfo(const char *Cmd)
+{
+    const desfire_session_t *session = desfire_session();
+    uint8_t version[28];
+    uint32_t aids[DESFIRE_MAX_APPS];
+    int res, i;
+
+    if (report(desfire_connect()))
+        return 0;
+
+    PrintAndLog("UID : %s", sprint_hex(session->uid, 7));
+    PrintAndLog("ATS : %s", sprint_hex(session->card.ats, session->card.ats_len));
+
+    res = desfire_get_version(version, sizeof(version));
+    if (report(res))
+        return 0;
+    if (res >= 28) {
+        PrintAndLog("HW  : vendor %02x type %02x/%02x version %d.%d storage %02x protocol %02x",
+            version[0], version[1], version[2], version[3], version[4], version[5], version[6]);
+        PrintAndLog("SW  : vendor %02x type %02x/%02x version %d.%d storage %02x protocol %02x",
+            version[7], version[8], version[9], version[10], version[11], version[12], version[13]);
+        PrintAndLog("Batch %s week %02x year %02x", sprint_hex(version + 21, 5), version[26], version[27]);
+    }
+
+    res = desfire_get_application_ids(aids, DESFIRE_MAX_APPS);
+    if (report(res))
+        return 0;
+    PrintAndLog("%d applications", res);
+    for (i = 0; i < res; i++)
+        PrintAndLog("  %06x", aids[i]);
+    return 0;
+}
+
+int CmdHFDESSelect(const char *Cmd)
+{
+    if (param_getchar(Cmd, 0) == 0) {
+        PrintAndLog("Usage:  hf des select <aid>");
+        PrintAndLog("        aid in hex, 0 selects the PICC level");
+        return 0;
+    }
+    report(desfire_select_application(param_get32ex(Cmd, 0, 0, 16) & 0xffffff));
+    return 0;
+}
+
+int CmdHFDESAuth(const char *Cmd)
+{
+    uint8_t key[24];
+    char type[8] = {0};
+    int len, key_slot, res;
+
+    len = param_gethex_var(Cmd, 1, key, sizeof(key));
+    if (param_getchar(Cmd, 0) == 0 || (len != 16 && len != 24) || param_getstr_max(Cmd, 2, type, sizeof(type)) < 0) {
+        PrintAndLog("Usage:  hf des auth <key slot> <key, 16 or 24 hex bytes> [iso|aes]");
+        PrintAndLog("        authenticates in the selected application, the");
+        PrintAndLog("        session keeps it for the following commands");
+        PrintAndLog("        16 byte keys use the legacy 2K3DES authentication,");
+        PrintAndLog("        iso the EV1 one; 24 byte keys are 3K3DES, aes keys AES-128");
+        return 0;
+    }
+    key_slot = param_get8(Cmd, 0);
+
+    if (!strcmp(type, "aes") && len == 16)
+        res = desfire_authenticate_ev1(key_slot, DESFIRE_KEY_AES, key);
+    else if (len == 24)
+        res = desfire_authenticate_ev1(key_slot, DESFIRE_KEY_3K3DES, key);
+    else if (!strcmp(type, "iso"))
+        res = desfire_authenticate_ev1(key_slot, DESFIRE_KEY_2K3DES, key);
+    else
+        res = desfire_authenticate(key_slot, key);
+
+    if (!report(res))
+        PrintAndLog("authenticated with key %d", key_slot);
+    return 0;
+}
+
+int CmdHFDESEmu(const char *Cmd)
+{
+    char mode[8] = {0};
+    int apps, files;
+
+    param_getstr_max(Cmd, 0, mode, sizeof(mode));
+    if (!strcmp(mode, "on")) {
+        desfire_set_transport(&desfire_emu_transport);
+    } else if (!strcmp(mode, "off")) {
+        desfire_set_transport(NULL);
+        PrintAndLog("hf des commands go to the device");
+        return 0;
+    } else if (!strcmp(mode, "reset")) {
+        desfire_emu_reset();
+        desfire_set_transport(&desfire_emu_transport);
+    } else {
+        PrintAndLog("Usage:  hf des emu <on|off|reset>");
+        PrintAndLog("        on:    hf des commands go to a card model on the host,");
+        PrintAndLog("               no device needed; its contents stay until reset");
+        PrintAndLog("        off:   back to the device");
+        PrintAndLog("        reset: on, with the test card again: 3 applications");
+        PrintAndLog("               with 2K3DES, 3K3DES and AES keys, all zero");
+        return 0;
+    }
+    desfire_emu_stats(&apps, &files);
+    PrintAndLog("emulated card: %d applications, %d files, %u commands run", apps, files, desfire_emu_commands());
+    return 0;
+}
+
+int CmdHFDESSim(const char *Cmd)
+{
+    static uint8_t image[DESFIRE_SIM_IMAGE_MAX];
+    char fileName[256] = {0};
+    int write = param_getchar(Cmd, 0) == 'w' && param_getchar(Cmd, 1);
+    int len, i;
+    FILE *f;
+
+    if (param_getchar(Cmd, 0) == 'h') {
+        PrintAndLog("Usage:  hf des sim [<image file> | w <image file>]");
+        PrintAndLog("        simulates the card of hf des emu, or the one of an");
+        PrintAndLog("        image file, on the device until the button is pressed;");
+        PrintAndLog("        w writes the image of the hf des emu card instead");
+        return 0;
+    }
+
+    if (write || !param_getchar(Cmd, 0)) {
+        if ((len = desfire_emu_image(image, sizeof(image))) < 0) {
+            PrintAndLog("The card does not fit the %d bytes of the device", DESFIRE_SIM_IMAGE_MAX);
+            return 0;
+        }
+    } else {
+        if (param_getstr_max(Cmd, 0, fileName, sizeof(fileName)) < 0) {
+            PrintAndLog("File name too long");
+            return 0;
+        }
+        if ((f = fopen(fileName, "rb")) == NULL) {
+            PrintAndLog("Could not open %s", fileName);
+            return 0;
+        }
+        len = fread(image, 1, sizeof(image), f);
+        fclose(f);
+    }
+
+    if (write) {
+        if (param_getstr_max(Cmd, 1, fileName, sizeof(fileName)) < 0) {
+            PrintAndLog("File name too long");
+            return 0;
+        }
+        if ((f = fopen(fileName, "wb")) == NULL) {
+            PrintAndLog("Could not create %s", fileName);
+            return 0;
+        }
+        fwrite(image, 1, len, f);
+        fclose(f);
+        PrintAndLog("%d byte image written to %s", len, fileName);
+        return 0;
+    }
+
+    for (i = 0; i < len; i += 48) {
+        UsbCommand c = {CMD_MIFARE_DES_SIM_LOAD, {i, len - i < 48 ? len - i : 48, 0}};
+
+        memcpy(c.d.asBytes, image + i, c.arg[1]);
+        SendCommand(&c);
+    }
+    UsbCommand c = {CMD_SIMULATE_MIFARE_DES, {len, 0, 0}};
+    SendCommand(&c);
+    PrintAndLog("%d byte image loaded, press the button to stop", len);
+    return 0;
+}
+
+// SP 800-38B, examples in D.1 (AES-128) and D.3 (three key TDEA)
+static const uint8_t nist_aes_key[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+static const uint8_t nist_tdea_key[24] = {
+    0x8a, 0xa8, 0x3b, 0xf8, 0xcb, 0xda, 0x10, 0x62, 0x0b, 0xc1, 0xbf, 0x19, 0xfb, 0xb6, 0xcd, 0x58,
+    0xbc, 0x31, 0x3d, 0x4a, 0x37, 0x1c, 0xa8, 0xb5,
+};
+
+static const uint8_t nist_message[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+
+static const struct {
+    const char *name;
+    int type;
+    int len;
+    uint8_t mac[16];
+} nist_cmac[] = {
+    {"CMAC-AES128 0 bytes", DESFIRE_KEY_AES, 0,
+     {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46}},
+    {"CMAC-AES128 16 bytes", DESFIRE_KEY_AES, 16,
+     {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c}},
+    {"CMAC-AES128 40 bytes", DESFIRE_KEY_AES, 40,
+     {0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27}},
+    {"CMAC-AES128 64 bytes", DESFIRE_KEY_AES, 64,
+     {0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe}},
+    {"CMAC-TDEA 0 bytes", DESFIRE_KEY_3K3DES, 0,
+     {0xb7, 0xa6, 0x88, 0xe1, 0x22, 0xff, 0xaf, 0x95}},
+    {"CMAC-TDEA 8 bytes", DESFIRE_KEY_3K3DES, 8,
+     {0x8e, 0x8f, 0x29, 0x31, 0x36, 0x28, 0x37, 0x97}},
+    {"CMAC-TDEA 20 bytes", DESFIRE_KEY_3K3DES, 20,
+     {0x74, 0x3d, 0xdb, 0xe0, 0xce, 0x2d, 0xc2, 0xed}},
+    {"CMAC-TDEA 32 bytes", DESFIRE_KEY_3K3DES, 32,
+     {0x33, 0xe6, 0xb1, 0x09, 0x24, 0x00, 0xea, 0xe5}},
+};
+
+// Checks AES, DES and CMAC against FIPS and NIST vectors. Returns the name
+// of the first one that fails, or NULL.
+static const char *crypto_selftest(void)
+{
+    // FIPS-197 C.1 and the FIPS 46 worked example
+    static const uint8_t aes_cipher[16] = {
+        0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+    };
+    static const uint8_t des_key[8] = {0x13, 0x34, 0x57, 0x79, 0x9b, 0xbc, 0xdf, 0xf1};
+    static const uint8_t des_plain[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+    static const uint8_t des_cipher[8] = {0x85, 0xe8, 0x13, 0x54, 0x0f, 0x0a, 0xb4, 0x05};
+    desfire_cipher_t cipher;
+    uint8_t key[16], block[16], plain[16], iv[16];
+    unsigned i;
+
+    for (i = 0; i < 16; i++) {
+        key[i] = i;
+        plain[i] = i * 0x11;
+    }
+    aes_setkey(&cipher.aes, key);
+    memcpy(block, plain, 16);
+    aes_encrypt_block(&cipher.aes, block);
+    if (memcmp(block, aes_cipher, 16))
+        return "AES-128 encryption";
+    aes_decrypt_block(&cipher.aes, block);
+    if (memcmp(block, plain, 16))
+        return "AES-128 decryption";
+
+    memset(&cipher.des, 0, sizeof(cipher.des));
+    des_setkey(&cipher.des, des_key, 8);
+    memcpy(block, des_plain, 8);
+    des_encrypt_block(&cipher.des, block);
+    if (memcmp(block, des_cipher, 8))
+        return "DES encryption";
+
+    for (i = 0; i < sizeof(nist_cmac) / sizeof(nist_cmac[0]); i++) {
+        memset(&cipher, 0, sizeof(cipher));
+        desfire_cipher_setkey(&cipher, nist_cmac[i].type,
+            nist_cmac[i].type == DESFIRE_KEY_AES ? nist_aes_key : nist_tdea_key);
+        memset(iv, 0, sizeof(iv));
+        desfire_cmac(&cipher, nist_message, nist_cmac[i].len, iv);
+        if (memcmp(iv, nist_cmac[i].mac, cipher.block_size))
+            return nist_cmac[i].name;
+    }
+    return NULL;
+}
+
+int CmdHFDESSelftest(const char *Cmd)
+{
+    const char *failed = crypto_selftest();
+
+    if (failed)
+        PrintAndLog("%s does not match the test vector", failed);
+    else
+        PrintAndLog("AES, DES, CMAC: all test vectors match");
+
+    failed = desfire_emu_sim_check();
+    if (failed)
+        PrintAndLog("the simulated card answers %s differently over ISO14443-4", failed);
+    else
+        PrintAndLog("card image: the simulation answers the same over ISO14443-4");
+    return 0;
+}
+
+// tried by hf des chk when no keys are given
+static const uint8_t chk_default_keys[][16] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f},
+    {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff},
+    {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff},
+    {0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f},
+    {0x4d, 0x49, 0x46, 0x41, 0x52, 0x45, 0x20, 0x44, 0x45, 0x53, 0x46, 0x69, 0x72, 0x65, 0x20, 0x31},
+};
+
+static int add_key(uint8_t **keys, int *count, const uint8_t *key)
+{
+    uint8_t *p;
+
+    if (*count % 64 == 0) {
+        if ((p = realloc(*keys, 16 * (*count + 64))) == NULL)
+            return -1;
+        *keys = p;
+    }
+    memcpy(*keys + 16 * (*count)++, key, 16);
+    return 0;
+}
+
+int CmdHFDESChk(const char *Cmd)
+{
+    uint8_t *keys = NULL, key[16];
+    int count = 0, key_slot, tried, i, res;
+    uint32_t aid, ms;
+    char filename[256], line[256];
+    FILE *f;
+
+    if (param_getchar(Cmd, 1) == 0) {
+        PrintAndLog("Usage:  hf des chk <aid> <key slot> [<key, 16 hex bytes>|<dictionary file>]...");
+        PrintAndLog("        tries 2K3DES keys on the device, one key per line in");
+        PrintAndLog("        the dictionary, # starts a comment");
+        PrintAndLog("        sample: hf des chk 0 0 000102030405060708090a0b0c0d0e0f keys.dic");
+        return 0;
+    }
+    aid = param_get32ex(Cmd, 0, 0, 16) & 0xffffff;
+    key_slot = param_get8(Cmd, 1);
+
+    for (i = 2; param_getchar(Cmd, i); i++) {
+        if (!param_gethex(Cmd, i, key, 32)) {
+            if (add_key(&keys, &count, key))
+                goto nomem;
+            continue;
+        }
+        if (param_getstr_max(Cmd, i, filename, sizeof(filename)) < 0) {
+            PrintAndLog("file name too long");
+            free(keys);
+            return 0;
+        }
+        if ((f = fopen(filename, "r")) == NULL) {
+            PrintAndLog("not a key or a readable file: %s", filename);
+            free(keys);
+            return 0;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            if (line[0] == '#' || param_getchar(line, 0) == 0)
+                continue;
+            if (param_gethex(line, 0, key, 32)) {
+                PrintAndLog("skipping '%s', a key has 32 hex digits", strtok(line, "\r\n"));
+                continue;
+            }
+            if (add_key(&keys, &count, key)) {
+                fclose(f);
+                goto nomem;
+            }
+        }
+        fclose(f);
+    }
+    if (count == 0) {
+        for (i = 0; i < (int)(sizeof(chk_default_keys) / 16); i++)
+            if (add_key(&keys, &count, chk_default_keys[i]))
+                goto nomem;
+    }
+
+    PrintAndLog("trying %d keys on key %d of application %06x", count, key_slot, aid);
+    res = desfire_check_keys(aid, key_slot, keys, count, &tried, &ms);
+    if (tried > 0 && ms > 0)
+        PrintAndLog("%d keys in %u ms, %.1f keys/s", tried, ms, tried * 1000.0 / ms);
+    if (!report(res)) {
+        if (res < count)
+            PrintAndLog("found key: %s", sprint_hex(keys + 16 * res, 16));
+        else
+            PrintAndLog("no key found");
+    }
+    free(keys);
+    return 0;
+
+nomem:
+    PrintAndLog("Cannot allocate memory for keys");
+    free(keys);
+    return 0;
+}
+
+int CmdHFDESRead(const char *Cmd)
+{
+    uint8_t data[8192];
+    int res, i;
+
+    if (param_getchar(Cmd, 0) == 0) {
+        PrintAndLog("Usage:  hf des read <file> [offset] [length]");
+        PrintAndLog("        reads a data file of the selected application,");
+        PrintAndLog("        length 0 reads up to its end");
+        return 0;
+    }
+    res = desfire_read_data(param_get8ex(Cmd, 0, 0, 16), param_get32ex(Cmd, 1, 0, 10),
+        param_get32ex(Cmd, 2, 0, 10), data, sizeof(data));
+    if (report(res))
+        return 0;
+    for (i = 0; i < res; i += 16)
+        PrintAndLog("%04x: %s", i, sprint_hex(data + i, res - i < 16 ? res - i : 16));
+    return 0;
+}
+
+int CmdHFDESWrite(const char *Cmd)
+{
+    uint8_t data[128];
+    int len;
+
+    len = param_gethex_var(Cmd, 2, data, sizeof(data));
+    if (param_getchar(Cmd, 0) == 0 || len < 0) {
+        PrintAndLog("Usage:  hf des write <file> <offset> <hex data> [e]");
+        PrintAndLog("        e: enciphered communication, needs hf des auth");
+        return 0;
+    }
+    report(desfire_write_data(param_get8ex(Cmd, 0, 0, 16), param_get32ex(Cmd, 1, 0, 10),
+        len, data, param_getchar(Cmd, 3) == 'e'));
+    return 0;
+}
+
+int CmdHFDESValue(const char *Cmd)
+{
+    uint8_t file = param_get8ex(Cmd, 0, 0, 16);
+    char op[16] = {0};
+    int32_t value;
+    int encrypt = param_getchar(Cmd, 3) == 'e';
+    int res = 0;
+
+    if (param_getchar(Cmd, 0) == 0 || param_getstr_max(Cmd, 1, op, sizeof(op)) < 0) {
+        PrintAndLog("Usage:  hf des value <file> [credit|debit|lcredit <amount> [e]]");
+        PrintAndLog("        without an operation the value is read, changes");
+        PrintAndLog("        take effect with hf des commit");
+        return 0;
+    }
+
+    value = param_get32ex(Cmd, 2, 0, 10);
+    if (!strcmp(op, "credit"))
+        res = desfire_credit(file, value, encrypt);
+    else if (!strcmp(op, "debit"))
+        res = desfire_debit(file, value, encrypt);
+    else if (!strcmp(op, "lcredit"))
+        res = desfire_limited_credit(file, value, encrypt);
+    if (report(res))
+        return 0;
+
+    if (!report(desfire_get_value(file, &value)))
+        PrintAndLog("value: %d", value);
+    return 0;
+}
+
+int CmdHFDESRecords(const char *Cmd)
+{
+    uint8_t file = param_get8ex(Cmd, 0, 0, 16);
+    uint8_t data[8192];
+    char op[16] = {0};
+    int res, i;
+
+    if (param_getchar(Cmd, 0) == 0 || param_getstr_max(Cmd, 1, op, sizeof(op)) < 0 || (op[0] && strcmp(op, "read") && strcmp(op, "write") && strcmp(op, "clear"))) {
+        PrintAndLog("Usage:  hf des records <file> [read [offset] [count]]");
+        PrintAndLog("        hf des records <file> write <offset> <hex data> [e]");
+        PrintAndLog("        hf des records <file> clear");
+        PrintAndLog("        writes and clearing take effect with hf des commit");
+        return 0;
+    }
+
+    if (!strcmp(op, "write")) {
+        int len = param_gethex_var(Cmd, 3, data, sizeof(data));
+        if (len < 0) {
+            PrintAndLog("hex data expected");
+            return 0;
+        }
+        report(desfire_write_record(file, param_get32ex(Cmd, 2, 0, 10), len, data, param_getchar(Cmd, 4) == 'e'));
+        return 0;
+    }
+    if (!strcmp(op, "clear")) {
+        report(desfire_clear_record_file(file));
+        return 0;
+    }
+
+    res = desfire_read_records(file, param_get32ex(Cmd, 2, 0, 10), param_get32ex(Cmd, 3, 0, 10), data, sizeof(data));
+    if (report(res))
+        return 0;
+    for (i = 0; i < res; i += 16)
+        PrintAndLog("%04x: %s", i, sprint_hex(data + i, res - i < 16 ? res - i : 16));
+    return 0;
+}
+
+int CmdHFDESCommit(const char *Cmd)
+{
+    report(desfire_commit_transaction());
+    return 0;
+}
+
+int CmdHFDESAbort(const char *Cmd)
+{
+    report(desfire_abort_transaction());
+    return 0;
+}
+
+int CmdHFDESClose(const char *Cmd)
+{
+    desfire_disconnect();
+    return 0;
+}
+
+int CmdHFDESBench(const char *Cmd)
+{
+    int count = param_get32ex(Cmd, 0, 100, 10);
+    int cold = count < 10 ? count : 10;
+    uint8_t version[28];
+    double start, elapsed;
+    int i, res;
+
+    if (count <= 0) {
+        PrintAndLog("Usage:  hf des bench [count]");
+        PrintAndLog("        times count GET_VERSION commands in one session,");
+        PrintAndLog("        and a few with the card activated for each");
+        return 0;
+    }
+
+    desfire_disconnect();
+    start = now_ms();
+    if (report(desfire_connect()))
+        return 0;
+    PrintAndLog("activation: %.1f ms", now_ms() - start);
+
+    start = now_ms();
+    for (i = 0; i < count; i++) {
+        if (ukbhit()) {
+            getchar();
+            PrintAndLog("aborted via keyboard!");
+            break;
+        }
+        if (report(res = desfire_get_version(version, sizeof(version))))
+            break;
+    }
+    elapsed = now_ms() - start;
+    if (i > 0)
+        PrintAndLog("session:    %d commands in %.1f ms, %.1f commands/s",
+            i, elapsed, i * 1000.0 / elapsed);
+    if (i < count)
+        return 0;
+
+    start = now_ms();
+    for (i = 0; i < cold; i++) {
+        desfire_disconnect();
+        if (report(res = desfire_get_version(version, sizeof(version))))
+            break;
+    }
+    elapsed = now_ms() - start;
+    if (i > 0)
+        PrintAndLog("reconnect:  %d commands in %.1f ms, %.1f commands/s",
+            i, elapsed, i * 1000.0 / elapsed);
+    return 0;
+}
+
+typedef struct {
+    FILE *f;
+    int bytes;
+    int errors;
+} dump_state_t;
+
+static uint32_t get24(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static void dump_hex(FILE *f, const uint8_t *data, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        fprintf(f, "%02x", data[i]);
+    fprintf(f, "\n");
+}
+
+static void dump_job_done(desfire_job_t *job, void *ctx)
+{
+    dump_state_t *dump = ctx;
+    uint8_t file = job->cmd[1];
+
+    if (job->result < 0) {
+        fprintf(dump->f, "error %02x %s\n", file, desfire_error(job->result));
+        dump->errors++;
+        return;
+    }
+    dump->bytes += job->result;
+
+    switch (job->cmd[0]) {
+        case READ_DATA:
+            fprintf(dump->f, "data %02x %u ", file, get24(job->cmd + 2));
+            dump_hex(dump->f, job->resp, job->result);
+            break;
+        case READ_RECORDS:
+            fprintf(dump->f, "records %02x %u ", file, get24(job->cmd + 2));
+            dump_hex(dump->f, job->resp, job->result);
+            break;
+        case GET_VALUE:
+            if (job->result >= 4)
+                fprintf(dump->f, "value %02x %d\n", file,
+                    (int32_t)(job->resp[0] | job->resp[1] << 8 | job->resp[2] << 16 | (uint32_t)job->resp[3] << 24));
+            break;
+    }
+}
+
+static desfire_job_t *add_job(desfire_job_t *jobs, int *count, enum desfire_command_id id, uint8_t file, uint32_t offset, uint32_t length)
+{
+    desfire_job_t *job = &jobs[(*count)++];
+
+    job->len = desfire_encode(job->cmd, id, (const uint32_t[]){file, offset, length});
+    return job;
+}
+
+// Read jobs for a file, responses are split at what one command returns
+static int add_read_jobs(desfire_job_t *jobs, int count, int room, uint8_t file, const uint8_t *settings)
+{
+    uint32_t size, record, records, step;
+
+    switch (settings[0]) {
+        case DESFIRE_STANDARD_DATA_FILE:
+        case DESFIRE_BACKUP_DATA_FILE:
+            size = get24(settings + 4);
+            for (uint32_t offset = 0; offset < size && count < room; offset += DESFIRE_CHAIN_LIMIT)
+                add_job(jobs, &count, DESFIRE_ID_READ_DATA, file, offset,
+                    size - offset < DESFIRE_CHAIN_LIMIT ? size - offset : DESFIRE_CHAIN_LIMIT);
+            break;
+        case DESFIRE_VALUE_FILE:
+            if (count < room)
+                add_job(jobs, &count, DESFIRE_ID_GET_VALUE, file, 0, 0);
+            break;
+        case DESFIRE_LINEAR_RECORD_FILE:
+        case DESFIRE_CYCLIC_RECORD_FILE:
+            record = get24(settings + 4);
+            records = get24(settings + 10);
+            step = record && record < DESFIRE_CHAIN_LIMIT ? DESFIRE_CHAIN_LIMIT / record : 1;
+            for (uint32_t offset = 0; offset < records && count < room; offset += step)
+                add_job(jobs, &count, DESFIRE_ID_READ_RECORDS, file, offset,
+                    records - offset < step ? records - offset : step);
+            break;
+    }
+    return count;
+}
+
+// One application: key settings, file settings, then the contents with the
+// reads pipelined. Returns -1 if the card is gone.
+static int dump_application(FILE *f, uint32_t aid, int key_slot, const uint8_t *key)
+{
+    uint8_t files[DESFIRE_MAX_FILES], settings[DESFIRE_MAX_FILES][32], keys[2];
+    int settings_len[DESFIRE_MAX_FILES];
+    desfire_job_t jobs[DESFIRE_MAX_FILES + 64];
+    dump_state_t dump = {f, 0, 0};
+    uint8_t *buffers;
+    int nfiles = 0, count = 0, res, i;
+    double start = now_ms();
+
+    fprintf(f, "application %06x\n", aid);
+    if ((res = desfire_select_application(aid)) < 0) {
+        fprintf(f, "error select %s\n", desfire_error(res));
+        return res == DESFIRE_LINK_ERROR ? -1 : 0;
+    }
+    if (key && (res = desfire_authenticate(key_slot, key)) < 0)
+        fprintf(f, "error auth %s\n", desfire_error(res));
 
+    if ((res = desfire_get_key_settings(keys, sizeof(keys))) >= 2)
+        fprintf(f, "keysettings %02x%02x\n", keys[0], keys[1]);
+
+    if (aid != 0 && (nfiles = desfire_get_file_ids(files, sizeof(files))) < 0) {
+        fprintf(f, "error files %s\n", desfire_error(nfiles));
+        return nfiles == DESFIRE_LINK_ERROR ? -1 : 0;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+        desfire_job_t *job = add_job(jobs, &count, DESFIRE_ID_GET_FILE_SETTINGS, files[i], 0, 0);
+        job->len = 2;
+        job->resp = settings[i];
+        job->max = sizeof(settings[i]);
+    }
+    if (desfire_run_jobs(jobs, count, NULL, NULL) < 0)
+        return -1;
+
+    for (i = 0; i < nfiles; i++) {
+        settings_len[i] = jobs[i].result;
+        if (settings_len[i] < 7) {
+            fprintf(f, "error %02x %s\n", files[i], settings_len[i] < 0 ? desfire_error(settings_len[i]) : "short file settings");
+            continue;
+        }
+        fprintf(f, "file %02x ", files[i]);
+        dump_hex(f, settings[i], settings_len[i]);
+    }
+
+    count = 0;
+    for (i = 0; i < nfiles; i++)
+        if (settings_len[i] >= 7)
+            count = add_read_jobs(jobs, count, arraylen(jobs), files[i], settings[i]);
+
+    buffers = malloc(count * DESFIRE_CHAIN_LIMIT);
+    if (buffers == NULL && count) {
+        PrintAndLog("out of memory");
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        jobs[i].resp = buffers + i * DESFIRE_CHAIN_LIMIT;
+        jobs[i].max = DESFIRE_CHAIN_LIMIT;
+    }
+    res = desfire_run_jobs(jobs, count, dump_job_done, &dump);
+    free(buffers);
+
+    fprintf(f, "time %06x %.1f ms\n", aid, now_ms() - start);
+    PrintAndLog("  %06x: %2d files, %5d bytes, %d errors in %.1f ms", aid, nfiles, dump.bytes, dump.errors, now_ms() - start);
+    return res < 0 ? -1 : 0;
+}
+
+int CmdHFDESDump(const char *Cmd)
+{
+    const desfire_session_t *session = desfire_session();
+    uint8_t key[16], version[28];
+    uint32_t aids[DESFIRE_MAX_APPS + 1];
+    int key_slot = -1, napps, res, i;
+    char fileName[200];
+    double start;
+    FILE *f;
+
+    if (param_getchar(Cmd, 0) == 'h' || (param_getchar(Cmd, 0) && param_gethex(Cmd, 1, key, 32))) {
+        PrintAndLog("Usage:  hf des dump [<key slot> <key, 16 hex bytes>]");
+        PrintAndLog("        reads every application and file into <uid>.desfire,");
+        PrintAndLog("        authenticating in each application if a key is given");
+        return 0;
+    }
+    if (param_getchar(Cmd, 0))
+        key_slot = param_get8(Cmd, 0);
+
+    start = now_ms();
+    if (report(desfire_connect()))
+        return 0;
+    if (report(res = desfire_get_version(version, sizeof(version))))
+        return 0;
+
+    aids[0] = 0;
+    if (report(napps = desfire_get_application_ids(aids + 1, DESFIRE_MAX_APPS)))
+        return 0;
+
+    FillFileNameByUID(fileName, (uint8_t *)session->uid, ".desfire", 7);
+    if ((f = fopen(fileName, "w")) == NULL) {
+        PrintAndLog("Could not create file name %s", fileName);
+        return 0;
+    }
+    fprintf(f, "# MIFARE DESfire dump\n");
+    fprintf(f, "uid ");
+    dump_hex(f, session->uid, 7);
+    fprintf(f, "ats ");
+    dump_hex(f, session->card.ats, session->card.ats_len);
+    fprintf(f, "fsc %d\n", desfire_fsc());
+    fprintf(f, "version ");
+    dump_hex(f, version, res);
+
+    PrintAndLog("%d applications", napps);
+    for (i = 0; i <= napps; i++) {
+        if (dump_application(f, aids[i], key_slot, key_slot >= 0 ? key : NULL) < 0) {
+            PrintAndLog("card lost");
+            break;
+        }
+    }
+    fclose(f);
+    PrintAndLog("Dumped to %s in %.1f ms", fileName, now_ms() - start);
+    return 0;
+}
 
 static command_t CommandTable[] = 
 {
     {"help",    CmdHelp,    1,  "This help"},
     {"dbg",     CmdHFDESDbg, 0, "Set default debug mode"},
     {"reader",  CmdHFDESReader, 0, "Reader"}, 
+    {"info",    CmdHFDESInfo,   0, "Card version and applications"},
+    {"select",  CmdHFDESSelect, 0, "Select an application"},
+    {"auth",    CmdHFDESAuth,   0, "Authenticate with a 2K3DES, 3K3DES or AES key"},
+    {"chk",     CmdHFDESChk,    0, "Try a list of 2K3DES keys on the device"},
+    {"read",    CmdHFDESRead,   0, "Read a data file"},
+    {"write",   CmdHFDESWrite,  0, "Write a data file"},
+    {"value",   CmdHFDESValue,  0, "Read or change a value file"},
+    {"records", CmdHFDESRecords, 0, "Read, write or clear a record file"},
+    {"dump",    CmdHFDESDump,   0, "Dump all applications and files"},
+    {"commit",  CmdHFDESCommit, 0, "Commit the transaction"},
+    {"abort",   CmdHFDESAbort,  0, "Abort the transaction"},
+    {"close",   CmdHFDESClose,  0, "End the card session and switch the field off"},
+    {"bench",   CmdHFDESBench,  0, "Commands per second in one session"},
+    {"emu",     CmdHFDESEmu,    1, "Run the hf des commands against a card model on the host"},
+    {"sim",     CmdHFDESSim,    0, "Simulate the emulated card or an image file on the device"},
+    {"selftest", CmdHFDESSelftest, 1, "Check the ciphers and the card simulation on the host"},
     {"test",    CmdHFDEStest,   0,  "test"},
     {NULL, NULL, 0, NULL}
 };
@@ -8,17 +8,16 @@
 // High frequency MIFARE commands
 //-----------------------------------------------------------------------------
 
+#include <time.h>
 #include "cmdhfmf.h"
 #include "proxmark3.h"
+#include "mifareemu.h"
 
 static int CmdHelp(const char *Cmd);
 
 int CmdHF14AMifare(const char *Cmd)
 {
-	uint32_t uid = 0;
-	uint32_t nt = 0;
-	uint64_t par_list = 0, ks_list = 0, r_key = 0;
-	uint8_t isOK = 0;
+	uint64_t r_key = 0;
 	uint8_t keyBlock[8] = {0};
 
 	if (param_getchar(Cmd, 0) && param_gethex(Cmd, 0, keyBlock, 8)) {
@@ -26,11 +25,6 @@ int CmdHF14AMifare(const char *Cmd)
 		return 1;
 	}
 
-	
-	UsbCommand c = {CMD_READER_MIFARE, {(uint32_t)bytes_to_num(keyBlock, 4), 0, 0}};
-start:
-	SendCommand(&c);
-	
 	//flush queue
 	while (ukbhit())	getchar();
 
@@ -40,56 +34,8 @@ start:
 	printf("Press the key on the proxmark3 device to abort both proxmark3 and client.\n");
 	printf("-------------------------------------------------------------------------\n");
 	
-	// wait cycle
-	while (true) {
-		printf(".");
-		fflush(stdout);
-		if (ukbhit()) {
-			getchar();
-			printf("\naborted via keyboard!\n");
-			break;
-		}
-		
-		UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 2000);
-		if (resp != NULL) {
-			isOK  = resp->arg[0] & 0xff;
-	
-			uid = (uint32_t)bytes_to_num(resp->d.asBytes +  0, 4);
-			nt =  (uint32_t)bytes_to_num(resp->d.asBytes +  4, 4);
-			par_list = bytes_to_num(resp->d.asBytes +  8, 8);
-			ks_list = bytes_to_num(resp->d.asBytes +  16, 8);
-	
-			printf("\n\n");
-			PrintAndLog("isOk:%02x", isOK);
-			if (!isOK) PrintAndLog("Proxmark can't get statistic info. Execution aborted.\n");
-			break;
-		}
-	}	
-	printf("\n");
-	
-	// error
-	if (isOK != 1) return 1;
-	
-	// execute original function from util nonce2key
-	if (nonce2key(uid, nt, par_list, ks_list, &r_key))
-	{
-		isOK = 2;
-		PrintAndLog("Key not found (lfsr_common_prefix list is null). Nt=%08x", nt);	
-	} else {
-		printf("------------------------------------------------------------------\n");
-		PrintAndLog("Key found:%012llx \n", r_key);
-
-		num_to_bytes(r_key, 6, keyBlock);
-		isOK = mfCheckKeys(0, 0, 1, keyBlock, &r_key);
-	}
-	if (!isOK) 
-		PrintAndLog("Found valid key:%012llx", r_key);
-	else
-	{
-		if (isOK != 2) PrintAndLog("Found invalid key. ( Nt=%08x ,Trying use it to run again...", nt);	
-		c.arg[0] = nt;
-		goto start;
-	}
+	if (mfDarkside((uint32_t)bytes_to_num(keyBlock, 4), &r_key)) return 1;
+	PrintAndLog("Found valid key:%012llx", r_key);
 	
 	return 0;
 }
@@ -130,8 +76,8 @@ int CmdHF14AMfWrBl(const char *Cmd)
   UsbCommand c = {CMD_MIFARE_WRITEBL, {blockNo, keyType, 0}};
 	memcpy(c.d.asBytes, key, 6);
 	memcpy(c.d.asBytes + 10, bldata, 16);
-  SendCommand(&c);
-	UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 1500);
+  mfSendCommand(&c);
+	UsbCommand * resp = mfWaitForResponseTimeout(CMD_ACK, 1500);
 
 	if (resp != NULL) {
 		uint8_t                isOK  = resp->arg[0] & 0xff;
@@ -174,8 +120,8 @@ int CmdHF14AMfRdBl(const char *Cmd)
 	
   UsbCommand c = {CMD_MIFARE_READBL, {blockNo, keyType, 0}};
 	memcpy(c.d.asBytes, key, 6);
-  SendCommand(&c);
-	UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 1500);
+  mfSendCommand(&c);
+	UsbCommand * resp = mfWaitForResponseTimeout(CMD_ACK, 1500);
 
 	if (resp != NULL) {
 		uint8_t                isOK  = resp->arg[0] & 0xff;
@@ -229,8 +175,8 @@ int CmdHF14AMfRdSc(const char *Cmd)
 	
   UsbCommand c = {CMD_MIFARE_READSC, {sectorNo, keyType, 0}};
 	memcpy(c.d.asBytes, key, 6);
-  SendCommand(&c);
-	UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 1500);
+  mfSendCommand(&c);
+	UsbCommand * resp = mfWaitForResponseTimeout(CMD_ACK, 1500);
 	PrintAndLog(" ");
 
 	if (resp != NULL) {
@@ -247,7 +193,7 @@ int CmdHF14AMfRdSc(const char *Cmd)
 	}
 
 		// response2
-	resp = WaitForResponseTimeout(CMD_ACK, 500);
+	resp = mfWaitForResponseTimeout(CMD_ACK, 500);
 	PrintAndLog(" ");
 
 	if (resp != NULL) {
@@ -265,132 +211,130 @@ int CmdHF14AMfRdSc(const char *Cmd)
   return 0;
 }
 
+// a file name parameter, def if there is none
+static int dump_file_name(const char *Cmd, int paramnum, char *fileName, int size, const char *def)
+{
+	int bg, en;
+
+	if (param_getptr(Cmd, &bg, &en, paramnum)) {
+		strcpy(fileName, def);
+		return 0;
+	}
+	if (en - bg + 1 >= size)
+		return 1;
+	param_getstr(Cmd, paramnum, fileName);
+	return 0;
+}
+
 int CmdHF14AMfDump(const char *Cmd)
 {
-	int i, j;
+	int i, j, res, blocks;
 	
 	uint8_t keyA[40][6];
 	uint8_t keyB[40][6];
-	uint8_t rights[40][4];
+	uint8_t status[40];
+	uint8_t data[4096];
+	mf_chk_key_t table[80];
+	uint8_t SectorsCnt = 16;
+	uint32_t ms;
+	char keyFile[256], dataFile[256];
 	
 	FILE *fin;
 	FILE *fout;
 	
-	UsbCommand *resp;
+	if (param_getchar(Cmd, 0) == 'h') {
+		PrintAndLog("Usage:  hf mf dump [<card memory> [<key file> [<data file>]]]");
+		PrintAndLog("Reads the card with the keys in the key file to the data file,");
+		PrintAndLog("each sector in one session on the device");
+		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K, <other> - 1K");
+		PrintAndLog("key file    - A keys, then B keys, 6 bytes each, default dumpkeys.bin");
+		PrintAndLog("data file   - default dumpdata.bin");
+		PrintAndLog("      sample: hf mf dump 4");
+		PrintAndLog("              hf mf dump 1 mykeys.bin mydump.bin");
+		return 0;
+	}
 	
-	if ((fin = fopen("dumpkeys.bin","rb")) == NULL) {
-		PrintAndLog("Could not find file dumpkeys.bin");
+	if (!mfTransportIsDevice()) {
+		PrintAndLog("hf mf dump needs the device, the card model of hf mf emu does not dump");
 		return 1;
 	}
 	
-	if ((fout = fopen("dumpdata.bin","wb")) == NULL) { 
-		PrintAndLog("Could not create file name dumpdata.bin");
+	switch (param_getchar(Cmd, 0)) {
+		case '0': SectorsCnt =  5; break;
+		case '1': SectorsCnt = 16; break;
+		case '2': SectorsCnt = 32; break;
+		case '4': SectorsCnt = 40; break;
+		default:  SectorsCnt = 16;
+	}
+	blocks = SectorsCnt < 32 ? SectorsCnt * 4 : 128 + (SectorsCnt - 32) * 16;
+	
+	if (dump_file_name(Cmd, 1, keyFile, sizeof(keyFile), "dumpkeys.bin")
+	    || dump_file_name(Cmd, 2, dataFile, sizeof(dataFile), "dumpdata.bin")) {
+		PrintAndLog("File name too long");
+		return 1;
+	}
+	
+	if ((fin = fopen(keyFile,"rb")) == NULL) {
+		PrintAndLog("Could not find file %s", keyFile);
 		return 1;
 	}
 	
 	// Read key file
 	
-	for (i=0 ; i<16 ; i++) {
-		fread ( keyA[i], 1, 6, fin );
+	for (i=0 ; i<SectorsCnt ; i++) {
+		if (fread ( keyA[i], 1, 6, fin ) != 6) break;
 	}
-	for (i=0 ; i<16 ; i++) {
-		fread ( keyB[i], 1, 6, fin );
+	for (j=0 ; i == SectorsCnt && j<SectorsCnt ; j++) {
+		if (fread ( keyB[j], 1, 6, fin ) != 6) break;
 	}
-	
-	// Read access rights to sectors
-	
-	PrintAndLog("|-----------------------------------------|");
-	PrintAndLog("|------ Reading sector access bits...-----|");
-	PrintAndLog("|-----------------------------------------|");
-	
-	for (i = 0 ; i < 16 ; i++) {
-		UsbCommand c = {CMD_MIFARE_READBL, {4*i + 3, 0, 0}};
-		memcpy(c.d.asBytes, keyA[i], 6);
-		SendCommand(&c);
-		resp = WaitForResponseTimeout(CMD_ACK, 1500);
-
-		if (resp != NULL) {
-			uint8_t isOK  = resp->arg[0] & 0xff;
-			uint8_t *data  = resp->d.asBytes;
-			if (isOK){
-				rights[i][0] = ((data[7] & 0x10)>>4) | ((data[8] & 0x1)<<1) | ((data[8] & 0x10)>>2);
-				rights[i][1] = ((data[7] & 0x20)>>5) | ((data[8] & 0x2)<<0) | ((data[8] & 0x20)>>3);
-				rights[i][2] = ((data[7] & 0x40)>>6) | ((data[8] & 0x4)>>1) | ((data[8] & 0x40)>>4);
-				rights[i][3] = ((data[7] & 0x80)>>7) | ((data[8] & 0x8)>>2) | ((data[8] & 0x80)>>5);
-				}
-			else{
-				PrintAndLog("Could not get access rights for block %d", i);
-			}
-		}
-		else {
-			PrintAndLog("Command execute timeout");
-		}
+	fclose(fin);
+	if (i != SectorsCnt || j != SectorsCnt) {
+		PrintAndLog("%s holds no A and B keys for %d sectors", keyFile, SectorsCnt);
+		return 1;
 	}
 	
-	// Read blocks and print to file
+	for (i = 0; i < SectorsCnt; i++) {
+		table[i * 2].found = 1;
+		memcpy(table[i * 2].key, keyA[i], 6);
+		table[i * 2 + 1].found = 1;
+		memcpy(table[i * 2 + 1].key, keyB[i], 6);
+	}
 	
 	PrintAndLog("|-----------------------------------------|");
 	PrintAndLog("|----- Dumping all blocks to file... -----|");
 	PrintAndLog("|-----------------------------------------|");
 	
-	for (i=0 ; i<16 ; i++) {
-		for (j=0 ; j<4 ; j++) {
-			if (j == 3){
-				UsbCommand c = {CMD_MIFARE_READBL, {i*4 + j, 0, 0}};
-				memcpy(c.d.asBytes, keyA[i], 6);
-				SendCommand(&c);
-				resp = WaitForResponseTimeout(CMD_ACK, 1500);
-			}
-			else{
-				if ((rights[i][j] == 6) | (rights[i][j] == 5)) {
-					UsbCommand c = {CMD_MIFARE_READBL, {i*4+j, 1, 0}};
-					memcpy(c.d.asBytes, keyB[i], 6);
-					SendCommand(&c);
-					resp = WaitForResponseTimeout(CMD_ACK, 1500);
-				}
-				else if (rights[i][j] == 7) {
-					PrintAndLog("Access rights do not allow reading of sector %d block %d",i,j);
-				}
-				else {
-					UsbCommand c = {CMD_MIFARE_READBL, {i*4+j, 0, 0}};
-					memcpy(c.d.asBytes, keyA[i], 6);
-					SendCommand(&c);
-					resp = WaitForResponseTimeout(CMD_ACK, 1500);
-				}
-			}
-
-			if (resp != NULL) {
-				uint8_t isOK  = resp->arg[0] & 0xff;
-				uint8_t *data  = resp->d.asBytes;
-				if (j == 3) {
-					data[0]  = (keyA[i][0]);
-					data[1]  = (keyA[i][1]);
-					data[2]  = (keyA[i][2]);
-					data[3]  = (keyA[i][3]);
-					data[4]  = (keyA[i][4]);
-					data[5]  = (keyA[i][5]);
-					data[10] = (keyB[i][0]);
-					data[11] = (keyB[i][1]);
-					data[12] = (keyB[i][2]);
-					data[13] = (keyB[i][3]);
-					data[14] = (keyB[i][4]);
-					data[15] = (keyB[i][5]);
-				}
-				if (isOK) {
-					fwrite ( data, 1, 16, fout );
-				}
-				else {
-					PrintAndLog("Could not get access rights for block %d", i);
-				}
-			}
-			else {
-				PrintAndLog("Command execute timeout");
-			}
+	res = mfDump(SectorsCnt, table, data, blocks * 16, status, &ms);
+	if (res == MF_CHK_TIMEOUT) {
+		PrintAndLog("Command execute timeout");
+		return 1;
+	}
+	if (res == MF_CHK_NO_CARD) {
+		PrintAndLog("Can't select card");
+		return 1;
+	}
+	if (res == MF_CHK_ABORTED)
+		PrintAndLog("Aborted by the button");
+	
+	for (i = 0; i < SectorsCnt; i++) {
+		uint8_t *trailer = data + 16 * (i < 32 ? i * 4 + 3 : 128 + (i - 32) * 16 + 15);
+		if (status[i] == MF_DUMP_SECTOR_NONE) {
+			PrintAndLog("Could not read sector %d", i);
+			continue;
 		}
+		if (status[i] == MF_DUMP_SECTOR_PARTIAL)
+			PrintAndLog("Access rights do not allow reading all of sector %d, those blocks are zero", i);
+		memcpy(trailer, keyA[i], 6);
+		memcpy(trailer + 10, keyB[i], 6);
 	}
 	
-	fclose(fin);
+	if ((fout = fopen(dataFile,"wb")) == NULL) { 
+		PrintAndLog("Could not create file name %s", dataFile);
+		return 1;
+	}
+	fwrite(data, 1, blocks * 16, fout);
 	fclose(fout);
+	PrintAndLog("%d blocks written to %s in %d.%03d s", blocks, dataFile, ms / 1000, ms % 1000);
 	
   return 0;
 }
@@ -404,16 +348,32 @@ int CmdHF14AMfRestore(const char *Cmd)
 	uint8_t bldata[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 	uint8_t keyA[16][6];
 	uint8_t keyB[16][6];
+	char keyFile[256], dataFile[256];
 	
 	FILE *fdump;
 	FILE *fkeys;
 	
-	if ((fdump = fopen("dumpdata.bin","rb")) == NULL) {
-		PrintAndLog("Could not find file dumpdata.bin");
+	if (param_getchar(Cmd, 0) == 'h') {
+		PrintAndLog("Usage:  hf mf restore [<key file> [<data file>]]");
+		PrintAndLog("Writes the data file to a 1K card with the keys of the key file");
+		PrintAndLog("key file  - A keys, then B keys, 6 bytes each, default dumpkeys.bin");
+		PrintAndLog("data file - default dumpdata.bin");
+		PrintAndLog("    sample: hf mf restore mykeys.bin mydump.bin");
+		return 0;
+	}
+	if (dump_file_name(Cmd, 0, keyFile, sizeof(keyFile), "dumpkeys.bin")
+	    || dump_file_name(Cmd, 1, dataFile, sizeof(dataFile), "dumpdata.bin")) {
+		PrintAndLog("File name too long");
+		return 1;
+	}
+	
+	if ((fdump = fopen(dataFile,"rb")) == NULL) {
+		PrintAndLog("Could not find file %s", dataFile);
 		return 1;
 	}
-	if ((fkeys = fopen("dumpkeys.bin","rb")) == NULL) {
-		PrintAndLog("Could not find file dumpkeys.bin");
+	if ((fkeys = fopen(keyFile,"rb")) == NULL) {
+		PrintAndLog("Could not find file %s", keyFile);
+		fclose(fdump);
 		return 1;
 	}
 	
@@ -424,7 +384,7 @@ int CmdHF14AMfRestore(const char *Cmd)
 		fread(keyB[i], 1, 6, fkeys);
 	}
 	
-	PrintAndLog("Restoring dumpdata.bin to card");
+	PrintAndLog("Restoring %s to card", dataFile);
 
 	for (i=0 ; i<16 ; i++) {
 		for( j=0 ; j<4 ; j++) {
@@ -461,8 +421,8 @@ int CmdHF14AMfRestore(const char *Cmd)
 			*/
 			
 			memcpy(c.d.asBytes + 10, bldata, 16);
-			SendCommand(&c);
-			UsbCommand *resp = WaitForResponseTimeout(CMD_ACK, 1500);
+			mfSendCommand(&c);
+			UsbCommand *resp = mfWaitForResponseTimeout(CMD_ACK, 1500);
 
 			if (resp != NULL) {
 				uint8_t isOK  = resp->arg[0] & 0xff;
@@ -712,16 +672,67 @@ get_trailer_block (uint32_t uiBlock)
   }
   return trailer_block;
 }
+static uint64_t chk_default_keys[] = {
+	0xffffffffffff, // Default key (first key used by program if no user defined key)
+	0x000000000000, // Blank key
+	0xa0a1a2a3a4a5, // NFCForum MAD key
+	0xb0b1b2b3b4b5,
+	0xaabbccddeeff,
+	0x4d3a99c351dd,
+	0x1a982c7e459a,
+	0xd3f7d3f7d3f7,
+	0x714c5c886e97,
+	0x587ee5f9350f,
+	0xa0478cc39091,
+	0x533cb6c723f6,
+	0x8fd0a4f256e9
+};
+
+// every sector in device jobs, the dictionary in growing batches: the common
+// keys come first and a card of them is done after the first, later batches
+// keep the uploads a small part of the time. The table of keys found stays on
+// the device between batches and its keys are tried first everywhere.
+static int chk_all_sectors(uint8_t SectorsCnt, int keyTypes, keySet *keys, mf_chk_key_t *table)
+{
+	uint32_t tried, ms, totalTried = 0, totalMs = 0;
+	int pos, batch = 64, found, wanted, res = MF_CHK_OK;
+
+	wanted = SectorsCnt * ((keyTypes & 1) + (keyTypes >> 1 & 1));
+	for (pos = 0; pos < keys->count; pos += batch, batch = batch * 2 > MF_CHK_MAX_KEYS ? MF_CHK_MAX_KEYS : batch * 2) {
+		int n = keys->count - pos < batch ? keys->count - pos : batch;
+
+		res = mfCheckKeysFast(SectorsCnt, keyTypes, keys->keys + 6 * pos, n, pos == 0, table, &tried, &ms);
+		totalTried += tried;
+		totalMs += ms;
+
+		found = 0;
+		for (int i = 0; i < SectorsCnt * 2; i++)
+			found += table[i].found && (keyTypes >> (i & 1) & 1);
+		printf("keys %d-%d: %d of %d keys found, %u authentications in %u ms\r", pos, pos + n - 1, found, wanted, tried, ms);
+		fflush(stdout);
+		if (res != MF_CHK_OK || found == wanted) break;
+	}
+	printf("\n");
+
+	if (res == MF_CHK_NO_CARD)
+		PrintAndLog("Can't select card");
+	else if (res == MF_CHK_ABORTED)
+		PrintAndLog("Aborted by the button");
+	else if (res == MF_CHK_TIMEOUT)
+		PrintAndLog("Command execute timeout");
+	if (totalMs)
+		PrintAndLog("%u authentications in %u ms, %.0f keys/s", totalTried, totalMs, totalTried * 1000.0 / totalMs);
+	return res;
+}
+
 int CmdHF14AMfChk(const char *Cmd)
 {
-	FILE * f;
+	FILE * fkeys;
 	char filename[256]={0};
-	char buf[13];
-	uint8_t *keyBlock = NULL, *p;
-	uint8_t stKeyBlock = 20;
+	keySet keys = {0};
+	uint8_t keyBlock[6];
 	
 	int i, res;
-	int	keycnt = 0;
 	char ctmp	= 0x00;
 	uint8_t blockNo = 0;
 	uint8_t SectorsCnt = 1;
@@ -731,29 +742,12 @@ int CmdHF14AMfChk(const char *Cmd)
 	int transferToEml = 0;
 	int createDumpFile = 0;
 
-	keyBlock = calloc(stKeyBlock, 6);
-	if (keyBlock == NULL) return 1;
-
-	num_to_bytes(0xffffffffffff, 6, (uint8_t*)(keyBlock + 0 * 6)); // Default key (first key used by program if no user defined key)
-	num_to_bytes(0x000000000000, 6, (uint8_t*)(keyBlock + 1 * 6)); // Blank key
-	num_to_bytes(0xa0a1a2a3a4a5, 6, (uint8_t*)(keyBlock + 2 * 6)); // NFCForum MAD key
-	num_to_bytes(0xb0b1b2b3b4b5, 6, (uint8_t*)(keyBlock + 3 * 6));
-	num_to_bytes(0xaabbccddeeff, 6, (uint8_t*)(keyBlock + 4 * 6));
-	num_to_bytes(0x4d3a99c351dd, 6, (uint8_t*)(keyBlock + 5 * 6));
-	num_to_bytes(0x1a982c7e459a, 6, (uint8_t*)(keyBlock + 6 * 6));
-	num_to_bytes(0xd3f7d3f7d3f7, 6, (uint8_t*)(keyBlock + 7 * 6));
-	num_to_bytes(0x714c5c886e97, 6, (uint8_t*)(keyBlock + 8 * 6));
-	num_to_bytes(0x587ee5f9350f, 6, (uint8_t*)(keyBlock + 9 * 6));
-	num_to_bytes(0xa0478cc39091, 6, (uint8_t*)(keyBlock + 10 * 6));
-	num_to_bytes(0x533cb6c723f6, 6, (uint8_t*)(keyBlock + 11 * 6));
-	num_to_bytes(0x8fd0a4f256e9, 6, (uint8_t*)(keyBlock + 12 * 6));
-	
 	if (strlen(Cmd)<3) {
-		PrintAndLog("Usage:  hf mf chk <block number>/<*card memory> <key type (A/B/?)> [t] [<key (12 hex symbols)>] [<dic (*.dic)>]");
-		PrintAndLog("          * - all sectors");
+		PrintAndLog("Usage:  hf mf chk <block number>/<*card memory> <key type (A/B/?)> [t|d] [<key (12 hex symbols)>] [<dic (*.dic)>]");
+		PrintAndLog("          * - all sectors, in jobs on the device");
 		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K, <other> - 1K");
-//		PrintAndLog("d - write keys to binary file\n");
-		
+		PrintAndLog("t - write the keys found to the emulator memory");
+		PrintAndLog("d - write keys to binary file dumpkeys.bin");
 		PrintAndLog("      sample: hf mf chk 0 A 1234567890ab keys.dic");
 		PrintAndLog("              hf mf chk *1 ? t");
 		return 0;
@@ -793,151 +787,124 @@ int CmdHF14AMfChk(const char *Cmd)
 	else if (ctmp == 'd' || ctmp == 'D') createDumpFile = 1;
 	
 	for (i = transferToEml || createDumpFile; param_getchar(Cmd, 2 + i); i++) {
-		if (!param_gethex(Cmd, 2 + i, keyBlock + 6 * keycnt, 12)) {
-			if ( stKeyBlock - keycnt < 2) {
-				p = realloc(keyBlock, 6*(stKeyBlock+=10));
-				if (!p) {
-					PrintAndLog("Cannot allocate memory for Keys");
-					free(keyBlock);
-					return 2;
-				}
-				keyBlock = p;
-			}
-			PrintAndLog("chk key[%d] %02x%02x%02x%02x%02x%02x", keycnt,
-			(keyBlock + 6*keycnt)[0],(keyBlock + 6*keycnt)[1], (keyBlock + 6*keycnt)[2],
-			(keyBlock + 6*keycnt)[3], (keyBlock + 6*keycnt)[4],	(keyBlock + 6*keycnt)[5], 6);
-			keycnt++;
+		if (!param_gethex(Cmd, 2 + i, keyBlock, 12)) {
+			res = mfKeySetAdd(&keys, bytes_to_num(keyBlock, 6));
+			if (res > 0)
+				PrintAndLog("chk key[%d] %s", keys.count - 1, sprint_hex(keyBlock, 6));
 		} else {
 			// May be a dic file
 			if ( param_getstr(Cmd, 2 + i,filename) > 255 ) {
 				PrintAndLog("File name too long");
-				free(keyBlock);
+				mfKeySetFree(&keys);
 				return 2;
 			}
-			
-			if ( (f = fopen( filename , "r")) ) {
-				while( !feof(f) ){
-					memset(buf, 0, sizeof(buf));
-					fgets(buf, sizeof(buf), f);
-					
-					if (strlen(buf) < 12 || buf[11] == '\n')
-						continue;
-				
-					while (fgetc(f) != '\n' && !feof(f)) ;  //goto next line
-					
-					if( buf[0]=='#' ) continue;	//The line start with # is remcommnet,skip
-
-					if (!isxdigit(buf[0])){
-						PrintAndLog("File content error. '%s' must include 12 HEX symbols",buf);
-						continue;
-					}
-					
-					buf[12] = 0;
-
-					if ( stKeyBlock - keycnt < 2) {
-						p = realloc(keyBlock, 6*(stKeyBlock+=10));
-						if (!p) {
-							PrintAndLog("Cannot allocate memory for defKeys");
-							free(keyBlock);
-							return 2;
-						}
-						keyBlock = p;
-					}
-					memset(keyBlock + 6 * keycnt, 0, 6);
-					num_to_bytes(strtoll(buf, NULL, 16), 6, keyBlock + 6*keycnt);
-					PrintAndLog("chk custom key[%d] %012llx", keycnt, bytes_to_num(keyBlock + 6*keycnt, 6));
-					keycnt++;
-				}
-			} else {
+			res = mfKeySetLoad(&keys, filename);
+			if (res >= 0)
+				PrintAndLog("%s: %d keys, %d in all", filename, res, keys.count);
+			else
 				PrintAndLog("File: %s: not found or locked.", filename);
-				free(keyBlock);
-				return 1;
-			fclose(f);
-			}
+		}
+		if (res < 0) {
+			mfKeySetFree(&keys);
+			return 1;
 		}
 	}
 	
-	if (keycnt == 0) {
+	if (keys.count == 0) {
 		PrintAndLog("No key specified,try default keys");
-		for (;keycnt <=12; keycnt++)
-			PrintAndLog("chk default key[%d] %02x%02x%02x%02x%02x%02x", keycnt,
-			(keyBlock + 6*keycnt)[0],(keyBlock + 6*keycnt)[1], (keyBlock + 6*keycnt)[2],
-			(keyBlock + 6*keycnt)[3], (keyBlock + 6*keycnt)[4],	(keyBlock + 6*keycnt)[5], 6);
+		for (i = 0; i < (int)(sizeof(chk_default_keys) / sizeof(chk_default_keys[0])); i++)
+			if (mfKeySetAdd(&keys, chk_default_keys[i]) < 0) {
+				mfKeySetFree(&keys);
+				return 2;
+			}
 	}
 	
-	for ( int t = !keyType ; t < 2 ; keyType==2?(t++):(t=2) ) {
-		int b=blockNo;
-		for (int i=0; i<SectorsCnt; ++i) {
-			PrintAndLog("--SectorsCnt:%d block no:0x%02x key type:%C key count:%d ", i,	 b, t?'B':'A', keycnt);
-			int size = keycnt>8?8:keycnt;
-			for (int c = 0; c < keycnt; c+=size) {
-				size=keycnt-c>8?8:keycnt-c;			
-				res = mfCheckKeys(b, t, size, keyBlock +6*c, &key64);
-				if (res !=1) {
-					if (!res) {
-						PrintAndLog("Found valid key:[%012llx]",key64);
-						if (transferToEml) {
-							uint8_t block[16];
-							mfEmlGetMem(block, get_trailer_block(b), 1);
-							num_to_bytes(key64, 6, block + t*10);
-							mfEmlSetMem(block, get_trailer_block(b), 1);
-						}
-						break;
-					}
-					else {
-						printf("Not found yet, keycnt:%d\r", c+size);
-						fflush(stdout);
-					}
-				} else {
-					PrintAndLog("Command execute timeout");
+	// all sectors: the scheduler, with the table straight to the emulator and file
+	if (param_getchar(Cmd, 0) == '*') {
+		mf_chk_key_t table[MF_CHK_MAX_SECTORS * 2];
+		uint8_t standart[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+		char keyStr[2][13];
+
+		PrintAndLog("--SectorsCnt:%d key type:%c key count:%d", SectorsCnt, keyType == 2 ? '?' : (keyType ? 'A' : 'B'), keys.count);
+		chk_all_sectors(SectorsCnt, keyType == 2 ? 3 : (keyType ? 1 : 2), &keys, table);
+		mfKeySetFree(&keys);
+
+		PrintAndLog("|---|----------------|----------------|");
+		PrintAndLog("|sec|key A           |key B           |");
+		PrintAndLog("|---|----------------|----------------|");
+		for (i = 0; i < SectorsCnt; i++) {
+			for (int t = 0; t < 2; t++) {
+				mf_chk_key_t *k = &table[i * 2 + t];
+				if (k->found)
+					sprintf(keyStr[t], "%012llx", (unsigned long long)bytes_to_num(k->key, 6));
+				else
+					strcpy(keyStr[t], "------------");
+				if (k->found && transferToEml) {
+					uint8_t block[16];
+					uint32_t trailer = get_trailer_block(i < 32 ? i * 4 : 128 + (i - 32) * 16);
+					mfEmlGetMem(block, trailer, 1);
+					memcpy(block + t * 10, k->key, 6);
+					mfEmlSetMem(block, trailer, 1);
 				}
 			}
-			b<127?(b+=4):(b+=16);	
+			PrintAndLog("|%03d|  %s  |  %s  |", i, keyStr[0], keyStr[1]);
 		}
-	}
-	
-	free(keyBlock);
+		PrintAndLog("|---|----------------|----------------|");
 
-/*
-	// Create dump file
-	if (createDumpFile) {
-		if ((fkeys = fopen("dumpkeys.bin","wb")) == NULL) { 
-			PrintAndLog("Could not create file dumpkeys.bin");
-			free(e_sector);
-			return 1;
-		}
-		PrintAndLog("Printing keys to bynary file dumpkeys.bin...");
-		for(i=0; i<16; i++) {
-			if (e_sector[i].foundKey[0]){
-				num_to_bytes(e_sector[i].Key[0], 6, tempkey);
-				fwrite ( tempkey, 1, 6, fkeys );
-			}
-			else{
-				fwrite ( &standart, 1, 6, fkeys );
+		// Create dump file
+		if (createDumpFile) {
+			if ((fkeys = fopen("dumpkeys.bin","wb")) == NULL) { 
+				PrintAndLog("Could not create file dumpkeys.bin");
+				return 1;
 			}
+			PrintAndLog("Printing keys to bynary file dumpkeys.bin...");
+			for (int t = 0; t < 2; t++)
+				for (i = 0; i < SectorsCnt; i++)
+					fwrite(table[i * 2 + t].found ? table[i * 2 + t].key : standart, 1, 6, fkeys);
+			fclose(fkeys);
 		}
-		for(i=0; i<16; i++) {
-			if (e_sector[i].foundKey[1]){
-				num_to_bytes(e_sector[i].Key[1], 6, tempkey);
-				fwrite ( tempkey, 1, 6, fkeys );
+		return 0;
+	}
+
+	for ( int t = !keyType ; t < 2 ; keyType==2?(t++):(t=2) ) {
+		int b=blockNo;
+		PrintAndLog("--block no:0x%02x key type:%C key count:%d ", b, t?'B':'A', keys.count);
+		for (int c = 0; c < keys.count; c += 8) {
+			int size = keys.count - c > 8 ? 8 : keys.count - c;
+			res = mfCheckKeys(b, t, size, keys.keys + 6 * c, &key64);
+			if (res == 1) {
+				PrintAndLog("Command execute timeout");
+				continue;
 			}
-			else{
-				fwrite ( &standart, 1, 6, fkeys );
+			if (!res) {
+				PrintAndLog("Found valid key:[%012llx]",key64);
+				if (transferToEml) {
+					uint8_t block[16];
+					mfEmlGetMem(block, get_trailer_block(b), 1);
+					num_to_bytes(key64, 6, block + t*10);
+					mfEmlSetMem(block, get_trailer_block(b), 1);
+				}
+				break;
 			}
+			printf("Not found yet, keycnt:%d\r", c+size);
+			fflush(stdout);
 		}
-		fclose(fkeys);
 	}
-*/
-  return 0;
+	
+	mfKeySetFree(&keys);
+	return 0;
 }
 
 int CmdHF14AMf1kSim(const char *Cmd)
 {
 	uint8_t uid[4] = {0, 0, 0, 0};
+	uint8_t SectorsCnt = 16;
 	
 	if (param_getchar(Cmd, 0) == 'h') {
-		PrintAndLog("Usage:  hf mf sim  <uid (8 hex symbols)>");
+		PrintAndLog("Usage:  hf mf sim  <uid (8 hex symbols)> [<card memory>]");
+		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K, <other> - 1K");
 		PrintAndLog("           sample: hf mf sim 0a0a0a0a ");
+		PrintAndLog("                   hf mf sim 0a0a0a0a 4");
 		return 0;
 	}	
 	
@@ -945,9 +912,16 @@ int CmdHF14AMf1kSim(const char *Cmd)
 		PrintAndLog("UID must include 8 HEX symbols");
 		return 1;
 	}
-	PrintAndLog(" uid:%s ", sprint_hex(uid, 4));
+	switch (param_getchar(Cmd, 1)) {
+		case '0': SectorsCnt =  5; break;
+		case '1': SectorsCnt = 16; break;
+		case '2': SectorsCnt = 32; break;
+		case '4': SectorsCnt = 40; break;
+		default:  SectorsCnt = 16;
+	}
+	PrintAndLog(" uid:%s sectors:%d ", sprint_hex(uid, 4), SectorsCnt);
 	
-  UsbCommand c = {CMD_SIMULATE_MIFARE_CARD, {0, 0, 0}};
+  UsbCommand c = {CMD_SIMULATE_MIFARE_CARD, {SectorsCnt, 0, 0}};
 	memcpy(c.d.asBytes, uid, 4);
   SendCommand(&c);
 
@@ -1042,126 +1016,120 @@ int CmdHF14AMfESet(const char *Cmd)
   return 0;
 }
 
+// a file name parameter, `.eml` appended unless it names a dump format
+static int eml_file_name(const char *Cmd, int paramnum, char *fileName, int size)
+{
+	int bg, en;
+	const char *ext;
+
+	if (param_getptr(Cmd, &bg, &en, paramnum) || en - bg + 1 + 4 >= size)
+		return 1;
+	param_getstr(Cmd, paramnum, fileName);
+	ext = strrchr(fileName, '.');
+	if (!ext || (strcmp(ext, ".eml") && strcmp(ext, ".mfd") && strcmp(ext, ".bin") && strcmp(ext, ".json")))
+		strcat(fileName, ".eml");
+	return 0;
+}
+
 int CmdHF14AMfELoad(const char *Cmd)
 {
-	FILE * f;
-	char filename[20];
-	char * fnameptr = filename;
-	char buf[64];
-	uint8_t buf8[64];
-	int i, len, blockNum;
+	char filename[256];
+	uint8_t data[4096];
+	int len, res;
 	
-	memset(filename, 0, sizeof(filename));
-	memset(buf, 0, sizeof(buf));
-
 	if (param_getchar(Cmd, 0) == 'h' || param_getchar(Cmd, 0)== 0x00) {
-		PrintAndLog("It loads emul dump from the file `filename.eml`");
-		PrintAndLog("Usage:  hf mf eload <file name w/o `.eml`>");
+		PrintAndLog("It loads emul dump from the file `filename.eml`, a binary dump");
+		PrintAndLog("(.mfd, .bin) or a JSON dump (.json) of a Mini, 1K, 2K or 4K card");
+		PrintAndLog("Usage:  hf mf eload <file name w/o `.eml`>|<file name.mfd/.bin/.json>");
 		PrintAndLog(" sample: hf mf eload filename");
+		PrintAndLog("         hf mf eload dumpdata.bin");
 		return 0;
 	}	
 
-	len = strlen(Cmd);
-	if (len > 14) len = 14;
-
-	memcpy(filename, Cmd, len);
-	fnameptr += len;
-
-	sprintf(fnameptr, ".eml"); 
+	if (eml_file_name(Cmd, 0, filename, sizeof(filename))) {
+		PrintAndLog("File name too long");
+		return 1;
+	}
 	
-	// open file
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	len = mfLoadDumpFile(filename, data, sizeof(data));
+	if (len == -1) {
 		PrintAndLog("File not found or locked.");
 		return 1;
 	}
-	
-	blockNum = 0;
-	while(!feof(f)){
-		memset(buf, 0, sizeof(buf));
-		fgets(buf, sizeof(buf), f);
-
-		if (strlen(buf) < 32){
-			if(strlen(buf) && feof(f))
-				break;
-			PrintAndLog("File content error. Block data must include 32 HEX symbols");
-			return 2;
-		}
-		for (i = 0; i < 32; i += 2)
-		  sscanf(&buf[i], "%02x", (unsigned int *)&buf8[i / 2]);
-//			PrintAndLog("data[%02d]:%s", blockNum, sprint_hex(buf8, 16));
+	if (len < 0) {
+		PrintAndLog("File content error. There must be 20, 64, 128 or 256 blocks");
+		return 2;
+	}
 
-		if (mfEmlSetMem(buf8, blockNum, 1)) {
-			PrintAndLog("Cant set emul block: %d", blockNum);
-			return 3;
-		}
-		blockNum++;
-		
-		if (blockNum >= 32 * 4 + 8 * 16) break;
+	res = mfEmlSetMemBulk(data, len);
+	if (res == 1) {
+		PrintAndLog("Command execute timeout");
+		return 3;
 	}
-	fclose(f);
-	
-	if (blockNum != 16 * 4 && blockNum != 32 * 4 + 8 * 16){
-		PrintAndLog("File content error. There must be 64 blocks");
-		return 4;
+	if (res == 2) {
+		PrintAndLog("Emulator memory differs from the file, CRC mismatch");
+		return 3;
 	}
-	PrintAndLog("Loaded from file: %s", filename);
+	PrintAndLog("Loaded %d blocks from file: %s", len / 16, filename);
   return 0;
 }
 
 int CmdHF14AMfESave(const char *Cmd)
 {
-	FILE * f;
-	char filename[20];
+	char filename[256];
 	char * fnameptr = filename;
-	uint8_t buf[64];
-	int i, j, len;
+	uint8_t data[4096];
+	int j, res, len = 256 * 16, fileparam = 0;
 	
 	memset(filename, 0, sizeof(filename));
-	memset(buf, 0, sizeof(buf));
 
 	if (param_getchar(Cmd, 0) == 'h') {
-		PrintAndLog("It saves emul dump into the file `filename.eml` or `cardID.eml`");
-		PrintAndLog("Usage:  hf mf esave [file name w/o `.eml`]");
+		PrintAndLog("It saves emul dump into the file `filename.eml` or `cardID.eml`,");
+		PrintAndLog("as a binary dump with .mfd or .bin, as JSON with .json");
+		PrintAndLog("Usage:  hf mf esave [<card memory>] [file name w/o `.eml`]");
+		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K (default)");
 		PrintAndLog(" sample: hf mf esave ");
 		PrintAndLog("         hf mf esave filename");
+		PrintAndLog("         hf mf esave 1 dumpdata.bin");
 		return 0;
 	}	
 
-	len = strlen(Cmd);
-	if (len > 14) len = 14;
-	
-	if (len < 1) {
-		// get filename
-		if (mfEmlGetMem(buf, 0, 1)) {
-			PrintAndLog("Cant get block: %d", 0);
-			return 1;
+	if (param_getptr(Cmd, &j, &res, 0) == 0 && j == res) {
+		fileparam = 1;
+		switch (param_getchar(Cmd, 0)) {
+			case '0': len =  20 * 16; break;
+			case '1': len =  64 * 16; break;
+			case '2': len = 128 * 16; break;
+			case '4': len = 256 * 16; break;
+			default:  fileparam = 0;
 		}
-		for (j = 0; j < 7; j++, fnameptr += 2)
-			sprintf(fnameptr, "%02x", buf[j]); 
-	} else {
-		memcpy(filename, Cmd, len);
-		fnameptr += len;
 	}
 
-	sprintf(fnameptr, ".eml"); 
-	
-	// open file
-	f = fopen(filename, "w+");
+	res = mfEmlGetMemBulk(data, len);
+	if (res == 1) {
+		PrintAndLog("Command execute timeout");
+		return 1;
+	}
+	if (res == 2) {
+		PrintAndLog("Emulator memory read with errors, CRC mismatch");
+		return 1;
+	}
 
-	// put hex
-	for (i = 0; i < 32 * 4 + 8 * 16; i++) {
-		if (mfEmlGetMem(buf, i, 1)) {
-			PrintAndLog("Cant get block: %d", i);
-			break;
-		}
-		for (j = 0; j < 16; j++)
-			fprintf(f, "%02x", buf[j]); 
-		fprintf(f,"\n");
+	if (param_getchar(Cmd, fileparam) == 0x00) {
+		// file name by the UID
+		for (j = 0; j < 7; j++, fnameptr += 2)
+			sprintf(fnameptr, "%02x", data[j]); 
+		sprintf(fnameptr, ".eml"); 
+	} else if (eml_file_name(Cmd, fileparam, filename, sizeof(filename))) {
+		PrintAndLog("File name too long");
+		return 1;
 	}
-	fclose(f);
-	
-	PrintAndLog("Saved to file: %s", filename);
+
+	if (mfSaveDumpFile(filename, data, len)) {
+		PrintAndLog("Could not create file %s", filename);
+		return 1;
+	}
+	PrintAndLog("Saved %d blocks to file: %s", len / 16, filename);
 	
   return 0;
 }
@@ -1169,10 +1137,14 @@ int CmdHF14AMfESave(const char *Cmd)
 int CmdHF14AMfECFill(const char *Cmd)
 {
 	uint8_t keyType = 0;
+	uint8_t SectorsCnt = 16;
+	UsbCommand *resp;
 
 	if (strlen(Cmd) < 1 || param_getchar(Cmd, 0) == 'h') {
-		PrintAndLog("Usage:  hf mf efill <key A/B>");
+		PrintAndLog("Usage:  hf mf efill <key A/B> [<card memory>]");
+		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K, <other> - 1K");
 		PrintAndLog("sample:  hf mf efill A");
+		PrintAndLog("         hf mf efill B 4");
 		PrintAndLog("Card data blocks transfers to card emulator memory.");
 		PrintAndLog("Keys must be laid in the simulator memory. \n");
 		return 0;
@@ -1185,8 +1157,22 @@ int CmdHF14AMfECFill(const char *Cmd)
 	}
 	if (ctmp != 'A' && ctmp != 'a') keyType = 1;
 
-  UsbCommand c = {CMD_MIFARE_EML_CARDLOAD, {0, keyType, 0}};
+	switch (param_getchar(Cmd, 1)) {
+		case '0': SectorsCnt =  5; break;
+		case '1': SectorsCnt = 16; break;
+		case '2': SectorsCnt = 32; break;
+		case '4': SectorsCnt = 40; break;
+		default:  SectorsCnt = 16;
+	}
+
+  UsbCommand c = {CMD_MIFARE_EML_CARDLOAD, {SectorsCnt, keyType, 0}};
   SendCommand(&c);
+	resp = WaitForResponseTimeout(CMD_ACK, 3000);
+	if (resp == NULL) {
+		PrintAndLog("Command execute timeout");
+		return 1;
+	}
+	PrintAndLog("%d of %d sectors transferred to the emulator memory", (int)resp->arg[0], SectorsCnt);
   return 0;
 }
 
@@ -1286,97 +1272,93 @@ int CmdHF14AMfCSetBlk(const char *Cmd)
 
 int CmdHF14AMfCLoad(const char *Cmd)
 {
-	FILE * f;
-	char filename[20];
-	char * fnameptr = filename;
-	char buf[64];
-	uint8_t buf8[64];
-	uint8_t fillFromEmulator = 0;
-	int i, len, blockNum, flags;
-	
-	memset(filename, 0, sizeof(filename));
-	memset(buf, 0, sizeof(buf));
+	char filename[256];
+	uint8_t data[4096], saved[4096], readBack[16];
+	int len = 64 * 16, res, block, bg, en, fileparam = 0, wantWipe = 0, restore = 0;
+	uint32_t msWrite, msVerify;
 
 	if (param_getchar(Cmd, 0) == 'h' || param_getchar(Cmd, 0)== 0x00) {
-		PrintAndLog("It loads magic Chinese card (only works with!!!) from the file `filename.eml`");
-		PrintAndLog("or from emulator memory (option `e`)");
-		PrintAndLog("Usage:  hf mf cload <file name w/o `.eml`>");
-		PrintAndLog("   or:  hf mf cload e ");
+		PrintAndLog("It loads magic Chinese card (only works with!!!) from the file `filename.eml`,");
+		PrintAndLog("a binary (.mfd, .bin) or JSON (.json) dump, or from emulator memory (option `e`),");
+		PrintAndLog("all blocks in one backdoor session and read back after.");
+		PrintAndLog("A file goes to the card through the emulator memory, which is put back after.");
+		PrintAndLog("Usage:  hf mf cload [w] <file name w/o `.eml`>|<file name.mfd/.bin/.json>");
+		PrintAndLog("   or:  hf mf cload [w] e [<card memory>]");
+		PrintAndLog("w - wipe the card first");
+		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K (default), 2 - 2K, 4 - 4K");
 		PrintAndLog(" sample: hf mf cload filename");
+		PrintAndLog("         hf mf cload w e 4");
 		return 0;
 	}	
 
-	char ctmp = param_getchar(Cmd, 0);
-	if (ctmp == 'e' || ctmp == 'E') fillFromEmulator = 1;
-	
-	if (fillFromEmulator) {
-		flags = CSETBLOCK_INIT_FIELD + CSETBLOCK_WUPC;
-		for (blockNum = 0; blockNum < 16 * 4; blockNum += 1) {
-			if (mfEmlGetMem(buf8, blockNum, 1)) {
-				PrintAndLog("Cant get block: %d", blockNum);
-				return 2;
-			}
-			
-			if (blockNum == 2) flags = 0;
-			if (blockNum == 16 * 4 - 1) flags = CSETBLOCK_HALT + CSETBLOCK_RESET_FIELD;
+	if (!param_getptr(Cmd, &bg, &en, fileparam) && bg == en && tolower((unsigned char)Cmd[bg]) == 'w') {
+		wantWipe = 1;
+		fileparam++;
+	}
 
-			if (mfCSetBlock(blockNum, buf8, NULL, 0, flags)) {
-				PrintAndLog("Cant set magic card block: %d", blockNum);
-				return 3;
-			}
+	if (!param_getptr(Cmd, &bg, &en, fileparam) && bg == en && tolower((unsigned char)Cmd[bg]) == 'e') {
+		switch (param_getchar(Cmd, fileparam + 1)) {
+			case '0': len =  20 * 16; break;
+			case '2': len = 128 * 16; break;
+			case '4': len = 256 * 16; break;
+			default:  len =  64 * 16;
 		}
-		return 0;
 	} else {
-		len = strlen(Cmd);
-		if (len > 14) len = 14;
-
-		memcpy(filename, Cmd, len);
-		fnameptr += len;
-
-		sprintf(fnameptr, ".eml"); 
-	
-		// open file
-		f = fopen(filename, "r");
-		if (f == NULL) {
+		if (eml_file_name(Cmd, fileparam, filename, sizeof(filename))) {
+			PrintAndLog("File name too long");
+			return 1;
+		}
+		len = mfLoadDumpFile(filename, data, sizeof(data));
+		if (len == -1) {
 			PrintAndLog("File not found or locked.");
 			return 1;
 		}
-	
-		blockNum = 0;
-		flags = CSETBLOCK_INIT_FIELD + CSETBLOCK_WUPC;
-		while(!feof(f)){
-			memset(buf, 0, sizeof(buf));
-			fgets(buf, sizeof(buf), f);
-
-			if (strlen(buf) < 32){
-				if(strlen(buf) && feof(f))
-					break;
-				PrintAndLog("File content error. Block data must include 32 HEX symbols");
-				return 2;
-			}
-			for (i = 0; i < 32; i += 2)
-				sscanf(&buf[i], "%02x", (unsigned int *)&buf8[i / 2]);
-
-			if (blockNum == 2) flags = 0;
-			if (blockNum == 16 * 4 - 1) flags = CSETBLOCK_HALT + CSETBLOCK_RESET_FIELD;
+		if (len < 0) {
+			PrintAndLog("File content error. There must be 20, 64, 128 or 256 blocks");
+			return 2;
+		}
 
-			if (mfCSetBlock(blockNum, buf8, NULL, 0, flags)) {
-				PrintAndLog("Cant set magic card block: %d", blockNum);
-				return 3;
-			}
-			blockNum++;
-		
-			if (blockNum >= 16 * 4) break;  // magic card type - mifare 1K
+		// the card image goes through the emulator memory, kept for after
+		res = mfEmlGetMemBulk(saved, len);
+		if (res) {
+			PrintAndLog(res == 1 ? "Command execute timeout" : "Emulator memory could not be saved, CRC mismatch");
+			return 3;
 		}
-		fclose(f);
-	
-		if (blockNum != 16 * 4 && blockNum != 32 * 4 + 8 * 16){
-			PrintAndLog("File content error. There must be 64 blocks");
-			return 4;
+		restore = 1;
+		res = mfEmlSetMemBulk(data, len);
+		if (res) {
+			PrintAndLog(res == 1 ? "Command execute timeout" : "Emulator memory differs from the file, CRC mismatch");
+			mfEmlSetMemBulk(saved, len);
+			return 3;
 		}
-		PrintAndLog("Loaded from file: %s", filename);
-		return 0;
+		PrintAndLog("Loaded %d blocks from file: %s", len / 16, filename);
 	}
+
+	res = mfCClone(len / 16, wantWipe, &block, readBack, &msWrite, &msVerify);
+	if (restore && mfEmlSetMemBulk(saved, len))
+		PrintAndLog("Emulator memory could not be put back, it holds the file");
+	switch (res) {
+		case -1:
+			return 3;
+		case MF_CHK_OK:
+			PrintAndLog("%d blocks written in %d ms and read back in %d ms", block, msWrite, msVerify);
+			return 0;
+		case MF_CHK_NO_CARD:
+			PrintAndLog("No magic card answered the backdoor");
+			break;
+		case MF_CHK_ABORTED:
+			PrintAndLog("Aborted by the button after %d blocks", block);
+			break;
+		case MF_CLONE_WRITE_ERROR:
+			PrintAndLog("Cant set magic card block: %d", block);
+			break;
+		case MF_CLONE_MISMATCH:
+			PrintAndLog("Block %d reads back as %s", block, sprint_hex(readBack, 16));
+			break;
+		default:
+			PrintAndLog("error %d", res);
+	}
+	return 3;
 }
 
 int CmdHF14AMfCGetBlk(const char *Cmd) {
@@ -1536,21 +1518,27 @@ int CmdHF14AMfSniff(const char *Cmd){
 	bool wantDecrypt = 0;
 	//bool wantSaveToEml = 0; TODO
 	bool wantSaveToEmlFile = 0;
+	bool wantTraceFile = 0;
 
 	//var 
 	int res = 0;
 	int len = 0;
-	int blockLen = 0;
 	int num = 0;
 	int pckNum = 0;
+	uint32_t seq = 0;
+	uint32_t lostPck = 0;
+	uint32_t lostFrames = 0;
+	uint32_t traceLen = 0;
 	uint8_t uid[8];
 	uint8_t atqa[2];
 	uint8_t sak;
 	bool isTag;
 	uint32_t parity;
-	uint8_t buf[3000];
-	uint8_t * bufPtr = buf;
-	memset(buf, 0x00, 3000);
+	uint8_t buf[512];	// the frames that are not through yet, one is 9 + 255 bytes at most
+	uint8_t * bufPtr;
+	int bufLen = 0;
+	bool resync = false;	// packets were lost, wait for the next half
+	FILE * ftrace = NULL;
 	
 	if (param_getchar(Cmd, 0) == 'h') {
 		PrintAndLog("It continuously get data from the field and saves it to: log, emulator, emulator file.");
@@ -1559,17 +1547,27 @@ int CmdHF14AMfSniff(const char *Cmd){
 		PrintAndLog("    d - decrypt sequence and put it to log file `uid.log`");
 		PrintAndLog(" n/a   e - decrypt sequence, collect read and write commands and save the result of the sequence to emulator memory");
 		PrintAndLog("    r - decrypt sequence, collect read and write commands and save the result of the sequence to emulator dump file `uid.eml`");
-		PrintAndLog("Usage:  hf mf sniff [l][d][e][r]");
+		PrintAndLog("    t - append the raw trace to `sniff.trc`");
+		PrintAndLog("Usage:  hf mf sniff [l][d][e][r][t]");
 		PrintAndLog("  sample: hf mf sniff l d e");
 		return 0;
 	}	
 	
-	for (int i = 0; i < 4; i++) {
+	for (int i = 0; i < 5; i++) {
 		char ctmp = param_getchar(Cmd, i);
 		if (ctmp == 'l' || ctmp == 'L') wantLogToFile = true;
 		if (ctmp == 'd' || ctmp == 'D') wantDecrypt = true;
 		//if (ctmp == 'e' || ctmp == 'E') wantSaveToEml = true; TODO
 		if (ctmp == 'f' || ctmp == 'F') wantSaveToEmlFile = true;
+		if (ctmp == 't' || ctmp == 'T') wantTraceFile = true;
+	}
+	
+	if (wantTraceFile) {
+		ftrace = fopen("sniff.trc", "ab");
+		if (ftrace == NULL) {
+			PrintAndLog("Could not open file sniff.trc");
+			return 1;
+		}
 	}
 	
 	printf("-------------------------------------------------------------------------\n");
@@ -1581,70 +1579,296 @@ int CmdHF14AMfSniff(const char *Cmd){
   UsbCommand c = {CMD_MIFARE_SNIFFER, {0, 0, 0}};
   SendCommand(&c);
 
-	// wait cycle
+	// wait cycle, the frames are decoded as they come
 	while (true) {
-		printf(".");
-		fflush(stdout);
 		if (ukbhit()) {
 			getchar();
 			printf("\naborted via keyboard!\n");
 			break;
 		}
 		
-		UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 2000);
-		if (resp != NULL) {
-			res = resp->arg[0] & 0xff;
-			len = resp->arg[1];
-			num = resp->arg[2];
-			
-			if (res == 0) return 0;
-			if (res == 1) {
-				if (num ==0) {
-					bufPtr = buf;
-					memset(buf, 0x00, 3000);
-				}
-				memcpy(bufPtr, resp->d.asBytes, len);
-				bufPtr += len;
-				pckNum++;
-			}
-			if (res == 2) {
-				blockLen = bufPtr - buf;
-				bufPtr = buf;
-				printf(">\n");
-				PrintAndLog("received trace len: %d packages: %d", blockLen, pckNum);
-				num = 0;
-				while (bufPtr - buf + 9 < blockLen) {
-				  isTag = bufPtr[3] & 0x80 ? true:false;
-					bufPtr += 4;
-					parity = *((uint32_t *)(bufPtr));
-					bufPtr += 4;
-					len = bufPtr[0];
-					bufPtr++;
-					if ((len == 14) && (bufPtr[0] = 0xff) && (bufPtr[1] = 0xff)) {
-						memcpy(uid, bufPtr + 2, 7);
-						memcpy(atqa, bufPtr + 2 + 7, 2);
-						sak = bufPtr[11];
-						
-						PrintAndLog("tag select uid:%s atqa:%02x %02x sak:0x%02x", sprint_hex(uid, 7), atqa[0], atqa[1], sak);
-						if (wantLogToFile) {
-							FillFileNameByUID(logHexFileName, uid, ".log", 7);
-							AddLogCurrentDT(logHexFileName);
-						}						
-						if (wantDecrypt) mfTraceInit(uid, atqa, sak, wantSaveToEmlFile);
-					} else {
-						PrintAndLog("%s(%d):%s", isTag ? "TAG":"RDR", num, sprint_hex(bufPtr, len));
-						if (wantLogToFile) AddLogHex(logHexFileName, isTag ? "TAG: ":"RDR: ", bufPtr, len);
-						if (wantDecrypt) mfTraceDecode(bufPtr, len, parity, wantSaveToEmlFile);
-					}
-					bufPtr += len;
-					num++;
-				}
+		UsbCommand * resp = WaitForStreamTimeout(2000);
+		if (resp == NULL) {
+			printf(".");
+			fflush(stdout);
+			continue;
+		}
+
+		res = resp->arg[0] & 0xff;
+		len = resp->arg[1];
+
+		if (resp->arg[2] != seq && res != 0) {
+			lostPck += resp->arg[2] - seq;
+			// the frame in the buffer lost its tail, and the next packet
+			// may start anywhere in a frame: only a half starts with one
+			bufLen = 0;
+			resync = true;
+		}
+		seq = resp->arg[2] + 1;
+
+		if (res == 0) {
+			PrintAndLog("sniffing finished. trace len: %d packages: %d", traceLen, pckNum);
+			lostFrames = resp->arg[1];
+			break;
+		}
+		if (res == 2) {
+			lostFrames = resp->arg[1];
+			bufLen = 0;
+			resync = false;
+			continue;
+		}
+		if (resync)
+			continue;
+		if (res != 1 || len > sizeof(resp->d.asBytes) || bufLen + len > sizeof(buf)) {
+			bufLen = 0;
+			continue;
+		}
+
+		memcpy(buf + bufLen, resp->d.asBytes, len);
+		bufLen += len;
+		traceLen += len;
+		pckNum++;
+		if (ftrace) fwrite(resp->d.asBytes, 1, len, ftrace);
+
+		// the frames that are complete
+		bufPtr = buf;
+		while (bufPtr - buf + 9 <= bufLen && bufPtr - buf + 9 + bufPtr[8] <= bufLen) {
+			isTag = bufPtr[3] & 0x80 ? true:false;
+			bufPtr += 4;
+			memcpy(&parity, bufPtr, 4);
+			bufPtr += 4;
+			len = bufPtr[0];
+			bufPtr++;
+			if ((len == 14) && (bufPtr[0] == 0xff) && (bufPtr[1] == 0xff)) {
+				memcpy(uid, bufPtr + 2, 7);
+				memcpy(atqa, bufPtr + 2 + 7, 2);
+				sak = bufPtr[11];
+				
+				PrintAndLog("tag select uid:%s atqa:%02x %02x sak:0x%02x", sprint_hex(uid, 7), atqa[0], atqa[1], sak);
+				if (wantLogToFile) {
+					FillFileNameByUID(logHexFileName, uid, ".log", 7);
+					AddLogCurrentDT(logHexFileName);
+				}						
+				if (wantDecrypt) mfTraceInit(uid, atqa, sak, wantSaveToEmlFile);
+			} else {
+				PrintAndLog("%s(%d):%s", isTag ? "TAG":"RDR", num, sprint_hex(bufPtr, len));
+				if (wantLogToFile) AddLogHex(logHexFileName, isTag ? "TAG: ":"RDR: ", bufPtr, len);
+				if (wantDecrypt) mfTraceDecode(bufPtr, len, parity, wantSaveToEmlFile);
 			}
-		} // resp not NILL
+			bufPtr += len;
+			num++;
+		}
+		bufLen -= bufPtr - buf;
+		memmove(buf, bufPtr, bufLen);
 	} // while (true)
+
+	if (lostPck || lostFrames)
+		PrintAndLog("lost: %d packages, %d frames the device had no room for", lostPck, lostFrames);
+	if (ftrace) {
+		fclose(ftrace);
+		PrintAndLog("trace appended to sniff.trc");
+	}
   return 0;
 }
 
+static const char *emu_prng_names[] = {"weak", "static", "hard"};
+
+static int emu_prng_param(const char *Cmd, int paramnum)
+{
+	int i, bg, en;
+
+	if (param_getptr(Cmd, &bg, &en, paramnum)) return -1;
+	for (i = 0; i < 3; i++)
+		if (strlen(emu_prng_names[i]) == en - bg + 1 && !strncmp(Cmd + bg, emu_prng_names[i], en - bg + 1)) return i;
+	return -1;
+}
+
+static void emu_status(void)
+{
+	uint32_t frames, auths;
+
+	mf_emu_stats(&frames, &auths);
+	PrintAndLog("emulated card: uid %08x, %d sectors, %s nonces, %u frames, %u authentications",
+		mf_emu_uid(), mf_emu_sectors(), emu_prng_names[mf_emu_prng()], frames, auths);
+}
+
+int CmdHF14AMfEmu(const char *Cmd)
+{
+	char mode[8] = {0};
+	char filename[256];
+	uint8_t data[4096];
+	int i, len, prng = -1;
+
+	if (param_getptr(Cmd, &i, &len, 0) == 0 && len - i + 1 < sizeof(mode))
+		param_getstr(Cmd, 0, mode);
+	if (!strcmp(mode, "off")) {
+		mfSetTransport(NULL);
+		PrintAndLog("hf mf commands go to the device");
+		return 0;
+	}
+	if (strcmp(mode, "on") && strcmp(mode, "reset")) {
+		PrintAndLog("Usage:  hf mf emu <on|off|reset> [weak|static|hard] [<card image>]");
+		PrintAndLog("        on:    rdbl, rdsc, wrbl, restore, chk, nested and mifare go");
+		PrintAndLog("               to a card model on the host, no device needed");
+		PrintAndLog("        off:   back to the device");
+		PrintAndLog("        reset: on, with the test card again: 1K, every key");
+		PrintAndLog("               different and none of the default ones");
+		PrintAndLog("        weak:   nonces of the 16 bit LFSR by the time since power-up");
+		PrintAndLog("        static: the same nonce for every authentication");
+		PrintAndLog("        hard:   random nonces, no NACK to a wrong reader answer");
+		PrintAndLog("        card image: .eml, .json or binary, as hf mf eload takes it");
+		PrintAndLog(" sample: hf mf emu reset static");
+		PrintAndLog("         hf mf emu on weak dumpdata.bin");
+		return 0;
+	}
+
+	if (!strcmp(mode, "reset") || !mf_emu_sectors())
+		mf_emu_reset(MF_EMU_PRNG_WEAK);
+	for (i = 1; i < 3 && param_getchar(Cmd, i); i++) {
+		if ((len = emu_prng_param(Cmd, i)) >= 0) {
+			prng = len;
+			continue;
+		}
+		if (eml_file_name(Cmd, i, filename, sizeof(filename))) {
+			PrintAndLog("File name too long");
+			return 1;
+		}
+		len = mfLoadDumpFile(filename, data, sizeof(data));
+		if (len == -1) {
+			PrintAndLog("File not found or locked.");
+			return 1;
+		}
+		if (len < 0 || mf_emu_load(data, len, mf_emu_prng())) {
+			PrintAndLog("File content error. There must be 20, 64, 128 or 256 blocks");
+			return 2;
+		}
+	}
+	if (prng >= 0)
+		mf_emu_set_prng(prng);
+
+	mfSetTransport(&mf_emu_transport);
+	emu_status();
+	return 0;
+}
+
+// the word-wide keystream against crypto1_byte, and how fast each of them
+// encrypts 18 byte frames
+static int selftest_crypto1(void)
+{
+	struct Crypto1State *a = crypto1_create(0xa0a1a2a3a4a5ULL);
+	struct Crypto1State *b = crypto1_create(0xa0a1a2a3a4a5ULL);
+	uint8_t x[18], y[18], bt;
+	uint32_t para, parb;
+	int i, j, len, ok = 1;
+	double byteRate, wordRate;
+	clock_t start;
+
+	for (len = 1; len <= 18 && ok; len++) {
+		for (i = 0; i < len; i++)
+			x[i] = y[i] = i * 0x35 + len;
+		for (para = 0, i = 0; i < len; i++) {
+			bt = x[i];
+			x[i] ^= crypto1_byte(a, 0, 0);
+			para |= (uint32_t)((filter(a->odd) ^ parity(bt) ^ 1) & 0x01) << i;
+		}
+		crypto1_ks_crypt(b, y, len, &parb);
+		// the two may leave different bits above the 24 of each half
+		ok = !memcmp(x, y, len) && para == parb
+			&& !(((a->odd ^ b->odd) | (a->even ^ b->even)) & 0xffffff);
+	}
+
+	start = clock();
+	for (j = 0; j < 100000; j++)
+		for (para = 0, i = 0; i < 18; i++) {
+			bt = x[i];
+			x[i] ^= crypto1_byte(a, 0, 0);
+			para |= (uint32_t)((filter(a->odd) ^ parity(bt) ^ 1) & 0x01) << i;
+		}
+	byteRate = 1.8 * CLOCKS_PER_SEC / (clock() - start + 1);
+	start = clock();
+	for (j = 0; j < 100000; j++)
+		crypto1_ks_crypt(b, y, 18, &parb);
+	wordRate = 1.8 * CLOCKS_PER_SEC / (clock() - start + 1);
+
+	PrintAndLog("crypto1: keystream by words %s the one by bytes, %.1f MB/s against %.1f MB/s",
+		ok ? "matches" : "differs from", wordRate, byteRate);
+	crypto1_destroy(a);
+	crypto1_destroy(b);
+	return ok;
+}
+
+// the attacks against the test card, timed: darkside on key A of sector 0,
+// then nested from it on both keys of the next sectors
+int CmdHF14AMfSelftest(const char *Cmd)
+{
+	int prng = MF_EMU_PRNG_WEAK, sectors = 1;
+	int wasDevice = mfTransportIsDevice();
+	int i, t, s, found = 0, tries, cryptoOk;
+	uint8_t key[6], keyBlock[16 * 6];
+	uint64_t key64;
+	clock_t start, all;
+
+	for (i = 0; i < 2 && param_getchar(Cmd, i); i++) {
+		if ((t = emu_prng_param(Cmd, i)) >= 0)
+			prng = t;
+		else
+			sectors = param_get8(Cmd, i);
+	}
+	if ((param_getchar(Cmd, 0) == 'h' && emu_prng_param(Cmd, 0) < 0) || sectors < 1 || sectors > 15) {
+		PrintAndLog("Usage:  hf mf selftest [weak|static|hard] [<sectors>]");
+		PrintAndLog("        checks the Crypto1 keystream and times it, then runs mifare");
+		PrintAndLog("        and nested against the test card of hf mf emu");
+		PrintAndLog("        with these nonces (weak by default) and times them; nested");
+		PrintAndLog("        goes for both keys of 1 to 15 sectors after sector 0, 1 by default");
+		PrintAndLog(" sample: hf mf selftest");
+		PrintAndLog("         hf mf selftest static 3");
+		return 0;
+	}
+
+	cryptoOk = selftest_crypto1();
+
+	mf_emu_reset(prng);
+	mfSetTransport(&mf_emu_transport);
+	all = start = clock();
+
+	if (mfDarkside(0, &key64) || key64 != mf_emu_key(0, 0)) {
+		PrintAndLog("mifare: no key, nested goes on with the key of the card");
+		key64 = mf_emu_key(0, 0);
+	} else {
+		PrintAndLog("mifare: key A of sector 0 in %.2f s", (double)(clock() - start) / CLOCKS_PER_SEC);
+		found++;
+	}
+	num_to_bytes(key64, 6, key);
+
+	for (s = 1; s <= sectors; s++)
+		for (t = 0; t < 2; t++) {
+			start = clock();
+			for (tries = 1; tries <= NESTED_SECTOR_RETRY; tries++) {
+				if (mfnested(0, 0, key, s * 4, t, keyBlock)) {
+					tries = NESTED_SECTOR_RETRY + 1;
+					break;
+				}
+				if ((!mfCheckKeys(s * 4, t, 8, keyBlock, &key64) || !mfCheckKeys(s * 4, t, 8, &keyBlock[6 * 8], &key64))
+					&& key64 == mf_emu_key(s, t))
+					break;
+			}
+			if (tries > NESTED_SECTOR_RETRY) {
+				PrintAndLog("nested: no key %c of sector %d", t ? 'B' : 'A', s);
+				continue;
+			}
+			PrintAndLog("nested: key %c of sector %d in %.2f s, %d run%s", t ? 'B' : 'A', s,
+				(double)(clock() - start) / CLOCKS_PER_SEC, tries, tries > 1 ? "s" : "");
+			found++;
+		}
+
+	PrintAndLog("%s nonces: %d of %d keys in %.2f s", emu_prng_names[prng], found, 1 + sectors * 2,
+		(double)(clock() - all) / CLOCKS_PER_SEC);
+	emu_status();
+	if (wasDevice)
+		mfSetTransport(NULL);
+	return found == 1 + sectors * 2 && cryptoOk ? 0 : 1;
+}
+
 static command_t CommandTable[] =
 {
   {"help",		CmdHelp,						1, "This help"},
@@ -1670,8 +1894,10 @@ static command_t CommandTable[] =
   {"csetblk",	CmdHF14AMfCSetBlk,	0, "Write block into magic Chinese card"},
   {"cgetblk",	CmdHF14AMfCGetBlk,	0, "Read block from magic Chinese card"},
   {"cgetsc",	CmdHF14AMfCGetSc,		0, "Read sector from magic Chinese card"},
-  {"cload",		CmdHF14AMfCLoad,		0, "Load dump into magic Chinese card"},
+  {"cload",		CmdHF14AMfCLoad,		0, "Load dump into magic Chinese card in one session"},
   {"csave",		CmdHF14AMfCSave,		0, "Save dump from magic Chinese card into file or emulator"},
+  {"emu",			CmdHF14AMfEmu,			1, "Run the reader commands against a card model on the host"},
+  {"selftest",	CmdHF14AMfSelftest,	1, "Check Crypto1, time mifare and nested against the card model"},
   {NULL, NULL, 0, NULL}
 };
 
@@ -52,6 +52,7 @@ int CmdFlexdemod(const char *Cmd)
       GraphBuffer[i] = 1;
     }
   }
+  GraphChanged(0, GraphTraceLen);
 
 #define LONG_WAIT 100
   int start;
@@ -73,6 +74,7 @@ int CmdFlexdemod(const char *Cmd)
 
   GraphBuffer[start] = 2;
   GraphBuffer[start+1] = -2;
+  GraphChanged(start, start + 2);
 
   uint8_t bits[64];
 
@@ -122,6 +124,7 @@ int CmdFlexdemod(const char *Cmd)
     }
   }
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -298,6 +301,7 @@ int CmdIndalaDemod(const char *Cmd)
     }
   }
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
@@ -517,6 +521,7 @@ int CmdVchDemod(const char *Cmd)
         GraphBuffer[GraphTraceLen++] = (*s == '1') ? 1 : 0;
       }
     }
+    GraphChanged(0, GraphTraceLen);
     RepaintGraphWindow();
   }
   return 0;
@@ -18,6 +18,7 @@
 #include "cmddata.h"
 #include "cmdlf.h"
 #include "cmdlfem4x.h"
+#include "util.h"
 
 static int CmdHelp(const char *Cmd);
 
@@ -243,15 +244,17 @@ int CmdEM410xSim(const char *Cmd)
   return 0;
 }
 
-/* Function is equivalent of loread + losamples + em410xread
- * looped until an EM410x tag is detected */
+/* Demodulate EM410x tags on the device, which only reports decoded IDs
+ * (with read count and timestamp) instead of whole sample buffers.
+ * Runs until the button is pressed, or until the first tag with '1' */
 int CmdEM410xWatch(const char *Cmd)
 {
-  do
-  {
-    CmdLFRead("");
-    CmdSamples("2000");
-  } while ( ! CmdEM410xRead(""));
+  int findone = param_getchar(Cmd, 0) == '1';
+
+  UsbCommand c = {CMD_EM410X_DEMOD, {findone, 0, 0}};
+  SendCommand(&c);
+  if (!findone)
+    PrintAndLog("Watching for EM410x tags, press the button to stop");
   return 0;
 }
 
@@ -428,7 +431,7 @@ static command_t CommandTable[] =
   {"help",        CmdHelp,        1, "This help"},
   {"em410xread",  CmdEM410xRead,  1, "[clock rate] -- Extract ID from EM410x tag"},
   {"em410xsim",   CmdEM410xSim,   0, "<UID> -- Simulate EM410x tag"},
-  {"em410xwatch", CmdEM410xWatch, 0, "Watches for EM410x tags"},
+  {"em410xwatch", CmdEM410xWatch, 0, "['1' stop after first tag] -- Watches for EM410x tags, decoded on the device"},
   {"em410xwrite", CmdEM410xWrite, 1, "<UID> <'0' T5555> <'1' T55x7> -- Write EM410x UID to T5555(Q5) or T55x7 tag"},
   {"em4x50read",  CmdEM4x50Read,  1, "Extract data from EM4x50 tag"},
   {NULL, NULL, 0, NULL}
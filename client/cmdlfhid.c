@@ -32,6 +32,7 @@ int CmdHIDDemod(const char *Cmd)
       GraphBuffer[i] = 1;
     }
   }
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
   return 0;
 }
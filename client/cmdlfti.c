@@ -117,6 +117,7 @@ int CmdTIDemod(const char *Cmd)
 
   GraphTraceLen -= (convLen + 16);
 
+  GraphChanged(0, GraphTraceLen);
   RepaintGraphWindow();
 
   // TI tag data format is 16 prebits, 8 start bits, 64 data bits,
@@ -154,6 +155,7 @@ int CmdTIDemod(const char *Cmd)
   // of the start of sync
   GraphBuffer[maxPos] = 800;
   GraphBuffer[maxPos+1] = -800;
+  GraphChanged(maxPos, maxPos + 2);
 
   // advance pointer to start of actual data stream (after 16 pre and 8 start bits)
   maxPos += 17*lowLen;
@@ -163,6 +165,7 @@ int CmdTIDemod(const char *Cmd)
   // of the end of sync
   GraphBuffer[maxPos] = 800;
   GraphBuffer[maxPos+1] = -800;
+  GraphChanged(maxPos, maxPos + 2);
 
   PrintAndLog("actual data bits start at sample %d", maxPos);
 
@@ -203,6 +206,7 @@ int CmdTIDemod(const char *Cmd)
     // place a marker in the buffer between bits to visually aid location
     GraphBuffer[maxPos] = 800;
     GraphBuffer[maxPos+1] = -800;
+    GraphChanged(maxPos, maxPos + 2);
   }
   PrintAndLog("Info: raw tag bits = %s", bits);
 
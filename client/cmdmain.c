@@ -28,6 +28,13 @@ unsigned int received_command = CMD_UNKNOWN;
 UsbCommand current_response;
 UsbCommand current_response_user;
 
+// packets the device streams faster than one response slot takes them,
+// filled by the receiving thread, emptied by WaitForStreamTimeout()
+#define STREAM_QUEUE_LEN 512
+static UsbCommand stream_queue[STREAM_QUEUE_LEN];
+static volatile unsigned int stream_head = 0, stream_tail = 0;
+static UsbCommand stream_user;
+
 static int CmdHelp(const char *Cmd);
 static int CmdQuit(const char *Cmd);
 
@@ -80,6 +87,34 @@ UsbCommand * WaitForResponse(uint32_t response_type)
 	return WaitForResponseTimeout(response_type, -1);
 }
 
+UsbCommand * WaitForStreamTimeout(uint32_t ms_timeout) {
+	uint32_t i;
+
+	for(i=0; stream_head == stream_tail && i < ms_timeout; i++) {
+		msleep(1);
+	}
+
+	if(stream_head == stream_tail)
+		return NULL;
+
+	__sync_synchronize();
+	memcpy(&stream_user, &stream_queue[stream_tail % STREAM_QUEUE_LEN], sizeof(UsbCommand));
+	__sync_synchronize();
+	stream_tail++;
+
+	return &stream_user;
+}
+
+static void StreamPush(UsbCommand *UC) {
+	// full: the packet is lost, the sequence number tells the reader
+	if(stream_head - stream_tail >= STREAM_QUEUE_LEN)
+		return;
+
+	memcpy(&stream_queue[stream_head % STREAM_QUEUE_LEN], UC, sizeof(UsbCommand));
+	__sync_synchronize();
+	stream_head++;
+}
+
 //-----------------------------------------------------------------------------
 // Entry point into our code: called whenever the user types a command and
 // then presses Enter, which the full command line that they typed.
@@ -115,6 +150,17 @@ void UsbCommandReceived(UsbCommand *UC)
       return;
     } break;
 
+    case CMD_MIFARE_SNIFF_DATA: {
+      StreamPush(UC);
+      return;
+    } break;
+
+    case CMD_EM410X_DEMODED_ID: {
+      PrintAndLog("EM410x Tag ID: %02x%08x  (read %d, t=%d ms, clock %d)",
+        UC->arg[0], UC->arg[1], UC->arg[2], UC->d.asDwords[0], UC->d.asDwords[1]);
+      return;
+    } break;
+
     case CMD_MEASURED_ANTENNA_TUNING: {
       int peakv, peakf;
       int vLf125, vLf134, vHf;
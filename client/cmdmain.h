@@ -17,5 +17,7 @@ void UsbCommandReceived(UsbCommand *UC);
 void CommandReceived(char *Cmd);
 UsbCommand * WaitForResponseTimeout(uint32_t response_type, uint32_t ms_timeout);
 UsbCommand * WaitForResponse(uint32_t response_type);
+// the next streamed packet (CMD_MIFARE_SNIFF_DATA), NULL after ms_timeout
+UsbCommand * WaitForStreamTimeout(uint32_t ms_timeout);
 
 #endif
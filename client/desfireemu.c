@@ -0,0 +1,589 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire card model standing in for the device and a card
+//
+// Two halves: the card is the simulation of common/desfiresim.c, the code
+// the firmware runs, on an image of the test card; in front of it a model
+// of the device firmware answers the USB packets of CMD_MIFARE_DES_READER
+// and CMD_MIFARE_DES_CHKKEYS the way armsrc/desfire.c does, legacy
+// authentication and encryption included. Plugged in with
+// desfire_set_transport(), the host library cannot tell it from a real
+// reader and card, which makes the hf des commands testable and
+// measurable without hardware.
+//
+// Not modeled is what the simulation leaves out: commands that create,
+// delete or change keys, none of which the client sends, and the MAC or
+// encryption of answers from files with MACed or enciphered communication
+// settings (answers are plain, with the CMAC of EV1 sessions).
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iso14443crc.h"
+#include "desfireemu.h"
+
+#define FRAME_DATA      DESFIRE_SIM_FRAME_DATA
+#define EMU_APPS        3         // of the test card, besides the PICC level
+#define EMU_FILES       8         // ... over all of them
+
+#define COMM_ENCIPHERED 3
+
+// PCB of the ISO14443-4 blocks a reader sends
+#define PCB_I           0x02
+#define PCB_R_ACK       0xa2
+#define PCB_CHAINING    0x10
+#define RATS            0xe0
+
+static const uint8_t emu_uid[7] = {0x04, 0xe5, 0x12, 0x3a, 0x4b, 0x2c, 0x80};
+static const uint8_t emu_ats[] = {0x06, 0x75, 0x77, 0x81, 0x02, 0x80};
+static const uint8_t emu_hw[] = {0x04, 0x01, 0x01, 0x01, 0x00, 0x1a, 0x05};
+static const uint8_t emu_sw[] = {0x04, 0x01, 0x01, 0x01, 0x04, 0x1a, 0x05};
+static const uint8_t emu_batch[] = {0xba, 0x5e, 0x0e, 0x4f, 0x10, 0x21, 0x12};
+
+// the card: the simulation on its image
+static uint8_t image[DESFIRE_SIM_IMAGE_MAX];
+static desfire_sim_t card;
+
+// the test card while desfire_emu_reset() lays it out
+static struct {
+	uint32_t length;          // bytes of the image so far
+	int napps, nfiles;
+} build;
+
+// the device: field, chained answers and its legacy session key
+static struct {
+	int field;
+	uint8_t chain[DESFIRE_CHAIN_LIMIT];
+	uint8_t keys[DESFIRE_CHAIN_LIMIT];
+	des_ctx_t session_key;
+	UsbCommand ack;
+	int ack_pending;
+} device;
+
+static void random_bytes(uint8_t *buf, int len)
+{
+	while (len--)
+		*buf++ = rand();
+}
+
+static void rotate_left(uint8_t *out, const uint8_t *in, int len)
+{
+	memcpy(out, in + 1, len - 1);
+	out[len - 1] = in[0];
+}
+
+//-----------------------------------------------------------------------------
+// the image of the test card
+//-----------------------------------------------------------------------------
+
+static desfire_sim_header_t *header(void)
+{
+	return (desfire_sim_header_t *)image;
+}
+
+static desfire_sim_app_t *apps(void)
+{
+	return (desfire_sim_app_t *)(image + sizeof(desfire_sim_header_t));
+}
+
+static desfire_sim_file_t *files(void)
+{
+	return (desfire_sim_file_t *)(apps() + EMU_APPS + 1);
+}
+
+// the next 4 byte aligned offset of the image
+static uint32_t image_alloc(uint32_t bytes)
+{
+	uint32_t offset = build.length;
+
+	build.length += (bytes + 3) & ~3;
+	return offset;
+}
+
+// an application with all keys zero, the PICC level first
+static void add_app(uint32_t aid, uint8_t key_settings, uint8_t num_keys)
+{
+	desfire_sim_app_t *app = &apps()[build.napps++];
+
+	app->aid = aid;
+	app->key_settings = key_settings;
+	app->num_keys = num_keys;
+	app->first_file = build.nfiles;
+	app->keys = image_alloc((num_keys & 0xf) * 24);
+}
+
+// a file of the application added last; backup and record files get room
+// for a transaction behind their data
+static desfire_sim_file_t *add_file(int id, int type, uint8_t comm, uint16_t access, uint32_t size, uint32_t max_records)
+{
+	desfire_sim_file_t *f = &files()[build.nfiles++];
+	uint32_t bytes = type >= DESFIRE_LINEAR_RECORD_FILE ? size * max_records : size;
+
+	f->id = id;
+	f->type = type;
+	f->comm = comm;
+	f->access = access;
+	f->size = size;
+	f->max_records = max_records;
+	if (type != DESFIRE_VALUE_FILE)
+		f->data = image_alloc(type == DESFIRE_STANDARD_DATA_FILE ? bytes : 2 * bytes);
+	apps()[build.napps - 1].nfiles++;
+	return f;
+}
+
+void desfire_emu_reset(void)
+{
+	desfire_sim_header_t *h = header();
+	desfire_sim_file_t *f;
+	int i;
+
+	memset(image, 0, sizeof(image));
+	build.napps = build.nfiles = 0;
+	build.length = sizeof(*h) + (EMU_APPS + 1) * sizeof(desfire_sim_app_t) + EMU_FILES * sizeof(desfire_sim_file_t);
+
+	add_app(0, 0x0f, 1);
+
+	// 2K3DES keys: every kind of file, a backup file that needs key 1
+	add_app(0x112233, 0x0f, 2);
+	f = add_file(0, DESFIRE_STANDARD_DATA_FILE, 0, 0xeeee, 64, 0);
+	for (i = 0; i < 64; i++)
+		image[f->data + i] = i;
+	f = add_file(1, DESFIRE_BACKUP_DATA_FILE, COMM_ENCIPHERED, 0x1100, 32, 0);
+	memset(image + f->data, 0xb1, 32);
+	f = add_file(2, DESFIRE_VALUE_FILE, 0, 0xeeee, 0, 0);
+	f->upper = 1000;
+	f->value = 100;
+	f->limited_enabled = 1;
+	f = add_file(3, DESFIRE_CYCLIC_RECORD_FILE, 0, 0xeeee, 16, 5);
+	for (i = 0; i < 32; i++)
+		image[f->data + i] = 0xc0 + i / 16;
+	f->records = 2;
+	f = add_file(4, DESFIRE_STANDARD_DATA_FILE, 0, 0xeeee, 300, 0);
+	for (i = 0; i < 300; i++)
+		image[f->data + i] = i * 7;
+
+	// 3K3DES keys, everything needs key 0
+	add_app(0x445566, 0x0f, 0x40 | 2);
+	f = add_file(0, DESFIRE_STANDARD_DATA_FILE, 0, 0x0000, 32, 0);
+	memset(image + f->data, 0x3d, 32);
+
+	// AES keys, an enciphered value file
+	add_app(0x778899, 0x0f, 0x80 | 2);
+	f = add_file(0, DESFIRE_STANDARD_DATA_FILE, 0, 0x0000, 32, 0);
+	memset(image + f->data, 0xae, 32);
+	f = add_file(1, DESFIRE_VALUE_FILE, COMM_ENCIPHERED, 0x0000, 0, 0);
+	f->lower = -100;
+	f->upper = 100000;
+	f->value = 500;
+
+	h->magic = DESFIRE_SIM_MAGIC;
+	h->length = build.length;
+	memcpy(h->uid, emu_uid, sizeof(emu_uid));
+	h->napps = build.napps - 1;
+	memcpy(h->ats, emu_ats, sizeof(emu_ats));
+	memcpy(h->version, emu_hw, 7);
+	memcpy(h->version + 7, emu_sw, 7);
+	memcpy(h->version + 14, emu_uid, 7);
+	memcpy(h->version + 21, emu_batch, 7);
+	h->nfiles = build.nfiles;
+
+	desfire_sim_init(&card, image, build.length, rand());
+}
+
+void desfire_emu_stats(int *napp, int *nfiles)
+{
+	if (card.image == NULL)
+		desfire_emu_reset();
+	*napp = header()->napps;
+	*nfiles = header()->nfiles;
+}
+
+uint32_t desfire_emu_commands(void)
+{
+	return card.commands;
+}
+
+// The image is committed as it is: a transaction builds in the copies of
+// its files, which the state of the card keeps track of.
+int desfire_emu_image(uint8_t *out, int size)
+{
+	if (card.image == NULL)
+		desfire_emu_reset();
+	if ((uint32_t)size < header()->length)
+		return -1;
+	memcpy(out, image, header()->length);
+	return header()->length;
+}
+
+//-----------------------------------------------------------------------------
+// the device
+//-----------------------------------------------------------------------------
+
+// desfire_chain() of the firmware
+static int device_chain(const uint8_t *cmd, int cmd_len, uint8_t *buf, int limit, uint8_t *status)
+{
+	static const uint8_t more[] = {ADDITIONAL_FRAME};
+	uint8_t frame[1 + FRAME_DATA];
+	int total = 0, len;
+
+	if (!device.field)
+		return DESFIRE_LINK_ERROR;
+	for (;;) {
+		// no answer at all is a dead link, as on the air
+		len = desfire_sim_native(&card, cmd, cmd_len, frame);
+		if (len < 1)
+			return DESFIRE_LINK_ERROR;
+		*status = frame[0];
+		len--;
+		if (total + len > limit)
+			return DESFIRE_BUFFER_ERROR;
+		memcpy(buf + total, frame + 1, len);
+		total += len;
+
+		if (*status != ADDITIONAL_FRAME || cmd[0] == AUTHENTICATE_A
+		    || cmd[0] == AUTHENTICATE_ISO || cmd[0] == AUTHENTICATE_AES)
+			return total;
+		cmd = more;
+		cmd_len = sizeof(more);
+	}
+}
+
+static void activate(void)
+{
+	device.field = 1;
+	desfire_sim_halt(&card);
+}
+
+// chk_select() of the firmware
+static int device_select(uint32_t aid)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX], status;
+	int res;
+
+	activate();
+	res = device_chain(cmd, DESFIRE_ENCODE(cmd, SELECT_APPLICATION, aid), device.chain, sizeof(device.chain), &status);
+	if (res < 0)
+		return res;
+	return status == OPERATION_OK ? 0 : -status;
+}
+
+// desfire_authenticate() of the firmware
+static int device_authenticate(uint8_t key_slot, const uint8_t *key)
+{
+	des_ctx_t knd = {.valid = 0};
+	uint8_t cmd[17], resp[16], rnd_b[8], session_key[16], iv[8] = {0};
+	uint8_t status;
+	int len;
+
+	des_setkey(&knd, key, 16);
+	len = DESFIRE_ENCODE(cmd, AUTHENTICATE_A, key_slot);
+	len = device_chain(cmd, len, resp, sizeof(resp), &status);
+	if (len < 0)
+		return len;
+	if (status != ADDITIONAL_FRAME)
+		return -status;
+	memcpy(rnd_b, resp, 8);
+	des_decrypt_block(&knd, rnd_b);
+
+	random_bytes(cmd + 1, 8);
+	memcpy(session_key, cmd + 1, 4);
+	memcpy(session_key + 4, rnd_b, 4);
+	memcpy(session_key + 8, cmd + 5, 4);
+	memcpy(session_key + 12, rnd_b + 4, 4);
+	if (!memcmp(key, key + 8, 8))
+		memcpy(session_key + 8, session_key, 8);
+
+	rotate_left(cmd + 9, rnd_b, 8);
+	des_cbc_send(&knd, cmd + 1, 16, iv);
+	cmd[0] = AUTHENTICATION_FRAME;
+	len = device_chain(cmd, 17, resp, sizeof(resp), &status);
+	if (len < 0)
+		return len;
+	if (status != OPERATION_OK)
+		return -status;
+
+	device.session_key.valid = 0;
+	des_setkey(&device.session_key, session_key, 16);
+	return 0;
+}
+
+
+static void device_reader(UsbCommand *c)
+{
+	uint32_t param = c->arg[0], param2 = c->arg[1];
+	UsbCommand *ack = &device.ack;
+
+	if (param & CONNECT) {
+		iso14a_card_select_t *info = (iso14a_card_select_t *)(ack->d.asBytes + 12);
+
+		activate();
+		device.session_key.valid = 0;
+		memcpy(ack->d.asBytes, header()->uid, sizeof(header()->uid));
+		info->atqa[0] = 0x44;
+		info->sak = 0x20;
+		info->ats_len = desfire_sim_static(&card, 0, info->ats);
+		ack->arg[0] = 1;
+		device.ack_pending = param & NO_DISCONNECT;
+	}
+
+	if (param & EXECUTE_NATIVE_COMMAND) {
+		uint8_t *cmd = c->d.asBytes, status = 0;
+		int cmd_len = param2 & 0xff, offset = param2 >> 8 & 0xff;
+
+		if (offset) {
+			int length = cmd_len - offset, padded = (length + 7 + 2) & ~7;
+			uint8_t iv[8] = {0};
+
+			ComputeCrc14443(CRC_14443_A, cmd + offset, length, &cmd[cmd_len], &cmd[cmd_len + 1]);
+			memset(cmd + cmd_len + 2, 0, padded - length - 2);
+			des_cbc_send(&device.session_key, cmd + offset, padded, iv);
+			cmd_len = offset + padded;
+		}
+		ack->arg[0] = device_chain(cmd, cmd_len, device.chain, sizeof(device.chain), &status);
+		ack->arg[1] = status;
+		memcpy(ack->d.asBytes, device.chain, sizeof(ack->d.asBytes));
+		device.ack_pending = 1;
+	}
+
+	if (param & FETCH_RESPONSE) {
+		if (param2 < sizeof(device.chain))
+			memcpy(ack->d.asBytes, device.chain + param2, sizeof(ack->d.asBytes));
+		device.ack_pending = 1;
+	}
+
+	if (param & EXECUTE_SPECIAL_COMMAND) {
+		ack->arg[0] = param2 == SPECIAL_AUTH && device_authenticate(c->d.asBytes[0], c->d.asBytes + 4) == 0;
+		device.ack_pending = 1;
+	}
+
+	if (!(param & NO_DISCONNECT))
+		device.field = 0;
+}
+
+// MifareDESChkKeys() of the firmware
+static void device_chk_keys(UsbCommand *c)
+{
+	int count = c->arg[2] & 0xff, first = c->arg[2] >> 8 & 0xff;
+	int total = first + count, i = 0, retried = 0, res;
+	UsbCommand *ack = &device.ack;
+	clock_t start;
+
+	device.ack_pending = 1;
+	if (count > DESFIRE_CHK_KEYS_PER_PACKET || total > DESFIRE_CHK_MAX_KEYS) {
+		ack->arg[0] = DESFIRE_BUFFER_ERROR;
+		return;
+	}
+	memcpy(device.keys + 16 * first, c->d.asBytes, 16 * count);
+	if (!(c->arg[2] & DESFIRE_CHK_RUN)) {
+		ack->arg[0] = total;
+		return;
+	}
+
+	start = clock();
+	res = device_select(c->arg[0]);
+	while (res == 0 && i < total) {
+		res = device_authenticate(c->arg[1], device.keys + 16 * i);
+		if (res == 0) {
+			memcpy(ack->d.asBytes, device.keys + 16 * i, 16);
+			ack->arg[0] = 1;
+			i++;
+			break;
+		}
+		if (res == -AUTHENTICATION_ERROR) {
+			res = 0;
+			retried = 0;
+			i++;
+		} else if (!retried) {
+			retried = 1;
+			res = device_select(c->arg[0]);
+		}
+	}
+	if (res < 0)
+		ack->arg[0] = res;
+	ack->arg[1] = i;
+	ack->arg[2] = (clock() - start) * 1000 / CLOCKS_PER_SEC;
+	device.field = 0;
+}
+
+//-----------------------------------------------------------------------------
+// the simulation on its own against the simulation on the air
+//-----------------------------------------------------------------------------
+
+// two simulations of copies of the image: one answers native frames, the
+// other ISO14443-4 blocks as the firmware sees them, its reader's block
+// number in air_block
+static desfire_sim_t native, air;
+static int air_block;
+
+// a block to the card on the air, CRC appended; its answer without CRC
+static int air_exchange(uint8_t *block, int len, uint8_t *answer)
+{
+	uint8_t frame[DESFIRE_SIM_FRAME_MAX];
+	int n;
+
+	ComputeCrc14443(CRC_14443_A, block, len, &block[len], &block[len + 1]);
+	n = desfire_sim_frame(&air, block, len + 2, frame);
+	if (n < 3 || n > DESFIRE_SIM_FRAME_MAX)
+		return -1;
+	memcpy(answer, frame, n - 2);
+	return n - 2;
+}
+
+// A native frame through I-blocks of at most DESFIRE_SIM_FRAME_MAX bytes
+// without CID, chained both ways as iso14_apdu_exchange() does.
+static int air_native(const uint8_t *cmd, int len, uint8_t *frame)
+{
+	uint8_t block[DESFIRE_SIM_FRAME_MAX], answer[DESFIRE_SIM_FRAME_MAX];
+	int room = DESFIRE_SIM_FRAME_MAX - 3, sent = 0, total = 0, piece, n;
+
+	do {
+		piece = len - sent > room ? room : len - sent;
+		block[0] = PCB_I | air_block | (sent + piece < len ? PCB_CHAINING : 0);
+		memcpy(block + 1, cmd + sent, piece);
+		sent += piece;
+		if ((n = air_exchange(block, 1 + piece, answer)) < 1)
+			return -1;
+		if (sent < len) {
+			if (answer[0] != (PCB_R_ACK | air_block))
+				return -1;
+			air_block ^= 1;
+		}
+	} while (sent < len);
+
+	for (;;) {
+		if ((answer[0] & ~PCB_CHAINING) != (PCB_I | air_block) || total + n - 1 > 1 + FRAME_DATA)
+			return -1;
+		air_block ^= 1;
+		memcpy(frame + total, answer + 1, n - 1);
+		total += n - 1;
+		if (!(answer[0] & PCB_CHAINING))
+			return total;
+		block[0] = PCB_R_ACK | air_block;
+		if ((n = air_exchange(block, 1, answer)) < 1)
+			return -1;
+	}
+}
+
+// the answer to cmd and its ADDITIONAL_FRAMEs from one of the two: payload
+// to buf, the last status behind it
+static int check_chain(desfire_sim_t *sim, const uint8_t *cmd, int len, uint8_t *buf)
+{
+	static const uint8_t more[] = {ADDITIONAL_FRAME};
+	uint8_t frame[1 + FRAME_DATA];
+	int total = 0, n;
+
+	for (;;) {
+		n = sim == &air ? air_native(cmd, len, frame) : desfire_sim_native(sim, cmd, len, frame);
+		if (n < 1 || total + n > DESFIRE_CHAIN_LIMIT)
+			return -1;
+		memcpy(buf + total, frame + 1, n - 1);
+		total += n - 1;
+		if (frame[0] != ADDITIONAL_FRAME) {
+			buf[total] = frame[0];
+			return total + 1;
+		}
+		cmd = more;
+		len = sizeof(more);
+	}
+}
+
+// both answer cmd the same
+static int check_same(const uint8_t *cmd, int len, uint8_t *answer)
+{
+	static uint8_t other[DESFIRE_CHAIN_LIMIT];
+	int n = check_chain(&native, cmd, len, answer);
+
+	return n > 0 && check_chain(&air, cmd, len, other) == n && !memcmp(answer, other, n) ? n : -1;
+}
+
+const char *desfire_emu_sim_check(void)
+{
+	static uint8_t native_image[DESFIRE_SIM_IMAGE_MAX], air_image[DESFIRE_SIM_IMAGE_MAX];
+	static uint8_t answer[DESFIRE_CHAIN_LIMIT];
+	static char failed[64];
+	uint8_t cmd[DESFIRE_HEADER_MAX], ids[DESFIRE_MAX_FILES], settings[32];
+	uint8_t rats[4] = {RATS, 0x80}, ats[DESFIRE_SIM_FRAME_MAX];
+	uint32_t aids[DESFIRE_MAX_APPS + 1] = {0};
+	int napp = 0, nfiles, n, i, j;
+
+	if ((n = desfire_emu_image(native_image, sizeof(native_image))) < 0)
+		return "the image of the card";
+	memcpy(air_image, native_image, n);
+	if (desfire_sim_init(&native, native_image, n, 1) || desfire_sim_init(&air, air_image, n, 1))
+		return "the image of the card";
+	if (air_exchange(rats, 2, ats) < 1)
+		return "RATS";
+	air_block = 0;
+
+#define CHECK(...) do { \
+		if ((n = check_same(cmd, DESFIRE_ENCODE(cmd, __VA_ARGS__), answer)) < 0) { \
+			sprintf(failed, "%s of %06x", #__VA_ARGS__, aids[i]); \
+			return failed; \
+		} \
+	} while (0)
+
+	i = 0;
+	CHECK(GET_VERSION);
+	CHECK(GET_APPLICATION_IDS);
+	for (j = 0; j + 3 < n && napp < DESFIRE_MAX_APPS; j += 3)
+		aids[++napp] = answer[j] | answer[j + 1] << 8 | answer[j + 2] << 16;
+
+	for (i = 0; i <= napp; i++) {
+		CHECK(SELECT_APPLICATION, aids[i]);
+		CHECK(GET_KEY_SETTINGS);
+		CHECK(GET_KEY_VERSION, 0);
+		CHECK(GET_FILE_IDS);
+		nfiles = n - 1 < (int)sizeof(ids) ? n - 1 : (int)sizeof(ids);
+		memcpy(ids, answer, nfiles);
+
+		for (j = 0; j < nfiles; j++) {
+			CHECK(GET_FILE_SETTINGS, ids[j]);
+			memcpy(settings, answer, n < (int)sizeof(settings) ? n : (int)sizeof(settings));
+			switch (settings[0]) {
+				case DESFIRE_STANDARD_DATA_FILE:
+				case DESFIRE_BACKUP_DATA_FILE:
+					CHECK(READ_DATA, ids[j], 0, 0);
+					break;
+				case DESFIRE_VALUE_FILE:
+					CHECK(GET_VALUE, ids[j]);
+					CHECK(DEBIT, ids[j], 1);
+					CHECK(ABORT_TRANSACTION);
+					break;
+				default:
+					CHECK(READ_RECORDS, ids[j], 0, 0);
+			}
+		}
+	}
+#undef CHECK
+	return NULL;
+}
+
+static void emu_send(UsbCommand *c)
+{
+	memset(&device.ack, 0, sizeof(device.ack));
+	device.ack.cmd = CMD_ACK;
+	device.ack_pending = 0;
+
+	if (card.image == NULL)
+		desfire_emu_reset();
+
+	switch (c->cmd) {
+		case CMD_MIFARE_DES_READER:  device_reader(c); break;
+		case CMD_MIFARE_DES_CHKKEYS: device_chk_keys(c); break;
+	}
+}
+
+static UsbCommand *emu_wait(uint32_t response_type, uint32_t ms_timeout)
+{
+	if (!device.ack_pending || response_type != CMD_ACK)
+		return NULL;
+	device.ack_pending = 0;
+	return &device.ack;
+}
+
+const desfire_transport_t desfire_emu_transport = {emu_send, emu_wait};
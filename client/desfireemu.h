@@ -0,0 +1,38 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire card model standing in for the device and a card
+//-----------------------------------------------------------------------------
+
+#ifndef DESFIREEMU_H__
+#define DESFIREEMU_H__
+
+#include <stdint.h>
+#include "desfirehost.h"
+#include "desfiresim.h"
+
+// answers the device's DESFire packets with the emulated card
+extern const desfire_transport_t desfire_emu_transport;
+
+// Replace the card by the test card: the PICC and three applications with
+// DES, 3K3DES and AES keys, all keys zero.
+void desfire_emu_reset(void);
+
+// application count, files over all of them
+void desfire_emu_stats(int *apps, int *files);
+
+// native commands the card has run since the last reset
+uint32_t desfire_emu_commands(void);
+
+// The committed contents of the card as a desfire_sim_t image, returns its
+// length or -1 if size is too small.
+int desfire_emu_image(uint8_t *image, int size);
+
+// Run the simulation of the card's image natively and behind ISO14443-4
+// side by side through every application and file, NULL if they answer
+// the same, else the command where they differ.
+const char *desfire_emu_sim_check(void);
+
+#endif
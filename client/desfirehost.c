@@ -0,0 +1,714 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire host library: native commands over a persistent RF session
+//
+// The card is activated once and stays in the field (NO_DISCONNECT) until
+// desfire_disconnect() or a link error. The selected application and the
+// authenticated key are tracked here, so selecting the same application or
+// authenticating with the same key again costs nothing. The device follows
+// ADDITIONAL_FRAME itself and keeps up to DESFIRE_CHAIN_LIMIT bytes of
+// payload, which come over in USB packet sized pieces.
+//
+// Legacy authentication runs on the device, which keeps the session key.
+// EV1 authentication (AES, ISO 2K3DES/3K3DES) runs here: the host keeps the
+// session key and IV, MACs every command, checks the CMAC of every answer
+// and enciphers command data itself.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "proxusb.h"
+#include "cmdmain.h"
+#include "desfirehost.h"
+
+#define USB_DATA_LEN      ((int)sizeof(((UsbCommand *)0)->d.asBytes))
+#define DESFIRE_TIMEOUT   1500
+
+// write commands have an 8 byte header, enciphered data grows by its
+// CRC and the padding to whole DES blocks
+#define WRITE_CHUNK        (USB_DATA_LEN - 8)
+#define WRITE_CHUNK_CRYPT  ((WRITE_CHUNK & ~7) - 2)
+
+static desfire_session_t session = {
+	.aid = DESFIRE_NO_AID,
+	.auth_key = -1,
+};
+
+static const desfire_transport_t device = {SendCommand, WaitForResponseTimeout};
+static const desfire_transport_t *transport = &device;
+
+static int ev1_session(void)
+{
+	return session.auth_key >= 0 && session.auth_type != DESFIRE_AUTH_LEGACY;
+}
+
+static void drop_session(void)
+{
+	session.connected = 0;
+	session.aid = DESFIRE_NO_AID;
+	session.auth_key = -1;
+}
+
+/*
+ * Route the session through another transport, NULL is the device. An
+ * open session ends.
+ */
+void desfire_set_transport(const desfire_transport_t *t)
+{
+	drop_session();
+	transport = t ? t : &device;
+}
+
+const desfire_session_t *desfire_session(void)
+{
+	return &session;
+}
+
+/*
+ * Activate the card and keep the field on. Does nothing if a session is
+ * already open.
+ */
+int desfire_connect(void)
+{
+	UsbCommand c = {CMD_MIFARE_DES_READER, {CONNECT | NO_DISCONNECT, 0, 0}};
+	UsbCommand *resp;
+
+	if (session.connected)
+		return 0;
+
+	drop_session();
+	transport->send(&c);
+	resp = transport->wait(CMD_ACK, DESFIRE_TIMEOUT);
+	if (resp == NULL || resp->arg[0] != 1)
+		return DESFIRE_LINK_ERROR;
+
+	memcpy(session.uid, resp->d.asBytes, sizeof(session.uid));
+	memcpy(&session.card, resp->d.asBytes + 12, sizeof(session.card));
+	session.connected = 1;
+	session.aid = 0;        // the PICC level is selected after activation
+	session.commands = 0;
+	return 0;
+}
+
+/*
+ * Largest frame the card accepts, from FSCI in the ATS
+ */
+int desfire_fsc(void)
+{
+	static const int fsc[] = {16, 24, 32, 40, 48, 64, 96, 128, 256};
+	int fsci = 2;
+
+	// TL, then T0 if present
+	if (session.card.ats_len > 1 && session.card.ats[0] > 1)
+		fsci = session.card.ats[1] & 0x0f;
+	return fsc[fsci < 8 ? fsci : 8];
+}
+
+void desfire_disconnect(void)
+{
+	UsbCommand c = {CMD_MIFARE_DES_READER, {0, 0, 0}};
+
+	transport->send(&c);
+	drop_session();
+}
+
+// Hand a command to the device, the answer is picked up by receive_frames()
+static int send_frames(const uint8_t *cmd, int len, int encrypt_offset)
+{
+	UsbCommand c = {CMD_MIFARE_DES_READER, {EXECUTE_NATIVE_COMMAND | NO_DISCONNECT, len | encrypt_offset << 8, 0}};
+
+	if (len > USB_DATA_LEN)
+		return DESFIRE_BUFFER_ERROR;
+	memcpy(c.d.asBytes, cmd, len);
+	transport->send(&c);
+	return 0;
+}
+
+// Wait for the answer and fetch what did not fit into the acknowledge packet
+static int receive_frames(uint8_t *resp, int max, uint8_t *status)
+{
+	UsbCommand *ack;
+	int n;
+
+	ack = transport->wait(CMD_ACK, DESFIRE_TIMEOUT);
+	if (ack == NULL || (int)ack->arg[0] == DESFIRE_LINK_ERROR) {
+		drop_session();
+		return DESFIRE_LINK_ERROR;
+	}
+	if ((int)ack->arg[0] < 0)
+		return (int)ack->arg[0];
+	session.commands++;
+
+	n = ack->arg[0];
+	*status = ack->arg[1];
+	if (n > max)
+		return DESFIRE_BUFFER_ERROR;
+	memcpy(resp, ack->d.asBytes, n < USB_DATA_LEN ? n : USB_DATA_LEN);
+
+	for (int offset = USB_DATA_LEN; offset < n; offset += USB_DATA_LEN) {
+		UsbCommand f = {CMD_MIFARE_DES_READER, {FETCH_RESPONSE | NO_DISCONNECT, offset, 0}};
+		transport->send(&f);
+		ack = transport->wait(CMD_ACK, DESFIRE_TIMEOUT);
+		if (ack == NULL) {
+			drop_session();
+			return DESFIRE_LINK_ERROR;
+		}
+		memcpy(resp + offset, ack->d.asBytes, n - offset < USB_DATA_LEN ? n - offset : USB_DATA_LEN);
+	}
+	return n;
+}
+
+// EV1 enciphered command data: a CRC32 over the whole command is appended,
+// zero padding, then CBC with the session IV
+static int ev1_encipher(const uint8_t *cmd, int len, int offset, uint8_t *out)
+{
+	int size = session.cipher.block_size;
+	int padded = (len - offset + 4 + size - 1) / size * size;
+	uint32_t crc;
+
+	if (offset + padded > USB_DATA_LEN)
+		return DESFIRE_BUFFER_ERROR;
+
+	crc = desfire_crc32(cmd, len, 0xffffffff);
+	memcpy(out, cmd, len);
+	memset(out + len, 0, offset + padded - len);
+	for (int i = 0; i < 4; i++)
+		out[len + i] = crc >> (8 * i);
+	desfire_encipher(&session.cipher, out + offset, padded, session.iv);
+	return offset + padded;
+}
+
+// Check and strip the CMAC an EV1 answer ends with. It covers the payload
+// and the status; buf needs a byte of room behind the payload.
+static int ev1_verify(uint8_t *buf, int total, uint8_t status)
+{
+	uint8_t mac[8];
+
+	if (total < 8) {
+		session.auth_key = -1;
+		return -INTEGRITY_ERROR;
+	}
+	total -= 8;
+	memcpy(mac, buf + total, 8);
+	buf[total] = status;
+	desfire_cmac(&session.cipher, buf, total + 1, session.iv);
+	if (memcmp(mac, session.iv, 8)) {
+		session.auth_key = -1;
+		return -INTEGRITY_ERROR;
+	}
+	return total;
+}
+
+/*
+ * Run a native command, connecting first if needed, and collect the
+ * payload of all its frames into resp. Data from encrypt_offset on is
+ * enciphered with the session key by the device, 0 sends it plain.
+ * Returns the payload length.
+ */
+int desfire_exchange(const uint8_t *cmd, int len, int encrypt_offset, uint8_t *resp, int max)
+{
+	int res;
+
+	if ((res = desfire_exchange_begin(cmd, len, encrypt_offset)) < 0)
+		return res;
+	return desfire_exchange_end(resp, max);
+}
+
+/*
+ * desfire_exchange() in two halves: the device works on the command while
+ * the host does something else until desfire_exchange_end().
+ */
+int desfire_exchange_begin(const uint8_t *cmd, int len, int encrypt_offset)
+{
+	uint8_t buf[USB_DATA_LEN];
+	int res;
+
+	if ((res = desfire_connect()) < 0)
+		return res;
+	session.pending = cmd[0];
+	if (!ev1_session())
+		return send_frames(cmd, len, encrypt_offset);
+
+	if (encrypt_offset) {
+		if ((len = ev1_encipher(cmd, len, encrypt_offset, buf)) < 0)
+			return len;
+		return send_frames(buf, len, 0);
+	}
+	desfire_cmac(&session.cipher, cmd, len, session.iv);
+	return send_frames(cmd, len, 0);
+}
+
+int desfire_exchange_end(uint8_t *resp, int max)
+{
+	static uint8_t buf[DESFIRE_CHAIN_LIMIT + 1];
+	// selecting an application ends the authentication, its answer has no MAC
+	int ev1 = ev1_session() && session.pending != SELECT_APPLICATION;
+	uint8_t status;
+	int total;
+
+	total = receive_frames(ev1 ? buf : resp, ev1 ? DESFIRE_CHAIN_LIMIT : max, &status);
+	if (total < 0)
+		return total;
+
+	// authentication answers ADDITIONAL_FRAME, the next frame is ours to send
+	if (status != OPERATION_OK && status != NO_CHANGES && status != ADDITIONAL_FRAME) {
+		// any error ends the authenticated state on the card
+		session.auth_key = -1;
+		return -status;
+	}
+	if (!ev1)
+		return total;
+
+	if ((total = ev1_verify(buf, total, status)) < 0)
+		return total;
+	if (total > max)
+		return DESFIRE_BUFFER_ERROR;
+	memcpy(resp, buf, total);
+	return total;
+}
+
+/*
+ * Run a list of commands with one always in flight: the next command goes
+ * out as soon as the previous answer is in, and done() handles that answer
+ * while the device and card work on the next one. Stops early only on a
+ * link error, which is returned.
+ */
+int desfire_run_jobs(desfire_job_t *jobs, int count, desfire_job_done_t done, void *ctx)
+{
+	int res;
+
+	if (count <= 0)
+		return 0;
+	if ((res = desfire_exchange_begin(jobs[0].cmd, jobs[0].len, 0)) < 0)
+		return res;
+
+	for (int i = 0; i < count; i++) {
+		jobs[i].result = desfire_exchange_end(jobs[i].resp, jobs[i].max);
+		if (jobs[i].result == DESFIRE_LINK_ERROR)
+			return DESFIRE_LINK_ERROR;
+		if (i + 1 < count && (res = desfire_exchange_begin(jobs[i + 1].cmd, jobs[i + 1].len, 0)) < 0)
+			return res;
+		if (done)
+			done(&jobs[i], ctx);
+	}
+	return 0;
+}
+
+int desfire_get_version(uint8_t *version, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = desfire_encode(cmd, DESFIRE_ID_GET_VERSION, NULL);
+
+	return desfire_exchange(cmd, len, 0, version, max);
+}
+
+/*
+ * Returns the number of applications stored into aids.
+ */
+int desfire_get_application_ids(uint32_t *aids, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	uint8_t resp[3 * DESFIRE_MAX_APPS];
+	int len = desfire_encode(cmd, DESFIRE_ID_GET_APPLICATION_IDS, NULL);
+	int res, count;
+
+	if ((res = desfire_exchange(cmd, len, 0, resp, sizeof(resp))) < 0)
+		return res;
+
+	count = res / 3;
+	if (count > max)
+		count = max;
+	for (int i = 0; i < count; i++)
+		aids[i] = resp[3 * i] | resp[3 * i + 1] << 8 | resp[3 * i + 2] << 16;
+	return count;
+}
+
+int desfire_select_application(uint32_t aid)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	uint8_t resp[8];
+	int res;
+
+	if (session.connected && session.aid == aid)
+		return 0;
+
+	res = DESFIRE_ENCODE(cmd, SELECT_APPLICATION, aid);
+	res = desfire_exchange(cmd, res, 0, resp, sizeof(resp));
+	session.auth_key = -1;
+	session.aid = res < 0 ? DESFIRE_NO_AID : aid;
+	return res < 0 ? res : 0;
+}
+
+/*
+ * Legacy 2K3DES authentication, run on the device which keeps the session
+ * key. Repeating it with the key the session holds is free.
+ */
+int desfire_authenticate(int key_slot, const uint8_t *key)
+{
+	UsbCommand c = {CMD_MIFARE_DES_READER, {EXECUTE_SPECIAL_COMMAND | NO_DISCONNECT, SPECIAL_AUTH, 0}};
+	UsbCommand *resp;
+	int res;
+
+	if (session.connected && session.auth_key == key_slot && session.auth_type == DESFIRE_AUTH_LEGACY
+	    && !memcmp(session.auth_value, key, 16))
+		return 0;
+	if ((res = desfire_connect()) < 0)
+		return res;
+
+	c.d.asBytes[0] = key_slot;
+	memcpy(c.d.asBytes + 4, key, 16);
+	transport->send(&c);
+	resp = transport->wait(CMD_ACK, DESFIRE_TIMEOUT);
+	if (resp == NULL) {
+		drop_session();
+		return DESFIRE_LINK_ERROR;
+	}
+	session.commands++;
+
+	if (resp->arg[0] != 1) {
+		session.auth_key = -1;
+		return -AUTHENTICATION_ERROR;
+	}
+	session.auth_key = key_slot;
+	session.auth_type = DESFIRE_AUTH_LEGACY;
+	memcpy(session.auth_value, key, 16);
+	return 0;
+}
+
+static void random_bytes(uint8_t *buf, int len)
+{
+	FILE *f = fopen("/dev/urandom", "rb");
+
+	if (f == NULL || fread(buf, 1, len, f) != (size_t)len) {
+		srand(time(NULL) ^ clock());
+		for (int i = 0; i < len; i++)
+			buf[i] = rand();
+	}
+	if (f)
+		fclose(f);
+}
+
+// a 2K3DES key with equal halves, apart from the parity (key version) bits
+static int single_des(const uint8_t *key)
+{
+	for (int i = 0; i < 8; i++)
+		if ((key[i] ^ key[i + 8]) & 0xfe)
+			return 0;
+	return 1;
+}
+
+static void rotate_left(uint8_t *out, const uint8_t *in, int len)
+{
+	memcpy(out, in + 1, len - 1);
+	out[len - 1] = in[0];
+}
+
+/*
+ * EV1 authentication: AUTHENTICATE_ISO with 2K3DES or 3K3DES keys,
+ * AUTHENTICATE_AES with AES keys. The session stays authenticated until an
+ * error or another application is selected, repeating it costs nothing.
+ */
+int desfire_authenticate_ev1(int key_slot, int key_type, const uint8_t *key)
+{
+	desfire_cipher_t cipher;
+	uint8_t cmd[1 + 32], resp[32];
+	uint8_t rnd_a[16], rnd_b[16], session_key[24], iv[16] = {0};
+	int key_len = desfire_key_length(key_type);
+	int n = key_type == DESFIRE_KEY_2K3DES ? 8 : 16;   // nonce length
+	int res;
+
+	if (session.connected && session.auth_key == key_slot && session.auth_type == key_type
+	    && !memcmp(session.auth_value, key, key_len))
+		return 0;
+	if ((res = desfire_connect()) < 0)
+		return res;
+
+	// the card forgets the current authentication with the first frame
+	session.auth_key = -1;
+	memset(&cipher, 0, sizeof(cipher));
+	desfire_cipher_setkey(&cipher, key_type, key);
+
+	res = desfire_encode(cmd, key_type == DESFIRE_KEY_AES ? DESFIRE_ID_AUTHENTICATE_AES : DESFIRE_ID_AUTHENTICATE_ISO,
+		(const uint32_t[]){key_slot});
+	if ((res = desfire_exchange(cmd, res, 0, resp, sizeof(resp))) < 0)
+		return res;
+	if (res != n)
+		return -AUTHENTICATION_ERROR;
+	memcpy(rnd_b, resp, n);
+	desfire_decipher(&cipher, rnd_b, n, iv);
+
+	// RndA || RndB rotated left by a byte
+	random_bytes(rnd_a, n);
+	cmd[0] = ADDITIONAL_FRAME;
+	memcpy(cmd + 1, rnd_a, n);
+	rotate_left(cmd + 1 + n, rnd_b, n);
+	desfire_encipher(&cipher, cmd + 1, 2 * n, iv);
+	if ((res = desfire_exchange(cmd, 1 + 2 * n, 0, resp, sizeof(resp))) < 0)
+		return res;
+	if (res != n)
+		return -AUTHENTICATION_ERROR;
+
+	// the card proves it knows the key with RndA rotated left
+	desfire_decipher(&cipher, resp, n, iv);
+	rotate_left(cmd, rnd_a, n);
+	if (memcmp(resp, cmd, n))
+		return -AUTHENTICATION_ERROR;
+
+	// the session key takes four byte pieces from both nonces
+	memcpy(session_key, rnd_a, 4);
+	memcpy(session_key + 4, rnd_b, 4);
+	if (key_type == DESFIRE_KEY_AES) {
+		memcpy(session_key + 8, rnd_a + 12, 4);
+		memcpy(session_key + 12, rnd_b + 12, 4);
+	} else if (key_type == DESFIRE_KEY_3K3DES) {
+		memcpy(session_key + 8, rnd_a + 6, 4);
+		memcpy(session_key + 12, rnd_b + 6, 4);
+		memcpy(session_key + 16, rnd_a + 12, 4);
+		memcpy(session_key + 20, rnd_b + 12, 4);
+	} else if (single_des(key)) {
+		memcpy(session_key + 8, session_key, 8);
+	} else {
+		memcpy(session_key + 8, rnd_a + 4, 4);
+		memcpy(session_key + 12, rnd_b + 4, 4);
+	}
+
+	desfire_cipher_setkey(&session.cipher, key_type, session_key);
+	memset(session.iv, 0, sizeof(session.iv));
+	session.auth_key = key_slot;
+	session.auth_type = key_type;
+	memcpy(session.auth_value, key, key_len);
+	return 0;
+}
+
+/*
+ * Try count keys of 16 bytes on key_slot of application aid, in batches the
+ * device runs on its own. The card is activated for it, so an open session
+ * ends. Returns the index of the first key that fits, count if none does, or
+ * a negative result with *tried telling how far it got. *ms is the time the
+ * device spent on the keys.
+ */
+int desfire_check_keys(uint32_t aid, int key_slot, const uint8_t *keys, int count, int *tried, uint32_t *ms)
+{
+	UsbCommand c = {CMD_MIFARE_DES_CHKKEYS, {aid, key_slot, 0}};
+	UsbCommand *resp = NULL;
+	int batch, n;
+
+	drop_session();
+	*tried = 0;
+	*ms = 0;
+
+	for (; *tried < count; keys += 16 * batch) {
+		batch = count - *tried < DESFIRE_CHK_MAX_KEYS ? count - *tried : DESFIRE_CHK_MAX_KEYS;
+
+		for (int i = 0; i < batch; i += n) {
+			n = batch - i < DESFIRE_CHK_KEYS_PER_PACKET ? batch - i : DESFIRE_CHK_KEYS_PER_PACKET;
+			c.arg[2] = n | i << 8 | (i + n == batch ? DESFIRE_CHK_RUN : 0);
+			memcpy(c.d.asBytes, keys + 16 * i, 16 * n);
+			transport->send(&c);
+			// about 10 ms per key, and a field reset now and then
+			resp = transport->wait(CMD_ACK, i + n == batch ? 2000 + 20 * batch : DESFIRE_TIMEOUT);
+			if (resp == NULL)
+				return DESFIRE_LINK_ERROR;
+			if (i + n < batch && (int)resp->arg[0] < 0)
+				return resp->arg[0];
+		}
+
+		*tried += resp->arg[1];
+		*ms += resp->arg[2];
+		if ((int)resp->arg[0] < 0)
+			return resp->arg[0];
+		if (resp->arg[0] == 1)
+			return *tried - 1;
+	}
+	return count;
+}
+
+int desfire_get_file_ids(uint8_t *ids, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = desfire_encode(cmd, DESFIRE_ID_GET_FILE_IDS, NULL);
+
+	return desfire_exchange(cmd, len, 0, ids, max);
+}
+
+int desfire_get_file_settings(uint8_t file_id, uint8_t *settings, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = DESFIRE_ENCODE(cmd, GET_FILE_SETTINGS, file_id);
+
+	return desfire_exchange(cmd, len, 0, settings, max);
+}
+
+int desfire_get_key_settings(uint8_t *settings, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = desfire_encode(cmd, DESFIRE_ID_GET_KEY_SETTINGS, NULL);
+
+	return desfire_exchange(cmd, len, 0, settings, max);
+}
+
+/*
+ * Read length bytes (0: up to the end of the file) of a data file. The
+ * payload comes back as the card sends it, MACed or enciphered files
+ * include their MAC or padding.
+ */
+int desfire_read_data(uint8_t file_id, uint32_t offset, uint32_t length, uint8_t *data, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = DESFIRE_ENCODE(cmd, READ_DATA, file_id, offset, length);
+
+	return desfire_exchange(cmd, len, 0, data, max);
+}
+
+// WRITE_DATA and WRITE_RECORD split into commands that fit a USB packet;
+// record writes within one transaction all go to the same new record.
+static int write_chunked(enum desfire_command_id id, uint8_t file_id, uint32_t offset, uint32_t length, const uint8_t *data, int encrypt)
+{
+	uint32_t chunk = encrypt ? WRITE_CHUNK_CRYPT : WRITE_CHUNK;
+	uint8_t cmd[USB_DATA_LEN];
+	uint8_t resp[8];
+
+	// EV1 adds a CRC32 and pads to the blocks of the session cipher
+	if (encrypt && ev1_session())
+		chunk = WRITE_CHUNK / session.cipher.block_size * session.cipher.block_size - 4;
+
+	while (length > 0) {
+		uint32_t n = length < chunk ? length : chunk;
+		int len = desfire_encode(cmd, id, (const uint32_t[]){file_id, offset, n});
+		int res;
+
+		memcpy(cmd + len, data, n);
+		res = desfire_exchange(cmd, len + n, encrypt ? desfire_commands[id].encrypt : 0, resp, sizeof(resp));
+		if (res < 0)
+			return res;
+
+		offset += n;
+		data += n;
+		length -= n;
+	}
+	return 0;
+}
+
+int desfire_write_data(uint8_t file_id, uint32_t offset, uint32_t length, const uint8_t *data, int encrypt)
+{
+	return write_chunked(DESFIRE_ID_WRITE_DATA, file_id, offset, length, data, encrypt);
+}
+
+int desfire_get_value(uint8_t file_id, int32_t *value)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	uint8_t resp[16];
+	int res;
+
+	res = DESFIRE_ENCODE(cmd, GET_VALUE, file_id);
+	if ((res = desfire_exchange(cmd, res, 0, resp, sizeof(resp))) < 0)
+		return res;
+	if (res < desfire_commands[DESFIRE_ID_GET_VALUE].resp)
+		return DESFIRE_BUFFER_ERROR;
+	*value = resp[0] | resp[1] << 8 | resp[2] << 16 | (uint32_t)resp[3] << 24;
+	return 0;
+}
+
+static int value_operation(enum desfire_command_id id, uint8_t file_id, int32_t amount, int encrypt)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	uint8_t resp[8];
+	int len = desfire_encode(cmd, id, (const uint32_t[]){file_id, amount});
+	int res;
+
+	res = desfire_exchange(cmd, len, encrypt ? desfire_commands[id].encrypt : 0, resp, sizeof(resp));
+	return res < 0 ? res : 0;
+}
+
+int desfire_credit(uint8_t file_id, int32_t amount, int encrypt)
+{
+	return value_operation(DESFIRE_ID_CREDIT, file_id, amount, encrypt);
+}
+
+int desfire_debit(uint8_t file_id, int32_t amount, int encrypt)
+{
+	return value_operation(DESFIRE_ID_DEBIT, file_id, amount, encrypt);
+}
+
+int desfire_limited_credit(uint8_t file_id, int32_t amount, int encrypt)
+{
+	return value_operation(DESFIRE_ID_LIMITED_CREDIT, file_id, amount, encrypt);
+}
+
+int desfire_write_record(uint8_t file_id, uint32_t offset, uint32_t length, const uint8_t *data, int encrypt)
+{
+	return write_chunked(DESFIRE_ID_WRITE_RECORD, file_id, offset, length, data, encrypt);
+}
+
+/*
+ * Read count records (0: all) starting offset records back from the
+ * newest one.
+ */
+int desfire_read_records(uint8_t file_id, uint32_t offset, uint32_t count, uint8_t *data, int max)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	int len = DESFIRE_ENCODE(cmd, READ_RECORDS, file_id, offset, count);
+
+	return desfire_exchange(cmd, len, 0, data, max);
+}
+
+static int simple_command(enum desfire_command_id id, const uint32_t *args)
+{
+	uint8_t cmd[DESFIRE_HEADER_MAX];
+	uint8_t resp[8];
+	int len = desfire_encode(cmd, id, args);
+	int res;
+
+	res = desfire_exchange(cmd, len, 0, resp, sizeof(resp));
+	return res < 0 ? res : 0;
+}
+
+int desfire_clear_record_file(uint8_t file_id)
+{
+	return simple_command(DESFIRE_ID_CLEAR_RECORD_FILE, (const uint32_t[]){file_id});
+}
+
+int desfire_commit_transaction(void)
+{
+	return simple_command(DESFIRE_ID_COMMIT_TRANSACTION, NULL);
+}
+
+int desfire_abort_transaction(void)
+{
+	return simple_command(DESFIRE_ID_ABORT_TRANSACTION, NULL);
+}
+
+const char *desfire_error(int result)
+{
+	switch (result >= 0 ? OPERATION_OK : -result) {
+		case OPERATION_OK:            return "ok";
+		case -DESFIRE_LINK_ERROR:     return "no answer from the card";
+		case -DESFIRE_BUFFER_ERROR:   return "response too long";
+		case NO_CHANGES:              return "no changes";
+		case OUT_OF_EEPROM_ERROR:     return "out of EEPROM";
+		case ILLEGAL_COMMAND_CODE:    return "illegal command code";
+		case INTEGRITY_ERROR:         return "integrity error";
+		case NO_SUCH_KEY:             return "no such key";
+		case LENGTH_ERROR:            return "length error";
+		case PERMISSION_DENIED:       return "permission denied";
+		case PARAMETER_ERROR:         return "parameter error";
+		case APPLICATION_NOT_FOUND:   return "application not found";
+		case APPL_INTEGRITY_ERROR:    return "application integrity error";
+		case AUTHENTICATION_ERROR:    return "authentication error";
+		case BOUNDARY_ERROR:          return "boundary error";
+		case PICC_INTEGRITY_ERROR:    return "PICC integrity error";
+		case COMMAND_ABORTED:         return "command aborted";
+		case PICC_DISABLED_ERROR:     return "PICC disabled";
+		case COUNT_ERROR:             return "count error";
+		case DUPLICATE_ERROR:         return "duplicate error";
+		case EEPROM_ERROR:            return "EEPROM error";
+		case FILE_NOT_FOUND:          return "file not found";
+		case FILE_INTEGRITY_ERROR:    return "file integrity error";
+		default:                      return "unknown error";
+	}
+}
@@ -0,0 +1,91 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire host library: native commands over a persistent RF session
+//-----------------------------------------------------------------------------
+
+#ifndef DESFIREHOST_H__
+#define DESFIREHOST_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "usb_cmd.h"
+#include "desfire.h"
+#include "desfirecrypto.h"
+
+// Results are a byte count or 0 on success, a negative DESFIRE_STATUS
+// (-PERMISSION_DENIED, ...) if the card refused, DESFIRE_LINK_ERROR or
+// DESFIRE_BUFFER_ERROR.
+
+#define DESFIRE_NO_AID        0xffffffff
+
+typedef struct {
+	int connected;
+	uint8_t uid[10];
+	iso14a_card_select_t card;
+	uint32_t aid;             // selected application or DESFIRE_NO_AID
+	int auth_key;             // key slot authenticated with, -1 if none
+	int auth_type;            // DESFIRE_AUTH_LEGACY or the DESFIRE_KEY_ type of EV1
+	uint8_t auth_value[24];
+	desfire_cipher_t cipher;  // EV1 session key
+	uint8_t iv[16];           // EV1 IV, chained through all commands
+	uint8_t pending;          // command code between exchange begin and end
+	uint32_t commands;        // commands run by the device in this session
+} desfire_session_t;
+
+// a plain command for desfire_run_jobs()
+typedef struct {
+	uint8_t cmd[16];
+	int len;
+	uint8_t *resp;
+	int max;
+	int result;               // as desfire_exchange()
+	int tag;                  // for the caller
+} desfire_job_t;
+
+typedef void (*desfire_job_done_t)(desfire_job_t *job, void *ctx);
+
+// what carries the USB packets: the device, or the card model of desfireemu.c
+typedef struct {
+	void (*send)(UsbCommand *c);
+	UsbCommand *(*wait)(uint32_t response_type, uint32_t ms_timeout);
+} desfire_transport_t;
+
+void desfire_set_transport(const desfire_transport_t *transport);
+
+const desfire_session_t *desfire_session(void);
+int desfire_connect(void);
+int desfire_fsc(void);
+void desfire_disconnect(void);
+int desfire_exchange(const uint8_t *cmd, int len, int encrypt_offset, uint8_t *resp, int max);
+int desfire_exchange_begin(const uint8_t *cmd, int len, int encrypt_offset);
+int desfire_exchange_end(uint8_t *resp, int max);
+int desfire_run_jobs(desfire_job_t *jobs, int count, desfire_job_done_t done, void *ctx);
+
+int desfire_get_version(uint8_t *version, int max);
+int desfire_get_application_ids(uint32_t *aids, int max);
+int desfire_select_application(uint32_t aid);
+int desfire_authenticate(int key_slot, const uint8_t *key);
+int desfire_authenticate_ev1(int key_slot, int key_type, const uint8_t *key);
+int desfire_get_file_ids(uint8_t *ids, int max);
+int desfire_get_file_settings(uint8_t file_id, uint8_t *settings, int max);
+int desfire_get_key_settings(uint8_t *settings, int max);
+int desfire_check_keys(uint32_t aid, int key_slot, const uint8_t *keys, int count, int *tried, uint32_t *ms);
+
+int desfire_read_data(uint8_t file_id, uint32_t offset, uint32_t length, uint8_t *data, int max);
+int desfire_write_data(uint8_t file_id, uint32_t offset, uint32_t length, const uint8_t *data, int encrypt);
+int desfire_get_value(uint8_t file_id, int32_t *value);
+int desfire_credit(uint8_t file_id, int32_t amount, int encrypt);
+int desfire_debit(uint8_t file_id, int32_t amount, int encrypt);
+int desfire_limited_credit(uint8_t file_id, int32_t amount, int encrypt);
+int desfire_write_record(uint8_t file_id, uint32_t offset, uint32_t length, const uint8_t *data, int encrypt);
+int desfire_read_records(uint8_t file_id, uint32_t offset, uint32_t count, uint8_t *data, int max);
+int desfire_clear_record_file(uint8_t file_id);
+int desfire_commit_transaction(void);
+int desfire_abort_transaction(void);
+
+const char *desfire_error(int result);
+
+#endif
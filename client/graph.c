@@ -12,14 +12,33 @@
 #include <string.h>
 #include "ui.h"
 #include "graph.h"
+#include "clockrec.h"
 
 int GraphBuffer[MAX_GRAPH_TRACE_LEN];
 int GraphTraceLen;
+unsigned char GraphChunkDirty[MAX_GRAPH_TRACE_LEN / GRAPH_CHUNK];
+
+/*
+ * Anything that writes GraphBuffer reports the samples it touched here, so
+ * the graph window only has to look again at those chunks
+ */
+void GraphChanged(int start, int end)
+{
+  int c;
+
+  if (start < 0)
+    start = 0;
+  if (end > MAX_GRAPH_TRACE_LEN)
+    end = MAX_GRAPH_TRACE_LEN;
+
+  for (c = start / GRAPH_CHUNK; c * GRAPH_CHUNK < end; ++c)
+    GraphChunkDirty[c] = 1;
+}
 
 /* write a bit to the graph */
 void AppendGraph(int redraw, int clock, int bit)
 {
-  int i;
+  int i, start = GraphTraceLen;
 
   for (i = 0; i < (int)(clock / 2); ++i)
     GraphBuffer[GraphTraceLen++] = bit ^ 1;
@@ -27,6 +46,8 @@ void AppendGraph(int redraw, int clock, int bit)
   for (i = (int)(clock / 2); i < clock; ++i)
     GraphBuffer[GraphTraceLen++] = bit;
 
+  GraphChanged(start, GraphTraceLen);
+
   if (redraw)
     RepaintGraphWindow();
 }
@@ -44,9 +65,10 @@ int ClearGraph(int redraw)
 }
 
 /*
- * Detect clock rate
+ * Detect clock rate from the minimum distance between peaks, fallback for
+ * buffers without enough edges for the autocorrelation
  */
-int DetectClock(int peak)
+static int DetectClockPeaks(int peak)
 {
   int i;
   int clock = 0xFFFF;
@@ -73,6 +95,19 @@ int DetectClock(int peak)
   return clock;
 }
 
+/*
+ * Detect clock rate
+ */
+int DetectClock(int peak)
+{
+  clock_estimate_t est;
+
+  if (estimate_clock(GraphBuffer, GraphTraceLen, peak, &est) == 0)
+    return est.clock;
+
+  return DetectClockPeaks(peak);
+}
+
 /* Get or auto-detect clock rate */
 int GetClock(const char *str, int peak, int verbose)
 {
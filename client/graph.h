@@ -13,6 +13,7 @@
 
 void AppendGraph(int redraw, int clock, int bit);
 int ClearGraph(int redraw);
+void GraphChanged(int start, int end);
 int DetectClock(int peak);
 int GetClock(const char *str, int peak, int verbose);
 
@@ -20,4 +21,8 @@ int GetClock(const char *str, int peak, int verbose);
 extern int GraphBuffer[MAX_GRAPH_TRACE_LEN];
 extern int GraphTraceLen;
 
+// Chunks of GraphBuffer written since the graph window last looked
+#define GRAPH_CHUNK 256
+extern unsigned char GraphChunkDirty[MAX_GRAPH_TRACE_LEN / GRAPH_CHUNK];
+
 #endif
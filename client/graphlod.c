@@ -0,0 +1,156 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Level of detail for the graph window: min/max pyramid of the samples
+//
+// Level l holds the minimum, maximum and sum of every aligned run of 2^l
+// samples, so any range of samples is covered by O(log n) nodes. Whatever
+// writes GraphBuffer marks the chunks it touched (GraphChanged), and only
+// the nodes above those chunks are rebuilt.
+//-----------------------------------------------------------------------------
+
+#include "graph.h"
+#include "graphlod.h"
+
+#define LOD_LEVELS  17                 // 2^17 == MAX_GRAPH_TRACE_LEN
+#define LOD_CHUNK   GRAPH_CHUNK
+
+typedef struct {
+	int min;
+	int max;
+	int64_t sum;
+} lod_node_t;
+
+static struct {
+	int valid;
+	int len;
+	const int *samples;
+	lod_node_t nodes[MAX_GRAPH_TRACE_LEN];   // levels 1..LOD_LEVELS back to back
+	lod_node_t *levels[LOD_LEVELS + 1];
+} lod;
+
+static void setup_levels(void)
+{
+	lod_node_t *next = lod.nodes;
+
+	for (int l = 1; l <= LOD_LEVELS; l++) {
+		lod.levels[l] = next;
+		next += MAX_GRAPH_TRACE_LEN >> l;
+	}
+}
+
+// Recompute all nodes above samples lo..hi-1
+static void rebuild(int lo, int hi)
+{
+	lod_node_t *level1 = lod.levels[1];
+
+	for (int i = lo >> 1; i <= (hi - 1) >> 1; i++) {
+		int a = lod.samples[2 * i], b = lod.samples[2 * i + 1];
+		level1[i].min = a < b ? a : b;
+		level1[i].max = a > b ? a : b;
+		level1[i].sum = (int64_t)a + b;
+	}
+
+	for (int l = 2; l <= LOD_LEVELS; l++) {
+		lod_node_t *up = lod.levels[l], *down = lod.levels[l - 1];
+		for (int i = lo >> l; i <= (hi - 1) >> l; i++) {
+			lod_node_t *a = &down[2 * i], *b = &down[2 * i + 1];
+			up[i].min = a->min < b->min ? a->min : b->min;
+			up[i].max = a->max > b->max ? a->max : b->max;
+			up[i].sum = a->sum + b->sum;
+		}
+	}
+}
+
+/*
+ * Bring the pyramid up to date with the sample buffer. Costs a pass over
+ * the chunk flags plus work proportional to the changed samples.
+ */
+void graph_lod_sync(const int *samples, int len)
+{
+	int lo, hi = 0;
+	int chunks;
+
+	if (len > MAX_GRAPH_TRACE_LEN)
+		len = MAX_GRAPH_TRACE_LEN;
+	if (len < 0)
+		len = 0;
+	lo = len;
+	lod.samples = samples;
+
+	if (!lod.valid) {
+		setup_levels();
+		lo = 0;
+		hi = len;
+		lod.valid = 1;
+	} else if (len != lod.len) {
+		// nodes that straddled the old end have to be redone
+		lo = (len < lod.len ? len : lod.len) & ~(LOD_CHUNK - 1);
+		hi = len;
+	}
+
+	// flags are taken before the samples are read, so a chunk written
+	// meanwhile stays marked for the next sync
+	chunks = (len + LOD_CHUNK - 1) / LOD_CHUNK;
+	for (int c = 0; c < MAX_GRAPH_TRACE_LEN / LOD_CHUNK; c++) {
+		if (!GraphChunkDirty[c])
+			continue;
+		GraphChunkDirty[c] = 0;
+		if (c >= chunks)
+			continue;
+		if (c * LOD_CHUNK < lo)
+			lo = c * LOD_CHUNK;
+		if ((c + 1) * LOD_CHUNK > hi)
+			hi = (c + 1) * LOD_CHUNK < len ? (c + 1) * LOD_CHUNK : len;
+	}
+
+	lod.len = len;
+	if (lo < hi)
+		rebuild(lo, hi);
+}
+
+/*
+ * Minimum, maximum and sum of samples start..end-1 as of the last sync.
+ * Returns 0, or -1 if the range holds no samples.
+ */
+int graph_lod_span(int start, int end, graph_span_t *span)
+{
+	if (start < 0)
+		start = 0;
+	if (end > lod.len)
+		end = lod.len;
+	if (start >= end)
+		return -1;
+
+	span->min = span->max = lod.samples[start];
+	span->sum = 0;
+	span->count = end - start;
+
+	for (int p = start; p < end; ) {
+		int l = 0;
+
+		// the largest aligned node that fits into the rest of the range
+		while (l < LOD_LEVELS && !(p & ((2 << l) - 1)) && p + (2 << l) <= end)
+			l++;
+
+		if (l == 0) {
+			int y = lod.samples[p];
+			if (y < span->min)
+				span->min = y;
+			if (y > span->max)
+				span->max = y;
+			span->sum += y;
+		} else {
+			lod_node_t *node = &lod.levels[l][p >> l];
+			if (node->min < span->min)
+				span->min = node->min;
+			if (node->max > span->max)
+				span->max = node->max;
+			span->sum += node->sum;
+		}
+		p += 1 << l;
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Level of detail for the graph window: min/max pyramid of the samples
+//-----------------------------------------------------------------------------
+
+#ifndef GRAPHLOD_H__
+#define GRAPHLOD_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	int min;
+	int max;
+	int64_t sum;
+	int count;
+} graph_span_t;
+
+void graph_lod_sync(const int *samples, int len);
+int graph_lod_span(int start, int end, graph_span_t *span);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
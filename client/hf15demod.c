@@ -0,0 +1,563 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// ISO15693 soft demodulator for sampled traces
+//
+// Finds every frame in a capture taken with hf 15 record/read (106.353 ksps,
+// one sample per 9.403us). Tag responses are found by correlating against the
+// SOF/logic/EOF templates from iso15693tools.h, at both data rates. The
+// templates consist of runs of +1/-1, so each correlation is a handful of
+// differences of a running sum, independent of the template length. The bit
+// clock is tracked in 1/256 samples along the mid-bit transitions. Reader
+// frames show up as short carrier pauses and are decoded by their position,
+// in 1-out-of-4 as well as 1-out-of-256 coding.
+//
+// All arithmetic is done in integers.
+//-----------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include "data.h"
+#include "iso15693tools.h"
+#include "hf15demod.h"
+
+#define HF15_MAX_BOXES       8
+
+// sample period and reader chip length in ns
+#define HF15_SAMPLE_NS       9403
+#define HF15_CHIP_NS         9440
+// tag bit length at the high data rate, 4x that at the low one
+#define HF15_TAG_BIT_NS      37760
+
+// SOF detection: normalized correlation of at least 0.7 (squared, in percent)
+#define HF15_SOF_RHO2        49
+// shortest tag response: flags and CRC
+#define HF15_MIN_TAG_FRAME   3
+// weak bits in a row that end a tag response without EOF
+#define HF15_MAX_WEAK_BITS   4
+// longest carrier dip, in samples, that counts as a reader pause, dips of
+// up to twice that length may be two pauses in a row
+#define HF15_MAX_PAUSE       3
+
+// a run of equal template values, as span of the decimated template
+typedef struct {
+	int offset;
+	int len;
+	int sign;
+} hf15_box_t;
+
+typedef struct {
+	int len;
+	int count;
+	hf15_box_t box[HF15_MAX_BOXES];
+} hf15_corr_t;
+
+typedef struct {
+	const int *samples;
+	int len;
+	int64_t *sum;         // sum[i] = samples[0] + .. + samples[i-1]
+	int64_t *sum_sq;      // same, over the squared samples
+	uint8_t *covered;     // samples belonging to an already decoded frame
+	int amplitude_floor;
+	hf15_frame_t *frames;
+	int count;
+	int size;
+} hf15_state_t;
+
+// Turn a template at 4x resolution into boxes at sample resolution
+static void build_correlator(hf15_corr_t *corr, const int *tmpl, int n, int skip)
+{
+	corr->len = n / skip;
+	corr->count = 0;
+
+	for (int j = 0; j < corr->len; j++) {
+		int sign = tmpl[j * skip];
+
+		if (corr->count && corr->box[corr->count - 1].sign == sign) {
+			corr->box[corr->count - 1].len++;
+		} else if (corr->count < HF15_MAX_BOXES) {
+			corr->box[corr->count].offset = j;
+			corr->box[corr->count].len = 1;
+			corr->box[corr->count].sign = sign;
+			corr->count++;
+		}
+	}
+}
+
+// Correlation of the template placed at pos, caller checks the bounds
+static int64_t correlate(const hf15_corr_t *corr, const int64_t *sum, int pos)
+{
+	int64_t acc = 0;
+
+	for (int i = 0; i < corr->count; i++) {
+		const hf15_box_t *box = &corr->box[i];
+		int64_t part = sum[pos + box->offset + box->len] - sum[pos + box->offset];
+		acc += box->sign > 0 ? part : -part;
+	}
+	return acc;
+}
+
+// Correlation at a position in 1/256 samples, interpolated linearly
+static int64_t correlate_fp(const hf15_corr_t *corr, const int64_t *sum, int pos_fp)
+{
+	int pos = pos_fp >> 8, frac = pos_fp & 0xff;
+
+	return (correlate(corr, sum, pos) * (256 - frac) + correlate(corr, sum, pos + 1) * frac) / 256;
+}
+
+// Conversions between reader chips and sample positions in 1/256 samples
+static int fp_to_chips(int fp)
+{
+	int64_t ns = (int64_t)fp * HF15_SAMPLE_NS;
+	int64_t chip = (int64_t)HF15_CHIP_NS << 8;
+
+	if (ns < 0)
+		return -(int)((-ns + chip / 2) / chip);
+	return (int)((ns + chip / 2) / chip);
+}
+
+static int chips_to_fp(int chips)
+{
+	return (int)((((int64_t)chips * HF15_CHIP_NS << 8) + HF15_SAMPLE_NS / 2) / HF15_SAMPLE_NS);
+}
+
+uint32_t hf15_sample_to_us(int sample)
+{
+	return (uint32_t)(((uint64_t)sample * HF15_SAMPLE_NS + 500) / 1000);
+}
+
+const char *hf15_coding_name(int coding)
+{
+	switch (coding) {
+		case HF15_TAG_HIGH_RATE: return "high";
+		case HF15_TAG_LOW_RATE:  return "low";
+		case HF15_READER_1OF4:   return "1/4";
+		case HF15_READER_1OF256: return "1/256";
+		default:                 return "?";
+	}
+}
+
+static int add_frame(hf15_state_t *st, const hf15_frame_t *frame)
+{
+	if (st->count == st->size) {
+		int size = st->size ? 2 * st->size : 16;
+		hf15_frame_t *frames = realloc(st->frames, size * sizeof(hf15_frame_t));
+		if (!frames)
+			return -1;
+		st->frames = frames;
+		st->size = size;
+	}
+	st->frames[st->count++] = *frame;
+	return 0;
+}
+
+static void finish_frame(hf15_frame_t *frame)
+{
+	frame->crc_ok = frame->len >= 3 && Iso15693Crc(frame->data, frame->len) == ISO15_CRC_CHECK;
+}
+
+static int is_covered(const hf15_state_t *st, int start, int end)
+{
+	for (int i = start; i < end; i++)
+		if (st->covered[i])
+			return 1;
+	return 0;
+}
+
+// Correlation of a plausible SOF at pos, 0 if there is none
+static int64_t sof_match(const hf15_state_t *st, const hf15_corr_t *sof, int pos)
+{
+	int64_t corr = correlate(sof, st->sum, pos);
+	int64_t sum, sum_sq, spread;
+
+	if (corr <= (int64_t)st->amplitude_floor * sof->len)
+		return 0;
+
+	// corr^2 / (n * sum((x - mean)^2)) is the squared normalized
+	// correlation, the template has n entries of +-1 and no DC
+	sum = st->sum[pos + sof->len] - st->sum[pos];
+	sum_sq = st->sum_sq[pos + sof->len] - st->sum_sq[pos];
+	spread = sof->len * sum_sq - sum * sum;
+	if (100 * corr * corr < HF15_SOF_RHO2 * spread)
+		return 0;
+	return corr;
+}
+
+// Correlators of one tag data rate
+typedef struct {
+	int bit_fp;           // bit length in 1/256 samples
+	hf15_corr_t sof;
+	hf15_corr_t logic1;
+	hf15_corr_t eof;
+} hf15_tag_rate_t;
+
+static void init_tag_rate(hf15_tag_rate_t *rate, int coding)
+{
+	int skip = coding == HF15_TAG_HIGH_RATE ? 4 : 1;
+
+	rate->bit_fp = (int)(((int64_t)HF15_TAG_BIT_NS * 4 / skip * 256 + HF15_SAMPLE_NS / 2) / HF15_SAMPLE_NS);
+	build_correlator(&rate->sof, Iso15693FrameSOF, arraylen(Iso15693FrameSOF), skip);
+	build_correlator(&rate->logic1, Iso15693Logic1, arraylen(Iso15693Logic1), skip);
+	build_correlator(&rate->eof, Iso15693FrameEOF, arraylen(Iso15693FrameEOF), skip);
+}
+
+// Mean level over the inner samples of a SOF box, in 1/256
+static int64_t box_level(const hf15_state_t *st, const hf15_box_t *box, int start)
+{
+	int first = start + box->offset + 1, last = start + box->offset + box->len - 1;
+
+	return (st->sum[last] - st->sum[first]) * 256 / (last - first);
+}
+
+/*
+ * Decode the tag response whose SOF is at start_fp (in 1/256 samples) and
+ * correlates with sof_corr. Returns 0 if the frame was terminated by a
+ * valid EOF.
+ */
+static int decode_tag_frame(const hf15_state_t *st, const hf15_tag_rate_t *rate,
+	int start_fp, int64_t sof_corr, hf15_frame_t *frame)
+{
+	const hf15_corr_t *logic1 = &rate->logic1, *eof = &rate->eof;
+	int start = (start_fp + 128) >> 8;
+	int pos_fp = start_fp + 4 * rate->bit_fp;
+	int64_t bit_level = sof_corr * logic1->len / rate->sof.len / 4;
+	int64_t unmodulated, modulated;
+	int bits = 0, weak = 0;
+
+	// The SOF's long runs give the levels of both halves of a bit, the
+	// timing recovery below measures against them
+	unmodulated = box_level(st, &rate->sof.box[0], start);
+	modulated = box_level(st, &rate->sof.box[1], start);
+	if (modulated - unmodulated < 256)
+		return -1;
+
+	for (;;) {
+		int pos = (pos_fp + 128) >> 8;
+		int64_t corr, as_data = 0, eof_corr = 0;
+		const int *mid;
+		int error;
+
+		if (pos + 2 + eof->len > st->len)
+			return -1;
+
+		// The EOF starts like a logic 0. It's there if it explains
+		// the next four bit times better than any data would.
+		eof_corr = correlate_fp(eof, st->sum, pos_fp);
+		for (int k = 0; k < 4; k++)
+			as_data += llabs(correlate_fp(logic1, st->sum, pos_fp + k * rate->bit_fp));
+		if (eof_corr > as_data && 2 * eof_corr >= sof_corr) {
+			if (bits % 8 || bits < 8 * HF15_MIN_TAG_FRAME)
+				return -1;
+			frame->len = bits / 8;
+			frame->end = pos + eof->len;
+			return 0;
+		}
+
+		// Logic 0 is the inverse of logic 1, one correlation decides
+		corr = correlate_fp(logic1, st->sum, pos_fp);
+		weak = llabs(corr) < bit_level ? weak + 1 : 0;
+		if (weak == HF15_MAX_WEAK_BITS || bits >= 8 * HF15_MAX_FRAME_LEN)
+			return -1;
+		if (corr > 0)
+			frame->data[bits >> 3] |= 1 << (bits & 7);
+		bits++;
+
+		// The sample clock isn't a multiple of the bit clock, so track
+		// the phase of the mid-bit transition. The two samples around it
+		// add up to both levels when it falls right between them, any
+		// deviation is the part of the step that landed in the wrong
+		// sample. Follow 1/8 of the measured phase error per bit.
+		mid = st->samples + pos + logic1->len / 2;
+		error = (int)((unmodulated + modulated - 256 * (mid[-1] + mid[0])) * 256
+			/ (modulated - unmodulated));
+		if (corr < 0)
+			error = -error;
+		error += (pos << 8) - pos_fp;
+		if (error > 128)
+			error = 128;
+		if (error < -128)
+			error = -128;
+		pos_fp += rate->bit_fp + error / 8;
+	}
+}
+
+static int scan_tag_frames(hf15_state_t *st, int coding)
+{
+	hf15_tag_rate_t rate;
+	const hf15_corr_t *sof = &rate.sof;
+
+	init_tag_rate(&rate, coding);
+
+	for (int pos = 1; pos + sof->len + rate.eof.len < st->len; pos++) {
+		hf15_frame_t frame;
+		int64_t corr, best, before, after;
+		int start = pos, start_fp;
+
+		if (st->covered[pos] || !(best = sof_match(st, sof, pos)))
+			continue;
+
+		// move on to the correlation peak and interpolate its position
+		for (int p = pos + 1; p <= pos + sof->len / 2 && p + 1 + sof->len + rate.eof.len < st->len; p++) {
+			corr = correlate(sof, st->sum, p);
+			if (corr > best) {
+				best = corr;
+				start = p;
+			}
+		}
+		before = correlate(sof, st->sum, start - 1);
+		after = correlate(sof, st->sum, start + 1);
+		start_fp = start << 8;
+		if (2 * best - before - after > 0)
+			start_fp += (int)(128 * (after - before) / (2 * best - before - after));
+
+		memset(&frame, 0, sizeof(frame));
+		frame.start = start;
+		frame.coding = coding;
+		if (decode_tag_frame(st, &rate, start_fp, best, &frame)
+		    || is_covered(st, frame.start, frame.end))
+		{
+			continue;
+		}
+
+		finish_frame(&frame);
+		if (add_frame(st, &frame))
+			return -1;
+		memset(st->covered + frame.start, 1, frame.end - frame.start);
+		pos = frame.end - 1;
+	}
+	return 0;
+}
+
+/*
+ * Centroid of the dip below level over samples first..last, in 1/256
+ * samples. With two set, the dip is cut into halves of equal area and the
+ * centroids of both halves are stored. Returns the dip's area.
+ */
+static int64_t dip_centers(const int *x, int first, int last, int level, int half_first, int half_last,
+	int two, int *centers)
+{
+	int64_t w[2 * HF15_MAX_PAUSE + 2];
+	int64_t area = 0, part = 0, moment[2] = {0, 0}, weight[2] = {0, 0};
+	int n = last - first + 1;
+
+	for (int k = 0; k < n; k++) {
+		w[k] = x[first + k] < level ? 2 * (level - x[first + k]) : 0;
+		if ((k == 0 && half_first) || (k == n - 1 && half_last))
+			w[k] /= 2;
+		area += w[k];
+	}
+
+	for (int k = 0; k < n; k++) {
+		int64_t pos = ((int64_t)(first + k) << 8) + 128;
+		// share of this sample that still belongs to the first half
+		int64_t head = two ? w[k] : 0;
+
+		if (two && part + w[k] > area / 2)
+			head = part < area / 2 ? area / 2 - part : 0;
+		weight[0] += head;
+		moment[0] += head * pos;
+		weight[1] += w[k] - head;
+		moment[1] += (w[k] - head) * pos;
+		part += w[k];
+	}
+
+	if (!area) {
+		centers[0] = centers[1] = (first + last + 1) << 7;
+	} else if (two) {
+		centers[0] = weight[0] ? (int)(moment[0] / weight[0]) : (int)(moment[1] / weight[1]);
+		centers[1] = weight[1] ? (int)(moment[1] / weight[1]) : centers[0];
+	} else {
+		centers[0] = (int)(moment[1] / weight[1]);
+	}
+	return area / 2;
+}
+
+/*
+ * Centers of the short dips below the carrier, in 1/256 samples. A pause is
+ * about as long as a sample, its center is the centroid of the dip below
+ * the surrounding carrier level. Two pauses one chip apart merge into one
+ * dip with a peak in between, the peak sample is shared by both. Adjacent
+ * pauses merge completely and are told apart by the area of the dip, a
+ * single pause takes the carrier down to about low for one sample.
+ */
+static int find_pauses(const hf15_state_t *st, int threshold, int low, int *pauses)
+{
+	const int *x = st->samples;
+	int count = 0;
+
+	for (int i = 2; i < st->len; i++) {
+		int run = 0, level, first;
+
+		if (x[i] >= threshold || x[i - 1] < threshold)
+			continue;
+		while (i + run < st->len && x[i + run] < threshold)
+			run++;
+		if (run > 2 * HF15_MAX_PAUSE || i + run + 1 >= st->len || is_covered(st, i, i + run)) {
+			i += run;
+			continue;
+		}
+
+		level = (x[i - 2] + x[i + run + 1]) / 2;
+		first = i - 1;
+		for (int k = i + 1; k <= i + run; k++) {
+			int peak = k < i + run - 1 && x[k] > x[k - 1] && x[k] >= x[k + 1];
+
+			if (!peak && k < i + run)
+				continue;
+			if (2 * dip_centers(x, first, k, level, first != i - 1, peak, 0, pauses + count)
+			    > 3 * (int64_t)(level - low))
+			{
+				dip_centers(x, first, k, level, first != i - 1, peak, 1, pauses + count++);
+			}
+			count++;
+			first = k;
+		}
+		i += run;
+	}
+	return count;
+}
+
+/*
+ * Decode the reader frame whose SOF starts with pause k. In each window of
+ * 4 (1/4) or 256 (1/256) slots of two chips the pause falls on the second
+ * chip of the slot that carries the value, a pause on the first chip of a
+ * slot is the EOF. Positions are pause centers, half a chip into the chip.
+ * Returns the index of the EOF pause, -1 on error.
+ */
+static int decode_reader_frame(const int *pauses, int count, int k, hf15_frame_t *frame)
+{
+	int window = frame->coding == HF15_READER_1OF4 ? 8 : 512;
+	int base = pauses[k] + chips_to_fp(8);
+	int bits = 0;
+
+	for (int j = k + 2; j < count; j++) {
+		int chip = fp_to_chips(pauses[j] - base);
+
+		if (chip < 0 || chip >= window)
+			return -1;
+
+		if (!(chip & 1)) {
+			if (bits == 0 || bits % 8)
+				return -1;
+			frame->len = bits / 8;
+			frame->end = (pauses[j] + chips_to_fp(2)) >> 8;
+			return j;
+		}
+
+		if (bits >= 8 * HF15_MAX_FRAME_LEN)
+			return -1;
+		if (frame->coding == HF15_READER_1OF4) {
+			frame->data[bits >> 3] |= (chip >> 1) << (bits & 7);
+			bits += 2;
+		} else {
+			frame->data[bits >> 3] = chip >> 1;
+			bits += 8;
+		}
+
+		// resynchronize on every pause
+		base = pauses[j] - chips_to_fp(chip) + chips_to_fp(window);
+	}
+	return -1;
+}
+
+// low and high are the extremes of the capture, pauses reach down to low
+static int scan_reader_frames(hf15_state_t *st, int low, int high)
+{
+	int *pauses = malloc(st->len * sizeof(int));
+	int count, result = 0;
+
+	if (!pauses)
+		return -1;
+	count = find_pauses(st, low + (high - low) / 2, low, pauses);
+
+	for (int k = 0; k + 1 < count; k++) {
+		int gap = fp_to_chips(pauses[k + 1] - pauses[k]);
+		hf15_frame_t frame;
+		int last;
+
+		// SOF: second pause after 5 chips for 1/4, after 7 for 1/256
+		if (gap != 5 && gap != 7)
+			continue;
+
+		memset(&frame, 0, sizeof(frame));
+		frame.start = (pauses[k] - chips_to_fp(1) / 2) >> 8;
+		frame.coding = gap == 5 ? HF15_READER_1OF4 : HF15_READER_1OF256;
+		last = decode_reader_frame(pauses, count, k, &frame);
+		if (last < 0)
+			continue;
+
+		finish_frame(&frame);
+		if (add_frame(st, &frame)) {
+			result = -1;
+			break;
+		}
+		k = last;
+	}
+
+	free(pauses);
+	return result;
+}
+
+static int compare_frames(const void *a, const void *b)
+{
+	return ((const hf15_frame_t *)a)->start - ((const hf15_frame_t *)b)->start;
+}
+
+/*
+ * Demodulate all ISO15693 frames in a sample buffer and pass them to handler,
+ * ordered by their start. Returns the number of frames, -1 if out of memory.
+ */
+int hf15_demod_stream(const int *samples, int len, hf15_frame_handler_t handler, void *ctx)
+{
+	hf15_state_t st;
+	int low, high, result = -1;
+
+	if (len < 2)
+		return 0;
+
+	memset(&st, 0, sizeof(st));
+	st.samples = samples;
+	st.len = len;
+	st.sum = malloc((len + 1) * sizeof(int64_t));
+	st.sum_sq = malloc((len + 1) * sizeof(int64_t));
+	st.covered = calloc(len, 1);
+	if (!st.sum || !st.sum_sq || !st.covered)
+		goto out;
+
+	low = high = samples[0];
+	st.sum[0] = st.sum_sq[0] = 0;
+	for (int i = 0; i < len; i++) {
+		st.sum[i + 1] = st.sum[i] + samples[i];
+		st.sum_sq[i + 1] = st.sum_sq[i] + (int64_t)samples[i] * samples[i];
+		if (samples[i] < low)
+			low = samples[i];
+		if (samples[i] > high)
+			high = samples[i];
+	}
+	st.amplitude_floor = (high - low) / 32;
+	if (st.amplitude_floor < 1)
+		st.amplitude_floor = 1;
+
+	// A low rate SOF doesn't correlate with high rate data, the other way
+	// round it does, so the low rate frames have to be claimed first.
+	if (scan_tag_frames(&st, HF15_TAG_LOW_RATE)
+	    || scan_tag_frames(&st, HF15_TAG_HIGH_RATE)
+	    || scan_reader_frames(&st, low, high))
+	{
+		goto out;
+	}
+
+	qsort(st.frames, st.count, sizeof(hf15_frame_t), compare_frames);
+	for (int i = 0; i < st.count; i++)
+		handler(&st.frames[i], ctx);
+	result = st.count;
+
+out:
+	free(st.sum);
+	free(st.sum_sq);
+	free(st.covered);
+	free(st.frames);
+	return result;
+}
@@ -0,0 +1,37 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// ISO15693 soft demodulator for sampled traces
+//-----------------------------------------------------------------------------
+
+#ifndef HF15DEMOD_H__
+#define HF15DEMOD_H__
+
+#include <stdint.h>
+
+#define HF15_MAX_FRAME_LEN   256
+
+// frame codings
+#define HF15_TAG_HIGH_RATE   0   // VICC -> VCD, one subcarrier, high data rate
+#define HF15_TAG_LOW_RATE    1   // VICC -> VCD, one subcarrier, low data rate
+#define HF15_READER_1OF4     2   // VCD -> VICC, 1-out-of-4 pulse position
+#define HF15_READER_1OF256   3   // VCD -> VICC, 1-out-of-256 pulse position
+
+typedef struct {
+	int start;            // first sample of the SOF
+	int end;              // first sample after the EOF
+	int coding;           // HF15_TAG_* or HF15_READER_*
+	int crc_ok;
+	int len;
+	uint8_t data[HF15_MAX_FRAME_LEN];
+} hf15_frame_t;
+
+typedef void (*hf15_frame_handler_t)(const hf15_frame_t *frame, void *ctx);
+
+int hf15_demod_stream(const int *samples, int len, hf15_frame_handler_t handler, void *ctx);
+uint32_t hf15_sample_to_us(int sample);
+const char *hf15_coding_name(int coding);
+
+#endif
@@ -0,0 +1,963 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic card model standing in for the device and a card
+//
+// Two halves, as in desfireemu.c: the card answers ISO14443A frames, the
+// anticollision, first and nested authentication, READ, WRITE and HALT
+// under Crypto1, checking and sending the parity bits the way a real card
+// does; in front of it a model of the device firmware answers the USB
+// packets of CMD_MIFARE_READBL, READSC, WRITEBL, CHKKEYS, CHKKEYS_FAST,
+// NESTED and CMD_READER_MIFARE the way armsrc/mifarecmd.c and
+// ReaderMifare() do. Plugged in with mfSetTransport(), hf mf rdbl, rdsc,
+// wrbl, restore, chk, nested and mifare run without hardware, the attacks
+// end to end.
+//
+// The nonces come from the card's PRNG: weak, the 16 bit LFSR of real
+// cards clocked from power-up; static, the same nonce every time; or hard,
+// random nonces and no NACK when the reader answer is wrong. Time counts in
+// bit periods, the LFSR's clock: the frames take their bits, the reader a
+// fixed turnaround between them and up to JITTER more while it computes
+// Crypto1, and the card powers up within POWER_JITTER periods. So the first
+// nonce after power-up comes back often, which the darkside attack needs,
+// and the nested ones spread a little as they do on a device. Each packet
+// starts its field at a phase of its own, so a darkside run that skips a
+// nonce meets others.
+//
+// Not modeled: access conditions beyond key A reading back as zeros, value
+// blocks, 7 byte UIDs and the backdoor of magic cards.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso14443crc.h"
+#include "nonce2key/crapto1.h"
+#include "mifareemu.h"
+
+#define MAX_BLOCKS      256
+#define TURNAROUND      200       // bit periods from an answer to the next frame
+#define JITTER          16        // more while the reader computes Crypto1
+#define POWER_JITTER    8         // the card comes up this many periods early or late
+#define PHASE_STEP      37        // power-up phase from one packet to the next
+#define DARKSIDE_TRIES  4096      // field cycles until the device gives up
+#define ACK_QUEUE       16
+#define BITS_PER_MS     106       // bit periods in a millisecond
+
+// as armsrc/mifareutil.h
+#define CRYPT_ALL       1
+#define AUTH_FIRST      0
+#define AUTH_NESTED     2
+#define NS_TOLERANCE    10
+#define NS_RETRIES_GETNONCE 15
+#define NES_MAX_INFO    5
+
+#define NACK_AUTH       0x5       // the encrypted answer the darkside attack reads
+#define NACK_CMD        0x4
+#define ACK             0xa
+
+enum {
+	CARD_IDLE,
+	CARD_READY,
+	CARD_ACTIVE,
+	CARD_HALT,
+	CARD_AUTH,                    // nonce sent, waiting for {nr, ar}
+	CARD_CRYPTO,                  // authenticated
+	CARD_WRITE,                   // waiting for the data of a WRITE
+};
+
+static struct {
+	uint8_t data[MAX_BLOCKS * 16];
+	int sectors, blocks;
+	int prng;
+	uint32_t seed;                // the nonce at power-up, the static one
+	uint32_t random;              // of the hard PRNG
+	int state;
+	struct Crypto1State cs;
+	uint32_t nt;                  // of the authentication going on
+	int sector;                   // ... and its sector
+	int write_block;
+	uint32_t ticks;               // bit periods since power-up
+	uint32_t frames, auths;
+} card;
+
+static struct {
+	UsbCommand acks[ACK_QUEUE], current;
+	int head, count;
+	uint32_t phase;               // at which the field comes on
+	uint32_t commands;
+	uint32_t random;              // of the jitter
+	uint8_t chk_keys[MF_CHK_MAX_KEYS * 6];            // at MF_CHK_KEYS
+	mf_chk_key_t chk_table[MF_CHK_MAX_SECTORS * 2];   // at MF_CHK_TABLE
+} device;
+
+static uint32_t next_random(uint32_t *x)
+{
+	*x = *x * 1103515245 + 12345;
+	return *x >> 8;
+}
+
+static int odd_parity(uint8_t b)
+{
+	return parity(b) ^ 1;
+}
+
+// the parity bits of plain bytes, byte i in bit i
+static uint32_t plain_parity(const uint8_t *data, int len)
+{
+	uint32_t par = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		par |= (uint32_t)odd_parity(data[i]) << i;
+	return par;
+}
+
+static void append_crc(uint8_t *data, int len)
+{
+	ComputeCrc14443(CRC_14443_A, data, len, &data[len], &data[len + 1]);
+}
+
+static int crc_ok(const uint8_t *data, int len)
+{
+	uint8_t b1, b2;
+
+	ComputeCrc14443(CRC_14443_A, data, len - 2, &b1, &b2);
+	return len > 2 && data[len - 2] == b1 && data[len - 1] == b2;
+}
+
+static void cipher_init(struct Crypto1State *cs, uint64_t key)
+{
+	struct Crypto1State *s = crypto1_create(key);
+
+	*cs = *s;
+	crypto1_destroy(s);
+}
+
+static int sector_of(int block)
+{
+	return block < 128 ? block / 4 : 32 + (block - 128) / 16;
+}
+
+static int trailer_of(int sector)
+{
+	return sector < 32 ? sector * 4 + 3 : 128 + (sector - 32) * 16 + 15;
+}
+
+static uint64_t test_key(int sector, int keyType)
+{
+	return (0x4d3a99c351ddULL ^ (uint64_t)(sector * 2 + keyType + 1) * 0x9e3779b97f4bULL) & 0xffffffffffffULL;
+}
+
+void mf_emu_set_prng(int prng)
+{
+	card.prng = prng;
+}
+
+int mf_emu_prng(void)
+{
+	return card.prng;
+}
+
+int mf_emu_sectors(void)
+{
+	return card.sectors;
+}
+
+uint32_t mf_emu_uid(void)
+{
+	return bytes_to_num(card.data, 4);
+}
+
+uint64_t mf_emu_key(int sector, int keyType)
+{
+	return bytes_to_num(card.data + 16 * trailer_of(sector) + (keyType ? 10 : 0), 6);
+}
+
+void mf_emu_stats(uint32_t *frames, uint32_t *auths)
+{
+	*frames = card.frames;
+	*auths = card.auths;
+}
+
+static void restart(int prng)
+{
+	card.prng = prng;
+	card.seed = prng_successor(0x2c198be4, 32);
+	card.random = 1;
+	card.state = CARD_IDLE;
+	card.frames = card.auths = 0;
+	device.head = device.count = 0;
+	device.commands = 0;
+	device.random = 1;
+}
+
+int mf_emu_load(const uint8_t *data, int len, int prng)
+{
+	switch (len) {
+		case 320:  card.sectors = 5; break;
+		case 1024: card.sectors = 16; break;
+		case 2048: card.sectors = 32; break;
+		case 4096: card.sectors = 40; break;
+		default:   return -1;
+	}
+	card.blocks = len / 16;
+	memset(card.data, 0, sizeof(card.data));
+	memcpy(card.data, data, len);
+	restart(prng);
+	return 0;
+}
+
+void mf_emu_reset(int prng)
+{
+	static const uint8_t access[4] = {0xff, 0x07, 0x80, 0x69};
+	uint8_t image[1024];
+	int block, sector;
+
+	for (block = 0; block < 64; block++) {
+		memset(image + 16 * block, block, 16);
+		image[16 * block] = block / 4;
+	}
+	for (sector = 0; sector < 16; sector++) {
+		uint8_t *trailer = image + 16 * trailer_of(sector);
+		num_to_bytes(test_key(sector, 0), 6, trailer);
+		memcpy(trailer + 6, access, 4);
+		num_to_bytes(test_key(sector, 1), 6, trailer + 10);
+	}
+	memcpy(image, "\x9c\x59\x9b\x32\x6c\x08\x04\x00\x62\x63\x64\x65\x66\x67\x68\x69", 16);
+	mf_emu_load(image, sizeof(image), prng);
+}
+
+//-----------------------------------------------------------------------------
+// the card
+//-----------------------------------------------------------------------------
+
+static void card_power(uint32_t phase)
+{
+	card.state = CARD_IDLE;
+	card.ticks = phase;
+}
+
+static uint32_t card_nonce(void)
+{
+	switch (card.prng) {
+		case MF_EMU_PRNG_STATIC: return card.seed;
+		case MF_EMU_PRNG_HARD:   return next_random(&card.random) ^ next_random(&card.random) << 16;
+	}
+	// the LFSR repeats after 65535 steps, a long session need not run them all
+	return prng_successor(card.seed, card.ticks % 65535);
+}
+
+// plain to out under the cipher
+static int card_encrypt(const uint8_t *plain, int len, uint8_t *out, uint32_t *par)
+{
+	memcpy(out, plain, len);
+	crypto1_ks_crypt(&card.cs, out, len, par);
+	return len;
+}
+
+// a 4 bit answer under the cipher
+static int card_answer4(uint8_t value, uint8_t *out)
+{
+	out[0] = (crypto1_ks(&card.cs, 4) ^ value) & 0x0f;
+	return 1;
+}
+
+// a reader frame under the cipher to plain, 0 if a parity bit is wrong
+static int card_decrypt(const uint8_t *in, int len, uint32_t par, uint8_t *plain)
+{
+	int i, ok = 1;
+
+	for (i = 0; i < len; i++) {
+		plain[i] = in[i] ^ crypto1_byte(&card.cs, 0, 0);
+		if ((uint32_t)(filter(card.cs.odd) ^ odd_parity(plain[i])) != (par >> i & 1))
+			ok = 0;
+	}
+	return ok;
+}
+
+// the nonce of an authentication, in the clear or nested under the cipher
+// of the one before; the cipher then starts on the key of the block
+static int card_auth(uint8_t keyType, uint8_t block, int nested, uint8_t *out, uint32_t *par)
+{
+	uint32_t uid = mf_emu_uid(), nt;
+	int i;
+
+	if (block >= card.blocks) {
+		card.state = CARD_IDLE;
+		return nested ? card_answer4(NACK_CMD, out) : 0;
+	}
+	card.nt = nt = card_nonce();
+	card.sector = sector_of(block);
+	card.auths++;
+	cipher_init(&card.cs, mf_emu_key(card.sector, keyType & 1));
+	num_to_bytes(nt, 4, out);
+	*par = plain_parity(out, 4);
+	if (nested) {
+		*par = 0;
+		for (i = 0; i < 4; i++) {
+			uint8_t plain = out[i];
+
+			out[i] ^= crypto1_byte(&card.cs, (uid ^ nt) >> (24 - 8 * i) & 0xff, 0);
+			*par |= (uint32_t)(filter(card.cs.odd) ^ odd_parity(plain)) << i;
+		}
+	} else {
+		crypto1_word(&card.cs, uid ^ nt, 0);
+	}
+	card.state = CARD_AUTH;
+	return 4;
+}
+
+// {nr, ar}: nr into the cipher, ar must be the nonce 64 steps on. With all
+// parity bits right and ar wrong a card of the weak PRNG sends a NACK under
+// the cipher, which is what the darkside attack lives on.
+static int card_reader_answer(const uint8_t *in, int len, uint32_t par, uint8_t *out, uint32_t *out_par)
+{
+	uint32_t ar = prng_successor(card.nt, 64);
+	uint8_t plain;
+	int i, parity_ok = 1, ar_ok = 1;
+
+	card.state = CARD_IDLE;
+	if (len != 8)
+		return 0;
+	for (i = 0; i < 8; i++) {
+		if (i < 4)
+			plain = in[i] ^ crypto1_byte(&card.cs, in[i], 1);
+		else
+			plain = in[i] ^ crypto1_byte(&card.cs, 0, 0);
+		if ((uint32_t)(filter(card.cs.odd) ^ odd_parity(plain)) != (par >> i & 1))
+			parity_ok = 0;
+		if (i >= 4 && plain != (ar >> (8 * (7 - i)) & 0xff))
+			ar_ok = 0;
+	}
+	if (!parity_ok)
+		return 0;
+	if (!ar_ok)
+		return card.prng == MF_EMU_PRNG_HARD ? 0 : card_answer4(NACK_AUTH, out);
+
+	num_to_bytes(prng_successor(card.nt, 96), 4, out);
+	card.state = CARD_CRYPTO;
+	return card_encrypt(out, 4, out, out_par);
+}
+
+static int card_command(const uint8_t *in, int len, uint32_t par, uint8_t *out, uint32_t *out_par)
+{
+	uint8_t plain[18];
+	int block;
+
+	if (len > (int)sizeof(plain) || !card_decrypt(in, len, par, plain) || !crc_ok(plain, len)) {
+		card.state = CARD_IDLE;
+		return 0;
+	}
+
+	if (card.state == CARD_WRITE) {
+		card.state = CARD_IDLE;
+		if (len != 18)
+			return 0;
+		memcpy(card.data + 16 * card.write_block, plain, 16);
+		card.state = CARD_CRYPTO;
+		return card_answer4(ACK, out);
+	}
+
+	if (len != 4) {
+		card.state = CARD_IDLE;
+		return 0;
+	}
+	block = plain[1];
+	switch (plain[0]) {
+		case 0x60:
+		case 0x61:
+			return card_auth(plain[0], block, 1, out, out_par);
+		case 0x30:
+			if (block >= card.blocks || sector_of(block) != card.sector)
+				break;
+			memcpy(plain, card.data + 16 * block, 16);
+			if (block == trailer_of(card.sector))
+				memset(plain, 0, 6);
+			append_crc(plain, 16);
+			return card_encrypt(plain, 18, out, out_par);
+		case 0xa0:
+			if (block >= card.blocks || sector_of(block) != card.sector)
+				break;
+			card.write_block = block;
+			card.state = CARD_WRITE;
+			return card_answer4(ACK, out);
+		case 0x50:
+			card.state = CARD_HALT;
+			return 0;
+	}
+	card.state = CARD_IDLE;
+	return card_answer4(NACK_CMD, out);
+}
+
+// One reader frame to the card, its answer to out: len bytes and the parity
+// bit of byte i in bit i of par; len 1 is a short frame of 7 bits going in
+// and a 4 bit answer coming out. Returns the length of the answer, 0 for
+// none.
+static int card_frame(const uint8_t *in, int len, uint32_t par, uint8_t *out, uint32_t *out_par)
+{
+	card.frames++;
+	*out_par = 0;
+	if (card.state == CARD_AUTH)
+		return card_reader_answer(in, len, par, out, out_par);
+	if (card.state == CARD_CRYPTO || card.state == CARD_WRITE)
+		return card_command(in, len, par, out, out_par);
+
+	if (len == 1) {
+		if (in[0] != 0x52 && (in[0] != 0x26 || card.state == CARD_HALT))
+			return 0;
+		card.state = CARD_READY;
+		out[0] = 0x04;
+		out[1] = 0x00;
+		*out_par = plain_parity(out, 2);
+		return 2;
+	}
+	if (par != plain_parity(in, len) || (len > 2 && !crc_ok(in, len))) {
+		card.state = card.state == CARD_HALT ? CARD_HALT : CARD_IDLE;
+		return 0;
+	}
+
+	if (card.state == CARD_READY && len == 2 && in[0] == 0x93 && in[1] == 0x20) {
+		memcpy(out, card.data, 5);
+		*out_par = plain_parity(out, 5);
+		return 5;
+	}
+	if (card.state == CARD_READY && len == 9 && in[0] == 0x93 && in[1] == 0x70 && !memcmp(in + 2, card.data, 5)) {
+		card.state = CARD_ACTIVE;
+		out[0] = card.sectors == 40 ? 0x18 : card.sectors == 32 ? 0x19 : card.sectors == 5 ? 0x09 : 0x08;
+		append_crc(out, 1);
+		*out_par = plain_parity(out, 3);
+		return 3;
+	}
+	if (card.state == CARD_ACTIVE && len == 4 && (in[0] == 0x60 || in[0] == 0x61))
+		return card_auth(in[0], in[1], 0, out, out_par);
+	if (card.state == CARD_ACTIVE && len == 4 && in[0] == 0x50) {
+		card.state = CARD_HALT;
+		return 0;
+	}
+	card.state = card.state == CARD_HALT ? CARD_HALT : CARD_IDLE;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// the device firmware
+//-----------------------------------------------------------------------------
+
+static UsbCommand *ack_new(void)
+{
+	UsbCommand *ack;
+
+	// a full queue drops the packet, as the USB pipe of the device would
+	ack = device.count == ACK_QUEUE ? &device.current : &device.acks[(device.head + device.count++) % ACK_QUEUE];
+	memset(ack, 0, sizeof(*ack));
+	ack->cmd = CMD_ACK;
+	return ack;
+}
+
+// the field off and on again
+static void device_field(void)
+{
+	card_power(device.phase + next_random(&device.random) % POWER_JITTER);
+}
+
+// a frame to the card and its answer, the time passing on the card's clock
+static int device_exchange(const uint8_t *in, int len, uint32_t par, int crypted, uint8_t *out, uint32_t *out_par)
+{
+	int n;
+
+	card.ticks += TURNAROUND + (len == 1 ? 7 : 9 * len);
+	if (crypted)
+		card.ticks += next_random(&device.random) % JITTER;
+	n = card_frame(in, len, par, out, out_par);
+	card.ticks += n == 1 ? 4 : 9 * n;
+	return n;
+}
+
+// iso14443a_select_card()
+static int device_select(uint8_t *uid, uint32_t *cuid)
+{
+	uint8_t cmd[9] = {0x52}, resp[18];
+	uint32_t par;
+
+	if (device_exchange(cmd, 1, 0, 0, resp, &par) != 2)
+		return 0;
+	cmd[0] = 0x93;
+	cmd[1] = 0x20;
+	if (device_exchange(cmd, 2, plain_parity(cmd, 2), 0, resp, &par) != 5)
+		return 0;
+	memcpy(uid, resp, 4);
+	*cuid = bytes_to_num(resp, 4);
+	cmd[1] = 0x70;
+	memcpy(cmd + 2, resp, 5);
+	append_crc(cmd, 7);
+	return device_exchange(cmd, 9, plain_parity(cmd, 9), 0, resp, &par) == 3;
+}
+
+// mifare_sendcmd_shortex(), the parity bits of the answer byte 0 first from
+// the top as ReaderReceivePar() leaves them
+static int device_sendcmd(struct Crypto1State *cs, int crypted, uint8_t cmd, uint8_t data, uint8_t *answer, uint32_t *parptr)
+{
+	uint8_t dcmd[4], ecmd[4];
+	uint32_t par = 0, answer_par;
+	int len, i;
+
+	dcmd[0] = cmd;
+	dcmd[1] = data;
+	append_crc(dcmd, 2);
+	if (crypted) {
+		memcpy(ecmd, dcmd, 4);
+		crypto1_ks_crypt(cs, ecmd, 4, &par);
+		len = device_exchange(ecmd, 4, par, 1, answer, &answer_par);
+	} else {
+		len = device_exchange(dcmd, 4, plain_parity(dcmd, 4), 0, answer, &answer_par);
+	}
+
+	if (parptr) {
+		*parptr = 0;
+		for (i = 0; i < len; i++)
+			*parptr = *parptr << 1 | (answer_par >> i & 1);
+	}
+
+	if (crypted == CRYPT_ALL) {
+		if (len == 1)
+			answer[0] = (crypto1_ks(cs, 4) ^ answer[0]) & 0x0f;
+		else
+			crypto1_ks_crypt(cs, answer, len, NULL);
+	}
+	return len;
+}
+
+// mifare_classic_authex()
+static int device_auth(struct Crypto1State *cs, uint32_t uid, uint8_t blockNo, uint8_t keyType, uint64_t key, int nested, uint32_t *ntptr)
+{
+	static const uint8_t nr[4] = {0x55, 0x41, 0x49, 0x92};
+	uint8_t answer[18], nr_ar[8];
+	uint32_t nt, par = 0, answer_par;
+	int i;
+
+	if (device_sendcmd(cs, nested, 0x60 + (keyType & 0x01), blockNo, answer, NULL) != 4)
+		return 1;
+	nt = bytes_to_num(answer, 4);
+
+	cipher_init(cs, key);
+	if (nested == AUTH_NESTED)
+		nt = crypto1_word(cs, nt ^ uid, 1) ^ nt;
+	else
+		crypto1_word(cs, nt ^ uid, 0);
+	if (ntptr)
+		*ntptr = nt;
+
+	for (i = 0; i < 4; i++) {
+		nr_ar[i] = crypto1_byte(cs, nr[i], 0) ^ nr[i];
+		par |= (uint32_t)(filter(cs->odd) ^ odd_parity(nr[i])) << i;
+	}
+	nt = prng_successor(nt, 32);
+	for (i = 4; i < 8; i++) {
+		nt = prng_successor(nt, 8);
+		nr_ar[i] = crypto1_byte(cs, 0x00, 0) ^ (nt & 0xff);
+		par |= (uint32_t)(filter(cs->odd) ^ odd_parity(nt & 0xff)) << i;
+	}
+
+	if (device_exchange(nr_ar, 8, par, 1, answer, &answer_par) != 4)
+		return 2;
+	if ((prng_successor(nt, 32) ^ crypto1_word(cs, 0, 0)) != bytes_to_num(answer, 4))
+		return 3;
+	return 0;
+}
+
+// mifare_classic_readblock()
+static int device_read(struct Crypto1State *cs, uint8_t blockNo, uint8_t *data)
+{
+	uint8_t answer[18];
+
+	if (device_sendcmd(cs, CRYPT_ALL, 0x30, blockNo, answer, NULL) != 18 || !crc_ok(answer, 18))
+		return 1;
+	memcpy(data, answer, 16);
+	return 0;
+}
+
+// mifare_classic_writeblock()
+static int device_write(struct Crypto1State *cs, uint8_t blockNo, const uint8_t *data)
+{
+	uint8_t block[18], answer[18];
+	uint32_t par = 0, answer_par;
+	int res;
+
+	if (device_sendcmd(cs, CRYPT_ALL, 0xa0, blockNo, answer, NULL) != 1 || answer[0] != ACK)
+		return 1;
+
+	memcpy(block, data, 16);
+	append_crc(block, 16);
+	crypto1_ks_crypt(cs, block, 18, &par);
+	if (device_exchange(block, 18, par, 1, answer, &answer_par) != 1)
+		return 2;
+	res = (crypto1_ks(cs, 4) ^ answer[0]) & 0x0f;
+	return res != ACK ? 2 : 0;
+}
+
+// mifare_classic_halt()
+static int device_halt(struct Crypto1State *cs)
+{
+	uint8_t answer[18];
+
+	return device_sendcmd(cs, CRYPT_ALL, 0x50, 0x00, answer, NULL) != 0;
+}
+
+// MifareReadBlock(), MifareReadSector() and MifareWriteBlock(): the first
+// blocks of the sector or the block
+static void device_block_command(UsbCommand *c)
+{
+	uint8_t blockNo = c->arg[0], keyType = c->arg[1], uid[4], data[64] = {0};
+	uint64_t key = bytes_to_num(c->d.asBytes, 6);
+	int count = c->cmd == CMD_MIFARE_READSC ? 4 : 1;
+	struct Crypto1State cs;
+	uint32_t cuid;
+	UsbCommand *ack;
+	int i, isOK = 0;
+
+	if (c->cmd == CMD_MIFARE_READSC)
+		blockNo *= 4;
+
+	device_field();
+	if (device_select(uid, &cuid) && !device_auth(&cs, cuid, blockNo, keyType, key, AUTH_FIRST, NULL)) {
+		isOK = 1;
+		for (i = 0; isOK && i < count; i++) {
+			if (c->cmd == CMD_MIFARE_WRITEBL)
+				isOK = !device_write(&cs, blockNo, c->d.asBytes + 10);
+			else
+				isOK = !device_read(&cs, blockNo + i, data + 16 * i);
+		}
+		isOK = isOK && !device_halt(&cs);
+	}
+
+	ack = ack_new();
+	ack->arg[0] = isOK;
+	if (c->cmd == CMD_MIFARE_WRITEBL)
+		return;
+	memcpy(ack->d.asBytes, data, 32);
+	if (c->cmd == CMD_MIFARE_READSC) {
+		ack = ack_new();
+		ack->arg[0] = isOK;
+		memcpy(ack->d.asBytes, data + 32, 32);
+	}
+}
+
+// MifareChkKeys()
+static void device_chk_keys(UsbCommand *c)
+{
+	uint8_t blockNo = c->arg[0], keyType = c->arg[1], keyCount = c->arg[2], uid[4];
+	struct Crypto1State cs;
+	UsbCommand *ack = ack_new();
+	uint32_t cuid;
+	int i;
+
+	for (i = 0; i < keyCount && i < 8; i++) {
+		device_field();
+		if (!device_select(uid, &cuid))
+			break;
+		if (device_auth(&cs, cuid, blockNo, keyType, bytes_to_num(c->d.asBytes + i * 6, 6), AUTH_FIRST, NULL))
+			continue;
+		ack->arg[0] = 1;
+		memcpy(ack->d.asBytes, c->d.asBytes + i * 6, 6);
+		break;
+	}
+}
+
+// MifareChkKeysFast(): the keys found first, then the dictionary, on every
+// sector; the card is selected again after each authentication
+static void device_chk_keys_fast(UsbCommand *c)
+{
+	mf_chk_key_t *table = device.chk_table;
+	int keyCount = c->arg[2] & 0xffff, sectors = c->arg[2] >> 16 & 0xff;
+	int s, t, i, j, res;
+	uint8_t uid[4], *key;
+	uint32_t cuid, start, tried = 0;
+	struct Crypto1State cs;
+	UsbCommand *ack;
+
+	if (c->arg[1] > 8 || c->arg[0] > MF_CHK_MAX_KEYS - c->arg[1])
+		return;
+	memcpy(device.chk_keys + c->arg[0] * 6, c->d.asBytes, c->arg[1] * 6);
+	if (!(c->arg[2] & MF_CHK_RUN))
+		return;
+
+	if (keyCount > MF_CHK_MAX_KEYS)
+		keyCount = MF_CHK_MAX_KEYS;
+	if (sectors > MF_CHK_MAX_SECTORS)
+		sectors = MF_CHK_MAX_SECTORS;
+	if (c->arg[2] & MF_CHK_CLEAR)
+		memset(table, 0, sizeof(device.chk_table));
+
+	ack = ack_new();
+	device_field();
+	start = card.ticks;
+	if (!device_select(uid, &cuid)) {
+		ack->arg[0] = MF_CHK_NO_CARD;
+		return;
+	}
+
+	for (s = 0; s < sectors; s++) {
+		for (t = 0; t < 2; t++) {
+			if (!(c->arg[2] & (t ? MF_CHK_KEY_B : MF_CHK_KEY_A)) || table[s * 2 + t].found)
+				continue;
+			for (i = 0; i < sectors * 2 + keyCount && !table[s * 2 + t].found; i++) {
+				if (i < sectors * 2) {
+					if (!table[i].found)
+						continue;
+					for (j = 0; j < i; j++)
+						if (table[j].found && !memcmp(table[j].key, table[i].key, 6))
+							break;
+					if (j < i)
+						continue;
+					key = table[i].key;
+				} else {
+					key = device.chk_keys + (i - sectors * 2) * 6;
+				}
+
+				res = device_auth(&cs, cuid, trailer_of(s), t, bytes_to_num(key, 6), AUTH_FIRST, NULL);
+				tried++;
+				if (res == 0) {
+					table[s * 2 + t].found = 1;
+					memcpy(table[s * 2 + t].key, key, 6);
+					device_halt(&cs);
+				}
+				if (!device_select(uid, &cuid)) {
+					ack->arg[0] = MF_CHK_NO_CARD;
+					s = sectors;
+					break;
+				}
+			}
+		}
+	}
+	ack->arg[1] = tried;
+	ack->arg[2] = (card.ticks - start) / BITS_PER_MS;
+}
+
+// the key table read back by CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, the rest of
+// BigBuf is not modeled
+static void device_download(UsbCommand *c)
+{
+	UsbCommand *ack = ack_new();
+	int pos = (int)c->arg[0] * 4 - MF_CHK_TABLE, i;
+
+	ack->cmd = CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K;
+	ack->arg[0] = c->arg[0];
+	for (i = 0; i < 48; i++)
+		if (pos + i >= 0 && pos + i < (int)sizeof(device.chk_table))
+			ack->d.asBytes[i] = ((uint8_t *)device.chk_table)[pos + i];
+}
+
+// valid_nonce() of armsrc/mifarecmd.c
+static int valid_nonce(uint32_t Nt, uint32_t NtEnc, uint32_t Ks1, const uint8_t *par)
+{
+	return odd_parity(Nt >> 24 & 0xff) == (par[0] ^ odd_parity(NtEnc >> 24 & 0xff) ^ BIT(Ks1, 16)) &&
+	       odd_parity(Nt >> 16 & 0xff) == (par[1] ^ odd_parity(NtEnc >> 16 & 0xff) ^ BIT(Ks1, 8)) &&
+	       odd_parity(Nt >> 8 & 0xff) == (par[2] ^ odd_parity(NtEnc >> 8 & 0xff) ^ BIT(Ks1, 0));
+}
+
+// MifareNested(): the distance of the nonces of two authentications, then
+// the candidates for nt and ks1 of nested authentications to the target
+static void device_nested(UsbCommand *c)
+{
+	uint8_t blockNo = c->arg[0], keyType = c->arg[1];
+	uint8_t targetBlockNo = c->arg[2] & 0xff, targetKeyType = c->arg[2] >> 8 & 0xff;
+	uint64_t key = bytes_to_num(c->d.asBytes, 6);
+	struct { uint32_t nt, ks1; } nvector[NES_MAX_INFO + 1][11];
+	int nvectorcount[NES_MAX_INFO + 1];
+	int rtr, i, j, m, ncount, davg = 0, dmin = 2000, dmax = 0;
+	uint32_t cuid, nt1, nt2, nttmp, nttest, ks1, par;
+	uint8_t uid[4], answer[18], par_array[4];
+	struct Crypto1State cs;
+	UsbCommand *ack;
+
+	for (i = 0; i < NES_MAX_INFO + 1; i++)
+		nvectorcount[i] = 11;
+
+	for (rtr = 0; rtr < 10; rtr++) {
+		device_field();
+		if (!device_select(uid, &cuid))
+			break;
+		if (device_auth(&cs, cuid, blockNo, keyType, key, AUTH_FIRST, &nt1))
+			break;
+		if (device_auth(&cs, cuid, blockNo, keyType, key, AUTH_NESTED, &nt2))
+			break;
+
+		nttmp = prng_successor(nt1, 500);
+		for (i = 501; i < 2000; i++) {
+			nttmp = prng_successor(nttmp, 1);
+			if (nttmp == nt2)
+				break;
+		}
+		if (i != 2000) {
+			davg += i;
+			if (dmin > i) dmin = i;
+			if (dmax < i) dmax = i;
+		}
+	}
+
+	// the firmware sends nothing here, the end of the list keeps the client
+	// from waiting for it
+	if (rtr == 0) {
+		ack_new()->arg[0] = 1;
+		return;
+	}
+	davg = davg / rtr;
+
+	for (rtr = 0; rtr < NS_RETRIES_GETNONCE; rtr++) {
+		device_field();
+		if (!device_select(uid, &cuid))
+			break;
+		if (device_auth(&cs, cuid, blockNo, keyType, key, AUTH_FIRST, &nt1))
+			break;
+
+		// nested authentication
+		if (device_sendcmd(&cs, AUTH_NESTED, 0x60 + (targetKeyType & 0x01), targetBlockNo, answer, &par) != 4)
+			break;
+		nt2 = bytes_to_num(answer, 4);
+
+		// parity validity check
+		for (i = 0; i < 4; i++) {
+			par_array[i] = odd_parity(answer[i]) != ((par & 0x08) >> 3);
+			par = par << 1;
+		}
+
+		ncount = 0;
+		nttest = prng_successor(nt1, dmin - NS_TOLERANCE);
+		for (m = dmin - NS_TOLERANCE + 1; m < dmax + NS_TOLERANCE; m++) {
+			nttest = prng_successor(nttest, 1);
+			ks1 = nt2 ^ nttest;
+			if (valid_nonce(nttest, nt2, ks1, par_array) && ncount < 11) {
+				nvector[NES_MAX_INFO][ncount].nt = nttest;
+				nvector[NES_MAX_INFO][ncount].ks1 = ks1;
+				ncount++;
+				nvectorcount[NES_MAX_INFO] = ncount;
+			}
+		}
+
+		// select vector with length less than got
+		if (nvectorcount[NES_MAX_INFO] != 0) {
+			m = NES_MAX_INFO;
+			for (i = 0; i < NES_MAX_INFO; i++)
+				if (nvectorcount[i] > 10) {
+					m = i;
+					break;
+				}
+			if (m == NES_MAX_INFO)
+				for (i = 0; i < NES_MAX_INFO; i++)
+					if (nvectorcount[NES_MAX_INFO] < nvectorcount[i]) {
+						m = i;
+						break;
+					}
+			if (m != NES_MAX_INFO) {
+				for (i = 0; i < nvectorcount[NES_MAX_INFO]; i++)
+					nvector[m][i] = nvector[NES_MAX_INFO][i];
+				nvectorcount[m] = nvectorcount[NES_MAX_INFO];
+			}
+		}
+	}
+
+	for (i = 0; i < NES_MAX_INFO; i++) {
+		if (nvectorcount[i] > 10)
+			continue;
+		for (j = 0; j < nvectorcount[i]; j += 5) {
+			ncount = nvectorcount[i] - j;
+			if (ncount > 5)
+				ncount = 5;
+			ack = ack_new();
+			ack->arg[1] = ncount;
+			ack->arg[2] = targetBlockNo + targetKeyType * 0x100;
+			memcpy(ack->d.asBytes, &cuid, 4);
+			for (m = 0; m < ncount; m++) {
+				memcpy(ack->d.asBytes + 8 + m * 8 + 0, &nvector[i][m + j].nt, 4);
+				memcpy(ack->d.asBytes + 8 + m * 8 + 4, &nvector[i][m + j].ks1, 4);
+			}
+		}
+	}
+	ack_new()->arg[0] = 1;
+}
+
+// ReaderMifare(): {nr, ar} with every parity until the card NACKs, then
+// the NACKs of 8 readers nonces differing in the last 3 bits of {nr}, all
+// on the same card nonce
+static void device_darkside(UsbCommand *c)
+{
+	static const uint8_t mf_auth[] = {0x60, 0x00, 0xf5, 0x7b};
+	uint8_t mf_nr_ar[8] = {0}, answer[18], uid[4] = {0};
+	uint8_t par = 0, par_low = 0, nt_diff = 0;
+	uint8_t par_list[8] = {0}, ks_list[8] = {0};
+	uint32_t cuid, nt = 0, nt_attacked = 0, nt_noattack = c->arg[0], answer_par;
+	UsbCommand *ack;
+	int tries, isOK = 0;
+
+	for (tries = 0; tries < DARKSIDE_TRIES; tries++) {
+		device_field();
+		if (!device_select(uid, &cuid))
+			continue;
+		if (device_exchange(mf_auth, 4, plain_parity(mf_auth, 4), 0, answer, &answer_par) != 4)
+			continue;
+		nt = bytes_to_num(answer, 4);
+
+		if (device_exchange(mf_nr_ar, 8, par, 0, answer, &answer_par)) {
+			if (nt_noattack != 0 && nt == nt_noattack)
+				continue;
+			if (nt_diff != 0 && nt != nt_attacked)
+				continue;
+			if (nt_diff == 0) {
+				nt_attacked = nt;
+				par_low = par & 0x07;
+			}
+			par_list[nt_diff] = par;
+			ks_list[nt_diff] = answer[0] ^ NACK_AUTH;
+			if (nt_diff == 0x07) {
+				isOK = 1;
+				break;
+			}
+			nt_diff = (nt_diff + 1) & 0x07;
+			mf_nr_ar[3] = nt_diff << 5;
+			par = par_low;
+		} else if (nt_diff == 0) {
+			par++;
+		} else {
+			par = (((par >> 3) + 1) << 3) | par_low;
+		}
+	}
+
+	ack = ack_new();
+	ack->arg[0] = isOK;
+	memcpy(ack->d.asBytes, uid, 4);
+	num_to_bytes(nt, 4, ack->d.asBytes + 4);
+	memcpy(ack->d.asBytes + 8, par_list, 8);
+	memcpy(ack->d.asBytes + 16, ks_list, 8);
+}
+
+static void emu_send(UsbCommand *c)
+{
+	if (card.blocks == 0)
+		mf_emu_reset(MF_EMU_PRNG_WEAK);
+	device.phase = device.commands++ * PHASE_STEP % 1000;
+
+	switch (c->cmd) {
+		case CMD_MIFARE_READBL:
+		case CMD_MIFARE_READSC:
+		case CMD_MIFARE_WRITEBL: device_block_command(c); break;
+		case CMD_MIFARE_CHKKEYS: device_chk_keys(c); break;
+		case CMD_MIFARE_CHKKEYS_FAST: device_chk_keys_fast(c); break;
+		case CMD_MIFARE_NESTED:  device_nested(c); break;
+		case CMD_READER_MIFARE:  device_darkside(c); break;
+		case CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K: device_download(c); break;
+	}
+}
+
+static UsbCommand *emu_wait(uint32_t response_type, uint32_t ms_timeout)
+{
+	if (device.count == 0 || device.acks[device.head].cmd != response_type)
+		return NULL;
+	device.current = device.acks[device.head];
+	device.head = (device.head + 1) % ACK_QUEUE;
+	device.count--;
+	return &device.current;
+}
+
+const mf_transport_t mf_emu_transport = {emu_send, emu_wait};
@@ -0,0 +1,42 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic card model standing in for the device and a card
+//-----------------------------------------------------------------------------
+
+#ifndef MIFAREEMU_H__
+#define MIFAREEMU_H__
+
+#include <stdint.h>
+#include "mifarehost.h"
+
+// where the card's nonces come from
+#define MF_EMU_PRNG_WEAK    0     // the 16 bit LFSR, by the time since power-up
+#define MF_EMU_PRNG_STATIC  1     // one nonce for every authentication
+#define MF_EMU_PRNG_HARD    2     // random, and no NACK to a wrong reader answer
+
+// answers the device's packets of the hf mf reader commands with the card
+extern const mf_transport_t mf_emu_transport;
+
+// Replace the card by the test card: 1K, every key different and none of
+// the default ones.
+void mf_emu_reset(int prng);
+
+// Replace the card by a card image of 320, 1024, 2048 or 4096 bytes,
+// returns 0 or -1 for another length.
+int mf_emu_load(const uint8_t *data, int len, int prng);
+
+void mf_emu_set_prng(int prng);
+int mf_emu_prng(void);
+int mf_emu_sectors(void);
+uint32_t mf_emu_uid(void);
+
+// a key of the card, from the trailer of its sector
+uint64_t mf_emu_key(int sector, int keyType);
+
+// frames and authentications the card has seen since the last reset
+void mf_emu_stats(uint32_t *frames, uint32_t *auths);
+
+#endif
@@ -11,12 +11,33 @@
 #include <stdio.h>
 #include <stdlib.h> 
 #include <string.h>
+#include <ctype.h>
 #include "mifarehost.h"
 
 // MIFARE
 
+static const mf_transport_t device = {SendCommand, WaitForResponseTimeout};
+static const mf_transport_t *transport = &device;
+
+void mfSetTransport(const mf_transport_t *t) {
+	transport = t ? t : &device;
+}
+
+int mfTransportIsDevice(void) {
+	return transport == &device;
+}
+
+void mfSendCommand(UsbCommand *c) {
+	transport->send(c);
+}
+
+UsbCommand * mfWaitForResponseTimeout(uint32_t response_type, uint32_t ms_timeout) {
+	return transport->wait(response_type, ms_timeout);
+}
+
 int compar_int(const void * a, const void * b) {
-	return (*(uint64_t*)b - *(uint64_t*)a);
+	// the difference of two keys does not fit an int
+	return (*(uint64_t*)b > *(uint64_t*)a) - (*(uint64_t*)b < *(uint64_t*)a);
 }
 
 // Compare countKeys structure
@@ -51,6 +72,67 @@ countKeys * uniqsort(uint64_t * possibleKeys, uint32_t size) {
 	return (our_counts);
 }
 
+int mfDarkside(uint32_t ntNoAttack, uint64_t * key)
+{
+	uint32_t uid = 0;
+	uint32_t nt = ntNoAttack;
+	uint64_t par_list = 0, ks_list = 0, r_key = 0;
+	uint8_t isOK = 0;
+	uint8_t keyBlock[6];
+	UsbCommand * resp;
+
+	*key = 0;
+	while (true) {
+		UsbCommand c = {CMD_READER_MIFARE, {nt, 0, 0}};
+		mfSendCommand(&c);
+
+		// wait cycle
+		while (true) {
+			printf(".");
+			fflush(stdout);
+			if (ukbhit()) {
+				getchar();
+				printf("\naborted via keyboard!\n");
+				return 1;
+			}
+
+			resp = mfWaitForResponseTimeout(CMD_ACK, 2000);
+			if (resp != NULL) {
+				isOK  = resp->arg[0] & 0xff;
+
+				uid = (uint32_t)bytes_to_num(resp->d.asBytes +  0, 4);
+				nt =  (uint32_t)bytes_to_num(resp->d.asBytes +  4, 4);
+				par_list = bytes_to_num(resp->d.asBytes +  8, 8);
+				ks_list = bytes_to_num(resp->d.asBytes +  16, 8);
+
+				printf("\n\n");
+				PrintAndLog("isOk:%02x", isOK);
+				if (!isOK) PrintAndLog("Proxmark can't get statistic info. Execution aborted.\n");
+				break;
+			}
+		}
+		printf("\n");
+
+		// error
+		if (isOK != 1) return 1;
+
+		// execute original function from util nonce2key
+		if (nonce2key(uid, nt, par_list, ks_list, &r_key)) {
+			PrintAndLog("Key not found (lfsr_common_prefix list is null). Nt=%08x", nt);
+			continue;
+		}
+		printf("------------------------------------------------------------------\n");
+		PrintAndLog("Key found:%012llx \n", r_key);
+
+		num_to_bytes(r_key, 6, keyBlock);
+		if (!mfCheckKeys(0, 0, 1, keyBlock, &r_key)) {
+			*key = r_key;
+			return 0;
+		}
+		PrintAndLog("Found invalid key. ( Nt=%08x ,Trying use it to run again...", nt);
+	}
+}
+
 int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t * resultKeys) 
 {
 	int i, m, len;
@@ -64,11 +146,11 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo
 	memset(resultKeys, 0x00, 16 * 6);
 
 	// flush queue
-	while (WaitForResponseTimeout(CMD_ACK, 500) != NULL) ;
+	while (mfWaitForResponseTimeout(CMD_ACK, 500) != NULL) ;
 	
   UsbCommand c = {CMD_MIFARE_NESTED, {blockNo, keyType, trgBlockNo + trgKeyType * 0x100}};
 	memcpy(c.d.asBytes, key, 6);
-  SendCommand(&c);
+  mfSendCommand(&c);
 
 	PrintAndLog("\n");
 
@@ -81,7 +163,7 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo
 			break;
 		}
 
-		resp = WaitForResponseTimeout(CMD_ACK, 1500);
+		resp = mfWaitForResponseTimeout(CMD_ACK, 1500);
 
 		if (resp != NULL) {
 			isEOF  = resp->arg[0] & 0xff;
@@ -188,9 +270,9 @@ int mfCheckKeys (uint8_t blockNo, uint8_t keyType, uint8_t keycnt, uint8_t * key
   UsbCommand c = {CMD_MIFARE_CHKKEYS, {blockNo, keyType, keycnt}};
 	memcpy(c.d.asBytes, keyBlock, 6 * keycnt);
 
-  SendCommand(&c);
+  mfSendCommand(&c);
 
-	UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 3000);
+	UsbCommand * resp = mfWaitForResponseTimeout(CMD_ACK, 3000);
 
 	if (resp == NULL) return 1;
 	if ((resp->arg[0] & 0xff) != 0x01) return 2;
@@ -198,6 +280,168 @@ int mfCheckKeys (uint8_t blockNo, uint8_t keyType, uint8_t keycnt, uint8_t * key
 	return 0;
 }
 
+// a job on the device answers once done, after some milliseconds per
+// authentication at most
+#define MF_JOB_TIMEOUT(auths)  (3000 + 10 * (auths))
+
+int mfCheckKeysFast(uint8_t sectorsCnt, uint8_t keyTypes, uint8_t * keyBlock, int keycnt, int clear, mf_chk_key_t * table, uint32_t * tried, uint32_t * ms) {
+	UsbCommand c = {CMD_MIFARE_CHKKEYS_FAST, {0, 0, 0}};
+	UsbCommand * resp;
+	int i, n, res;
+
+	*tried = 0;
+	*ms = 0;
+	if (clear) memset(table, 0, sectorsCnt * 2 * sizeof(mf_chk_key_t));
+
+	if (keycnt > MF_CHK_MAX_KEYS) keycnt = MF_CHK_MAX_KEYS;
+	for (i = 0; ; i += n) {
+		n = keycnt - i < 8 ? keycnt - i : 8;
+		c.arg[0] = i;
+		c.arg[1] = n;
+		memcpy(c.d.asBytes, keyBlock + 6 * i, 6 * n);
+		if (i + n >= keycnt) {
+			c.arg[2] = MF_CHK_RUN | (clear ? MF_CHK_CLEAR : 0) | sectorsCnt << 16 | keycnt;
+			if (keyTypes & 1) c.arg[2] |= MF_CHK_KEY_A;
+			if (keyTypes & 2) c.arg[2] |= MF_CHK_KEY_B;
+			mfSendCommand(&c);
+			break;
+		}
+		mfSendCommand(&c);
+	}
+	resp = mfWaitForResponseTimeout(CMD_ACK, MF_JOB_TIMEOUT((keycnt + sectorsCnt * 2) * sectorsCnt * 2));
+	if (resp == NULL) return MF_CHK_TIMEOUT;
+	res = resp->arg[0];
+	*tried = resp->arg[1];
+	*ms = resp->arg[2];
+
+	// the table out of BigBuf
+	for (i = 0; i < sectorsCnt * 2 * (int)sizeof(mf_chk_key_t); i += 48) {
+		UsbCommand d = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {(MF_CHK_TABLE + i) / 4, 0, 0}};
+		mfSendCommand(&d);
+		resp = mfWaitForResponseTimeout(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K, 2000);
+		if (resp == NULL) return MF_CHK_TIMEOUT;
+		n = sectorsCnt * 2 * sizeof(mf_chk_key_t) - i;
+		memcpy((uint8_t *)table + i, resp->d.asBytes, n < 48 ? n : 48);
+	}
+	return res;
+}
+
+int mfDump(uint8_t sectorsCnt, mf_chk_key_t * table, uint8_t * data, int size, uint8_t * status, uint32_t * ms) {
+	UsbCommand c = {CMD_MIFARE_DUMP, {0, 0, 0}};
+	UsbCommand * resp;
+	int i, n, res, len = sectorsCnt * 2 * sizeof(mf_chk_key_t);
+
+	*ms = 0;
+	memset(status, MF_DUMP_SECTOR_NONE, sectorsCnt);
+
+	// the keys into the table on the device, the last packet starts the job
+	for (i = 0; ; i += n) {
+		n = len - i < 48 ? len - i : 48;
+		c.arg[0] = i;
+		c.arg[1] = n;
+		memcpy(c.d.asBytes, (uint8_t *)table + i, n);
+		if (i + n >= len) {
+			c.arg[2] = MF_DUMP_RUN | sectorsCnt;
+			mfSendCommand(&c);
+			break;
+		}
+		mfSendCommand(&c);
+	}
+	// an authentication and a read per block at most
+	resp = mfWaitForResponseTimeout(CMD_ACK, MF_JOB_TIMEOUT(size / 16 * 2));
+	if (resp == NULL) return MF_CHK_TIMEOUT;
+	res = resp->arg[0];
+	*ms = resp->arg[2];
+	memcpy(status, resp->d.asBytes, sectorsCnt);
+
+	// the blocks out of BigBuf
+	for (i = 0; i < size; i += 48) {
+		UsbCommand d = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {(MF_DUMP_DATA + i) / 4, 0, 0}};
+		mfSendCommand(&d);
+		resp = mfWaitForResponseTimeout(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K, 2000);
+		if (resp == NULL) return MF_CHK_TIMEOUT;
+		n = size - i;
+		memcpy(data + i, resp->d.asBytes, n < 48 ? n : 48);
+	}
+	return res;
+}
+
+// KEY SETS
+
+#define KEYSET_USED 0x8000000000000000ULL
+
+static uint32_t keySetSlot(uint64_t key, int nslots) {
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (nslots - 1);
+}
+
+int mfKeySetAdd(keySet * set, uint64_t key) {
+	uint32_t i;
+
+	key &= 0xffffffffffffULL;
+
+	// the hash set at most half full
+	if (2 * (set->count + 1) > set->nslots) {
+		int nslots = set->nslots ? 2 * set->nslots : 64;
+		uint64_t * slots = calloc(nslots, sizeof(uint64_t));
+		if (!slots) return -1;
+		for (int k = 0; k < set->count; k++) {
+			for (i = keySetSlot(bytes_to_num(set->keys + 6 * k, 6), nslots); slots[i]; i = (i + 1) & (nslots - 1));
+			slots[i] = bytes_to_num(set->keys + 6 * k, 6) | KEYSET_USED;
+		}
+		free(set->slots);
+		set->slots = slots;
+		set->nslots = nslots;
+	}
+	for (i = keySetSlot(key, set->nslots); set->slots[i]; i = (i + 1) & (set->nslots - 1))
+		if (set->slots[i] == (key | KEYSET_USED)) return 0;
+
+	if (set->count == set->size) {
+		int size = set->size ? 2 * set->size : 64;
+		uint8_t * keys = realloc(set->keys, 6 * size);
+		if (!keys) return -1;
+		set->keys = keys;
+		set->size = size;
+	}
+	set->slots[i] = key | KEYSET_USED;
+	num_to_bytes(key, 6, set->keys + 6 * set->count++);
+	return 1;
+}
+
+int mfKeySetLoad(keySet * set, char * fileName) {
+	FILE * f;
+	char line[256];
+	int added = 0, res, i;
+
+	if ((f = fopen(fileName, "r")) == NULL) return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		char * p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\r' || *p == '\n' || *p == 0)
+			continue;
+		for (i = 0; i < 12 && isxdigit((unsigned char)p[i]); i++);
+		if (i < 12 || isxdigit((unsigned char)p[12])) {
+			PrintAndLog("File content error. '%s' must include 12 HEX symbols", strtok(p, "\r\n"));
+			continue;
+		}
+		p[12] = 0;
+		res = mfKeySetAdd(set, strtoull(p, NULL, 16));
+		if (res < 0) {
+			fclose(f);
+			return -1;
+		}
+		added += res;
+	}
+	fclose(f);
+	return added;
+}
+
+void mfKeySetFree(keySet * set) {
+	free(set->keys);
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
 // EMULATOR
 
 int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount) {
@@ -219,6 +463,167 @@ int mfEmlSetMem(uint8_t *data, int blockNum, int blocksCount) {
 	return 0;
 }
 
+uint16_t mfEmlCrc(uint8_t *data, int len) {
+	uint16_t crc = 0xffff;
+
+	for (int i = 0; i < len; i++)
+		crc = update_crc16(crc, data[i]);
+	return crc;
+}
+
+// the CRC16 of the first len bytes of the emulator memory, -1 on a timeout
+static int mfEmlMemCrc(uint8_t *data, int pos, int n, int len) {
+	UsbCommand c = {CMD_MIFARE_EML_MEMSET_BULK, {pos, n, MF_EML_CRC | len}};
+	UsbCommand * resp;
+
+	memcpy(c.d.asBytes, data, n);
+	SendCommand(&c);
+	resp = WaitForResponseTimeout(CMD_ACK, 1500);
+	if (resp == NULL || (int)resp->arg[1] != len) return -1;
+	return resp->arg[0] & 0xffff;
+}
+
+int mfEmlSetMemBulk(uint8_t *data, int len) {
+	int i, n, crc;
+
+	if (len > CARD_MEMORY_LEN) len = CARD_MEMORY_LEN;
+
+	// unanswered packets, the last one asks for the CRC
+	for (i = 0; len - i > 48; i += 48) {
+		UsbCommand c = {CMD_MIFARE_EML_MEMSET_BULK, {i, 48, 0}};
+		memcpy(c.d.asBytes, data + i, 48);
+		SendCommand(&c);
+	}
+	n = len - i;
+	crc = mfEmlMemCrc(data + i, i, n, len);
+	if (crc < 0) return 1;
+	return crc != mfEmlCrc(data, len) ? 2 : 0;
+}
+
+int mfEmlGetMemBulk(uint8_t *data, int len) {
+	UsbCommand * resp;
+	int i, n, crc;
+
+	if (len > CARD_MEMORY_LEN) len = CARD_MEMORY_LEN;
+
+	for (i = 0; i < len; i += 48) {
+		UsbCommand c = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {(CARD_MEMORY + i) / 4, 0, 0}};
+		SendCommand(&c);
+		resp = WaitForResponseTimeout(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K, 1500);
+		if (resp == NULL) return 1;
+		n = len - i;
+		memcpy(data + i, resp->d.asBytes, n < 48 ? n : 48);
+	}
+	crc = mfEmlMemCrc(data, 0, 0, len);
+	if (crc < 0) return 1;
+	return crc != mfEmlCrc(data, len) ? 2 : 0;
+}
+
+// DUMP FILES
+
+static const char * mfDumpFileExt(char *fileName) {
+	const char * ext = strrchr(fileName, '.');
+
+	return ext ? ext : "";
+}
+
+static int mfLoadEml(FILE * f, uint8_t *data, int size) {
+	char buf[64];
+	int i, len = 0;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		if (buf[0] == '\r' || buf[0] == '\n') continue;
+		if (len + 16 > size) return -2;
+		for (i = 0; i < 32; i++)
+			if (!isxdigit((unsigned char)buf[i])) return -2;
+		for (i = 0; i < 16; i++)
+			sscanf(&buf[i * 2], "%02hhx", &data[len + i]);
+		len += 16;
+	}
+	return len;
+}
+
+// the "blocks" object: "<block number>": "<32 hex symbols>" pairs
+static int mfLoadJson(FILE * f, uint8_t *data, int size) {
+	static char text[128 * 1024];
+	char * p;
+	int i, n, block, len = 0;
+
+	n = fread(text, 1, sizeof(text) - 1, f);
+	text[n] = 0;
+	if ((p = strstr(text, "\"blocks\"")) == NULL || (p = strchr(p, '{')) == NULL)
+		return -2;
+	memset(data, 0, size);
+	for (p++; ; ) {
+		while (isspace((unsigned char)*p) || *p == ',') p++;
+		if (*p == '}') return len;
+		n = 0;
+		if (sscanf(p, "\"%d\" : \"%n", &block, &n) < 1 || !n || block < 0 || (block + 1) * 16 > size)
+			return -2;
+		p += n;
+		for (i = 0; i < 32; i++)
+			if (!isxdigit((unsigned char)p[i])) return -2;
+		for (i = 0; i < 16; i++)
+			sscanf(&p[i * 2], "%02hhx", &data[block * 16 + i]);
+		if (p[32] != '"') return -2;
+		p += 33;
+		if ((block + 1) * 16 > len) len = (block + 1) * 16;
+	}
+}
+
+int mfLoadDumpFile(char *fileName, uint8_t *data, int size) {
+	const char * ext = mfDumpFileExt(fileName);
+	FILE * f;
+	int len;
+
+	if ((f = fopen(fileName, strcmp(ext, ".eml") && strcmp(ext, ".json") ? "rb" : "r")) == NULL)
+		return -1;
+	if (!strcmp(ext, ".eml"))
+		len = mfLoadEml(f, data, size);
+	else if (!strcmp(ext, ".json"))
+		len = mfLoadJson(f, data, size);
+	else {
+		len = fread(data, 1, size, f);
+		if (fgetc(f) != EOF) len = -2;
+	}
+	fclose(f);
+
+	// whole blocks of a Mini, 1K, 2K or 4K card
+	if (len != 20 * 16 && len != 64 * 16 && len != 128 * 16 && len != 256 * 16)
+		return -2;
+	return len;
+}
+
+int mfSaveDumpFile(char *fileName, uint8_t *data, int len) {
+	const char * ext = mfDumpFileExt(fileName);
+	FILE * f;
+	int i, j;
+
+	if (!strcmp(ext, ".eml")) {
+		if ((f = fopen(fileName, "w")) == NULL) return 1;
+		for (i = 0; i < len; i += 16) {
+			for (j = 0; j < 16; j++)
+				fprintf(f, "%02x", data[i + j]);
+			fprintf(f, "\n");
+		}
+	} else if (!strcmp(ext, ".json")) {
+		if ((f = fopen(fileName, "w")) == NULL) return 1;
+		fprintf(f, "{\n  \"Created\": \"proxmark3\",\n  \"FileType\": \"mfcard\",\n  \"blocks\": {\n");
+		for (i = 0; i < len; i += 16) {
+			fprintf(f, "    \"%d\": \"", i / 16);
+			for (j = 0; j < 16; j++)
+				fprintf(f, "%02X", data[i + j]);
+			fprintf(f, "\"%s\n", i + 16 < len ? "," : "");
+		}
+		fprintf(f, "  }\n}\n");
+	} else {
+		if ((f = fopen(fileName, "wb")) == NULL) return 1;
+		fwrite(data, 1, len, f);
+	}
+	fclose(f);
+	return 0;
+}
+
 // "MAGIC" CARD
 
 int mfCSetUID(uint8_t *uid, uint8_t *oldUID, int wantWipe) {
@@ -254,6 +659,22 @@ int mfCSetBlock(uint8_t blockNo, uint8_t *data, uint8_t *uid, int wantWipe, uint
 	return 0;
 }
 
+int mfCClone(int blocks, int wantWipe, int *block, uint8_t *readBack, uint32_t *msWrite, uint32_t *msVerify) {
+	UsbCommand c = {CMD_MIFARE_CLONE_MAGIC, {blocks, wantWipe ? MF_CLONE_WIPE : 0, 0}};
+	SendCommand(&c);
+
+	UsbCommand * resp = WaitForResponseTimeout(CMD_ACK, 20000);
+	if (resp == NULL) {
+		PrintAndLog("Command execute timeout");
+		return -1;
+	}
+	*block = resp->arg[1];
+	*msWrite = resp->arg[2] & 0xffff;
+	*msVerify = resp->arg[2] >> 16;
+	memcpy(readBack, resp->d.asBytes, 16);
+	return resp->arg[0];
+}
+
 int mfCGetBlock(uint8_t blockNo, uint8_t *data, uint8_t params) {
 	uint8_t isOK = 0;
 
@@ -390,6 +811,15 @@ void mf_crypto1_decrypt(struct Crypto1State *pcs, uint8_t *data, int len, bool i
 	uint8_t	bt = 0;
 	int i;
 	
+	// the keystream alone, by words
+	if (!isEncrypted) {
+		if (len == 1)
+			data[0] = (crypto1_ks(pcs, 4) ^ data[0]) & 0x0f;
+		else
+			crypto1_ks_crypt(pcs, data, len, NULL);
+		return;
+	}
+
 	if (len != 1) {
 		for (i = 0; i < len; i++)
 			data[i] = crypto1_byte(pcs, 0x00, isEncrypted) ^ data[i];
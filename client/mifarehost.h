@@ -8,6 +8,9 @@
 // High frequency ISO14443A commands
 //-----------------------------------------------------------------------------
 
+#ifndef MIFAREHOST_H__
+#define MIFAREHOST_H__
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,11 +22,16 @@
 #include "util.h"
 #include "nonce2key/nonce2key.h"
 #include "nonce2key/crapto1.h"
+#include "crypto1ks.h"
 #include "iso14443crc.h"
+#include "crc16.h"
 
 #define MEM_CHUNK               1000000
 #define NESTED_SECTOR_RETRY     10
 
+// next to the MF_CHK_* statuses of the device: it did not answer
+#define MF_CHK_TIMEOUT          -1
+
 // mfCSetBlock work flags
 #define CSETBLOCK_UID 					0x01
 #define CSETBLOCK_WUPC					0x02
@@ -60,17 +68,75 @@ typedef struct {
         int             count;
 } countKeys;
 
+typedef struct {
+	uint8_t  *keys;    // 6 bytes each
+	int      count, size;
+	uint64_t *slots;   // hash set of the keys
+	int      nslots;
+} keySet;
+
 extern char logHexFileName[200];
 
+// what carries the USB packets of the reader commands (rdbl, rdsc, wrbl,
+// restore, chk, nested, mifare): the device, or the card model of
+// mifareemu.c
+typedef struct {
+	void (*send)(UsbCommand *c);
+	UsbCommand *(*wait)(uint32_t response_type, uint32_t ms_timeout);
+} mf_transport_t;
+
+// NULL is the device
+void mfSetTransport(const mf_transport_t *transport);
+int mfTransportIsDevice(void);
+void mfSendCommand(UsbCommand *c);
+UsbCommand * mfWaitForResponseTimeout(uint32_t response_type, uint32_t ms_timeout);
+
+// the darkside attack on key A of block 0: the device collects the NACKs of
+// one nonce, the key is recovered from them and checked on the card, a wrong
+// one runs it again on another nonce. ntNoAttack is a nonce to skip, 0 for
+// none. Returns 0 and the key, 1 if aborted or the device got nothing.
+int mfDarkside(uint32_t ntNoAttack, uint64_t * key);
 int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t * ResultKeys);
 int mfCheckKeys (uint8_t blockNo, uint8_t keyType, uint8_t keycnt, uint8_t * keyBlock, uint64_t * key);
+// up to MF_CHK_MAX_KEYS keys on all sectors in one job on the device, keyTypes
+// bit 0 key A, bit 1 key B; the table on the device is emptied first if clear,
+// else its keys are kept and tried first. Fills table with sectorsCnt * 2
+// entries, returns an MF_CHK_* status or MF_CHK_TIMEOUT.
+int mfCheckKeysFast(uint8_t sectorsCnt, uint8_t keyTypes, uint8_t * keyBlock, int keycnt, int clear, mf_chk_key_t * table, uint32_t * tried, uint32_t * ms);
+// the first sectorsCnt sectors in one job on the device with the keys in
+// table, sectorsCnt * 2 entries as mfCheckKeysFast leaves them. Fills size
+// bytes of data with the blocks and status with an MF_DUMP_SECTOR_* per
+// sector, returns an MF_CHK_* status or MF_CHK_TIMEOUT. Not on the card
+// model.
+int mfDump(uint8_t sectorsCnt, mf_chk_key_t * table, uint8_t * data, int size, uint8_t * status, uint32_t * ms);
+
+// a dictionary without duplicates, in the order the keys came
+int mfKeySetAdd(keySet * set, uint64_t key);          // 1 new, 0 known, -1 out of memory
+int mfKeySetLoad(keySet * set, char * fileName);      // keys added or -1
+void mfKeySetFree(keySet * set);
 
 int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount);
 int mfEmlSetMem(uint8_t *data, int blockNum, int blocksCount);
+// the whole emulator memory in 48 byte frames, checked by a CRC16 over it:
+// 0, 1 on a timeout, 2 if the CRC differs
+uint16_t mfEmlCrc(uint8_t *data, int len);
+int mfEmlSetMemBulk(uint8_t *data, int len);
+int mfEmlGetMemBulk(uint8_t *data, int len);
+
+// card images by the extension of the file name: .eml hex lines, .json
+// with a "blocks" object, else binary (.mfd, .bin). Loading returns the bytes
+// of the card or -1 if it cannot open the file, -2 for no card image.
+int mfLoadDumpFile(char *fileName, uint8_t *data, int size);
+int mfSaveDumpFile(char *fileName, uint8_t *data, int len);
 
 int mfCSetUID(uint8_t *uid, uint8_t *oldUID, int wantWipe);
 int mfCSetBlock(uint8_t blockNo, uint8_t *data, uint8_t *uid, int wantWipe, uint8_t params);
 int mfCGetBlock(uint8_t blockNo, uint8_t *data, uint8_t params);
+// the first blocks of the emulator memory to a magic card and read back in
+// one job on the device. block gets the blocks done or the one it failed at,
+// readBack that block on a mismatch. Returns an MF_CHK_* or MF_CLONE_*
+// status, -1 on a timeout.
+int mfCClone(int blocks, int wantWipe, int *block, uint8_t *readBack, uint32_t *msWrite, uint32_t *msVerify);
 
 int mfTraceInit(uint8_t *tuid, uint8_t *atqa, uint8_t sak, bool wantSaveToEmlFile);
 int mfTraceDecode(uint8_t *data_src, int len, uint32_t parity, bool wantSaveToEmlFile);
@@ -80,3 +146,5 @@ int isBlockEmpty(int blockN);
 int isBlockTrailer(int blockN);
 int loadTraceCard(uint8_t *tuid);
 int saveTraceCard(void);
+
+#endif
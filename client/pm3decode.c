@@ -0,0 +1,461 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// pm3-decode: headless batch decoder for sample traces (.pm3)
+//
+// Runs the client's demodulators over a set of trace files without GUI,
+// readline or USB and prints one JSON record per file. Files are handed out
+// to a pool of worker processes; the demodulators keep their state in the
+// global graph buffer, so processes rather than threads keep them apart.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "proxusb.h"
+#include "ui.h"
+#include "graph.h"
+#include "clockrec.h"
+#include "cmdmain.h"
+#include "cmddata.h"
+#include "cmdlf.h"
+#include "cmdlfem4x.h"
+#include "cmdlfti.h"
+#include "cmdhf15.h"
+#include "cmdhf14b.h"
+
+#define DECODE_LOG_SIZE   (64*1024)
+#define DECODE_ID_SIZE    128
+#define DECODE_MAX_JOBS   64
+
+typedef struct {
+	const char *name;
+	const char *modulation;
+	int (*demod)(const char *Cmd);
+	const char *args;
+	int (*extract)(const char *log, char *id, size_t len);
+	int automatic;          // part of the default decoder chain
+} decoder_t;
+
+// Environment the demodulators expect from ui.c and the USB layer
+double CursorScaleFactor;
+int PlotGridX, PlotGridY, PlotGridXdefault = 64, PlotGridYdefault = 64;
+int offline = 1;
+unsigned char return_on_error = 1;
+unsigned char error_occured = 0;
+
+static char decode_log[DECODE_LOG_SIZE];
+static size_t decode_log_len;
+static int verbose;
+static int saved_samples[MAX_GRAPH_TRACE_LEN];
+static int saved_len;
+
+// Collect the demodulators' output for the extractors instead of printing it
+void PrintAndLog(char *fmt, ...)
+{
+	va_list argptr;
+	int len;
+
+	va_start(argptr, fmt);
+	len = vsnprintf(decode_log + decode_log_len, sizeof(decode_log) - decode_log_len, fmt, argptr);
+	va_end(argptr);
+	if (len < 0)
+		return;
+
+	if (verbose)
+		fprintf(stderr, "%s\n", decode_log + decode_log_len);
+
+	decode_log_len += len;
+	if (decode_log_len >= sizeof(decode_log) - 1)
+		decode_log_len = sizeof(decode_log) - 2;
+	decode_log[decode_log_len++] = '\n';
+	decode_log[decode_log_len] = '\0';
+}
+
+void SetLogFilename(char *fn) {}
+
+// There is no device: commands go nowhere and never get an answer
+void SendCommand(UsbCommand *c)
+{
+	error_occured = 1;
+}
+
+UsbCommand *WaitForResponseTimeout(uint32_t response_type, uint32_t ms_timeout)
+{
+	return NULL;
+}
+
+UsbCommand *WaitForResponse(uint32_t response_type)
+{
+	return NULL;
+}
+
+// copy the run of hex digits following marker
+static int extract_hex_after(const char *log, const char *marker, char *id, size_t len)
+{
+	const char *p = strstr(log, marker);
+	size_t n = 0;
+
+	if (!p)
+		return 0;
+	for (p += strlen(marker); isxdigit((unsigned char)*p) && n < len - 1; p++)
+		id[n++] = tolower((unsigned char)*p);
+	id[n] = '\0';
+	return n > 0;
+}
+
+static int extract_em410x(const char *log, char *id, size_t len)
+{
+	return extract_hex_after(log, "EM410x Tag ID: ", id, len);
+}
+
+static int extract_indala(const char *log, char *id, size_t len)
+{
+	const char *p = strstr(log, "UID=");
+
+	return p && extract_hex_after(p, "(", id, len);
+}
+
+static int extract_ti(const char *log, char *id, size_t len)
+{
+	return strstr(log, "is good") && extract_hex_after(log, "Tag data = ", id, len);
+}
+
+static int extract_fsk(const char *log, char *id, size_t len)
+{
+	const char *p = strstr(log, "hex: ");
+	char lo[16];
+	unsigned int hi;
+
+	if (!p || !extract_hex_after(p, "hex: ", id, len) || strlen(id) + 8 >= len)
+		return 0;
+	if (!extract_hex_after(p + 5 + strlen(id), " ", lo, sizeof(lo)))
+		return 0;
+	strcat(id, lo);
+	// the demodulator prints its 45 bits for any trace, so take only what
+	// looks like a HID frame: zeros, then the leading 1 of a format of up
+	// to 37 bits
+	if (sscanf(id, "%8x", &hi) != 1)
+		return 0;
+	return hi != 0 && hi < 0x40;
+}
+
+// concatenate the bytes of all lines that consist of prefix and a hex byte
+static int extract_byte_lines(const char *log, const char *prefix, char *id, size_t len)
+{
+	size_t n = 0, plen = strlen(prefix);
+	const char *line = log;
+
+	while (*line && n + 2 < len) {
+		const char *p = line;
+		unsigned int value;
+		if (!strncmp(p, prefix, plen)) {
+			p += plen;
+			if (sscanf(p, "%*d: %x", &value) == 1 || sscanf(p, "%x", &value) == 1)
+				n += sprintf(id + n, "%02x", value & 0xff);
+		}
+		line = strchr(line, '\n');
+		if (!line)
+			break;
+		line++;
+	}
+	id[n] = '\0';
+	return n > 0;
+}
+
+// data of the first tag response with a good CRC
+static int extract_hf15(const char *log, char *id, size_t len)
+{
+	for (const char *line = log; *line; line += strcspn(line, "\n") + 1) {
+		char buf[1024], src[8], crc[8];
+		size_t line_len = strcspn(line, "\n");
+		const char *p = buf;
+		unsigned int value;
+		int pos, n = 0;
+
+		if (line_len >= sizeof(buf))
+			line_len = sizeof(buf) - 1;
+		memcpy(buf, line, line_len);
+		buf[line_len] = '\0';
+
+		if (sscanf(buf, "%*u %7s %*s %7s %n", src, crc, &pos) < 2
+		    || strcmp(src, "tag") || strcmp(crc, "ok"))
+		{
+			if (!line[line_len])
+				break;
+			continue;
+		}
+		for (p += pos; n + 2 < (int)len && sscanf(p, "%x%n", &value, &pos) == 1; p += pos)
+			n += sprintf(id + n, "%02x", value & 0xff);
+		id[n] = '\0';
+		return n > 0;
+	}
+	return 0;
+}
+
+static int extract_hf14b(const char *log, char *id, size_t len)
+{
+	return !strstr(log, "demod error") && extract_byte_lines(log, "   ", id, len);
+}
+
+static const decoder_t decoders[] = {
+	{"em410x",  "ask/manchester", CmdEM410xRead,  "",    extract_em410x, 1},
+	{"indala",  "psk1",           CmdIndalaDemod, "",    extract_indala, 1},
+	{"indala224", "psk1",         CmdIndalaDemod, "224", extract_indala, 1},
+	{"ti",      "fsk",            CmdTIDemod,     "",    extract_ti,     1},
+	{"fsk",     "fsk",            CmdFSKdemod,    "",    extract_fsk,    1},
+	{"hf15",    "iso15693",       CmdHF15Demod,   "",    extract_hf15,   0},
+	{"hf14b",   "iso14443b",      CmdHF14BDemod,  "",    extract_hf14b,  0},
+	{NULL, NULL, NULL, NULL, NULL, 0}
+};
+
+static const decoder_t *only_decoder;
+
+static double now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static size_t json_string(char *dst, size_t size, const char *src)
+{
+	size_t n = 0;
+
+	if (!src)
+		return snprintf(dst, size, "null");
+
+	dst[n++] = '"';
+	for (; *src && n + 8 < size; src++) {
+		if (*src == '"' || *src == '\\')
+			n += sprintf(dst + n, "\\%c", *src);
+		else if ((unsigned char)*src < 0x20)
+			n += sprintf(dst + n, "\\u%04x", *src);
+		else
+			dst[n++] = *src;
+	}
+	dst[n++] = '"';
+	dst[n] = '\0';
+	return n;
+}
+
+static int run_decoder(const decoder_t *dec, char *id, size_t len)
+{
+	memcpy(GraphBuffer, saved_samples, saved_len * sizeof(int));
+	GraphTraceLen = saved_len;
+	GraphChanged(0, saved_len);
+	decode_log_len = 0;
+	decode_log[0] = '\0';
+
+	dec->demod(dec->args);
+	return dec->extract(decode_log, id, len);
+}
+
+static void decode_file(const char *path)
+{
+	const decoder_t *found = NULL;
+	clock_estimate_t est = {0, 0, 0.0};
+	char id[DECODE_ID_SIZE];
+	char *record;
+	size_t size, n = 0;
+	double start = now_ms();
+
+	decode_log_len = 0;
+	GraphTraceLen = 0;
+	CmdLoad(path);
+	saved_len = GraphTraceLen;
+	memcpy(saved_samples, GraphBuffer, saved_len * sizeof(int));
+
+	if (saved_len > 0) {
+		estimate_clock(saved_samples, saved_len, 0, &est);
+
+		if (only_decoder) {
+			if (run_decoder(only_decoder, id, sizeof(id)))
+				found = only_decoder;
+		} else {
+			for (const decoder_t *dec = decoders; dec->name && !found; dec++)
+				if (dec->automatic && run_decoder(dec, id, sizeof(id)))
+					found = dec;
+		}
+	}
+
+	// an escaped character takes at most six bytes; the fixed fields fit in the slack
+	size = 6 * (strlen(path) + sizeof(id)) + 256;
+	if (!(record = malloc(size))) {
+		perror("malloc");
+		return;
+	}
+
+	n += snprintf(record + n, size - n, "{\"file\": ");
+	n += json_string(record + n, size - n, path);
+	n += snprintf(record + n, size - n, ", \"samples\": %d, \"modulation\": ", saved_len);
+	n += json_string(record + n, size - n, found ? found->modulation : NULL);
+	n += snprintf(record + n, size - n, ", \"decoder\": ");
+	n += json_string(record + n, size - n, found ? found->name : NULL);
+	n += snprintf(record + n, size - n, ", \"clock\": %d, \"clock_confidence\": %.2f, \"id\": ",
+		est.clock, est.confidence);
+	n += json_string(record + n, size - n, found ? id : NULL);
+	n += snprintf(record + n, size - n, ", \"ms\": %.3f}\n", now_ms() - start);
+
+	// a single write per record keeps the workers' lines from interleaving
+	if (write(STDOUT_FILENO, record, n) < 0)
+		perror("write");
+	free(record);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t nlen = strlen(name), slen = strlen(suffix);
+
+	return nlen >= slen && !strcasecmp(name + nlen - slen, suffix);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static char **files;
+static int file_count, file_alloc;
+
+static void add_file(const char *path)
+{
+	if (file_count == file_alloc) {
+		file_alloc = file_alloc ? 2 * file_alloc : 64;
+		files = realloc(files, file_alloc * sizeof(char *));
+		if (!files) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	files[file_count++] = strdup(path);
+}
+
+// add a trace file, or every .pm3 file in a directory
+static void add_path(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+	char name[4096];
+	int first = file_count;
+
+	if (!dir) {
+		add_file(path);
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (!has_suffix(entry->d_name, ".pm3"))
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		add_file(name);
+	}
+	closedir(dir);
+	qsort(files + first, file_count - first, sizeof(char *), compare_names);
+}
+
+static void worker(int queue)
+{
+	uint32_t index;
+
+	while (read(queue, &index, sizeof(index)) == sizeof(index))
+		decode_file(files[index]);
+	exit(0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: pm3-decode [-j jobs] [-d decoder] [-v] <dir|file.pm3>...\n\n");
+	fprintf(stderr, "  -j jobs     number of worker processes (default: one per CPU)\n");
+	fprintf(stderr, "  -d decoder  only run this decoder instead of the default chain\n");
+	fprintf(stderr, "  -v          show the demodulators' output on stderr\n\n");
+	fprintf(stderr, "decoders (* = default chain):");
+	for (const decoder_t *dec = decoders; dec->name; dec++)
+		fprintf(stderr, " %s%s", dec->name, dec->automatic ? "*" : "");
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int queue[2], opt;
+
+	while ((opt = getopt(argc, argv, "j:d:vh")) != -1) {
+		switch (opt) {
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+			case 'd':
+				for (only_decoder = decoders; only_decoder->name; only_decoder++)
+					if (!strcmp(only_decoder->name, optarg))
+						break;
+				if (!only_decoder->name) {
+					fprintf(stderr, "unknown decoder '%s'\n", optarg);
+					usage();
+				}
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+
+	for (int i = optind; i < argc; i++)
+		add_path(argv[i]);
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > DECODE_MAX_JOBS)
+		jobs = DECODE_MAX_JOBS;
+	if (jobs > file_count)
+		jobs = file_count;
+
+	if (jobs <= 1) {
+		for (int i = 0; i < file_count; i++)
+			decode_file(files[i]);
+		return 0;
+	}
+
+	// the file indices go through a pipe, every worker takes the next one
+	// when it's done with the last
+	if (pipe(queue) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for (int i = 0; i < jobs; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		}
+		if (pid == 0) {
+			close(queue[1]);
+			worker(queue[0]);
+		}
+	}
+	close(queue[0]);
+	for (uint32_t i = 0; i < file_count; i++)
+		if (write(queue[1], &i, sizeof(i)) != sizeof(i))
+			break;
+	close(queue[1]);
+
+	while (wait(NULL) > 0)
+		;
+	return 0;
+}
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include "proxguiqt.h"
 #include "proxgui.h"
+#include "graphlod.h"
 
 int GridOffset= 0;
 bool GridLocked= 0;
@@ -99,6 +100,21 @@ ProxGuiQT::~ProxGuiQT(void)
 	}
 }
 
+static void DrawLabel(QPainter &painter, QPainterPath &whitePath, int x, int zeroHeight, int offset)
+{
+	whitePath.moveTo(x, zeroHeight - 3);
+	whitePath.lineTo(x, zeroHeight + 3);
+
+	char str[100];
+	sprintf(str, "+%d", offset);
+
+	painter.setPen(QColor(255, 255, 255));
+	QRect size;
+	QFontMetrics metrics(painter.font());
+	size = metrics.boundingRect(str);
+	painter.drawText(x - (size.right() - size.left()), zeroHeight + 9, str);
+}
+
 void ProxWidget::paintEvent(QPaintEvent *event)
 {
 	QPainter painter(this);
@@ -165,19 +181,20 @@ void ProxWidget::paintEvent(QPaintEvent *event)
 		GraphStart = startMax;
 	}
 
+	// visible samples, and those drawn including the one past the right edge
+	int visEnd = GraphStart + (int)((r.right() - 40) / GraphPixelsPerPoint) + 1;
+	int drawEnd = GraphStart + (int)((r.right() - 40 + GraphPixelsPerPoint) / GraphPixelsPerPoint) + 1;
+	if(visEnd > GraphTraceLen) visEnd = GraphTraceLen;
+	if(drawEnd > GraphTraceLen) drawEnd = GraphTraceLen;
+
+	// min/max/mean come from the pyramid, so none of this walks the samples
+	graph_lod_sync(GraphBuffer, GraphTraceLen);
+
+	graph_span_t visible;
 	int absYMax = 1;
 
-	for(i = GraphStart; ; i++) {
-		if(i >= GraphTraceLen) {
-			break;
-		}
-		if(fabs((double)GraphBuffer[i]) > absYMax) {
-			absYMax = (int)fabs((double)GraphBuffer[i]);
-		}
-		int x = 40 + (int)((i - GraphStart)*GraphPixelsPerPoint);
-		if(x > r.right()) {
-			break;
-		}
+	if(graph_lod_span(GraphStart, visEnd, &visible) == 0) {
+		absYMax = qMax(absYMax, qMax(qAbs(visible.min), qAbs(visible.max)));
 	}
 
 	absYMax = (int)(absYMax*1.2 + 1);
@@ -195,69 +212,88 @@ void ProxWidget::paintEvent(QPaintEvent *event)
 	int yMean = 0;
 	int n = 0;
 
-	for(i = GraphStart; ; i++) {
-		if(i >= GraphTraceLen) {
-			break;
-		}
-		int x = 40 + (int)((i - GraphStart)*GraphPixelsPerPoint);
-		if(x > r.right() + GraphPixelsPerPoint) {
-			break;
-		}
+	if(graph_lod_span(GraphStart, drawEnd, &visible) == 0) {
+		yMin = visible.min;
+		yMax = visible.max;
+		yMean = (int)(visible.sum / visible.count);
+		n = visible.count;
+	}
 
-		int y = GraphBuffer[i];
-		if(y < yMin) {
-			yMin = y;
-		}
-		if(y > yMax) {
-			yMax = y;
-		}
-		yMean += y;
-		n++;
-
-		y = (y * (r.top() - r.bottom()) / (2*absYMax)) + zeroHeight;
-		if(i == GraphStart) {
-			penPath.moveTo(x, y);
-		} else {
-			penPath.lineTo(x, y);
-		}
+	if(GraphPixelsPerPoint >= 1) {
+		for(i = GraphStart; i < drawEnd; i++) {
+			int x = 40 + (int)((i - GraphStart)*GraphPixelsPerPoint);
+			int y = (GraphBuffer[i] * (r.top() - r.bottom()) / (2*absYMax)) + zeroHeight;
 
-		if(GraphPixelsPerPoint > 10) {
-			QRect f(QPoint(x - 3, y - 3),QPoint(x + 3, y + 3));
-			painter.fillRect(f, brush);
-		}
+			if(i == GraphStart) {
+				penPath.moveTo(x, y);
+			} else {
+				penPath.lineTo(x, y);
+			}
 
-		if(((i - GraphStart) % pointsPerLabel == 0) && i != GraphStart) {
-			whitePath.moveTo(x, zeroHeight - 3);
-			whitePath.lineTo(x, zeroHeight + 3);
+			if(GraphPixelsPerPoint > 10) {
+				QRect f(QPoint(x - 3, y - 3),QPoint(x + 3, y + 3));
+				painter.fillRect(f, brush);
+			}
 
-			char str[100];
-			sprintf(str, "+%d", (i - GraphStart));
+			if(((i - GraphStart) % pointsPerLabel == 0) && i != GraphStart) {
+				DrawLabel(painter, whitePath, x, zeroHeight, i - GraphStart);
+				penPath.moveTo(x,y);
+			}
 
-			painter.setPen(QColor(255, 255, 255));
-			QRect size;
-			QFontMetrics metrics(painter.font());
-			size = metrics.boundingRect(str);
-			painter.drawText(x - (size.right() - size.left()), zeroHeight + 9, str);
+			if(i == CursorAPos || i == CursorBPos) {
+				QPainterPath *cursorPath;
 
-			penPath.moveTo(x,y);
+				if(i == CursorAPos) {
+					cursorPath = &cursorAPath;
+				} else {
+					cursorPath = &cursorBPath;
+				}
+				cursorPath->moveTo(x, r.top());
+				cursorPath->lineTo(x, r.bottom());
+				penPath.moveTo(x, y);
+			}
 		}
+	} else {
+		// zoomed out: one vertical stroke per pixel column covering the
+		// range of the samples that fall into it
+		for(int column = 0; ; column++) {
+			int s0 = GraphStart + (int)(column / GraphPixelsPerPoint);
+			int s1 = GraphStart + (int)((column + 1) / GraphPixelsPerPoint);
+			if(s0 >= drawEnd) {
+				break;
+			}
+			if(s1 > drawEnd) {
+				s1 = drawEnd;
+			}
 
-		if(i == CursorAPos || i == CursorBPos) {
-			QPainterPath *cursorPath;
+			graph_span_t cell;
+			if(graph_lod_span(s0, s1, &cell) != 0) {
+				continue;
+			}
+			// reach back to the previous column so the strokes join up
+			if(s0 > GraphStart) {
+				cell.min = qMin(cell.min, GraphBuffer[s0 - 1]);
+				cell.max = qMax(cell.max, GraphBuffer[s0 - 1]);
+			}
 
-			if(i == CursorAPos) {
-				cursorPath = &cursorAPath;
-			} else {
-				cursorPath = &cursorBPath;
+			int x = 40 + column;
+			penPath.moveTo(x, (cell.max * (r.top() - r.bottom()) / (2*absYMax)) + zeroHeight);
+			penPath.lineTo(x, (cell.min * (r.top() - r.bottom()) / (2*absYMax)) + zeroHeight);
+
+			int label = (s1 - 1 - GraphStart) / pointsPerLabel * pointsPerLabel;
+			if(label >= s0 - GraphStart && label != 0) {
+				DrawLabel(painter, whitePath, x, zeroHeight, label);
 			}
-			cursorPath->moveTo(x, r.top());
-			cursorPath->lineTo(x, r.bottom());
-			penPath.moveTo(x, y);
-		}
-	}
 
-	if(n != 0) {
-		yMean /= n;
+			if(CursorAPos >= s0 && CursorAPos < s1) {
+				cursorAPath.moveTo(x, r.top());
+				cursorAPath.lineTo(x, r.bottom());
+			}
+			if(CursorBPos >= s0 && CursorBPos < s1) {
+				cursorBPath.moveTo(x, r.top());
+				cursorBPath.lineTo(x, r.bottom());
+			}
+		}
 	}
 
 	painter.setPen(QColor(255, 255, 255));
@@ -13,7 +13,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#ifndef WITHOUT_LIBUSB
 #include <usb.h>
+#else
+typedef struct usb_dev_handle usb_dev_handle;
+#endif
 #include "usb_cmd.h"
 
 extern unsigned char return_on_error;
@@ -30,6 +30,7 @@ char * sprint_hex(const uint8_t * data, const size_t len);
 void num_to_bytes(uint64_t n, size_t len, uint8_t* dest);
 uint64_t bytes_to_num(uint8_t* src, size_t len);
 
+int param_getptr(const char *line, int *bg, int *en, int paramnum);
 char param_getchar(const char *line, int paramnum);
 uint8_t param_get8(const char *line, int paramnum);
 uint8_t param_get8ex(const char *line, int paramnum, int deflt, int base);
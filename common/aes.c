@@ -0,0 +1,180 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// AES-128, byte oriented after FIPS-197
+//
+// Small rather than fast: DESFire moves a few blocks per command, so only
+// the S-boxes are tables and MixColumns multiplies with xtime().
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+#include "aes.h"
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t aes_inv_sbox[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+
+static uint8_t xtime(uint8_t x)
+{
+	return x << 1 ^ (x & 0x80 ? 0x1b : 0);
+}
+
+static uint8_t mul(uint8_t x, uint8_t y)
+{
+	uint8_t r = 0;
+
+	for (; y; y >>= 1, x = xtime(x))
+		if (y & 1)
+			r ^= x;
+	return r;
+}
+
+void aes_setkey(aes_ctx_t *ctx, const uint8_t *key)
+{
+	uint8_t *w = ctx->round_keys[0];
+	uint8_t rcon = 1;
+
+	memcpy(w, key, 16);
+	for (int i = 16; i < 176; i += 4) {
+		uint8_t t[4] = {w[i - 4], w[i - 3], w[i - 2], w[i - 1]};
+
+		if (i % 16 == 0) {
+			// RotWord, SubWord and the round constant
+			uint8_t first = t[0];
+			t[0] = aes_sbox[t[1]] ^ rcon;
+			t[1] = aes_sbox[t[2]];
+			t[2] = aes_sbox[t[3]];
+			t[3] = aes_sbox[first];
+			rcon = xtime(rcon);
+		}
+		for (int j = 0; j < 4; j++)
+			w[i + j] = w[i + j - 16] ^ t[j];
+	}
+}
+
+static void add_round_key(uint8_t *s, const uint8_t *k)
+{
+	for (int i = 0; i < 16; i++)
+		s[i] ^= k[i];
+}
+
+// SubBytes and ShiftRows in one go, the state is column major
+static void sub_shift(uint8_t *s, const uint8_t *box, int inverse)
+{
+	uint8_t t[16];
+
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++) {
+			int from = inverse ? (c - r + 4) % 4 : (c + r) % 4;
+			t[4 * c + r] = box[s[4 * from + r]];
+		}
+	memcpy(s, t, 16);
+}
+
+static void mix_columns(uint8_t *s)
+{
+	for (int c = 0; c < 16; c += 4) {
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+		uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+		s[c] ^= all ^ xtime(a0 ^ a1);
+		s[c + 1] ^= all ^ xtime(a1 ^ a2);
+		s[c + 2] ^= all ^ xtime(a2 ^ a3);
+		s[c + 3] ^= all ^ xtime(a3 ^ a0);
+	}
+}
+
+static void inv_mix_columns(uint8_t *s)
+{
+	for (int c = 0; c < 16; c += 4) {
+		uint8_t a0 = s[c], a1 = s[c + 1], a2 = s[c + 2], a3 = s[c + 3];
+
+		s[c] = mul(a0, 14) ^ mul(a1, 11) ^ mul(a2, 13) ^ mul(a3, 9);
+		s[c + 1] = mul(a0, 9) ^ mul(a1, 14) ^ mul(a2, 11) ^ mul(a3, 13);
+		s[c + 2] = mul(a0, 13) ^ mul(a1, 9) ^ mul(a2, 14) ^ mul(a3, 11);
+		s[c + 3] = mul(a0, 11) ^ mul(a1, 13) ^ mul(a2, 9) ^ mul(a3, 14);
+	}
+}
+
+void aes_encrypt_block(const aes_ctx_t *ctx, uint8_t *block)
+{
+	add_round_key(block, ctx->round_keys[0]);
+	for (int round = 1; round < 10; round++) {
+		sub_shift(block, aes_sbox, 0);
+		mix_columns(block);
+		add_round_key(block, ctx->round_keys[round]);
+	}
+	sub_shift(block, aes_sbox, 0);
+	add_round_key(block, ctx->round_keys[10]);
+}
+
+void aes_decrypt_block(const aes_ctx_t *ctx, uint8_t *block)
+{
+	add_round_key(block, ctx->round_keys[10]);
+	for (int round = 9; round > 0; round--) {
+		sub_shift(block, aes_inv_sbox, 1);
+		add_round_key(block, ctx->round_keys[round]);
+		inv_mix_columns(block);
+	}
+	sub_shift(block, aes_inv_sbox, 1);
+	add_round_key(block, ctx->round_keys[0]);
+}
+
+void aes_cbc_encrypt(const aes_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv)
+{
+	for (; len >= 16; len -= 16, data += 16) {
+		for (int i = 0; i < 16; i++)
+			data[i] ^= iv[i];
+		aes_encrypt_block(ctx, data);
+		memcpy(iv, data, 16);
+	}
+}
+
+void aes_cbc_decrypt(const aes_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv)
+{
+	uint8_t next[16];
+
+	for (; len >= 16; len -= 16, data += 16) {
+		memcpy(next, data, 16);
+		aes_decrypt_block(ctx, data);
+		for (int i = 0; i < 16; i++)
+			data[i] ^= iv[i];
+		memcpy(iv, next, 16);
+	}
+}
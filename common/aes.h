@@ -0,0 +1,28 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// AES-128
+//-----------------------------------------------------------------------------
+
+#ifndef AES_H__
+#define AES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint8_t round_keys[11][16];
+} aes_ctx_t;
+
+void aes_setkey(aes_ctx_t *ctx, const uint8_t *key);
+
+void aes_encrypt_block(const aes_ctx_t *ctx, uint8_t *block);
+void aes_decrypt_block(const aes_ctx_t *ctx, uint8_t *block);
+
+// In place on len bytes, a multiple of 16. iv is updated for the next call.
+void aes_cbc_encrypt(const aes_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv);
+void aes_cbc_decrypt(const aes_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv);
+
+#endif
@@ -0,0 +1,26 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Crypto1 keystream for the frames after the authentication, up to 32 bits
+// at a time, shared by the client and the firmware
+//-----------------------------------------------------------------------------
+
+#ifndef __CRYPTO1KS_H
+#define __CRYPTO1KS_H
+
+#include <stdint.h>
+
+struct Crypto1State;
+
+// The next 1 to 32 bits of the keystream of a cipher that gets no input,
+// the first in bit 0: what crypto1_bit(s, 0, 0) gives one by one.
+uint32_t crypto1_ks(struct Crypto1State *s, int bits);
+
+// len bytes under the keystream, as crypto1_byte(s, 0, 0) ^ data[i]. par,
+// unless NULL, gets the encrypted odd parity of each byte that came in,
+// bit i for byte i, for a frame of up to 32 bytes.
+void crypto1_ks_crypt(struct Crypto1State *s, uint8_t *data, int len, uint32_t *par);
+
+#endif
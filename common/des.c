@@ -0,0 +1,455 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// DES and triple DES, shared by the client and the firmware
+//
+// The round function is Outerbridge's: S-boxes and P are merged into eight
+// tables of 64 words and the halves are kept rotated by one bit, so a round
+// costs eight lookups. A 3DES schedule is the 48 subkeys of E-D-E in the
+// order they are used; deciphering walks the same schedule backwards, so one
+// schedule serves both directions and is only rebuilt when the key changes.
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+#include "des.h"
+
+// not const: on the device .data is copied to SRAM, which is faster than flash
+static uint32_t des_sp[8][64] = {
+	{
+		0x01010400, 0x00000000, 0x00010000, 0x01010404,
+		0x01010004, 0x00010404, 0x00000004, 0x00010000,
+		0x00000400, 0x01010400, 0x01010404, 0x00000400,
+		0x01000404, 0x01010004, 0x01000000, 0x00000004,
+		0x00000404, 0x01000400, 0x01000400, 0x00010400,
+		0x00010400, 0x01010000, 0x01010000, 0x01000404,
+		0x00010004, 0x01000004, 0x01000004, 0x00010004,
+		0x00000000, 0x00000404, 0x00010404, 0x01000000,
+		0x00010000, 0x01010404, 0x00000004, 0x01010000,
+		0x01010400, 0x01000000, 0x01000000, 0x00000400,
+		0x01010004, 0x00010000, 0x00010400, 0x01000004,
+		0x00000400, 0x00000004, 0x01000404, 0x00010404,
+		0x01010404, 0x00010004, 0x01010000, 0x01000404,
+		0x01000004, 0x00000404, 0x00010404, 0x01010400,
+		0x00000404, 0x01000400, 0x01000400, 0x00000000,
+		0x00010004, 0x00010400, 0x00000000, 0x01010004,
+	},
+	{
+		0x80108020, 0x80008000, 0x00008000, 0x00108020,
+		0x00100000, 0x00000020, 0x80100020, 0x80008020,
+		0x80000020, 0x80108020, 0x80108000, 0x80000000,
+		0x80008000, 0x00100000, 0x00000020, 0x80100020,
+		0x00108000, 0x00100020, 0x80008020, 0x00000000,
+		0x80000000, 0x00008000, 0x00108020, 0x80100000,
+		0x00100020, 0x80000020, 0x00000000, 0x00108000,
+		0x00008020, 0x80108000, 0x80100000, 0x00008020,
+		0x00000000, 0x00108020, 0x80100020, 0x00100000,
+		0x80008020, 0x80100000, 0x80108000, 0x00008000,
+		0x80100000, 0x80008000, 0x00000020, 0x80108020,
+		0x00108020, 0x00000020, 0x00008000, 0x80000000,
+		0x00008020, 0x80108000, 0x00100000, 0x80000020,
+		0x00100020, 0x80008020, 0x80000020, 0x00100020,
+		0x00108000, 0x00000000, 0x80008000, 0x00008020,
+		0x80000000, 0x80100020, 0x80108020, 0x00108000,
+	},
+	{
+		0x00000208, 0x08020200, 0x00000000, 0x08020008,
+		0x08000200, 0x00000000, 0x00020208, 0x08000200,
+		0x00020008, 0x08000008, 0x08000008, 0x00020000,
+		0x08020208, 0x00020008, 0x08020000, 0x00000208,
+		0x08000000, 0x00000008, 0x08020200, 0x00000200,
+		0x00020200, 0x08020000, 0x08020008, 0x00020208,
+		0x08000208, 0x00020200, 0x00020000, 0x08000208,
+		0x00000008, 0x08020208, 0x00000200, 0x08000000,
+		0x08020200, 0x08000000, 0x00020008, 0x00000208,
+		0x00020000, 0x08020200, 0x08000200, 0x00000000,
+		0x00000200, 0x00020008, 0x08020208, 0x08000200,
+		0x08000008, 0x00000200, 0x00000000, 0x08020008,
+		0x08000208, 0x00020000, 0x08000000, 0x08020208,
+		0x00000008, 0x00020208, 0x00020200, 0x08000008,
+		0x08020000, 0x08000208, 0x00000208, 0x08020000,
+		0x00020208, 0x00000008, 0x08020008, 0x00020200,
+	},
+	{
+		0x00802001, 0x00002081, 0x00002081, 0x00000080,
+		0x00802080, 0x00800081, 0x00800001, 0x00002001,
+		0x00000000, 0x00802000, 0x00802000, 0x00802081,
+		0x00000081, 0x00000000, 0x00800080, 0x00800001,
+		0x00000001, 0x00002000, 0x00800000, 0x00802001,
+		0x00000080, 0x00800000, 0x00002001, 0x00002080,
+		0x00800081, 0x00000001, 0x00002080, 0x00800080,
+		0x00002000, 0x00802080, 0x00802081, 0x00000081,
+		0x00800080, 0x00800001, 0x00802000, 0x00802081,
+		0x00000081, 0x00000000, 0x00000000, 0x00802000,
+		0x00002080, 0x00800080, 0x00800081, 0x00000001,
+		0x00802001, 0x00002081, 0x00002081, 0x00000080,
+		0x00802081, 0x00000081, 0x00000001, 0x00002000,
+		0x00800001, 0x00002001, 0x00802080, 0x00800081,
+		0x00002001, 0x00002080, 0x00800000, 0x00802001,
+		0x00000080, 0x00800000, 0x00002000, 0x00802080,
+	},
+	{
+		0x00000100, 0x02080100, 0x02080000, 0x42000100,
+		0x00080000, 0x00000100, 0x40000000, 0x02080000,
+		0x40080100, 0x00080000, 0x02000100, 0x40080100,
+		0x42000100, 0x42080000, 0x00080100, 0x40000000,
+		0x02000000, 0x40080000, 0x40080000, 0x00000000,
+		0x40000100, 0x42080100, 0x42080100, 0x02000100,
+		0x42080000, 0x40000100, 0x00000000, 0x42000000,
+		0x02080100, 0x02000000, 0x42000000, 0x00080100,
+		0x00080000, 0x42000100, 0x00000100, 0x02000000,
+		0x40000000, 0x02080000, 0x42000100, 0x40080100,
+		0x02000100, 0x40000000, 0x42080000, 0x02080100,
+		0x40080100, 0x00000100, 0x02000000, 0x42080000,
+		0x42080100, 0x00080100, 0x42000000, 0x42080100,
+		0x02080000, 0x00000000, 0x40080000, 0x42000000,
+		0x00080100, 0x02000100, 0x40000100, 0x00080000,
+		0x00000000, 0x40080000, 0x02080100, 0x40000100,
+	},
+	{
+		0x20000010, 0x20400000, 0x00004000, 0x20404010,
+		0x20400000, 0x00000010, 0x20404010, 0x00400000,
+		0x20004000, 0x00404010, 0x00400000, 0x20000010,
+		0x00400010, 0x20004000, 0x20000000, 0x00004010,
+		0x00000000, 0x00400010, 0x20004010, 0x00004000,
+		0x00404000, 0x20004010, 0x00000010, 0x20400010,
+		0x20400010, 0x00000000, 0x00404010, 0x20404000,
+		0x00004010, 0x00404000, 0x20404000, 0x20000000,
+		0x20004000, 0x00000010, 0x20400010, 0x00404000,
+		0x20404010, 0x00400000, 0x00004010, 0x20000010,
+		0x00400000, 0x20004000, 0x20000000, 0x00004010,
+		0x20000010, 0x20404010, 0x00404000, 0x20400000,
+		0x00404010, 0x20404000, 0x00000000, 0x20400010,
+		0x00000010, 0x00004000, 0x20400000, 0x00404010,
+		0x00004000, 0x00400010, 0x20004010, 0x00000000,
+		0x20404000, 0x20000000, 0x00400010, 0x20004010,
+	},
+	{
+		0x00200000, 0x04200002, 0x04000802, 0x00000000,
+		0x00000800, 0x04000802, 0x00200802, 0x04200800,
+		0x04200802, 0x00200000, 0x00000000, 0x04000002,
+		0x00000002, 0x04000000, 0x04200002, 0x00000802,
+		0x04000800, 0x00200802, 0x00200002, 0x04000800,
+		0x04000002, 0x04200000, 0x04200800, 0x00200002,
+		0x04200000, 0x00000800, 0x00000802, 0x04200802,
+		0x00200800, 0x00000002, 0x04000000, 0x00200800,
+		0x04000000, 0x00200800, 0x00200000, 0x04000802,
+		0x04000802, 0x04200002, 0x04200002, 0x00000002,
+		0x00200002, 0x04000000, 0x04000800, 0x00200000,
+		0x04200800, 0x00000802, 0x00200802, 0x04200800,
+		0x00000802, 0x04000002, 0x04200802, 0x04200000,
+		0x00200800, 0x00000000, 0x00000002, 0x04200802,
+		0x00000000, 0x00200802, 0x04200000, 0x00000800,
+		0x04000002, 0x04000800, 0x00000800, 0x00200002,
+	},
+	{
+		0x10001040, 0x00001000, 0x00040000, 0x10041040,
+		0x10000000, 0x10001040, 0x00000040, 0x10000000,
+		0x00040040, 0x10040000, 0x10041040, 0x00041000,
+		0x10041000, 0x00041040, 0x00001000, 0x00000040,
+		0x10040000, 0x10000040, 0x10001000, 0x00001040,
+		0x00041000, 0x00040040, 0x10040040, 0x10041000,
+		0x00001040, 0x00000000, 0x00000000, 0x10040040,
+		0x10000040, 0x10001000, 0x00041040, 0x00040000,
+		0x00041040, 0x00040000, 0x10041000, 0x00001000,
+		0x00000040, 0x10040040, 0x00001000, 0x00041040,
+		0x10001000, 0x00000040, 0x10000040, 0x10040000,
+		0x10040040, 0x10000000, 0x00040000, 0x10001040,
+		0x00000000, 0x10041040, 0x00040040, 0x10000040,
+		0x10040000, 0x10001000, 0x10001040, 0x00000000,
+		0x10041040, 0x00041000, 0x00041000, 0x00001040,
+		0x00001040, 0x00040040, 0x10000000, 0x10041000,
+	},
+};
+
+// permuted choice 1, bit numbers from the FIPS
+static const uint8_t des_pc1[56] = {
+	57, 49, 41, 33, 25, 17,  9,  1, 58, 50, 42, 34, 26, 18,
+	10,  2, 59, 51, 43, 35, 27, 19, 11,  3, 60, 52, 44, 36,
+	63, 55, 47, 39, 31, 23, 15,  7, 62, 54, 46, 38, 30, 22,
+	14,  6, 61, 53, 45, 37, 29, 21, 13,  5, 28, 20, 12,  4
+};
+
+// left rotations of the key halves up to each round
+static const uint8_t des_totrot[16] = {
+	1, 2, 4, 6, 8, 10, 12, 14, 15, 17, 19, 21, 23, 25, 27, 28
+};
+
+// permuted choice 2
+static const uint8_t des_pc2[48] = {
+	14, 17, 11, 24,  1,  5,  3, 28, 15,  6, 21, 10,
+	23, 19, 12,  4, 26,  8, 16,  7, 27, 20, 13,  2,
+	41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+	44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+// One round: r through the subkey pair k into l. k[0] holds the 6-bit
+// subkeys of S-boxes 1, 3, 5 and 7 one per byte, k[1] those of 2, 4, 6, 8.
+#define DES_F(l, r, k) do { \
+	uint32_t work_ = ((r) >> 4 | (r) << 28) ^ (k)[0]; \
+	(l) ^= des_sp[6][work_ & 0x3f] ^ des_sp[4][work_ >> 8 & 0x3f] \
+	     ^ des_sp[2][work_ >> 16 & 0x3f] ^ des_sp[0][work_ >> 24 & 0x3f]; \
+	work_ = (r) ^ (k)[1]; \
+	(l) ^= des_sp[7][work_ & 0x3f] ^ des_sp[5][work_ >> 8 & 0x3f] \
+	     ^ des_sp[3][work_ >> 16 & 0x3f] ^ des_sp[1][work_ >> 24 & 0x3f]; \
+} while (0)
+
+#define DES_SWAP_MASK(a, b, shift, mask) do { \
+	uint32_t work_ = ((a) >> (shift) ^ (b)) & (mask); \
+	(b) ^= work_; \
+	(a) ^= work_ << (shift); \
+} while (0)
+
+// Hoey's initial permutation, leaving both halves rotated left by one
+#define DES_IP(l, r) do { \
+	DES_SWAP_MASK(l, r, 4, 0x0f0f0f0f); \
+	DES_SWAP_MASK(l, r, 16, 0x0000ffff); \
+	DES_SWAP_MASK(r, l, 2, 0x33333333); \
+	DES_SWAP_MASK(r, l, 8, 0x00ff00ff); \
+	r = r << 1 | r >> 31; \
+	DES_SWAP_MASK(l, r, 0, 0xaaaaaaaa); \
+	l = l << 1 | l >> 31; \
+} while (0)
+
+#define DES_FP(l, r) do { \
+	r = r << 31 | r >> 1; \
+	DES_SWAP_MASK(l, r, 0, 0xaaaaaaaa); \
+	l = l >> 1 | l << 31; \
+	DES_SWAP_MASK(l, r, 8, 0x00ff00ff); \
+	DES_SWAP_MASK(l, r, 2, 0x33333333); \
+	DES_SWAP_MASK(r, l, 16, 0x0000ffff); \
+	DES_SWAP_MASK(r, l, 4, 0x0f0f0f0f); \
+} while (0)
+
+static uint32_t load_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Subkeys of one DES key in the packed form DES_F() expects
+static void des_schedule(uint32_t (*ks)[2], const uint8_t *key, int decrypt)
+{
+	uint8_t pc1m[56], pcr[56], sub[8];
+	int i, j, l;
+
+	for (j = 0; j < 56; j++) {
+		l = des_pc1[j] - 1;
+		pc1m[j] = key[l >> 3] >> (7 - (l & 7)) & 1;
+	}
+
+	for (i = 0; i < 16; i++) {
+		int rot = des_totrot[decrypt ? 15 - i : i];
+
+		// the two 28-bit halves rotate separately
+		for (j = 0; j < 56; j++) {
+			l = j + rot;
+			pcr[j] = pc1m[l < (j < 28 ? 28 : 56) ? l : l - 28];
+		}
+
+		memset(sub, 0, sizeof(sub));
+		for (j = 0; j < 48; j++)
+			if (pcr[des_pc2[j] - 1])
+				sub[j / 6] |= 0x20 >> (j % 6);
+
+		ks[i][0] = (uint32_t)sub[0] << 24 | (uint32_t)sub[2] << 16 | (uint32_t)sub[4] << 8 | sub[6];
+		ks[i][1] = (uint32_t)sub[1] << 24 | (uint32_t)sub[3] << 16 | (uint32_t)sub[5] << 8 | sub[7];
+	}
+}
+
+// DES keys are equal when they differ in the parity bits only
+static int same_key(const uint8_t *a, const uint8_t *b)
+{
+	for (int i = 0; i < 8; i++)
+		if ((a[i] ^ b[i]) & 0xfe)
+			return 0;
+	return 1;
+}
+
+int des_setkey(des_ctx_t *ctx, const uint8_t *key, size_t len)
+{
+	uint8_t full[24];
+
+	memcpy(full, key, 8);
+	memcpy(full + 8, len >= 16 ? key + 8 : key, 8);
+	memcpy(full + 16, len >= 24 ? key + 16 : key, 8);
+
+	if (ctx->valid && !memcmp(ctx->key, full, sizeof(full)))
+		return 0;
+
+	// E(k1) D(k1) E(k3) == E(k3) and E(k1) D(k2) E(k2) == E(k1)
+	if (same_key(full, full + 8)) {
+		des_schedule(ctx->ks, full + 16, 0);
+		ctx->rounds = 16;
+	} else if (same_key(full + 8, full + 16)) {
+		des_schedule(ctx->ks, full, 0);
+		ctx->rounds = 16;
+	} else {
+		des_schedule(ctx->ks, full, 0);
+		des_schedule(ctx->ks + 16, full + 8, 1);
+		des_schedule(ctx->ks + 32, full + 16, 0);
+		ctx->rounds = 48;
+	}
+
+	memcpy(ctx->key, full, sizeof(full));
+	ctx->valid = 1;
+	return 1;
+}
+
+// The rounds between the permutations; the halves swap between DES stages.
+static void des_rounds(const des_ctx_t *ctx, int decrypt, uint32_t *left, uint32_t *right)
+{
+	const uint32_t *k = decrypt ? ctx->ks[ctx->rounds - 1] : ctx->ks[0];
+	int step = decrypt ? -2 : 2;
+	uint32_t l = *left, r = *right, t;
+
+	for (int round = 0; round < ctx->rounds; round += 2) {
+		if (round && !(round & 15)) {
+			t = l;
+			l = r;
+			r = t;
+		}
+		DES_F(l, r, k);
+		k += step;
+		DES_F(r, l, k);
+		k += step;
+	}
+
+	*left = l;
+	*right = r;
+}
+
+static void des_crypt(const des_ctx_t *ctx, int decrypt, uint8_t *block)
+{
+	uint32_t l = load_be32(block), r = load_be32(block + 4);
+
+	DES_IP(l, r);
+	des_rounds(ctx, decrypt, &l, &r);
+	DES_FP(l, r);
+
+	store_be32(block, r);
+	store_be32(block + 4, l);
+}
+
+#ifdef DES_INTERLEAVE
+// des_crypt() on DES_INTERLEAVE consecutive blocks at once, so the table
+// lookups of independent blocks overlap
+static void des_crypt_multi(const des_ctx_t *ctx, int decrypt, uint8_t *blocks)
+{
+	const uint32_t *k = decrypt ? ctx->ks[ctx->rounds - 1] : ctx->ks[0];
+	int step = decrypt ? -2 : 2;
+	uint32_t l[DES_INTERLEAVE], r[DES_INTERLEAVE], t;
+	int i;
+
+	for (i = 0; i < DES_INTERLEAVE; i++) {
+		l[i] = load_be32(blocks + 8 * i);
+		r[i] = load_be32(blocks + 8 * i + 4);
+		DES_IP(l[i], r[i]);
+	}
+
+	for (int round = 0; round < ctx->rounds; round += 2) {
+		if (round && !(round & 15)) {
+			for (i = 0; i < DES_INTERLEAVE; i++) {
+				t = l[i];
+				l[i] = r[i];
+				r[i] = t;
+			}
+		}
+		for (i = 0; i < DES_INTERLEAVE; i++)
+			DES_F(l[i], r[i], k);
+		k += step;
+		for (i = 0; i < DES_INTERLEAVE; i++)
+			DES_F(r[i], l[i], k);
+		k += step;
+	}
+
+	for (i = 0; i < DES_INTERLEAVE; i++) {
+		DES_FP(l[i], r[i]);
+		store_be32(blocks + 8 * i, r[i]);
+		store_be32(blocks + 8 * i + 4, l[i]);
+	}
+}
+#endif
+
+void des_encrypt_block(const des_ctx_t *ctx, uint8_t *block)
+{
+	des_crypt(ctx, 0, block);
+}
+
+void des_decrypt_block(const des_ctx_t *ctx, uint8_t *block)
+{
+	des_crypt(ctx, 1, block);
+}
+
+void des_ecb(const des_ctx_t *ctx, uint8_t *data, size_t len, int decrypt)
+{
+#ifdef DES_INTERLEAVE
+	for (; len >= 8 * DES_INTERLEAVE; len -= 8 * DES_INTERLEAVE, data += 8 * DES_INTERLEAVE)
+		des_crypt_multi(ctx, decrypt, data);
+#endif
+	for (; len >= 8; len -= 8, data += 8)
+		des_crypt(ctx, decrypt, data);
+}
+
+void des_cbc_encrypt(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv)
+{
+	const uint8_t *prev = iv;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		for (int i = 0; i < 8; i++)
+			data[i] ^= prev[i];
+		des_crypt(ctx, 0, data);
+		prev = data;
+	}
+	if (prev != iv)
+		memcpy(iv, prev, 8);
+}
+
+void des_cbc_send(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv)
+{
+	const uint8_t *prev = iv;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		for (int i = 0; i < 8; i++)
+			data[i] ^= prev[i];
+		des_crypt(ctx, 1, data);
+		prev = data;
+	}
+	if (prev != iv)
+		memcpy(iv, prev, 8);
+}
+
+void des_cbc_decrypt(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv)
+{
+	uint8_t next[8];
+	int i;
+
+#ifdef DES_INTERLEAVE
+	uint8_t saved[8 * DES_INTERLEAVE];
+
+	for (; len >= sizeof(saved); len -= sizeof(saved), data += sizeof(saved)) {
+		memcpy(saved, data, sizeof(saved));
+		des_crypt_multi(ctx, 1, data);
+		for (i = 0; i < 8; i++)
+			data[i] ^= iv[i];
+		for (i = 8; i < (int)sizeof(saved); i++)
+			data[i] ^= saved[i - 8];
+		memcpy(iv, saved + sizeof(saved) - 8, 8);
+	}
+#endif
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(next, data, 8);
+		des_crypt(ctx, 1, data);
+		for (i = 0; i < 8; i++)
+			data[i] ^= iv[i];
+		memcpy(iv, next, 8);
+	}
+}
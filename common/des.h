@@ -0,0 +1,45 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// DES and triple DES, shared by the client and the firmware
+//-----------------------------------------------------------------------------
+
+#ifndef DES_H__
+#define DES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk ECB and CBC decryption run this many blocks side by side on the
+// host; the ARM7 has too few registers for that to pay off.
+#ifndef __arm__
+#define DES_INTERLEAVE  4
+#endif
+
+typedef struct {
+	uint32_t ks[48][2];   // subkeys in encryption order, E-D-E for 3DES
+	int rounds;           // 16 or 48
+	uint8_t key[24];      // the key the schedule was built from
+	int valid;
+} des_ctx_t;
+
+// len is 8 (DES), 16 (2-key 3DES) or 24 (3-key 3DES). A 3DES key with two
+// equal halves runs as single DES. Returns 1 if the schedule was rebuilt,
+// 0 if ctx already held it.
+int des_setkey(des_ctx_t *ctx, const uint8_t *key, size_t len);
+
+void des_encrypt_block(const des_ctx_t *ctx, uint8_t *block);
+void des_decrypt_block(const des_ctx_t *ctx, uint8_t *block);
+
+// In place on len bytes, a multiple of 8. iv is updated for the next call.
+void des_ecb(const des_ctx_t *ctx, uint8_t *data, size_t len, int decrypt);
+void des_cbc_encrypt(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv);
+void des_cbc_decrypt(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv);
+
+// DESFire native "send mode": each block is XORed with the previous result
+// and then deciphered, so the card can encipher to check it.
+void des_cbc_send(const des_ctx_t *ctx, uint8_t *data, size_t len, uint8_t *iv);
+
+#endif
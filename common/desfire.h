@@ -1,12 +1,31 @@
 #ifndef __DESFIRE_H
 #define __DESFIRE_H
 
-struct desfire_data {
-   uint8_t iso_resp_buf[256];
-   uint8_t resp_buf[256];
-   DES3_KS session_key;
-   uint8_t authenticated_key;
-};
+#include <stdint.h>
+
+/* results besides payload lengths and -DESFIRE_STATUS */
+#define DESFIRE_LINK_ERROR    -1
+#define DESFIRE_BUFFER_ERROR  -2
+
+/* most payload bytes one command returns to the host */
+#define DESFIRE_CHAIN_LIMIT   2048
+
+/* CMD_MIFARE_DES_CHKKEYS: arg[0] AID, arg[1] key slot, arg[2] the number of
+ * 16 byte keys in the packet | index of the first << 8 | DESFIRE_CHK_RUN */
+#define DESFIRE_CHK_KEYS_PER_PACKET  3
+#define DESFIRE_CHK_MAX_KEYS         (DESFIRE_CHAIN_LIMIT / 16)
+#define DESFIRE_CHK_RUN              (1 << 16)
+
+#define DESFIRE_MAX_APPS      28
+#define DESFIRE_MAX_FILES     32
+#define DESFIRE_MAX_KEYS      14
+
+/* file types in GET_FILE_SETTINGS */
+#define DESFIRE_STANDARD_DATA_FILE  0
+#define DESFIRE_BACKUP_DATA_FILE    1
+#define DESFIRE_VALUE_FILE          2
+#define DESFIRE_LINEAR_RECORD_FILE  3
+#define DESFIRE_CYCLIC_RECORD_FILE  4
 
 enum DESFIRE_STATUS {
     OPERATION_OK = 0,
@@ -62,6 +81,8 @@ enum DESFIRE_CMD {
     CREATE_CYCLIC_RECORD_FILE = 0xc0,
     DELETE_FILE = 0xdf,
     AUTHENTICATE_A = 0xa,
+    AUTHENTICATE_ISO = 0x1a,
+    AUTHENTICATE_AES = 0xaa,
     CHANGE_KEY_SETTINGS = 0x54,
     GET_KEY_SETTINGS = 0x45,
     CHANGE_KEY = 0xc4,
@@ -69,11 +90,86 @@ enum DESFIRE_CMD {
     AUTHENTICATION_FRAME = 0xAF
 };
 
+/* The native commands by layout: name, the widths in bytes of the
+ * parameters after the command code (one per nibble, the first lowest,
+ * each little endian), the offset the data is enciphered from in a secured
+ * session (0: never) and the least payload of a successful answer.
+ * Variable data (WRITE_DATA, the CHANGE_KEY cryptogram) follows the
+ * parameters. */
+#define DESFIRE_COMMANDS(X) \
+    X(GET_VERSION,               0x0,       0, 28) \
+    X(GET_APPLICATION_IDS,       0x0,       0, 0)  \
+    X(SELECT_APPLICATION,        0x3,       0, 0)  \
+    X(CREATE_APPLICATION,        0x113,     0, 0)  \
+    X(DELETE_APPLICATION,        0x3,       0, 0)  \
+    X(FORMAT_PICC,               0x0,       0, 0)  \
+    X(GET_FILE_IDS,              0x0,       0, 0)  \
+    X(GET_FILE_SETTINGS,         0x1,       0, 7)  \
+    X(CHANGE_FILE_SETTINGS,      0x211,     2, 0)  \
+    X(CREATE_STD_DATA_FILE,      0x3211,    0, 0)  \
+    X(CREATE_BACKUP_DATA_FILE,   0x3211,    0, 0)  \
+    X(CREATE_VALUE_FILE,         0x1444211, 0, 0)  \
+    X(CREATE_LINEAR_RECORD_FILE, 0x33211,   0, 0)  \
+    X(CREATE_CYCLIC_RECORD_FILE, 0x33211,   0, 0)  \
+    X(DELETE_FILE,               0x1,       0, 0)  \
+    X(READ_DATA,                 0x331,     0, 0)  \
+    X(WRITE_DATA,                0x331,     8, 0)  \
+    X(GET_VALUE,                 0x1,       0, 4)  \
+    X(CREDIT,                    0x41,      2, 0)  \
+    X(DEBIT,                     0x41,      2, 0)  \
+    X(LIMITED_CREDIT,            0x41,      2, 0)  \
+    X(WRITE_RECORD,              0x331,     8, 0)  \
+    X(READ_RECORDS,              0x331,     0, 0)  \
+    X(CLEAR_RECORD_FILE,         0x1,       0, 0)  \
+    X(COMMIT_TRANSACTION,        0x0,       0, 0)  \
+    X(ABORT_TRANSACTION,         0x0,       0, 0)  \
+    X(AUTHENTICATE_A,            0x1,       0, 8)  \
+    X(AUTHENTICATE_ISO,          0x1,       0, 8)  \
+    X(AUTHENTICATE_AES,          0x1,       0, 16) \
+    X(CHANGE_KEY_SETTINGS,       0x0,       1, 0)  \
+    X(GET_KEY_SETTINGS,          0x0,       0, 2)  \
+    X(CHANGE_KEY,                0x1,       2, 0)  \
+    X(GET_KEY_VERSION,           0x1,       0, 1)
+
+enum desfire_command_id {
+#define DESFIRE_COMMAND_ID(name, layout, encrypt, resp) DESFIRE_ID_##name,
+    DESFIRE_COMMANDS(DESFIRE_COMMAND_ID)
+#undef DESFIRE_COMMAND_ID
+    DESFIRE_COMMAND_COUNT
+};
+
+typedef struct {
+    uint8_t code;       // enum DESFIRE_CMD
+    uint8_t encrypt;
+    uint8_t resp;
+    uint32_t layout;
+} desfire_command_t;
+
+extern const desfire_command_t desfire_commands[DESFIRE_COMMAND_COUNT];
+
+/* the longest encoding, CREATE_VALUE_FILE */
+#define DESFIRE_HEADER_MAX  18
+
+/* Writes the command code and the parameters in args to buf, returns the
+ * length. Commands without parameters take args NULL. */
+int desfire_encode(uint8_t * buf, enum desfire_command_id id, const uint32_t * args);
+
+/* DESFIRE_ENCODE(buf, READ_DATA, file_id, offset, length) */
+#define DESFIRE_ENCODE(buf, name, ...) \
+    desfire_encode(buf, DESFIRE_ID_##name, (const uint32_t[]){__VA_ARGS__})
+
 enum MIFARE_COMMAND {
     CONNECT = 1,
     EXECUTE_NATIVE_COMMAND = 2,
     EXECUTE_SPECIAL_COMMAND = 4,
-    NO_DISCONNECT = 8
+    NO_DISCONNECT = 8,
+    FETCH_RESPONSE = 0x20
+};
+
+/* EXECUTE_SPECIAL_COMMAND operations, passed in param2 */
+enum DESFIRE_SPECIAL {
+    SPECIAL_AUTH = 1,       // cmd[0]: key slot, cmd+4: 16 byte key
+    SPECIAL_CHANGE_KEY = 2  // cmd[0]: key slot, cmd+4: old key, cmd+20: new key
 };
 
 #endif
@@ -0,0 +1,118 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire EV1 ciphers, CMAC and CRC32
+//
+// EV1 sessions use ordinary CBC in both directions, unlike the legacy
+// "send mode" of AUTHENTICATE_A. One IV runs through the whole session:
+// every command and answer either MACs or enciphers with it.
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+#include "desfirecrypto.h"
+
+int desfire_key_length(int type)
+{
+	return type == DESFIRE_KEY_3K3DES ? 24 : 16;
+}
+
+static void encrypt_block(const desfire_cipher_t *cipher, uint8_t *block)
+{
+	if (cipher->type == DESFIRE_KEY_AES)
+		aes_encrypt_block(&cipher->aes, block);
+	else
+		des_encrypt_block(&cipher->des, block);
+}
+
+// one bit left across the block, folding the carry back in with Rb
+static void cmac_shift(uint8_t *out, const uint8_t *in, int size)
+{
+	int carry = in[0] & 0x80;
+
+	for (int i = 0; i < size - 1; i++)
+		out[i] = in[i] << 1 | in[i + 1] >> 7;
+	out[size - 1] = in[size - 1] << 1;
+	if (carry)
+		out[size - 1] ^= size == 16 ? 0x87 : 0x1b;
+}
+
+void desfire_cipher_setkey(desfire_cipher_t *cipher, int type, const uint8_t *key)
+{
+	uint8_t l[16] = {0};
+
+	cipher->type = type;
+	if (type == DESFIRE_KEY_AES) {
+		cipher->block_size = 16;
+		aes_setkey(&cipher->aes, key);
+	} else {
+		cipher->block_size = 8;
+		cipher->des.valid = 0;
+		des_setkey(&cipher->des, key, desfire_key_length(type));
+	}
+
+	encrypt_block(cipher, l);
+	cmac_shift(cipher->k1, l, cipher->block_size);
+	cmac_shift(cipher->k2, cipher->k1, cipher->block_size);
+}
+
+void desfire_encipher(const desfire_cipher_t *cipher, uint8_t *data, size_t len, uint8_t *iv)
+{
+	if (cipher->type == DESFIRE_KEY_AES)
+		aes_cbc_encrypt(&cipher->aes, data, len, iv);
+	else
+		des_cbc_encrypt(&cipher->des, data, len, iv);
+}
+
+void desfire_decipher(const desfire_cipher_t *cipher, uint8_t *data, size_t len, uint8_t *iv)
+{
+	if (cipher->type == DESFIRE_KEY_AES)
+		aes_cbc_decrypt(&cipher->aes, data, len, iv);
+	else
+		des_cbc_decrypt(&cipher->des, data, len, iv);
+}
+
+void desfire_cmac_blocks(const desfire_cipher_t *cipher, const uint8_t *data, size_t blocks, uint8_t *iv)
+{
+	int size = cipher->block_size;
+
+	for (; blocks; blocks--, data += size) {
+		for (int i = 0; i < size; i++)
+			iv[i] ^= data[i];
+		encrypt_block(cipher, iv);
+	}
+}
+
+void desfire_cmac(const desfire_cipher_t *cipher, const uint8_t *data, size_t len, uint8_t *iv)
+{
+	int size = cipher->block_size, i;
+	const uint8_t *subkey = cipher->k1;
+	size_t blocks = len ? (len - 1) / size : 0;
+
+	// all blocks but the last one
+	desfire_cmac_blocks(cipher, data, blocks, iv);
+	data += blocks * size;
+	len -= blocks * size;
+
+	// the last one, padded with 80 00.. if it is not complete
+	if (len < (size_t)size) {
+		iv[len] ^= 0x80;
+		subkey = cipher->k2;
+	}
+	for (i = 0; i < (int)len; i++)
+		iv[i] ^= data[i];
+	for (i = 0; i < size; i++)
+		iv[i] ^= subkey[i];
+	encrypt_block(cipher, iv);
+}
+
+uint32_t desfire_crc32(const uint8_t *data, size_t len, uint32_t crc)
+{
+	while (len--) {
+		crc ^= *data++;
+		for (int i = 0; i < 8; i++)
+			crc = crc >> 1 ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+	return crc;
+}
@@ -0,0 +1,49 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire EV1 ciphers, CMAC and CRC32
+//-----------------------------------------------------------------------------
+
+#ifndef DESFIRECRYPTO_H__
+#define DESFIRECRYPTO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "des.h"
+#include "aes.h"
+
+#define DESFIRE_KEY_2K3DES  0
+#define DESFIRE_KEY_3K3DES  1
+#define DESFIRE_KEY_AES     2
+#define DESFIRE_AUTH_LEGACY -1    // the session of AUTHENTICATE_A
+
+typedef struct {
+	int type;
+	int block_size;           // 8 or 16
+	des_ctx_t des;
+	aes_ctx_t aes;
+	uint8_t k1[16];           // CMAC subkeys
+	uint8_t k2[16];
+} desfire_cipher_t;
+
+int desfire_key_length(int type);
+void desfire_cipher_setkey(desfire_cipher_t *cipher, int type, const uint8_t *key);
+
+// CBC in place on whole blocks, iv is updated for the next call
+void desfire_encipher(const desfire_cipher_t *cipher, uint8_t *data, size_t len, uint8_t *iv);
+void desfire_decipher(const desfire_cipher_t *cipher, uint8_t *data, size_t len, uint8_t *iv);
+
+// CMAC (NIST SP 800-38B) chained from iv instead of zero, as DESFire EV1
+// does; iv receives the whole MAC, the card sends its first 8 bytes.
+void desfire_cmac(const desfire_cipher_t *cipher, const uint8_t *data, size_t len, uint8_t *iv);
+
+// whole blocks of a CMAC that goes on, for data that is not in one piece;
+// desfire_cmac() finishes it with the rest
+void desfire_cmac_blocks(const desfire_cipher_t *cipher, const uint8_t *data, size_t blocks, uint8_t *iv);
+
+// the CRC32 of EV1 enciphered data: IEEE 802.3 without the final inversion
+uint32_t desfire_crc32(const uint8_t *data, size_t len, uint32_t crc);
+
+#endif
@@ -0,0 +1,1052 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire PICC simulation from a card image
+//
+// The card works on the image in place: reads answer straight from it,
+// writes, values and records change it, transactions commit into it.
+// Legacy (AUTHENTICATE_A) and EV1 (AUTHENTICATE_ISO, AUTHENTICATE_AES)
+// authentication with 2K3DES, 3K3DES and AES keys. Command data for
+// enciphered files is deciphered and its CRC checked; EV1 sessions MAC
+// every command and append a CMAC to every good answer, which otherwise
+// goes out plain whatever the communication settings of the file. The
+// image has a fixed layout, so commands that create, delete or change keys
+// are refused.
+//
+// In front of the card the ISO14443-4 half layer: RATS, PPS, CID, block
+// numbers, chaining both ways, R-block retransmission and S(DESELECT).
+// Blocks stay within DESFIRE_SIM_FRAME_MAX, so the ATS advertises no more
+// than that and native answer frames are chained over several blocks.
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+#include "iso14443crc.h"
+#include "desfiresim.h"
+
+// key settings
+#define FREE_LIST       0x02      // GET_APPLICATION_IDS, GET_FILE_IDS without a key
+
+// nibbles of the access rights
+#define ACCESS_FREE     0xe
+#define ACCESS_NEVER    0xf
+#define READ(f)         ((f)->access >> 12)
+#define WRITE(f)        ((f)->access >> 8 & 0xf)
+#define READ_WRITE(f)   ((f)->access >> 4 & 0xf)
+
+#define COMM_ENCIPHERED 3
+
+// PCB of ISO14443-4 blocks
+#define PCB_I           0x02
+#define PCB_R_ACK       0xa2
+#define PCB_R_NAK       0xb2
+#define PCB_DESELECT    0xc2
+#define PCB_CID         0x08
+#define PCB_NAD         0x04
+#define PCB_CHAINING    0x10
+#define RATS            0xe0
+#define PPS             0xd0
+
+static uint32_t get24(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16;
+}
+
+static int32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put(desfire_sim_t *sim, const void *data, int len)
+{
+	memcpy(sim->buf + sim->out_len, data, len);
+	sim->out_len += len;
+}
+
+static void put24(desfire_sim_t *sim, uint32_t value)
+{
+	uint8_t b[3] = {value, value >> 8, value >> 16};
+
+	put(sim, b, 3);
+}
+
+static void put32(desfire_sim_t *sim, uint32_t value)
+{
+	uint8_t b[4] = {value, value >> 8, value >> 16, value >> 24};
+
+	put(sim, b, 4);
+}
+
+static void append_crc(uint8_t *frame, int len)
+{
+	ComputeCrc14443(CRC_14443_A, frame, len, &frame[len], &frame[len + 1]);
+}
+
+static void rotate_left(uint8_t *out, const uint8_t *in, int len)
+{
+	memcpy(out, in + 1, len - 1);
+	out[len - 1] = in[0];
+}
+
+//-----------------------------------------------------------------------------
+// the image
+//-----------------------------------------------------------------------------
+
+static desfire_sim_header_t *header(const desfire_sim_t *sim)
+{
+	return (desfire_sim_header_t *)sim->image;
+}
+
+static desfire_sim_app_t *apps(const desfire_sim_t *sim)
+{
+	return (desfire_sim_app_t *)(sim->image + sizeof(desfire_sim_header_t));
+}
+
+static desfire_sim_file_t *files(const desfire_sim_t *sim)
+{
+	return (desfire_sim_file_t *)(apps(sim) + header(sim)->napps + 1);
+}
+
+static uint32_t file_bytes(const desfire_sim_file_t *f)
+{
+	return f->type >= DESFIRE_LINEAR_RECORD_FILE ? f->size * f->max_records : f->size;
+}
+
+// data bytes of a file in the image, its transaction copy included
+static uint32_t image_bytes(const desfire_sim_file_t *f)
+{
+	if (f->type == DESFIRE_VALUE_FILE)
+		return 0;
+	return f->type == DESFIRE_STANDARD_DATA_FILE ? f->size : 2 * file_bytes(f);
+}
+
+static int key_type(const desfire_sim_app_t *app)
+{
+	switch (app->num_keys & 0xc0) {
+		case 0x40: return DESFIRE_KEY_3K3DES;
+		case 0x80: return DESFIRE_KEY_AES;
+		default:   return DESFIRE_KEY_2K3DES;
+	}
+}
+
+static const uint8_t *app_key(const desfire_sim_t *sim, int slot)
+{
+	return sim->image + sim->app->keys + slot * 24;
+}
+
+static uint8_t *file_data(const desfire_sim_t *sim, const desfire_sim_file_t *f)
+{
+	return sim->image + f->data;
+}
+
+// the copy a transaction works on, the data itself for standard files
+static uint8_t *file_shadow(const desfire_sim_t *sim, const desfire_sim_file_t *f)
+{
+	return sim->image + f->data + (f->type == DESFIRE_STANDARD_DATA_FILE ? 0 : file_bytes(f));
+}
+
+static int check_image(const uint8_t *image, uint32_t size)
+{
+	const desfire_sim_header_t *h = (const desfire_sim_header_t *)image;
+	const desfire_sim_app_t *a;
+	const desfire_sim_file_t *f;
+	uint32_t tables;
+	int i, j;
+
+	if (size < sizeof(*h) || h->magic != DESFIRE_SIM_MAGIC || h->length > size)
+		return -1;
+	if (h->napps > DESFIRE_MAX_APPS || h->ats[0] < 1 || h->ats[0] > sizeof(h->ats))
+		return -1;
+	tables = sizeof(*h) + (h->napps + 1) * sizeof(*a) + h->nfiles * sizeof(*f);
+	if (tables > h->length)
+		return -1;
+
+	a = (const desfire_sim_app_t *)(image + sizeof(*h));
+	f = (const desfire_sim_file_t *)(a + h->napps + 1);
+	for (i = 0; i <= h->napps; i++, a++) {
+		if ((a->num_keys & 0xf) > DESFIRE_MAX_KEYS || a->nfiles > DESFIRE_MAX_FILES
+		    || a->first_file + a->nfiles > h->nfiles
+		    || a->keys + (a->num_keys & 0xf) * 24u > h->length)
+			return -1;
+		for (j = 0; j < a->nfiles; j++) {
+			const desfire_sim_file_t *file = &f[a->first_file + j];
+
+			if (file->id >= DESFIRE_MAX_FILES || file->type > DESFIRE_CYCLIC_RECORD_FILE
+			    || file->size > h->length || file->max_records > h->length
+			    || file->records > file->max_records
+			    || (file->type >= DESFIRE_LINEAR_RECORD_FILE && file->max_records == 0)
+			    || file->data > h->length || image_bytes(file) > h->length - file->data)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// the card
+//-----------------------------------------------------------------------------
+
+static void random_bytes(desfire_sim_t *sim, uint8_t *buf, int len)
+{
+	// xorshift32
+	while (len--) {
+		sim->random ^= sim->random << 13;
+		sim->random ^= sim->random >> 17;
+		sim->random ^= sim->random << 5;
+		*buf++ = sim->random;
+	}
+}
+
+static void abort_transaction(desfire_sim_t *sim)
+{
+	sim->dirty = 0;
+	sim->new_record = 0;
+}
+
+static void deselect(desfire_sim_t *sim)
+{
+	abort_transaction(sim);
+	sim->app = &apps(sim)[0];
+	sim->auth_key = -1;
+	sim->auth_pending = 0;
+	sim->out_len = sim->out_pos = sim->mac_len = 0;
+}
+
+// a file of the selected application, *bit its transaction bit
+static desfire_sim_file_t *get_file(desfire_sim_t *sim, int id, uint32_t *bit)
+{
+	desfire_sim_file_t *f = &files(sim)[sim->app->first_file];
+
+	for (int i = 0; i < sim->app->nfiles; i++)
+		if (f[i].id == id) {
+			if (bit)
+				*bit = 1u << i;
+			return &f[i];
+		}
+	return NULL;
+}
+
+// a file that takes part in transactions, ready to be changed
+static void touch(desfire_sim_t *sim, desfire_sim_file_t *f, uint32_t bit)
+{
+	if (sim->dirty & bit)
+		return;
+	if (f->type != DESFIRE_VALUE_FILE)
+		memcpy(file_shadow(sim, f), file_data(sim, f), file_bytes(f));
+	f->shadow_records = f->records;
+	f->shadow_value = f->value;
+	f->shadow_limited = f->limited;
+	sim->dirty |= bit;
+}
+
+// The status for an operation one of the keys in rights may do
+static int allowed(const desfire_sim_t *sim, const int *rights, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (rights[i] == ACCESS_FREE || (sim->auth_key >= 0 && rights[i] == sim->auth_key))
+			return OPERATION_OK;
+	for (i = 0; i < count; i++)
+		if (rights[i] != ACCESS_NEVER)
+			return sim->auth_key < 0 ? AUTHENTICATION_ERROR : PERMISSION_DENIED;
+	return PERMISSION_DENIED;
+}
+
+static int may_read(const desfire_sim_t *sim, const desfire_sim_file_t *f)
+{
+	int rights[] = {READ(f), READ_WRITE(f)};
+
+	return allowed(sim, rights, 2);
+}
+
+static int may_write(const desfire_sim_t *sim, const desfire_sim_file_t *f)
+{
+	int rights[] = {WRITE(f), READ_WRITE(f)};
+
+	return allowed(sim, rights, 2);
+}
+
+static int may_list(const desfire_sim_t *sim)
+{
+	return sim->app->key_settings & FREE_LIST || sim->auth_key == 0 ? OPERATION_OK : AUTHENTICATION_ERROR;
+}
+
+// the receiving end of the reader's legacy "send mode"
+static void legacy_decipher(const desfire_sim_t *sim, uint8_t *data, int len)
+{
+	uint8_t prev[8] = {0}, c[8];
+
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(c, data, 8);
+		des_encrypt_block(&sim->cipher.des, data);
+		for (int i = 0; i < 8; i++)
+			data[i] ^= prev[i];
+		memcpy(prev, c, 8);
+	}
+}
+
+/*
+ * The data of a command from offset on, plain_len bytes. If the file
+ * wants enciphered communication and a key is authenticated, it is
+ * deciphered and its CRC checked: CRC16 of the data for legacy sessions,
+ * CRC32 of the whole command for EV1.
+ */
+static int command_data(desfire_sim_t *sim, const desfire_sim_file_t *f, const uint8_t *cmd, int len, int offset, int plain_len, uint8_t *plain)
+{
+	uint8_t buf[DESFIRE_SIM_FRAME_DATA + 2], b1, b2;
+	int n = len - offset;
+	uint32_t crc;
+
+	if (f->comm != COMM_ENCIPHERED || sim->auth_key < 0) {
+		if (n != plain_len)
+			return LENGTH_ERROR;
+		memcpy(plain, cmd + offset, n);
+		return OPERATION_OK;
+	}
+
+	if (n <= 0 || n > (int)sizeof(buf))
+		return LENGTH_ERROR;
+	memcpy(buf, cmd + offset, n);
+
+	if (sim->auth_type == DESFIRE_AUTH_LEGACY) {
+		if (n % 8 || plain_len + 2 > n)
+			return LENGTH_ERROR;
+		legacy_decipher(sim, buf, n);
+		ComputeCrc14443(CRC_14443_A, buf, plain_len, &b1, &b2);
+		if (buf[plain_len] != b1 || buf[plain_len + 1] != b2)
+			return INTEGRITY_ERROR;
+	} else {
+		if (n % sim->cipher.block_size || plain_len + 4 > n)
+			return LENGTH_ERROR;
+		desfire_decipher(&sim->cipher, buf, n, sim->iv);
+		sim->deciphered = 1;
+		crc = desfire_crc32(cmd, offset, 0xffffffff);
+		crc = desfire_crc32(buf, plain_len, crc);
+		if ((uint32_t)get32(buf + plain_len) != crc)
+			return INTEGRITY_ERROR;
+	}
+	memcpy(plain, buf, plain_len);
+	return OPERATION_OK;
+}
+
+// in three frames like the card: hardware, software, UID and batch
+static int cmd_get_version(desfire_sim_t *sim)
+{
+	sim->out = header(sim)->version;
+	sim->out_len = sizeof(header(sim)->version);
+	sim->chunk = 7;
+	return OPERATION_OK;
+}
+
+static int cmd_get_application_ids(desfire_sim_t *sim)
+{
+	int res;
+
+	if (sim->app != &apps(sim)[0])
+		return PERMISSION_DENIED;
+	if ((res = may_list(sim)) != OPERATION_OK)
+		return res;
+	for (int i = 1; i <= header(sim)->napps; i++)
+		put24(sim, apps(sim)[i].aid);
+	return OPERATION_OK;
+}
+
+static int cmd_select_application(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	uint32_t aid = get24(cmd + 1);
+
+	deselect(sim);
+	for (int i = 0; i <= header(sim)->napps; i++)
+		if (apps(sim)[i].aid == aid) {
+			sim->app = &apps(sim)[i];
+			return OPERATION_OK;
+		}
+	return APPLICATION_NOT_FOUND;
+}
+
+static int cmd_get_file_ids(desfire_sim_t *sim)
+{
+	const desfire_sim_file_t *f = &files(sim)[sim->app->first_file];
+	int res;
+
+	if ((res = may_list(sim)) != OPERATION_OK)
+		return res;
+	for (int i = 0; i < sim->app->nfiles; i++)
+		put(sim, &f[i].id, 1);
+	return OPERATION_OK;
+}
+
+static int cmd_get_file_settings(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	const desfire_sim_file_t *f = get_file(sim, cmd[1], NULL);
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	put(sim, &f->type, 1);
+	put(sim, &f->comm, 1);
+	put(sim, &f->access, 2);
+	switch (f->type) {
+		case DESFIRE_STANDARD_DATA_FILE:
+		case DESFIRE_BACKUP_DATA_FILE:
+			put24(sim, f->size);
+			break;
+		case DESFIRE_VALUE_FILE:
+			put32(sim, f->lower);
+			put32(sim, f->upper);
+			put32(sim, f->limited);
+			put(sim, &f->limited_enabled, 1);
+			break;
+		default:
+			put24(sim, f->size);
+			put24(sim, f->max_records);
+			put24(sim, f->records);
+	}
+	return OPERATION_OK;
+}
+
+static int cmd_read_data(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	const desfire_sim_file_t *f = get_file(sim, cmd[1], NULL);
+	uint32_t offset = get24(cmd + 2), length = get24(cmd + 5);
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type > DESFIRE_BACKUP_DATA_FILE)
+		return PARAMETER_ERROR;
+	if ((res = may_read(sim, f)) != OPERATION_OK)
+		return res;
+	if (offset > f->size || (length && offset + length > f->size))
+		return BOUNDARY_ERROR;
+	sim->out = file_data(sim, f) + offset;
+	sim->out_len = length ? length : f->size - offset;
+	return OPERATION_OK;
+}
+
+static int cmd_write_data(desfire_sim_t *sim, const uint8_t *cmd, int len)
+{
+	uint32_t bit, offset = get24(cmd + 2), length = get24(cmd + 5);
+	desfire_sim_file_t *f = get_file(sim, cmd[1], &bit);
+	uint8_t data[DESFIRE_SIM_FRAME_DATA];
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type > DESFIRE_BACKUP_DATA_FILE)
+		return PARAMETER_ERROR;
+	if ((res = may_write(sim, f)) != OPERATION_OK)
+		return res;
+	if (length > sizeof(data))
+		return LENGTH_ERROR;
+	if (offset + length > f->size)
+		return BOUNDARY_ERROR;
+	if ((res = command_data(sim, f, cmd, len, 8, length, data)) != OPERATION_OK)
+		return res;
+
+	if (f->type == DESFIRE_BACKUP_DATA_FILE)
+		touch(sim, f, bit);
+	memcpy(file_shadow(sim, f) + offset, data, length);
+	return OPERATION_OK;
+}
+
+static int cmd_get_value(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	const desfire_sim_file_t *f = get_file(sim, cmd[1], NULL);
+	int rights[3];
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type != DESFIRE_VALUE_FILE)
+		return PARAMETER_ERROR;
+	rights[0] = READ(f);
+	rights[1] = WRITE(f);
+	rights[2] = READ_WRITE(f);
+	if ((res = allowed(sim, rights, 3)) != OPERATION_OK)
+		return res;
+	put32(sim, f->value);
+	return OPERATION_OK;
+}
+
+static int cmd_value(desfire_sim_t *sim, const uint8_t *cmd, int len)
+{
+	uint32_t bit;
+	desfire_sim_file_t *f = get_file(sim, cmd[1], &bit);
+	uint8_t data[4];
+	int32_t amount, value;
+	int rights[3], res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type != DESFIRE_VALUE_FILE)
+		return PARAMETER_ERROR;
+
+	rights[0] = READ_WRITE(f);
+	rights[1] = rights[2] = ACCESS_NEVER;
+	if (cmd[0] == DEBIT) {
+		rights[1] = READ(f);
+		rights[2] = WRITE(f);
+	} else if (cmd[0] == LIMITED_CREDIT) {
+		rights[1] = WRITE(f);
+	}
+	if ((res = allowed(sim, rights, 3)) != OPERATION_OK)
+		return res;
+	if ((res = command_data(sim, f, cmd, len, 2, 4, data)) != OPERATION_OK)
+		return res;
+	if ((amount = get32(data)) < 0)
+		return PARAMETER_ERROR;
+
+	touch(sim, f, bit);
+	value = f->shadow_value;
+	switch (cmd[0]) {
+		case CREDIT:
+			if (value > f->upper - amount)
+				return BOUNDARY_ERROR;
+			f->shadow_value = value + amount;
+			break;
+		case DEBIT:
+			if (value < f->lower + amount)
+				return BOUNDARY_ERROR;
+			f->shadow_value = value - amount;
+			f->shadow_limited += amount;
+			break;
+		default:
+			if (!f->limited_enabled || amount > f->shadow_limited)
+				return PERMISSION_DENIED;
+			f->shadow_value = value + amount;
+			f->shadow_limited -= amount;
+	}
+	return OPERATION_OK;
+}
+
+static int cmd_write_record(desfire_sim_t *sim, const uint8_t *cmd, int len)
+{
+	uint32_t bit, offset = get24(cmd + 2), length = get24(cmd + 5);
+	desfire_sim_file_t *f = get_file(sim, cmd[1], &bit);
+	uint8_t data[DESFIRE_SIM_FRAME_DATA], *shadow;
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type < DESFIRE_LINEAR_RECORD_FILE)
+		return PARAMETER_ERROR;
+	if ((res = may_write(sim, f)) != OPERATION_OK)
+		return res;
+	if (length > sizeof(data))
+		return LENGTH_ERROR;
+	if (offset + length > f->size)
+		return BOUNDARY_ERROR;
+	if ((res = command_data(sim, f, cmd, len, 8, length, data)) != OPERATION_OK)
+		return res;
+
+	// writes of one transaction all go to the same new record
+	touch(sim, f, bit);
+	shadow = file_shadow(sim, f);
+	if (!(sim->new_record & bit)) {
+		if (f->shadow_records == f->max_records) {
+			if (f->type == DESFIRE_LINEAR_RECORD_FILE)
+				return BOUNDARY_ERROR;
+			// the oldest record makes room, front to back
+			for (uint32_t i = 0; i < f->size * (f->max_records - 1); i++)
+				shadow[i] = shadow[i + f->size];
+			f->shadow_records--;
+		}
+		memset(shadow + f->size * f->shadow_records, 0, f->size);
+		f->shadow_records++;
+		sim->new_record |= bit;
+	}
+	memcpy(shadow + f->size * (f->shadow_records - 1) + offset, data, length);
+	return OPERATION_OK;
+}
+
+// count records (0: all) starting offset records back from the newest,
+// oldest first
+static int cmd_read_records(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	const desfire_sim_file_t *f = get_file(sim, cmd[1], NULL);
+	uint32_t offset = get24(cmd + 2), count = get24(cmd + 5), last;
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type < DESFIRE_LINEAR_RECORD_FILE)
+		return PARAMETER_ERROR;
+	if ((res = may_read(sim, f)) != OPERATION_OK)
+		return res;
+	if (offset >= f->records)
+		return BOUNDARY_ERROR;
+	last = f->records - offset;
+	if (count == 0)
+		count = last;
+	if (count > last)
+		return BOUNDARY_ERROR;
+	sim->out = file_data(sim, f) + f->size * (last - count);
+	sim->out_len = f->size * count;
+	return OPERATION_OK;
+}
+
+static int cmd_clear_record_file(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	uint32_t bit;
+	desfire_sim_file_t *f = get_file(sim, cmd[1], &bit);
+	int rights[1];
+	int res;
+
+	if (f == NULL)
+		return FILE_NOT_FOUND;
+	if (f->type < DESFIRE_LINEAR_RECORD_FILE)
+		return PARAMETER_ERROR;
+	rights[0] = READ_WRITE(f);
+	if ((res = allowed(sim, rights, 1)) != OPERATION_OK)
+		return res;
+	touch(sim, f, bit);
+	f->shadow_records = 0;
+	sim->new_record &= ~bit;
+	return OPERATION_OK;
+}
+
+static int cmd_commit_transaction(desfire_sim_t *sim)
+{
+	desfire_sim_file_t *f = &files(sim)[sim->app->first_file];
+
+	for (int i = 0; i < sim->app->nfiles; i++, f++) {
+		if (!(sim->dirty & 1u << i))
+			continue;
+		if (f->type != DESFIRE_VALUE_FILE)
+			memcpy(file_data(sim, f), file_shadow(sim, f), file_bytes(f));
+		f->records = f->shadow_records;
+		f->value = f->shadow_value;
+		f->limited = f->shadow_limited;
+	}
+	abort_transaction(sim);
+	return OPERATION_OK;
+}
+
+static int cmd_get_key_settings(desfire_sim_t *sim)
+{
+	put(sim, &sim->app->key_settings, 1);
+	put(sim, &sim->app->num_keys, 1);
+	return OPERATION_OK;
+}
+
+static int cmd_get_key_version(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	if (cmd[1] >= (sim->app->num_keys & 0xf))
+		return NO_SUCH_KEY;
+	put(sim, &sim->app->key_versions[cmd[1]], 1);
+	return OPERATION_OK;
+}
+
+// A 2K3DES key with equal halves. Legacy authentication compares them as
+// they are, EV1 leaves out the parity (key version) bits.
+static int single_des(const uint8_t *key, int legacy)
+{
+	for (int i = 0; i < 8; i++)
+		if ((key[i] ^ key[i + 8]) & (legacy ? 0xff : 0xfe))
+			return 0;
+	return 1;
+}
+
+// the first frame of an authentication: the card's nonce, enciphered
+static int auth_start(desfire_sim_t *sim, const uint8_t *cmd)
+{
+	int slot = cmd[1], type = key_type(sim->app);
+	int n = type == DESFIRE_KEY_2K3DES ? 8 : 16;
+	uint8_t rnd_b[16];
+
+	sim->auth_key = -1;
+	if (slot >= (sim->app->num_keys & 0xf))
+		return NO_SUCH_KEY;
+	if ((cmd[0] == AUTHENTICATE_A && type != DESFIRE_KEY_2K3DES)
+	    || (cmd[0] == AUTHENTICATE_ISO && type == DESFIRE_KEY_AES)
+	    || (cmd[0] == AUTHENTICATE_AES && type != DESFIRE_KEY_AES))
+		return AUTHENTICATION_ERROR;
+
+	desfire_cipher_setkey(&sim->auth_cipher, type, app_key(sim, slot));
+	memset(sim->auth_iv, 0, sizeof(sim->auth_iv));
+	random_bytes(sim, sim->rnd_b, n);
+	memcpy(rnd_b, sim->rnd_b, n);
+	if (cmd[0] == AUTHENTICATE_A)
+		des_encrypt_block(&sim->auth_cipher.des, rnd_b);
+	else
+		desfire_encipher(&sim->auth_cipher, rnd_b, n, sim->auth_iv);
+	put(sim, rnd_b, n);
+
+	sim->auth_pending = 1;
+	sim->auth_slot = slot;
+	sim->auth_step_type = cmd[0] == AUTHENTICATE_A ? DESFIRE_AUTH_LEGACY : type;
+	return ADDITIONAL_FRAME;
+}
+
+// the second one: check RndB' from the reader, prove the key with RndA'
+static int auth_finish(desfire_sim_t *sim, const uint8_t *cmd, int len)
+{
+	int type = sim->auth_step_type, legacy = type == DESFIRE_AUTH_LEGACY;
+	int n = type == DESFIRE_KEY_2K3DES || legacy ? 8 : 16;
+	uint8_t buf[32], rotated[16], session_key[24];
+
+	sim->auth_pending = 0;
+	if (len != 1 + 2 * n)
+		return LENGTH_ERROR;
+	memcpy(buf, cmd + 1, 2 * n);
+
+	if (legacy) {
+		// the reader deciphered, so encipher to undo it
+		des_encrypt_block(&sim->auth_cipher.des, buf + 8);
+		for (int i = 0; i < 8; i++)
+			buf[8 + i] ^= cmd[1 + i];
+		des_encrypt_block(&sim->auth_cipher.des, buf);
+	} else {
+		desfire_decipher(&sim->auth_cipher, buf, 2 * n, sim->auth_iv);
+	}
+	rotate_left(rotated, sim->rnd_b, n);
+	if (memcmp(buf + n, rotated, n))
+		return AUTHENTICATION_ERROR;
+
+	rotate_left(rotated, buf, n);
+	if (legacy)
+		des_encrypt_block(&sim->auth_cipher.des, rotated);
+	else
+		desfire_encipher(&sim->auth_cipher, rotated, n, sim->auth_iv);
+	put(sim, rotated, n);
+
+	// RndA is in buf, RndB in sim->rnd_b
+	memcpy(session_key, buf, 4);
+	memcpy(session_key + 4, sim->rnd_b, 4);
+	if (type == DESFIRE_KEY_AES) {
+		memcpy(session_key + 8, buf + 12, 4);
+		memcpy(session_key + 12, sim->rnd_b + 12, 4);
+	} else if (type == DESFIRE_KEY_3K3DES) {
+		memcpy(session_key + 8, buf + 6, 4);
+		memcpy(session_key + 12, sim->rnd_b + 6, 4);
+		memcpy(session_key + 16, buf + 12, 4);
+		memcpy(session_key + 20, sim->rnd_b + 12, 4);
+	} else if (single_des(app_key(sim, sim->auth_slot), legacy)) {
+		memcpy(session_key + 8, session_key, 8);
+	} else {
+		memcpy(session_key + 8, buf + 4, 4);
+		memcpy(session_key + 12, sim->rnd_b + 4, 4);
+	}
+
+	if (legacy) {
+		sim->cipher.des.valid = 0;
+		des_setkey(&sim->cipher.des, session_key, 16);
+	} else {
+		desfire_cipher_setkey(&sim->cipher, type, session_key);
+		memset(sim->iv, 0, sizeof(sim->iv));
+	}
+	sim->auth_key = sim->auth_slot;
+	sim->auth_type = type;
+	return OPERATION_OK;
+}
+
+// the length of a command from its layout, 0 for commands with data of
+// their own, -1 for unknown ones
+static int command_length(uint8_t code)
+{
+	for (int i = 0; i < DESFIRE_COMMAND_COUNT; i++) {
+		const desfire_command_t *c = &desfire_commands[i];
+		int len = 1;
+
+		if (c->code != code)
+			continue;
+		if (c->encrypt)
+			return 0;
+		for (uint32_t layout = c->layout; layout; layout >>= 4)
+			len += layout & 0xf;
+		return len;
+	}
+	return -1;
+}
+
+static int run_command(desfire_sim_t *sim, const uint8_t *cmd, int len)
+{
+	int expected = command_length(cmd[0]);
+
+	if (expected < 0)
+		return ILLEGAL_COMMAND_CODE;
+	if (len < (expected ? expected : 2) || (expected && len != expected))
+		return LENGTH_ERROR;
+
+	switch (cmd[0]) {
+		case GET_VERSION:               return cmd_get_version(sim);
+		case GET_APPLICATION_IDS:       return cmd_get_application_ids(sim);
+		case SELECT_APPLICATION:        return cmd_select_application(sim, cmd);
+		case GET_FILE_IDS:              return cmd_get_file_ids(sim);
+		case GET_FILE_SETTINGS:         return cmd_get_file_settings(sim, cmd);
+		case READ_DATA:                 return cmd_read_data(sim, cmd);
+		case WRITE_DATA:                return len < 8 ? LENGTH_ERROR : cmd_write_data(sim, cmd, len);
+		case GET_VALUE:                 return cmd_get_value(sim, cmd);
+		case CREDIT:
+		case DEBIT:
+		case LIMITED_CREDIT:            return cmd_value(sim, cmd, len);
+		case WRITE_RECORD:              return len < 8 ? LENGTH_ERROR : cmd_write_record(sim, cmd, len);
+		case READ_RECORDS:              return cmd_read_records(sim, cmd);
+		case CLEAR_RECORD_FILE:         return cmd_clear_record_file(sim, cmd);
+		case COMMIT_TRANSACTION:        return cmd_commit_transaction(sim);
+		case ABORT_TRANSACTION:         abort_transaction(sim); return OPERATION_OK;
+		case AUTHENTICATE_A:
+		case AUTHENTICATE_ISO:
+		case AUTHENTICATE_AES:          return auth_start(sim, cmd);
+		case GET_KEY_SETTINGS:          return cmd_get_key_settings(sim);
+		case GET_KEY_VERSION:           return cmd_get_key_version(sim, cmd);
+		default:                        return PERMISSION_DENIED;
+	}
+}
+
+// The CMAC of an EV1 answer over its data and status. The data may be in
+// the image, so the blocks but the last one are taken from there.
+static void answer_cmac(desfire_sim_t *sim)
+{
+	uint32_t size = sim->cipher.block_size, blocks = sim->out_len / size;
+	uint32_t rest = sim->out_len - blocks * size;
+	uint8_t last[16];
+
+	desfire_cmac_blocks(&sim->cipher, sim->out, blocks, sim->iv);
+	memcpy(last, sim->out + blocks * size, rest);
+	last[rest] = sim->status;
+	desfire_cmac(&sim->cipher, last, rest + 1, sim->iv);
+	memcpy(sim->mac, sim->iv, 8);
+	sim->mac_len = 8;
+}
+
+// The next frame of the answer: status, then chunk bytes. A last frame
+// may take up to twice as many and the CMAC, as the one of GET_VERSION does.
+static int next_frame(desfire_sim_t *sim, uint8_t *frame)
+{
+	uint32_t total = sim->out_len + sim->mac_len, n = total - sim->out_pos, data;
+
+	if (n > sim->chunk && (n > 2u * sim->chunk + sim->mac_len || n > DESFIRE_SIM_FRAME_DATA))
+		n = sim->chunk;
+	data = sim->out_pos < sim->out_len ? sim->out_len - sim->out_pos : 0;
+	if (data > n)
+		data = n;
+	memcpy(frame + 1, sim->out + sim->out_pos, data);
+	if (n > data)
+		memcpy(frame + 1 + data, sim->mac + sim->out_pos + data - sim->out_len, n - data);
+	sim->out_pos += n;
+	frame[0] = sim->out_pos < total ? ADDITIONAL_FRAME : sim->status;
+	return 1 + n;
+}
+
+int desfire_sim_native(desfire_sim_t *sim, const uint8_t *cmd, int len, uint8_t *frame)
+{
+	if (len < 1)
+		return 0;
+	if (cmd[0] == ADDITIONAL_FRAME && !sim->auth_pending) {
+		if (sim->out_pos < sim->out_len + sim->mac_len)
+			return next_frame(sim, frame);
+		frame[0] = ILLEGAL_COMMAND_CODE;
+		return 1;
+	}
+
+	sim->commands++;
+	sim->out = sim->buf;
+	sim->out_len = sim->out_pos = sim->mac_len = 0;
+	sim->chunk = DESFIRE_SIM_FRAME_DATA;
+	sim->deciphered = 0;
+	if (cmd[0] == ADDITIONAL_FRAME)
+		sim->status = auth_finish(sim, cmd, len);
+	else
+		sim->status = run_command(sim, cmd, len);
+
+	if (sim->status != OPERATION_OK && sim->status != ADDITIONAL_FRAME) {
+		sim->auth_key = -1;
+		sim->out_len = 0;
+	} else if (sim->auth_key >= 0 && sim->auth_type != DESFIRE_AUTH_LEGACY
+	           && cmd[0] != ADDITIONAL_FRAME) {
+		if (!sim->deciphered)
+			desfire_cmac(&sim->cipher, cmd, len, sim->iv);
+		answer_cmac(sim);
+	}
+	return next_frame(sim, frame);
+}
+
+//-----------------------------------------------------------------------------
+// ISO14443-4
+//-----------------------------------------------------------------------------
+
+int desfire_sim_init(desfire_sim_t *sim, uint8_t *image, uint32_t size, uint32_t seed)
+{
+	if (check_image(image, size))
+		return -1;
+	memset(sim, 0, sizeof(*sim));
+	sim->image = image;
+	sim->random = seed ? seed : 0x2545f491;
+	desfire_sim_halt(sim);
+	return 0;
+}
+
+void desfire_sim_halt(desfire_sim_t *sim)
+{
+	deselect(sim);
+	sim->active = 0;
+	sim->cid = -1;
+	sim->chain_len = 0;
+	sim->answer_len = sim->answer_pos = 0;
+	sim->last_len = 0;
+}
+
+// the ATS of the image, its FSCI lowered to what the card takes
+static int ats(const desfire_sim_t *sim, uint8_t *out)
+{
+	const uint8_t *a = header(sim)->ats;
+
+	memcpy(out, a, a[0]);
+	if (a[0] > 1 && (a[1] & 0xf) > DESFIRE_SIM_FSCI)
+		out[1] = (a[1] & 0xf0) | DESFIRE_SIM_FSCI;
+	return a[0];
+}
+
+// an answer block: PCB, the CID if the reader sent one, inf, CRC
+static int block(desfire_sim_t *sim, uint8_t pcb, const uint8_t *inf, int inf_len, uint8_t *out, int with_cid)
+{
+	int len = 0;
+
+	if (with_cid)
+		pcb |= PCB_CID;
+	out[len++] = pcb;
+	if (with_cid)
+		out[len++] = sim->cid;
+	memcpy(out + len, inf, inf_len);
+	len += inf_len;
+	append_crc(out, len);
+	len += 2;
+
+	memcpy(sim->last, out, len);
+	sim->last_len = len;
+	return len;
+}
+
+// the next piece of the native answer, chained if more follows
+static int answer_block(desfire_sim_t *sim, int blocknum, uint8_t *out, int with_cid)
+{
+	int room = DESFIRE_SIM_FRAME_MAX - 3 - (with_cid ? 1 : 0);
+	int n = sim->answer_len - sim->answer_pos;
+	uint8_t pcb = PCB_I | blocknum;
+
+	if (n > room) {
+		n = room;
+		pcb |= PCB_CHAINING;
+	}
+	sim->answer_pos += n;
+	return block(sim, pcb, sim->answer + sim->answer_pos - n, n, out, with_cid);
+}
+
+int desfire_sim_frame(desfire_sim_t *sim, const uint8_t *in, int len, uint8_t *out)
+{
+	uint8_t b1, b2;
+	uint8_t pcb = in[0];
+	int with_cid, pos, n;
+
+	if (len < 3)
+		return 0;
+	ComputeCrc14443(CRC_14443_A, in, len - 2, &b1, &b2);
+	if (in[len - 2] != b1 || in[len - 1] != b2)
+		return 0;
+	len -= 2;
+
+	if (!sim->active) {
+		if (pcb != RATS || len != 2)
+			return 0;
+		sim->active = 1;
+		sim->cid = in[1] & 0xf;
+		n = ats(sim, out);
+		append_crc(out, n);
+		return n + 2;
+	}
+
+	if ((pcb & 0xf0) == PPS && len == 3 && (pcb & 0xf) == sim->cid) {
+		out[0] = pcb;
+		append_crc(out, 1);
+		return 3;
+	}
+
+	// blocks with a CID are for us if it is ours, those without if ours is 0
+	with_cid = pcb & PCB_CID;
+	if (with_cid ? len < 2 || (in[1] & 0xf) != sim->cid : sim->cid != 0)
+		return 0;
+	pos = with_cid ? 2 : 1;
+
+	if ((pcb & 0xe2) == PCB_I) {
+		if (pcb & PCB_NAD)
+			pos++;
+		if ((n = len - pos) < 0)
+			return 0;
+		sim->answer_len = sim->answer_pos = 0;
+		if (sim->chain_len >= 0 && sim->chain_len + n <= (int)sizeof(sim->chain)) {
+			memcpy(sim->chain + sim->chain_len, in + pos, n);
+			sim->chain_len += n;
+		} else {
+			sim->chain_len = -1;
+		}
+		if (pcb & PCB_CHAINING)
+			return block(sim, PCB_R_ACK | (pcb & 1), NULL, 0, out, with_cid);
+
+		if (sim->chain_len < 0) {
+			sim->answer[0] = LENGTH_ERROR;
+			sim->answer_len = 1;
+		} else {
+			sim->answer_len = desfire_sim_native(sim, sim->chain, sim->chain_len, sim->answer);
+		}
+		sim->chain_len = 0;
+		return answer_block(sim, pcb & 1, out, with_cid);
+	}
+
+	if ((pcb & 0xe6) == PCB_R_ACK) {
+		// the reader missed our last block: once more, else an ACK asks
+		// for the next block of a chained answer and a NAK is answered
+		// with an ACK
+		if (sim->last_len && (pcb & 1) == (sim->last[0] & 1)) {
+			memcpy(out, sim->last, sim->last_len);
+			return sim->last_len;
+		}
+		if ((pcb & 0xf6) == PCB_R_ACK && sim->answer_pos < sim->answer_len)
+			return answer_block(sim, pcb & 1, out, with_cid);
+		if ((pcb & 0xf6) == PCB_R_NAK)
+			return block(sim, PCB_R_ACK | (sim->last[0] & 1), NULL, 0, out, with_cid);
+		return 0;
+	}
+
+	if ((pcb & 0xf7) == PCB_DESELECT) {
+		n = block(sim, PCB_DESELECT, NULL, 0, out, with_cid);
+		desfire_sim_halt(sim);
+		return n;
+	}
+	return 0;
+}
+
+int desfire_sim_static(const desfire_sim_t *sim, int index, uint8_t *frame)
+{
+	const desfire_sim_header_t *h = header(sim);
+	int len;
+
+	switch (index) {
+		case 0:
+			len = ats(sim, frame);
+			break;
+		case 1:
+			frame[0] = PCB_DESELECT;
+			len = 1;
+			break;
+		case 2:
+		case 3:
+			frame[0] = PCB_R_ACK | (index & 1);
+			len = 1;
+			break;
+		case 4: case 5: case 6:
+		case 7: case 8: case 9:
+			// GET_VERSION: hardware, software, then UID and batch
+			frame[0] = PCB_I | (index & 1);
+			frame[1] = index < 8 ? ADDITIONAL_FRAME : OPERATION_OK;
+			memcpy(frame + 2, h->version + (index - 4) / 2 * 7, index < 8 ? 7 : 14);
+			len = index < 8 ? 9 : 16;
+			break;
+		default:
+			return 0;
+	}
+	append_crc(frame, len);
+	return len + 2;
+}
@@ -0,0 +1,136 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE DESFire PICC simulation from a card image, shared by the client and
+// the firmware
+//-----------------------------------------------------------------------------
+
+#ifndef DESFIRESIM_H__
+#define DESFIRESIM_H__
+
+#include <stdint.h>
+#include "desfire.h"
+#include "desfirecrypto.h"
+
+#define DESFIRE_SIM_MAGIC       0x31534644    // "DFS1"
+#define DESFIRE_SIM_FRAME_DATA  59            // payload of a native answer frame
+#define DESFIRE_SIM_FRAME_MAX   32            // a block either way, CRC included
+#define DESFIRE_SIM_FSCI        2             // ... as the ATS advertises it
+#define DESFIRE_SIM_BUF         96            // answers not read from the image
+#define DESFIRE_SIM_IMAGE_MAX   24576         // the most the firmware holds
+
+/*
+ * The image: a header, the applications (the PICC level first), the files
+ * of all applications in the order of the applications, then keys and file
+ * data the tables point to by offset. All little endian, every table
+ * 4 byte aligned, so client and firmware share the layout.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t length;          // bytes of the whole image
+	uint8_t uid[7];
+	uint8_t napps;            // applications besides the PICC level
+	uint8_t ats[16];          // TL first, without CRC
+	uint8_t version[28];      // the GET_VERSION answer
+	uint16_t nfiles;
+	uint16_t reserved;
+} desfire_sim_header_t;
+
+typedef struct {
+	uint32_t aid;             // 0 for the PICC level
+	uint8_t key_settings;
+	uint8_t num_keys;         // key count, the key type in bits 6 and 7
+	uint8_t nfiles;
+	uint8_t first_file;       // its files in the file table
+	uint8_t key_versions[DESFIRE_MAX_KEYS];
+	uint16_t keys;            // offset of num_keys 24 byte keys
+} desfire_sim_app_t;
+
+/*
+ * Backup data and record files keep a second copy of their data right
+ * behind the first, the one a transaction builds; values, records and the
+ * limited credit have theirs in the table.
+ */
+typedef struct {
+	uint8_t id;
+	uint8_t type;             // DESFIRE_*_FILE
+	uint8_t comm;
+	uint8_t limited_enabled;
+	uint16_t access;          // read, write, read&write, change key nibbles
+	uint16_t reserved;
+	uint32_t size;            // bytes of a data file or of a record
+	uint32_t max_records;
+	int32_t lower, upper;
+	uint32_t data;            // offset of the data
+	uint32_t records, shadow_records;
+	int32_t value, shadow_value;
+	int32_t limited, shadow_limited;
+} desfire_sim_file_t;
+
+// the card's volatile state around an image
+typedef struct {
+	uint8_t *image;
+	desfire_sim_app_t *app;   // selected
+	int auth_key;             // -1 if none
+	int auth_type;            // DESFIRE_AUTH_LEGACY or a DESFIRE_KEY_ type
+	desfire_cipher_t cipher;  // the session key
+	uint8_t iv[16];           // of EV1 sessions
+	int deciphered;           // the command data went through the IV
+	uint32_t dirty;           // files of app in the transaction
+	uint32_t new_record;      // ... that started a record in it
+
+	// an authentication waiting for its second frame
+	int auth_pending, auth_slot, auth_step_type;
+	desfire_cipher_t auth_cipher;
+	uint8_t auth_iv[16], rnd_b[16];
+	uint32_t random;
+
+	// the answer: read from the image or built in buf, in EV1 sessions
+	// its CMAC behind it; out_pos counts both
+	const uint8_t *out;
+	uint32_t out_len, out_pos;
+	uint8_t mac[8];
+	uint32_t mac_len;
+	uint32_t chunk;           // payload per frame
+	uint8_t buf[DESFIRE_SIM_BUF];
+	uint8_t status;
+
+	// ISO14443-4
+	int active;               // RATS answered
+	int cid;                  // -1: none
+	uint8_t chain[DESFIRE_SIM_FRAME_DATA + 1];
+	int chain_len;            // reader chaining, -1 after an overflow
+	uint8_t answer[DESFIRE_SIM_FRAME_DATA + 1];
+	int answer_len, answer_pos; // a native frame going out in chained blocks
+	uint8_t last[DESFIRE_SIM_FRAME_MAX];
+	int last_len;
+
+	uint32_t commands;
+} desfire_sim_t;
+
+// Check the image and start on it, returns 0 or -1 if it is no image.
+// seed starts the nonces of authentication.
+int desfire_sim_init(desfire_sim_t *sim, uint8_t *image, uint32_t size, uint32_t seed);
+
+// Field lost, HLTA or S(DESELECT): back to ISO14443-3, the transaction aborted.
+void desfire_sim_halt(desfire_sim_t *sim);
+
+// One native command, its answer frame to frame: status, then up to
+// DESFIRE_SIM_FRAME_DATA bytes. Returns the frame length.
+int desfire_sim_native(desfire_sim_t *sim, const uint8_t *cmd, int len, uint8_t *frame);
+
+// A frame after anticollision, CRC included: RATS, PPS, I-, R- and S-blocks.
+// Writes the answer with its CRC to out, returns its length or 0 for none.
+// No block either way is longer than DESFIRE_SIM_FRAME_MAX: the ATS caps
+// the reader's frames, longer answers go out chained.
+int desfire_sim_frame(desfire_sim_t *sim, const uint8_t *in, int len, uint8_t *out);
+
+// Answer frames that depend on the image only, for the firmware to modulate
+// in advance: the ATS, S(DESELECT), R(ACK) and the GET_VERSION frames with
+// either block number. Writes the index-th one with its CRC, returns its
+// length or 0 after the last.
+int desfire_sim_static(const desfire_sim_t *sim, int index, uint8_t *frame);
+
+#endif
@@ -32,7 +32,112 @@ typedef enum ISO14A_COMMAND {
 	ISO14A_RAW = 8,
 	ISO14A_REQUEST_TRIGGER = 0x10,
 	ISO14A_APPEND_CRC = 0x20,
-	ISO14A_SET_TIMEOUT = 0x40
+	ISO14A_SET_TIMEOUT = 0x40,
+	ISO14A_ACTIVATE = 0x80
 } iso14a_command_t;
 
+// CMD_READER_ISO_14443a_APDUS stores arg[1] (at most 48) bytes at offset
+// arg[0] of the APDU queue, each APDU a 16 bit little endian length and its
+// bytes. With ISO14A_APDU in the iso14a_command_t flags in the upper half of
+// arg[2] the device then runs the first arg[2] & 0xfff APDUs of the queue
+// (after a select with RATS if ISO14A_CONNECT is set, else on the card with
+// CID arg[2] >> 12 & 0xf) and answers with the
+// count of APDUs answered, the bytes of answers and 0 or an ISO14A_APDU_*
+// error, plus the first 48 bytes of the answers. These are laid out like the
+// queue at ISO14A_APDU_ANSWERS in BigBuf.
+#define ISO14A_APDU_QUEUE          12288
+#define ISO14A_APDU_QUEUE_SIZE     12288
+#define ISO14A_APDU_ANSWERS        24576
+#define ISO14A_APDU_ANSWERS_SIZE   12288
+
+#define ISO14A_APDU_LINK_ERROR     -1  // no valid frame after the retries
+#define ISO14A_APDU_PROTOCOL_ERROR -2  // a block out of turn
+#define ISO14A_APDU_OVERFLOW       -3  // no room for the answer
+#define ISO14A_APDU_NO_CARD        -4  // no ISO14443-4 card selected
+
+// CMD_READER_ISO_14443a_INVENTORY lists every card in the field, at most
+// arg[1], as iso14a_inventory_t at ISO14A_INVENTORY in BigBuf. With
+// ISO14A_ACTIVATE in the iso14a_command_t flags of arg[0] the ISO14443-4
+// cards among them get RATS with the CIDs from 0 on and the field stays on,
+// for CMD_READER_ISO_14443a_APDUS to address them. The answer holds the
+// count of cards, of cards activated and the milliseconds taken, plus the
+// first 48 bytes of the list.
+#define ISO14A_INVENTORY           24576
+#define ISO14A_INVENTORY_MAX       64
+#define ISO14A_MAX_CID             15
+
+typedef struct {
+	uint8_t uid[10];
+	uint8_t uid_len;
+	uint8_t atqa[2];           // as the cards in the field answered together
+	uint8_t sak;
+	uint8_t cid;               // 0xff if not activated
+	uint8_t ats_len;
+} __attribute__((__packed__)) iso14a_inventory_t;
+
+//-----------------------------------------------------------------------------
+// MIFARE Classic
+//-----------------------------------------------------------------------------
+// The card emulator memory, CARD_MEMORY_LEN bytes block by block at
+// CARD_MEMORY in BigBuf. CMD_MIFARE_EML_MEMSET_BULK stores the arg[1] (at
+// most 48) bytes of the packet at byte arg[0] of it. With MF_EML_CRC in
+// arg[2] the device then answers with the CRC16 (update_crc16() from 0xffff)
+// of its first arg[2] & 0xffff bytes.
+#define CARD_MEMORY          6000
+#define CARD_MEMORY_LEN      4096
+#define MF_EML_CRC           0x01000000
+
+// CMD_MIFARE_CHKKEYS_FAST stores the arg[1] (at most 8) keys of the packet
+// from key arg[0] on in the dictionary at MF_CHK_KEYS in BigBuf. With
+// MF_CHK_RUN in arg[2] the device then tries the first arg[2] & 0xffff keys
+// of it on the first arg[2] >> 16 & 0xff sectors, key A with MF_CHK_KEY_A,
+// key B with MF_CHK_KEY_B. The keys found go to the table at MF_CHK_TABLE,
+// key A and B sector by sector; MF_CHK_CLEAR empties it first, else keys in
+// it are not looked for again. The answer holds an MF_CHK_* status, the
+// authentications tried and the milliseconds taken.
+#define MF_CHK_KEYS          12288
+#define MF_CHK_MAX_KEYS      2048
+#define MF_CHK_TABLE         24576
+#define MF_CHK_MAX_SECTORS   40
+
+#define MF_CHK_RUN           0x01000000
+#define MF_CHK_KEY_A         0x02000000
+#define MF_CHK_KEY_B         0x04000000
+#define MF_CHK_CLEAR         0x08000000
+
+#define MF_CHK_OK            0
+#define MF_CHK_NO_CARD       1  // not there or lost on the way
+#define MF_CHK_ABORTED       2  // by the button
+
+typedef struct {
+	uint8_t found;
+	uint8_t reserved;
+	uint8_t key[6];
+} mf_chk_key_t;
+
+// CMD_MIFARE_DUMP stores the arg[1] (at most 48) bytes of the packet at byte
+// arg[0] of the key table at MF_CHK_TABLE, the one CMD_MIFARE_CHKKEYS_FAST
+// leaves. With MF_DUMP_RUN in arg[2] the device then reads the first
+// arg[2] & 0xff sectors, each in one authenticated session, to MF_DUMP_DATA
+// block by block. The answer holds an MF_CHK_* status, the sectors and the
+// milliseconds taken, and an MF_DUMP_SECTOR_* per sector.
+#define MF_DUMP_DATA         12288
+#define MF_DUMP_RUN          0x01000000
+
+#define MF_DUMP_SECTOR_NONE     0  // no key opened it
+#define MF_DUMP_SECTOR_PARTIAL  1  // blocks the keys may not read are zero
+#define MF_DUMP_SECTOR_ALL      2
+
+// CMD_MIFARE_CLONE_MAGIC writes the first arg[0] blocks (0 for 64) of the
+// card emulator memory to a "magic Chinese" card in one backdoor session
+// (0x40, 0x43), with MF_CLONE_WIPE in arg[1] after wiping it (0x41), and
+// reads them all back in the same session. The answer holds an MF_CHK_* or
+// MF_CLONE_* status, the blocks done or the block it failed at, and the
+// milliseconds of the writes in the lower, of the read back in the upper 16
+// bits, plus the block read back on a mismatch.
+#define MF_CLONE_WIPE        0x01
+
+#define MF_CLONE_WRITE_ERROR 3  // a block refused in two sessions
+#define MF_CLONE_MISMATCH    4  // a block read back differs
+
 #endif
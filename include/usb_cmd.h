@@ -71,6 +71,8 @@ typedef struct {
 #define CMD_INDALA_CLONE_TAG                                              0x0212
 // for 224 bits UID
 #define CMD_INDALA_CLONE_TAG_L                                            0x0213
+#define CMD_EM410X_DEMOD                                                  0x0214
+#define CMD_EM410X_DEMODED_ID                                             0x0215
 
 /* CMD_SET_ADC_MUX: ext1 is 0 for lopkd, 1 for loraw, 2 for hipkd, 3 for hiraw */
 
@@ -98,10 +100,12 @@ typedef struct {
 #define CMD_SNOOP_ISO_14443a                                              0x0383
 #define CMD_SIMULATE_TAG_ISO_14443a                                       0x0384
 #define CMD_READER_ISO_14443a                                             0x0385
+#define CMD_READER_ISO_14443a_APDUS                                       0x0386
 #define CMD_SIMULATE_TAG_LEGIC_RF                                         0x0387
 #define CMD_READER_LEGIC_RF                                               0x0388
 #define CMD_WRITER_LEGIC_RF                                               0x0389
 #define CMD_EPA_PACE_COLLECT_NONCE                                        0x038A
+#define CMD_READER_ISO_14443a_INVENTORY                                   0x038B
 
 #define CMD_SNOOP_ICLASS                                                  0x0392
 #define CMD_SIMULATE_TAG_ICLASS                                           0x0393
@@ -124,6 +128,8 @@ typedef struct {
 #define CMD_MIFARE_EML_CARDLOAD                                           0x0604
 #define CMD_MIFARE_EML_CSETBLOCK                                          0x0605
 #define CMD_MIFARE_EML_CGETBLOCK                                          0x0606
+#define CMD_MIFARE_EML_MEMSET_BULK                                        0x0607
+#define CMD_MIFARE_CLONE_MAGIC                                            0x0608
 
 #define CMD_SIMULATE_MIFARE_CARD                                          0x0610
 
@@ -134,11 +140,17 @@ typedef struct {
 #define CMD_MIFARE_READSC                                                 0x0621
 #define CMD_MIFARE_WRITEBL                                                0x0622
 #define CMD_MIFARE_CHKKEYS                                                0x0623
+#define CMD_MIFARE_CHKKEYS_FAST                                           0x0624
+#define CMD_MIFARE_DUMP                                                   0x0625
 
 #define CMD_MIFARE_SNIFFER                                                0x0630
+#define CMD_MIFARE_SNIFF_DATA                                             0x0631
 
 // For mifare desfire
 #define CMD_MIFARE_DES_READER                                             0x0640
+#define CMD_MIFARE_DES_CHKKEYS                                            0x0641
+#define CMD_MIFARE_DES_SIM_LOAD                                           0x0642
+#define CMD_SIMULATE_MIFARE_DES                                           0x0643
 
 #define CMD_UNKNOWN                                                       0xFFFF
 
@@ -4,7 +4,7 @@
  *
  * This information is in the public domain 12/15/95 P. Karn
  */
-#include "des.h"
+#include "des_ref.h"
 
 int Asmversion = 0;
 
@@ -12,7 +12,7 @@ int Asmversion = 0;
  * For best results, ensure that this is aligned on a 32-bit boundary;
  * Borland C++ 3.1 doesn't guarantee this!
  */
-extern unsigned long Spbox[8][64];     /* Combined S and P boxes */
+extern uint32_t Spbox[8][64];     /* Combined S and P boxes */
 
 /* Primitive function F.
  * Input is r, subkey array in keys, output is XORed into l.
@@ -43,17 +43,17 @@ des3(ks,block)
 DES3_KS ks;            /* Key schedule */
 unsigned char block[8];        /* Data block */
 {
-   unsigned long left,right,work;
+   uint32_t left,right,work;
    
    /* Read input block and place in left/right in big-endian order */
-   left = ((unsigned long)block[0] << 24)
-    | ((unsigned long)block[1] << 16)
-    | ((unsigned long)block[2] << 8)
-    | (unsigned long)block[3];
-   right = ((unsigned long)block[4] << 24)
-    | ((unsigned long)block[5] << 16)
-    | ((unsigned long)block[6] << 8)
-    | (unsigned long)block[7];
+   left = ((uint32_t)block[0] << 24)
+    | ((uint32_t)block[1] << 16)
+    | ((uint32_t)block[2] << 8)
+    | (uint32_t)block[3];
+   right = ((uint32_t)block[4] << 24)
+    | ((uint32_t)block[5] << 16)
+    | ((uint32_t)block[6] << 8)
+    | (uint32_t)block[7];
 
    /* Hoey's clever initial permutation algorithm, from Outerbridge
     * (see Schneier p 478) 
@@ -1,5 +1,7 @@
-typedef unsigned long DES_KS[16][2];   /* Single-key DES key schedule */
-typedef unsigned long DES3_KS[48][2];  /* Triple-DES key schedule */
+#include <stdint.h>
+
+typedef uint32_t DES_KS[16][2];   /* Single-key DES key schedule */
+typedef uint32_t DES3_KS[48][2];  /* Triple-DES key schedule */
 
 /* In deskey.c: */
 void deskey(DES_KS,unsigned char *,int);
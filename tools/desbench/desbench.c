@@ -0,0 +1,175 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Checks common/des.c against the Outerbridge/Karn code the firmware used
+// before, and compares their speed in blocks per second.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "des_ref.h"
+#include "des.h"
+
+#define BUF_BLOCKS  512
+#define MIN_SECONDS 0.5
+
+static uint8_t buf[BUF_BLOCKS * 8];
+
+static void fill(uint8_t *p, size_t len)
+{
+	while (len--)
+		*p++ = rand();
+}
+
+static void print_hex(const char *name, const uint8_t *p, size_t len)
+{
+	printf("%-10s", name);
+	while (len--)
+		printf("%02x", *p++);
+	printf("\n");
+}
+
+// the old desfire_encrypt_cbc(): memxor() and des3() per block
+static void ref_cbc_send(DES3_KS ks, uint8_t *data, size_t len)
+{
+	uint8_t iv[8] = {0};
+
+	for (; len >= 8; len -= 8, data += 8) {
+		for (int i = 0; i < 8; i++)
+			data[i] ^= iv[i];
+		des3(ks, data);
+		memcpy(iv, data, 8);
+	}
+}
+
+static int check(void)
+{
+	static const uint8_t fips_key[8] = {0x13, 0x34, 0x57, 0x79, 0x9b, 0xbc, 0xdf, 0xf1};
+	static const uint8_t fips_plain[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+	static const uint8_t fips_cipher[8] = {0x85, 0xe8, 0x13, 0x54, 0x0f, 0x0a, 0xb4, 0x05};
+	des_ctx_t ctx = {0};
+	uint8_t block[8];
+	int bad = 0;
+
+	des_setkey(&ctx, fips_key, 8);
+	memcpy(block, fips_plain, 8);
+	des_encrypt_block(&ctx, block);
+	if (memcmp(block, fips_cipher, 8)) {
+		print_hex("expected", fips_cipher, 8);
+		print_hex("got", block, 8);
+		bad++;
+	}
+
+	for (int n = 0; n < 3000; n++) {
+		uint8_t key[24], data[BUF_BLOCKS], ref[BUF_BLOCKS], iv[8] = {0}, iv2[8] = {0};
+		size_t len = n % 3 == 0 ? 8 : n % 3 == 1 ? 16 : 24;
+		size_t data_len = 8 * (1 + rand() % (sizeof(data) / 8));
+		DES3_KS enc, dec;
+
+		fill(key, sizeof(key));
+		if (n % 5 == 0)
+			memcpy(key + 8, key, 8);
+		if (len < 24)
+			memcpy(key + 16, key, 8);
+		if (len < 16)
+			memcpy(key + 8, key, 8);
+		des3key(enc, key, 0);
+		des3key(dec, key, 1);
+		des_setkey(&ctx, key, len);
+		fill(data, data_len);
+
+		memcpy(ref, data, data_len);
+		for (size_t i = 0; i < data_len; i += 8)
+			des3(enc, ref + i);
+		des_ecb(&ctx, data, data_len, 0);
+		bad += memcmp(ref, data, data_len) != 0;
+
+		for (size_t i = 0; i < data_len; i += 8)
+			des3(dec, ref + i);
+		des_ecb(&ctx, data, data_len, 1);
+		bad += memcmp(ref, data, data_len) != 0;
+
+		ref_cbc_send(dec, ref, data_len);
+		des_cbc_send(&ctx, data, data_len, iv);
+		bad += memcmp(ref, data, data_len) != 0;
+
+		memset(iv, 0, sizeof(iv));
+		des_cbc_encrypt(&ctx, data, data_len, iv);
+		des_cbc_decrypt(&ctx, data, data_len, iv2);
+		bad += memcmp(ref, data, data_len) != 0;
+	}
+	return bad;
+}
+
+static double seconds(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// run body until MIN_SECONDS have passed, return blocks per second
+#define RATE(blocks_per_pass, body) ({ \
+	clock_t start_ = clock(); \
+	long passes_ = 0; \
+	do { \
+		for (int k_ = 0; k_ < 16; k_++, passes_++) \
+			body; \
+	} while (seconds(start_) < MIN_SECONDS); \
+	passes_ * (double)(blocks_per_pass) / seconds(start_); \
+})
+
+static void report(const char *what, double old_rate, double new_rate)
+{
+	printf("%-28s %12.0f %12.0f %6.2fx\n", what, old_rate, new_rate, new_rate / old_rate);
+}
+
+int main(void)
+{
+	uint8_t key[24], iv[8] = {0};
+	DES3_KS ks;
+	des_ctx_t ctx = {0};
+	int bad;
+
+	srand(time(NULL));
+	if ((bad = check())) {
+		printf("%d mismatches against the reference\n", bad);
+		return 1;
+	}
+	printf("results match the reference\n\n");
+	printf("%-28s %12s %12s\n", "per second", "old", "new");
+
+	fill(buf, sizeof(buf));
+	fill(key, sizeof(key));
+	memcpy(key + 16, key, 8);
+
+	report("3DES key schedules",
+	       RATE(1, (key[0]++, des3key(ks, key, 1))),
+	       RATE(1, (key[0]++, des_setkey(&ctx, key, 16))));
+	report("3DES key, unchanged",
+	       RATE(1, des3key(ks, key, 1)),
+	       RATE(1, des_setkey(&ctx, key, 16)));
+
+	des3key(ks, key, 1);
+	des_setkey(&ctx, key, 16);
+	report("3DES CBC send, blocks",
+	       RATE(BUF_BLOCKS, ref_cbc_send(ks, buf, sizeof(buf))),
+	       RATE(BUF_BLOCKS, des_cbc_send(&ctx, buf, sizeof(buf), iv)));
+	report("3DES ECB, blocks",
+	       RATE(BUF_BLOCKS, for (int i = 0; i < BUF_BLOCKS; i++) des3(ks, buf + 8 * i)),
+	       RATE(BUF_BLOCKS, des_ecb(&ctx, buf, sizeof(buf), 1)));
+	report("3DES CBC decrypt, blocks",
+	       RATE(BUF_BLOCKS, for (int i = 0; i < BUF_BLOCKS; i++) des3(ks, buf + 8 * i)),
+	       RATE(BUF_BLOCKS, des_cbc_decrypt(&ctx, buf, sizeof(buf), iv)));
+
+	// the old code had no single DES path, a legacy DESFire key ran as 3DES
+	memcpy(key + 8, key, 8);
+	des3key(ks, key, 1);
+	des_setkey(&ctx, key, 16);
+	report("DES CBC send, blocks",
+	       RATE(BUF_BLOCKS, ref_cbc_send(ks, buf, sizeof(buf))),
+	       RATE(BUF_BLOCKS, des_cbc_send(&ctx, buf, sizeof(buf), iv)));
+	return 0;
+}
@@ -4,7 +4,7 @@
  */
 
 #include <string.h>
-#include "des.h"
+#include "des_ref.h"
 
 /* Key schedule-related tables from FIPS-46 */
 
@@ -1,4 +1,6 @@
-unsigned long Spbox[8][64] = {{
+#include <stdint.h>
+
+uint32_t Spbox[8][64] = {{
 0x01010400,0x00000000,0x00010000,0x01010404,
 0x01010004,0x00010404,0x00000004,0x00010000,
 0x00000400,0x01010400,0x01010404,0x00000400,